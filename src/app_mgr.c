@@ -0,0 +1,488 @@
+/*
+ * Application manager: starts and stops the clients using switches on
+ * GPIO inputs.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>           // PRIu64
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "gpio.h"
+#include "timebase.h"
+
+/*
+ * Each client has a switch on an active low GPIO input. The manager sleeps
+ * in poll() on the GPIO edge events and on a signalfd for SIGCHLD. After
+ * an edge the switch is debounced and the client is started or stopped
+ * right away, i.e. a few msec after the switch was flipped. A client that
+ * exits while its switch is on is restarted after a delay that doubles
+ * with every exit in a row.
+ *
+ * The clients are started directly, each in its own process group, so
+ * that a stop also reaches the children of a wrapper script.
+ */
+
+#define AM_DEBOUNCE_MS      20
+#define AM_STOP_MS          3000        /* SIGKILL if still running */
+#define AM_RESTART_MIN_MS   500
+#define AM_RESTART_MAX_MS   30000
+#define AM_STABLE_MS        30000       /* a run this long resets the delay */
+#define AM_MAX_ARGS         32
+
+/**
+ * A supervised client.
+ *
+ * @name        Name used in messages.
+ * @pin         GPIO of the switch.
+ * @cmd         Command line; copied into argv.
+ * @argv        Arguments for execvp(); argv[0] is NULL if disabled.
+ * @gpio        The switch input.
+ * @on          Debounced switch state.
+ * @check_at    Time to read the switch after an edge; 0 if none.
+ * @edge_time   CLOCK_MONOTONIC time of the last edge (nsec).
+ * @pid         Process id; 0 if not running.
+ * @started     Start time.
+ * @kill_at     Time to send SIGKILL; 0 unless being stopped.
+ * @restart_at  Time to start the client; 0 if not due.
+ * @exits       Number of exits in a row, for the restart delay.
+ *
+ * Times are in msec from time_ms() unless noted.
+ */
+struct am_client {
+    const char     *name;
+    const char     *pin;
+    char           *cmd;
+    char           *argv[AM_MAX_ARGS + 1];
+    struct gpio_line gpio;
+    int             on;
+    uint64_t        check_at;
+    uint64_t        edge_time;
+    pid_t           pid;
+    uint64_t        started;
+    uint64_t        kill_at;
+    uint64_t        restart_at;
+    unsigned int    exits;
+};
+
+static struct am_client clients[] = {
+    {.name = "control client",.pin = "67"},
+    {.name = "audio client",.pin = "68"},
+};
+
+#define AM_CLIENTS (int)(sizeof(clients) / sizeof(clients[0]))
+
+static int      keep_running = 1;
+
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: app_mgr [options]\n"
+        "\n Possible options are:\n"
+        "\n"
+        "  -c    GPIO of the control client switch, <number> or\n"
+        "        <chip>:<offset> (default is 67).\n"
+        "  -a    GPIO of the audio client switch (default is 68).\n"
+        "  -C    Control client command line (default is ./ic706_client).\n"
+        "  -A    Audio client command line (default is ./audio_client).\n"
+        "  -h    This help message.\n"
+        "\n Command lines are split at spaces; there is no shell quoting.\n"
+        " An empty command line disables the client.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+/* Split the command line into arguments; -1 if there are too many */
+static int split_cmd(struct am_client *c)
+{
+    char           *arg;
+    int             i = 0;
+
+    for (arg = strtok(c->cmd, " \t"); arg; arg = strtok(NULL, " \t"))
+    {
+        if (i == AM_MAX_ARGS)
+        {
+            fprintf(stderr, "Too many arguments for %s (max %d)\n",
+                    c->name, AM_MAX_ARGS);
+            return -1;
+        }
+        c->argv[i++] = arg;
+    }
+
+    c->argv[i] = NULL;
+    return 0;
+}
+
+static uint32_t restart_delay_ms(unsigned int exits)
+{
+    if (exits > 6)
+        return AM_RESTART_MAX_MS;
+
+    return (AM_RESTART_MIN_MS << exits) < AM_RESTART_MAX_MS ?
+        (AM_RESTART_MIN_MS << exits) : AM_RESTART_MAX_MS;
+}
+
+static void start_client(struct am_client *c, uint64_t now)
+{
+    sigset_t        none;
+    pid_t           pid;
+
+    pid = fork();
+    if (pid == 0)
+    {
+        /* signals are blocked for the signalfd */
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        setpgid(0, 0);
+        execvp(c->argv[0], c->argv);
+        fprintf(stderr, "Error starting %s: %d: %s\n", c->argv[0], errno,
+                strerror(errno));
+        _exit(127);
+    }
+
+    c->restart_at = 0;
+    if (pid == -1)
+    {
+        fprintf(stderr, "Error forking %s: %d: %s\n", c->name, errno,
+                strerror(errno));
+        c->restart_at = now + restart_delay_ms(c->exits++);
+        return;
+    }
+
+    /* also in the parent, so that a stop can't miss the group */
+    setpgid(pid, pid);
+    c->pid = pid;
+    c->started = now;
+    if (c->exits)
+        fprintf(stderr, "Restarted %s, pid %d\n", c->name, (int)pid);
+    else
+        fprintf(stderr, "Started %s, pid %d, %" PRIu64 " ms after the "
+                "switch\n", c->name, (int)pid,
+                (time_ns() - c->edge_time) / 1000000);
+}
+
+/* Stop a client, or kill it if it did not stop in time */
+static void stop_client(struct am_client *c, uint64_t now)
+{
+    if (c->kill_at == 0)
+    {
+        fprintf(stderr, "Stopping %s\n", c->name);
+        kill(-c->pid, SIGTERM);
+        c->kill_at = now + AM_STOP_MS;
+    }
+    else if (now >= c->kill_at)
+    {
+        fprintf(stderr, "Killing %s\n", c->name);
+        kill(-c->pid, SIGKILL);
+        c->kill_at = now + AM_STOP_MS;
+    }
+}
+
+/* Read the switch after the debounce time */
+static void check_switch(struct am_client *c, uint64_t now)
+{
+    int             on;
+
+    c->check_at = 0;
+    on = gpio_get(&c->gpio);
+    if (on == -1)
+    {
+        fprintf(stderr, "Error reading %s GPIO: %d: %s\n", c->name, errno,
+                strerror(errno));
+        return;
+    }
+
+    if (on == c->on)
+        return;
+
+    c->on = on;
+    fprintf(stderr, "%s switched %s\n", c->name, on ? "on" : "off");
+    if (on)
+    {
+        c->exits = 0;
+        c->restart_at = now;
+    }
+}
+
+/* Start or stop the client as needed */
+static void service_client(struct am_client *c, uint64_t now)
+{
+    if (c->check_at && now >= c->check_at)
+        check_switch(c, now);
+
+    /* a stop goes on until the process is reaped, even if the switch is
+     * back on; the client is then restarted */
+    if (c->pid && c->kill_at)
+    {
+        stop_client(c, now);
+    }
+    else if (keep_running && c->on)
+    {
+        if (c->pid == 0 && c->restart_at && now >= c->restart_at)
+            start_client(c, now);
+    }
+    else
+    {
+        c->restart_at = 0;
+        if (c->pid)
+            stop_client(c, now);
+    }
+}
+
+/* Reap exited clients and schedule the restarts */
+static void reap_clients(uint64_t now)
+{
+    struct am_client *c;
+    pid_t           pid;
+    int             status;
+    int             i;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (i = 0, c = NULL; i < AM_CLIENTS; i++)
+            if (clients[i].pid == pid)
+                c = &clients[i];
+
+        if (c == NULL)
+            continue;
+
+        if (WIFSIGNALED(status))
+            fprintf(stderr, "%s exited on signal %d\n", c->name,
+                    WTERMSIG(status));
+        else
+            fprintf(stderr, "%s exited with status %d\n", c->name,
+                    WEXITSTATUS(status));
+
+        c->pid = 0;
+        if (c->kill_at)
+        {
+            /* stopped by us */
+            c->kill_at = 0;
+            continue;
+        }
+
+        if (now - c->started >= AM_STABLE_MS)
+            c->exits = 0;
+
+        if (keep_running && c->on)
+        {
+            c->restart_at = now + restart_delay_ms(c->exits++);
+            fprintf(stderr, "Restarting %s in %" PRIu64 " ms\n", c->name,
+                    c->restart_at - now);
+        }
+    }
+}
+
+/* Get the poll() timeout until the next timer of the clients */
+static int next_timeout(uint64_t now)
+{
+    uint64_t        next = UINT64_MAX;
+    uint64_t        t[3];
+    int             i, j;
+
+    for (i = 0; i < AM_CLIENTS; i++)
+    {
+        t[0] = clients[i].check_at;
+        t[1] = clients[i].pid ? clients[i].kill_at : 0;
+        t[2] = clients[i].pid ? 0 : clients[i].restart_at;
+        for (j = 0; j < 3; j++)
+            if (t[j] && t[j] < next)
+                next = t[j];
+    }
+
+    if (next == UINT64_MAX)
+        return -1;
+
+    return next > now ? (int)(next - now) : 0;
+}
+
+/* Handle SIGCHLD, SIGINT and SIGTERM from the signalfd */
+static void read_signals(int sfd, uint64_t now)
+{
+    struct signalfd_siginfo si;
+
+    while (read(sfd, &si, sizeof(si)) == sizeof(si))
+    {
+        if (si.ssi_signo == SIGCHLD)
+            reap_clients(now);
+        else if (keep_running)
+        {
+            fprintf(stderr, "Shutting down...\n");
+            keep_running = 0;
+        }
+    }
+}
+
+static int any_running(void)
+{
+    int             i;
+
+    for (i = 0; i < AM_CLIENTS; i++)
+        if (clients[i].pid)
+            return 1;
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct pollfd   fds[AM_CLIENTS + 1];
+    struct gpio_event ev;
+    struct am_client *c;
+    sigset_t        mask;
+    uint64_t        now;
+    int             sfd = -1;
+    int             option;
+    int             exit_code = EXIT_FAILURE;
+    int             res;
+    int             i;
+
+    clients[0].cmd = strdup("./ic706_client");
+    clients[1].cmd = strdup("./audio_client");
+    for (i = 0; i < AM_CLIENTS; i++)
+        gpio_init(&clients[i].gpio);
+
+    while ((option = getopt(argc, argv, "c:a:C:A:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'c':
+            clients[0].pin = optarg;
+            break;
+
+        case 'a':
+            clients[1].pin = optarg;
+            break;
+
+        case 'C':
+            free(clients[0].cmd);
+            clients[0].cmd = strdup(optarg);
+            break;
+
+        case 'A':
+            free(clients[1].cmd);
+            clients[1].cmd = strdup(optarg);
+            break;
+
+        case 'h':
+            help();
+            exit(EXIT_SUCCESS);
+
+        default:
+            help();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* child exits and termination requests are read from a signalfd, so
+     * that none is lost between the checks and poll() */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd == -1)
+    {
+        fprintf(stderr, "Error creating signalfd: %d: %s\n", errno,
+                strerror(errno));
+        goto cleanup;
+    }
+
+    fds[AM_CLIENTS].fd = sfd;
+    fds[AM_CLIENTS].events = POLLIN;
+
+    fprintf(stderr, "Starting application manager\n");
+    now = time_ms();
+    for (i = 0; i < AM_CLIENTS; i++)
+    {
+        c = &clients[i];
+        if (c->cmd[strspn(c->cmd, " \t")] == '\0')
+        {
+            fprintf(stderr, "%s disabled\n", c->name);
+        }
+        else if (gpio_open_in(&c->gpio, c->pin, GPIO_EDGE_BOTH) == -1)
+        {
+            fprintf(stderr, "Error configuring %s GPIO %s: %d: %s\n",
+                    c->name, c->pin, errno, strerror(errno));
+            goto cleanup;
+        }
+        else
+        {
+            fprintf(stderr, "%s: GPIO %s%s, %s\n", c->name, c->pin,
+                    c->gpio.sysfs ? " (sysfs)" : "", c->cmd);
+            c->edge_time = time_ns();
+            c->check_at = now;
+        }
+        if (split_cmd(c) == -1)
+            goto cleanup;
+
+        /* poll() ignores negative file descriptors */
+        fds[i].fd = c->gpio.fd;
+        fds[i].events = gpio_poll_events(&c->gpio);
+    }
+
+    while (keep_running || any_running())
+    {
+        now = time_ms();
+        for (i = 0; i < AM_CLIENTS; i++)
+            service_client(&clients[i], now);
+
+        if (poll(fds, AM_CLIENTS + 1, next_timeout(now)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            fprintf(stderr, "Error in poll(): %d: %s\n", errno,
+                    strerror(errno));
+            break;
+        }
+
+        now = time_ms();
+        for (i = 0; i < AM_CLIENTS; i++)
+        {
+            c = &clients[i];
+            if (!(fds[i].revents & fds[i].events))
+                continue;
+
+            /* any edge restarts the debounce time; the switch is read
+             * when it has settled */
+            res = gpio_read_event(&c->gpio, &ev);
+            if (res == -1)
+                fprintf(stderr, "Error reading %s GPIO: %d: %s\n",
+                        c->name, errno, strerror(errno));
+            else if (res == 1 && c->check_at == 0)
+                c->edge_time = ev.time;
+            c->check_at = now + AM_DEBOUNCE_MS;
+        }
+
+        if (fds[AM_CLIENTS].revents & POLLIN)
+            read_signals(sfd, now);
+    }
+
+    fprintf(stderr, "Application manager stopped\n");
+    exit_code = EXIT_SUCCESS;
+
+  cleanup:
+    for (i = 0; i < AM_CLIENTS; i++)
+    {
+        gpio_close(&clients[i].gpio);
+        free(clients[i].cmd);
+    }
+    if (sfd != -1)
+        close(sfd);
+
+    exit(exit_code);
+}
@@ -23,13 +23,44 @@
 
 #include "audio_util.h"
 #include "common.h"
+#include "flightrec.h"
+#include "gpio.h"
+#include "metrics_series.h"
+#include "prof.h"
 
 /* application state and config */
 struct app_data {
     uint32_t        sample_rate;        /* audio sample rate */
     int             device_index;       /* audio device index */
+    char           *headless_spec;      /* headless audio; NULL for sound card */
     int             server_port;        /* network port number */
     char           *server_ip;
+
+    /* TX audio */
+    int             tx_enabled;         /* send TX audio to server */
+    char           *ptt_gpio;           /* GPIO sensing PTT; NULL if none */
+    int32_t         opus_bitrate;
+    int32_t         opus_complexity;
+
+    int             use_udp;            /* request UDP transport */
+    int             mux_port;           /* local port for ic706_client */
+    char           *metrics_spec;       /* metrics port or socket path */
+    char           *series_spec;        /* metrics time series file */
+    int             prof_interval;      /* profiler table interval in sec */
+};
+
+/* Receiver state and statistics for AUDIO_PKT_SEQ packets (UDP, and TCP
+ * when the server supports session resume) */
+struct seq_rx {
+    int             started;            /* first packet has been received */
+    uint16_t        seq;                /* next expected sequence number */
+    uint32_t        timestamp;          /* next expected timestamp */
+    uint32_t        last_frames;        /* frames in last decoded packet */
+
+    uint64_t        packets;            /* packets received */
+    uint64_t        lost;               /* packets never received */
+    uint64_t        late;               /* packets received out of order */
+    uint64_t        concealed;          /* frames generated by PLC */
 };
 
 static int      keep_running = 1;       /* set to 0 to exit infinite loop */
@@ -49,9 +80,31 @@ static void help(void)
         "  -d <num>    Audio device index (see -l).\n"
         "  -r <num>    Audio sample rate (default is 48000).\n"
         "  -l          List audio devices.\n"
+        "  -A <str>    Run without a sound card, e.g. out=rx.wav,clock=fast.\n"
+        "              Options: in=sine:<Hz>|noise|silence|<file>,\n"
+        "              out=null|<file>, clock=rt|fast, period=<ms>.\n"
         "  -s <str>    Server IP (default is 127.0.0.1).\n"
         "  -p <num>    Network port number (default is 42001).\n"
-        "  -h          This help message.\n\n";
+        "  -t          Enable TX audio (send audio input to server).\n"
+        "  -g <gpio>   GPIO used to sense PTT, <number> or <chip>:<offset>.\n"
+        "              TX audio is only sent while PTT is active. Default is\n"
+        "              to send continuously.\n"
+        "  -b <num>    TX Opus encoder rate in bits per sec (default is 16 kbps).\n"
+        "  -c <num>    TX Opus encoder complexity 1-10 (default is 5).\n"
+        "  -U          Receive audio using UDP. The TCP connection is still\n"
+        "              used for session setup and TX audio.\n"
+        "  -m <num>    Multiplex control and audio on the same connection.\n"
+        "              ic706_client should connect to 127.0.0.1 on the\n"
+        "              specified port (normally 42000). Requires -m on the\n"
+        "              server.\n"
+        "  -M <str>    Serve live metrics in Prometheus format on the given\n"
+        "              port on 127.0.0.1 or on a Unix socket path.\n"
+        "  -T <str>    Record the metrics every second in a memory-mapped\n"
+        "              file: <path>[,interval=<ms>][,records=<num>].\n"
+        "  -P <num>    Print a CPU profile of the processing stages every\n"
+        "              <num> seconds.\n"
+        "  -h          This help message.\n"
+        "\n SIGUSR1 dumps the flight recorder, see flightrec.h.\n\n";
 
     fprintf(stderr, "%s", help_string);
 }
@@ -63,7 +116,7 @@ static void parse_options(int argc, char **argv, struct app_data *app)
 
     if (argc > 1)
     {
-        while ((option = getopt(argc, argv, "d:r:ls:p:h")) != -1)
+        while ((option = getopt(argc, argv, "d:r:lA:s:p:tg:b:c:Um:M:T:P:h")) != -1)
         {
             switch (option)
             {
@@ -79,6 +132,10 @@ static void parse_options(int argc, char **argv, struct app_data *app)
                 audio_list_devices();
                 exit(EXIT_SUCCESS);
 
+            case 'A':
+                app->headless_spec = optarg;
+                break;
+
             case 's':
                 app->server_ip = strdup(optarg);
                 break;
@@ -87,6 +144,42 @@ static void parse_options(int argc, char **argv, struct app_data *app)
                 app->server_port = atoi(optarg);
                 break;
 
+            case 't':
+                app->tx_enabled = 1;
+                break;
+
+            case 'g':
+                app->ptt_gpio = optarg;
+                break;
+
+            case 'b':
+                app->opus_bitrate = (int32_t) atof(optarg);
+                break;
+
+            case 'c':
+                app->opus_complexity = atoi(optarg);
+                break;
+
+            case 'U':
+                app->use_udp = 1;
+                break;
+
+            case 'm':
+                app->mux_port = atoi(optarg);
+                break;
+
+            case 'M':
+                app->metrics_spec = optarg;
+                break;
+
+            case 'T':
+                app->series_spec = optarg;
+                break;
+
+            case 'P':
+                app->prof_interval = atoi(optarg);
+                break;
+
             case 'h':
                 help();
                 exit(EXIT_SUCCESS);
@@ -99,36 +192,352 @@ static void parse_options(int argc, char **argv, struct app_data *app)
     }
 }
 
+/* Configure TX encoder; uses the same settings as the audio_server */
+static void setup_encoder(OpusEncoder * encoder, struct app_data *app)
+{
+    opus_int32      x;
+
+    fprintf(stderr, "Configuring opus encoder:\n");
+
+    opus_encoder_ctl(encoder, OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_WIDEBAND));
+    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(app->opus_bitrate));
+    opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(app->opus_complexity));
+
+    opus_encoder_ctl(encoder, OPUS_GET_COMPLEXITY(&x));
+    fprintf(stderr, "  Complexity: %d\n", x);
+    opus_encoder_ctl(encoder, OPUS_GET_BITRATE(&x));
+    fprintf(stderr, "  Bitrate   : %d\n", x);
+}
+
+#define TX_FRAMES 1920          // 40 msec: 48000 * 0.04
+#define TX_BUFLEN 3840
+
+/**
+ * Encode and send available TX audio.
+ *
+ * @return The number of encoded bytes sent or -1 if there was a write error.
+ *
+ * Audio is read from the input buffer in 40 msec frames. While PTT is
+ * inactive the frames are discarded to prevent stale audio from being sent
+ * when PTT is activated.
+ */
+static int send_tx_audio(int fd, audio_t * audio, OpusEncoder * encoder,
+                         int ptt_on, uint64_t * encoder_errors)
+{
+    uint8_t         buffer1[TX_BUFLEN];
+    uint8_t         buffer2[TX_BUFLEN + 2];
+    struct prof_sample ps;
+    opus_int32      length;
+    ssize_t         num;
+    int             sent = 0;
+
+    while (audio_frames_available(audio) >= TX_FRAMES)
+    {
+        audio_read_frames(audio, buffer1, TX_FRAMES);
+        if (!ptt_on)
+            continue;
+
+        /* encode audio frame (items 0, 1 are reserved for header) */
+        prof_begin(&ps);
+        length = opus_encode(encoder, (opus_int16 *) buffer1, TX_FRAMES,
+                             &buffer2[2], TX_BUFLEN);
+        prof_end(PROF_ENCODE, &ps);
+        if (length <= 0)
+        {
+            (*encoder_errors)++;
+            fprintf(stderr, "Encoder error: %d (%s)\n", length,
+                    opus_strerror(length));
+            continue;
+        }
+
+        sent += length;
+        length += AUDIO_HDR_LEN;
+        audio_pkt_set_header(buffer2, length, AUDIO_PKT_DATA);
+        prof_begin(&ps);
+        num = write(fd, buffer2, length);
+        prof_end(PROF_WRITE, &ps);
+        if (num != length)
+            return -1;
+    }
+
+    return sent;
+}
+
+/**
+ * Send AUDIO_CI_SESSION control item.
+ *
+ * @param fd        The TCP connection.
+ * @param token     The session token identifying this client.
+ * @param seq_valid Set if next_seq is valid, i.e. audio has been received.
+ * @param next_seq  The sequence number of the next packet we expect.
+ */
+static int send_session_request(int fd, uint32_t token, int seq_valid,
+                                uint16_t next_seq)
+{
+    uint8_t         pkt[AUDIO_HDR_LEN + 9];
+
+    audio_pkt_set_header(pkt, sizeof(pkt), AUDIO_PKT_CTRL);
+    pkt[2] = AUDIO_CI_SESSION & 0xFF;
+    pkt[3] = AUDIO_CI_SESSION >> 8;
+    pkt[4] = token & 0xFF;
+    pkt[5] = (token >> 8) & 0xFF;
+    pkt[6] = (token >> 16) & 0xFF;
+    pkt[7] = (token >> 24) & 0xFF;
+    pkt[8] = seq_valid ? 0x01 : 0x00;
+    pkt[9] = next_seq & 0xFF;
+    pkt[10] = next_seq >> 8;
+
+    return write(fd, pkt, sizeof(pkt)) != sizeof(pkt);
+}
+
+/* Send AUDIO_CI_UDP control item; used both on TCP and UDP */
+static int send_udp_request(int fd, uint32_t token)
+{
+    uint8_t         pkt[AUDIO_HDR_LEN + 6];
+
+    audio_pkt_set_header(pkt, sizeof(pkt), AUDIO_PKT_CTRL);
+    pkt[2] = AUDIO_CI_UDP & 0xFF;
+    pkt[3] = AUDIO_CI_UDP >> 8;
+    pkt[4] = token & 0xFF;
+    pkt[5] = (token >> 8) & 0xFF;
+    pkt[6] = (token >> 16) & 0xFF;
+    pkt[7] = (token >> 24) & 0xFF;
+
+    return write(fd, pkt, sizeof(pkt)) != sizeof(pkt);
+}
+
+#define STATS_INTERVAL_MS   1000
+
+/**
+ * Send AUDIO_CI_STATS control item.
+ *
+ * The server uses the statistics to adapt the encoder bitrate to the link.
+ */
+static int send_rx_stats(int fd, uint32_t packets, uint32_t lost,
+                         uint32_t late, uint32_t underflows)
+{
+    uint8_t         pkt[AUDIO_HDR_LEN + 18];
+    uint32_t        val[4] = { packets, lost, late, underflows };
+    int             i;
+
+    audio_pkt_set_header(pkt, sizeof(pkt), AUDIO_PKT_CTRL);
+    pkt[2] = AUDIO_CI_STATS & 0xFF;
+    pkt[3] = AUDIO_CI_STATS >> 8;
+    for (i = 0; i < 4; i++)
+    {
+        pkt[4 + 4 * i] = val[i] & 0xFF;
+        pkt[5 + 4 * i] = (val[i] >> 8) & 0xFF;
+        pkt[6 + 4 * i] = (val[i] >> 16) & 0xFF;
+        pkt[7 + 4 * i] = (val[i] >> 24) & 0xFF;
+    }
+
+    return write(fd, pkt, sizeof(pkt)) != sizeof(pkt);
+}
+
+/**
+ * Process AUDIO_CI_TIMING control item.
+ *
+ * Stores the latency measured by the server and echoes the stamp so that
+ * the server can measure the round trip time. The clocks of the server and
+ * the client are not synchronized, so the network delay is estimated as
+ * half the round trip time.
+ */
+static void process_timing(int fd, const uint8_t * pkt, uint16_t length,
+                           struct audio_latency *lat)
+{
+    uint8_t         echo[AUDIO_HDR_LEN + 6];
+
+    if (length < AUDIO_HDR_LEN + 22)
+        return;
+
+    lat->capture = audio_get_le32(&pkt[4]);
+    lat->encode = audio_get_le32(&pkt[8]);
+    lat->queue = audio_get_le32(&pkt[12]);
+    lat->network = audio_get_le32(&pkt[16]) / 2;
+
+    audio_pkt_set_header(echo, sizeof(echo), AUDIO_PKT_CTRL);
+    echo[2] = AUDIO_CI_TIMING & 0xFF;
+    echo[3] = AUDIO_CI_TIMING >> 8;
+    memcpy(&echo[4], &pkt[20], 4);
+
+    if (write(fd, echo, sizeof(echo)) != sizeof(echo))
+        fprintf(stderr, "Error sending timing reply\n");
+}
+
+/* Update the stages measured on this side after audio has been received */
+static void update_latency(struct audio_latency *lat, audio_t * audio)
+{
+    audio_latency_smooth(&lat->buffer, audio_output_delay_us(audio));
+    lat->output = __atomic_load_n(&audio->dac_delay, __ATOMIC_RELAXED);
+    lat->total = lat->capture + lat->encode + lat->queue + lat->network +
+        lat->buffer + lat->output;
+}
+
+#define SEQ_MAX_CONCEAL 11520   // 240 msec: 48000 * 0.24
+#define SEQ_PCM_FRAMES  5760    // 120 msec: largest opus frame
+#define SEQ_RESYNC      64      // seq this far back: stream restarted
+
+/**
+ * Process AUDIO_PKT_SEQ audio packet.
+ *
+ * Packets arriving out of order are dropped. Lost packets are concealed
+ * using Opus packet loss concealment, using the capture timestamps to
+ * determine the amount of audio that is missing. Packets received twice,
+ * e.g. when the server sends the history after a session resume, are
+ * dropped as late.
+ */
+static void process_seq_packet(uint8_t * pkt, int num, struct seq_rx *rx,
+                               OpusDecoder * decoder, audio_t * audio,
+                               uint64_t * decoder_errors)
+{
+    opus_int16      pcm[SEQ_PCM_FRAMES];
+    struct prof_sample ps;
+    uint16_t        seq;
+    uint32_t        timestamp;
+    int32_t         missing;
+    int16_t         diff;
+
+    if (num <= AUDIO_SEQ_HDR_LEN || audio_pkt_length(pkt) != num ||
+        audio_pkt_type(pkt) != AUDIO_PKT_SEQ)
+        return;
+
+    seq = pkt[2] | (pkt[3] << 8);
+    timestamp = pkt[4] | (pkt[5] << 8) | (pkt[6] << 16) |
+        ((uint32_t) pkt[7] << 24);
+    rx->packets++;
+
+    /* sequence numbers started over, e.g. after a server restart */
+    if (rx->started && (int16_t) (seq - rx->seq) <= -SEQ_RESYNC)
+        rx->started = 0;
+
+    if (rx->started)
+    {
+        diff = (int16_t) (seq - rx->seq);
+        if (diff < 0)
+        {
+            rx->late++;
+            return;
+        }
+
+        if (diff > 0)
+        {
+            rx->lost += diff;
+            flightrec_event(FR_EV_LOSS, 0, 0, diff);
+
+            missing = (int32_t) (timestamp - rx->timestamp);
+            if (missing > SEQ_MAX_CONCEAL)
+                missing = SEQ_MAX_CONCEAL;
+
+            while (missing >= (int32_t) rx->last_frames)
+            {
+                prof_begin(&ps);
+                num = opus_decode(decoder, NULL, 0, pcm, rx->last_frames, 0);
+                prof_end(PROF_DECODE, &ps);
+                if (num <= 0)
+                    break;
+
+                audio_write_frames(audio, (uint8_t *) pcm, num);
+                rx->concealed += num;
+                missing -= num;
+            }
+        }
+    }
+
+    prof_begin(&ps);
+    num = opus_decode(decoder, &pkt[AUDIO_SEQ_HDR_LEN],
+                      num - AUDIO_SEQ_HDR_LEN, pcm, SEQ_PCM_FRAMES, 0);
+    prof_end(PROF_DECODE, &ps);
+    if (num > 0)
+    {
+        audio_write_frames(audio, (uint8_t *) pcm, num);
+        rx->last_frames = num;
+    }
+    else
+    {
+        (*decoder_errors)++;
+        fprintf(stderr, "Decoder error: %d (%s)\n", num, opus_strerror(num));
+        num = 0;
+    }
+
+    rx->started = 1;
+    rx->seq = seq + 1;
+    rx->timestamp = timestamp + num;
+}
+
 int main(int argc, char **argv)
 {
     struct sockaddr_in serv_addr;
-    struct pollfd   poll_fds[1];
+    struct pollfd   poll_fds[6];
+    struct seq_rx   seq_rx;
+    struct audio_rx_buf net_rx;
+    uint32_t        udp_token = 0;
+    uint32_t        session_token;
+    unsigned int    attempts = 0;   /* failed connection attempts */
+    uint64_t        last_hello = 0;
+    uint64_t        last_stats = 0;
+    uint64_t        tcp_packets = 0;        /* audio packets received on TCP */
+    struct seq_rx   seq_base;       /* UDP statistics at connect */
+    struct audio_latency latency;
+    uint32_t        underflows_base = 0;    /* underflows at connect */
     int             exit_code = EXIT_FAILURE;
     int             net_fd = -1;
+    int             udp_fd = -1;
+    int             ctl_fd = -1;
+    int             mux_fd = -1;
+    int             ptt_on = 1;
     int             connected = 0;
+    int             audio_running = 0;
     int             res;
 
     audio_t        *audio;
     OpusDecoder    *decoder;
+    OpusEncoder    *encoder = NULL;
     uint64_t        encoded_bytes = 0;
     uint64_t        decoder_errors = 0;
+    uint64_t        tx_encoded_bytes = 0;
+    uint64_t        encoder_errors = 0;
     int             error;
+    struct metrics  metrics;
+    struct metrics_series series;
+    struct prof_sample ps;
+    struct gpio_line ptt;
+    struct gpio_event edge;
 
     struct app_data app = {
         .sample_rate = 48000,
         .device_index = -1,
         .server_port = DEFAULT_AUDIO_PORT,
+        .tx_enabled = 0,
+        .ptt_gpio = NULL,
+        .opus_bitrate = 16000,
+        .opus_complexity = 5,
+        .use_udp = 0,
+        .mux_port = 0,
+        .metrics_spec = NULL,
+        .series_spec = NULL,
+        .prof_interval = 0,
     };
 
+    metrics_init(&metrics, "audio_client");
+    gpio_init(&ptt);
+    metrics_series_init(&series, &metrics);
     parse_options(argc, argv, &app);
     if (app.server_ip == NULL)
         app.server_ip = strdup("127.0.0.1");
+    if (app.prof_interval)
+        prof_init(app.prof_interval);
 
     fprintf(stderr, "Using server IP %s\n", app.server_ip);
     fprintf(stderr, "using server port %d\n", app.server_port);
 
     /* initialize audio subsystem */
-    audio = audio_init(app.device_index, app.sample_rate, AUDIO_CONF_OUTPUT);
+    if (app.headless_spec)
+        audio = audio_init_headless(app.headless_spec, app.sample_rate,
+                                    app.tx_enabled ? AUDIO_CONF_DUPLEX :
+                                    AUDIO_CONF_OUTPUT);
+    else
+        audio = audio_init(app.device_index, app.sample_rate,
+                           app.tx_enabled ? AUDIO_CONF_DUPLEX : AUDIO_CONF_OUTPUT);
     if (audio == NULL)
         exit(EXIT_FAILURE);
 
@@ -141,12 +550,47 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if (app.tx_enabled)
+    {
+        encoder = opus_encoder_create(app.sample_rate, 1,
+                                      OPUS_APPLICATION_AUDIO, &error);
+        if (error != OPUS_OK)
+        {
+            fprintf(stderr, "Error creating opus encoder: %d (%s)\n",
+                    error, opus_strerror(error));
+            opus_decoder_destroy(decoder);
+            audio_close(audio);
+            exit(EXIT_FAILURE);
+        }
+        setup_encoder(encoder, &app);
+
+        if (app.ptt_gpio != NULL)
+        {
+            if (gpio_open_in(&ptt, app.ptt_gpio, GPIO_EDGE_BOTH) == -1)
+            {
+                fprintf(stderr, "Error configuring PTT GPIO %s: %d: %s\n",
+                        app.ptt_gpio, errno, strerror(errno));
+                goto cleanup;
+            }
+            ptt_on = gpio_get(&ptt) == 1;
+        }
+    }
+
+    /* PTT edges; poll() ignores negative file descriptors */
+    poll_fds[1].fd = ptt.fd;
+    poll_fds[1].events = gpio_poll_events(&ptt);
+
     /* setup signal handler */
     if (signal(SIGINT, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGINT\n");
     if (signal(SIGTERM, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGTERM\n");
 
+    /* write errors on closed connections are handled where they occur */
+    signal(SIGPIPE, SIG_IGN);
+
+    flightrec_init("audio_client", SIGUSR1);
+
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port = htons(app.server_port);
@@ -157,6 +601,101 @@ int main(int argc, char **argv)
         goto cleanup;
     }
 
+    audio_rx_init(&net_rx);
+    memset(&seq_rx, 0, sizeof(seq_rx));
+    memset(&latency, 0, sizeof(latency));
+    poll_fds[2].fd = -1;
+    poll_fds[2].events = POLLIN;
+    if (app.use_udp)
+    {
+        /* connected UDP socket: we only receive from the server */
+        udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (udp_fd == -1 ||
+            connect(udp_fd, (struct sockaddr *)&serv_addr,
+                    sizeof(serv_addr)) == -1)
+        {
+            fprintf(stderr, "Error creating UDP socket: %d: %s\n", errno,
+                    strerror(errno));
+            goto cleanup;
+        }
+        poll_fds[2].fd = udp_fd;
+    }
+
+    /* The session token identifies this client when reconnecting. The UDP
+     * token is kept too, so that a resumed session can continue sending
+     * UDP audio to the same address right away. */
+    session_token = session_token_create();
+    do
+    {
+        if (random_bytes(&udp_token, sizeof(udp_token)))
+            break;
+    }
+    while (udp_token == 0);
+
+    /* local control connection from ic706_client in mux mode */
+    if (app.mux_port)
+    {
+        mux_fd = create_local_server_socket(app.mux_port);
+        if (mux_fd == -1)
+            goto cleanup;
+    }
+    poll_fds[3].fd = mux_fd;
+    poll_fds[3].events = POLLIN;
+    poll_fds[4].fd = -1;
+    poll_fds[4].events = POLLIN;
+
+    if (app.metrics_spec || app.series_spec)
+    {
+        METRICS_ADD(&metrics, "encoded_bytes_total", METRIC_COUNTER,
+                    "Encoded audio bytes received.", encoded_bytes);
+        METRICS_ADD(&metrics, "decoder_errors_total", METRIC_COUNTER,
+                    "Opus decoder errors.", decoder_errors);
+        METRICS_ADD(&metrics, "tcp_packets_total", METRIC_COUNTER,
+                    "Audio packets received without sequence numbers.",
+                    tcp_packets);
+        METRICS_ADD(&metrics, "seq_packets_total", METRIC_COUNTER,
+                    "Sequenced audio packets received.", seq_rx.packets);
+        METRICS_ADD(&metrics, "seq_lost_total", METRIC_COUNTER,
+                    "Sequenced audio packets never received.", seq_rx.lost);
+        METRICS_ADD(&metrics, "seq_late_total", METRIC_COUNTER,
+                    "Sequenced audio packets received too late.",
+                    seq_rx.late);
+        METRICS_ADD(&metrics, "plc_frames_total", METRIC_COUNTER,
+                    "Audio frames generated by packet loss concealment.",
+                    seq_rx.concealed);
+        METRICS_ADD(&metrics, "resync_bytes_total", METRIC_COUNTER,
+                    "Bytes discarded while resynchronizing the stream.",
+                    net_rx.resyncs);
+        METRICS_ADD(&metrics, "tx_encoded_bytes_total", METRIC_COUNTER,
+                    "Encoded TX audio bytes sent.", tx_encoded_bytes);
+        METRICS_ADD(&metrics, "tx_encoder_errors_total", METRIC_COUNTER,
+                    "Opus encoder errors on TX audio.", encoder_errors);
+        METRICS_ADD(&metrics, "connected", METRIC_GAUGE,
+                    "1 if connected to the server.", connected);
+        METRICS_ADD(&metrics, "latency_capture_us", METRIC_GAUGE,
+                    "Delay from ADC to encoder input on the server.",
+                    latency.capture);
+        METRICS_ADD(&metrics, "latency_encode_us", METRIC_GAUGE,
+                    "Opus encoding time on the server.", latency.encode);
+        METRICS_ADD(&metrics, "latency_queue_us", METRIC_GAUGE,
+                    "Time in the server send queue.", latency.queue);
+        METRICS_ADD(&metrics, "latency_network_us", METRIC_GAUGE,
+                    "One way network delay (half the RTT).",
+                    latency.network);
+        METRICS_ADD(&metrics, "latency_buffer_us", METRIC_GAUGE,
+                    "Time in the playout buffer.", latency.buffer);
+        METRICS_ADD(&metrics, "latency_output_us", METRIC_GAUGE,
+                    "Delay from output callback to DAC.", latency.output);
+        METRICS_ADD(&metrics, "latency_total_us", METRIC_GAUGE,
+                    "Estimated mouth-to-ear latency.", latency.total);
+        audio_register_metrics(audio, &metrics);
+        if (app.metrics_spec && metrics_open(&metrics, app.metrics_spec))
+            goto cleanup;
+        if (app.series_spec && metrics_series_open(&series, app.series_spec))
+            goto cleanup;
+    }
+    poll_fds[5].events = POLLIN;
+
     while (keep_running)
     {
         if (net_fd == -1)
@@ -170,7 +709,10 @@ int main(int argc, char **argv)
             }
         }
 
-        /* Try to connect to server */
+        /* Try to connect to server; the first attempt after losing the
+         * connection is immediate */
+        usleep(1000 * reconnect_delay_ms(attempts));
+        metrics_series_process(&series, time_ms());
         if (connect(net_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr))
             == -1)
         {
@@ -180,7 +722,7 @@ int main(int argc, char **argv)
             if (errno == ECONNREFUSED || errno == ENETUNREACH ||
                 errno == ETIMEDOUT)
             {
-                sleep(1);
+                attempts++;
                 continue;
             }
             else
@@ -189,64 +731,243 @@ int main(int argc, char **argv)
             }
         }
 
+        if (app.mux_port)
+            set_nodelay(net_fd);
+
         poll_fds[0].fd = net_fd;
         poll_fds[0].events = POLLIN;
+        net_rx.rdidx = 0;
+        net_rx.wridx = 0;
         connected = 1;
+        attempts = 0;
         fprintf(stderr, "Connected...\n");
+        flightrec_event(FR_EV_CONNECT, 0, net_fd,
+                        ntohl(serv_addr.sin_addr.s_addr));
 
-        /* start audio system */
-        audio_start(audio);
+        /* The audio system is started once and keeps running while we
+         * reconnect, so that a resumed session does not need to restart
+         * and rebuffer the audio device. */
+        if (!audio_running)
+        {
+            audio_start(audio);
+            audio_running = 1;
+        }
+        else if (app.tx_enabled)
+        {
+            /* discard TX audio captured while disconnected */
+            send_tx_audio(net_fd, audio, encoder, 0, &encoder_errors);
+        }
+
+        if (send_session_request(net_fd, session_token, seq_rx.started,
+                                 seq_rx.seq))
+            fprintf(stderr, "Error sending session request\n");
+
+        /* statistics reported to the server are counted per connection */
+        tcp_packets = 0;
+        seq_base = seq_rx;
+        underflows_base = audio->underflows;
+        last_stats = time_ms();
+
+        if (app.use_udp)
+        {
+            if (send_udp_request(net_fd, udp_token))
+                fprintf(stderr, "Error sending UDP request\n");
+            last_hello = 0;
+        }
 
         while (keep_running && connected)
         {
-            res = poll(poll_fds, 1, 500);
+            /* UDP hello tells the server where to send audio and keeps
+             * NAT mappings alive */
+            if (app.use_udp &&
+                time_ms() - last_hello > (seq_rx.started ? 5000 : 1000))
+            {
+                send_udp_request(udp_fd, udp_token);
+                last_hello = time_ms();
+            }
 
-            if (res <= 0)
+            if (time_ms() - last_stats >= STATS_INTERVAL_MS)
+            {
+                send_rx_stats(net_fd,
+                              tcp_packets + seq_rx.packets - seq_base.packets,
+                              seq_rx.lost - seq_base.lost,
+                              seq_rx.late - seq_base.late,
+                              audio->underflows - underflows_base);
+                last_stats = time_ms();
+            }
+
+            poll_fds[4].fd = ctl_fd;
+            poll_fds[5].fd = metrics_fd(&metrics);
+            metrics_series_process(&series, time_ms());
+            prof_process(time_ms());
+            res = poll(poll_fds, 6,
+                       (app.tx_enabled || app.use_udp) ? 10 : 500);
+
+            if (res < 0)
                 continue;
 
+            if (poll_fds[5].revents & POLLIN)
+                metrics_process(&metrics);
+
+            /* Relay control data first so that it is never queued behind
+             * TX audio */
+            if (poll_fds[4].revents & (POLLIN | POLLHUP))
+            {
+                if (audio_relay_civ(ctl_fd, net_fd) <= 0)
+                {
+                    fprintf(stderr, "Control connection closed (FD=%d)\n",
+                            ctl_fd);
+                    close(ctl_fd);
+                    ctl_fd = -1;
+                }
+            }
+
+            if (poll_fds[3].revents & POLLIN)
+            {
+                int             new = accept(mux_fd, NULL, NULL);
+
+                if (new != -1)
+                {
+                    fprintf(stderr, "Control connection accepted (FD=%d)\n",
+                            new);
+                    close(ctl_fd);
+                    ctl_fd = new;
+                }
+            }
+
+            if (poll_fds[2].revents & POLLIN)
+            {
+                uint8_t         pkt[AUDIO_MAX_PKT_LEN];
+                int             num;
+
+                prof_begin(&ps);
+                num = recv(udp_fd, pkt, sizeof(pkt), 0);
+                prof_end(PROF_READ, &ps);
+
+                if (num > 0)
+                {
+                    flightrec_event(FR_EV_RX, audio_pkt_type(pkt), udp_fd,
+                                    num);
+                    encoded_bytes += num;
+                    process_seq_packet(pkt, num, &seq_rx, decoder, audio,
+                                       &decoder_errors);
+                    update_latency(&latency, audio);
+                }
+            }
+
+            if ((poll_fds[1].revents & poll_fds[1].events) &&
+                gpio_read_event(&ptt, &edge) == 1)
+            {
+                ptt_on = edge.value;
+                flightrec_event(FR_EV_GPIO, edge.value, ptt.pin, edge.delay);
+                fprintf(stderr, "PTT %s\n", ptt_on ? "on" : "off");
+            }
+
+            if (app.tx_enabled)
+            {
+                res = send_tx_audio(net_fd, audio, encoder, ptt_on,
+                                    &encoder_errors);
+                if (res > 0)
+                    tx_encoded_bytes += res;
+                else if (res < 0)
+                    fprintf(stderr, "Error writing TX audio to network\n");
+            }
+
             /* service network socket */
             if (poll_fds[0].revents & POLLIN)
             {
 
 #define AUDIO_FRAMES 5760       // allows receiving up to 120 msec frames
-#define AUDIO_BUFLEN 2 * AUDIO_FRAMES   // 120 msec: 48000 * 0.12
-                uint8_t         buffer1[AUDIO_BUFLEN];
-                uint8_t         buffer2[AUDIO_BUFLEN * 2];
+                opus_int16      pcm[AUDIO_FRAMES];
+                uint8_t        *pkt;
                 uint16_t        length;
-
                 int             num;
 
-                /* read 2 byte header */
-                num = read(net_fd, buffer1, 2);
-                if (num != 2)
+                num = audio_rx_read(net_fd, &net_rx);
+                if (num <= 0)
                 {
-                    /* unrecovarable error; disconnect */
-                    fprintf(stderr, "Error reading packet header: %d\n", num);
+                    if (num == 0)
+                        fprintf(stderr, "Connection closed (FD=%d)\n",
+                                net_fd);
+                    else
+                        fprintf(stderr, "Error reading from net: %d: %s\n",
+                                errno, strerror(errno));
+
+                    flightrec_event(FR_EV_DISCONNECT, 0, net_fd, 0);
                     close(net_fd);
                     net_fd = -1;
                     connected = 0;
                     poll_fds[0].fd = -1;
-                    audio_stop(audio);
-
-                    num = opus_decode(decoder, NULL, 0, (opus_int16 *) buffer2,
-                                      AUDIO_FRAMES, 0);
 
+                    /* keep audio and decoder state for a resumed session */
                     continue;
                 }
 
-                length = buffer1[0] + ((buffer1[1] & 0x1F) << 8);
-                length -= 2;
-                num = read(net_fd, buffer1, length);
-
-                if (num == length)
+                /* decode all complete packets; partial packets are kept in
+                 * the buffer until the rest arrives */
+                while ((pkt = audio_rx_next(&net_rx, &length)) != NULL)
                 {
-                    encoded_bytes += num;
-                    num = opus_decode(decoder, buffer1, num,
-                                      (opus_int16 *) buffer2, AUDIO_FRAMES, 0);
+                    flightrec_event(FR_EV_RX, audio_pkt_type(pkt), net_fd,
+                                    length);
+                    if (audio_pkt_type(pkt) == AUDIO_PKT_CIV)
+                    {
+                        /* control data for ic706_client */
+                        if (ctl_fd != -1 &&
+                            write(ctl_fd, &pkt[AUDIO_HDR_LEN],
+                                  length - AUDIO_HDR_LEN) < 0)
+                            fprintf(stderr, "Error writing to control "
+                                    "connection\n");
+                        continue;
+                    }
+
+                    if (audio_pkt_type(pkt) == AUDIO_PKT_CTRL &&
+                        length >= 9 &&
+                        (pkt[2] | (pkt[3] << 8)) == AUDIO_CI_SESSION)
+                    {
+                        if (pkt[8] & 0x01)
+                        {
+                            fprintf(stderr, "Session resumed\n");
+                        }
+                        else
+                        {
+                            fprintf(stderr, "New session\n");
+                            seq_rx.started = 0;
+                            opus_decoder_ctl(decoder, OPUS_RESET_STATE);
+                        }
+                        continue;
+                    }
+
+                    if (audio_pkt_type(pkt) == AUDIO_PKT_CTRL &&
+                        length >= AUDIO_HDR_LEN + 2 &&
+                        (pkt[2] | (pkt[3] << 8)) == AUDIO_CI_TIMING)
+                    {
+                        process_timing(net_fd, pkt, length, &latency);
+                        continue;
+                    }
+
+                    if (audio_pkt_type(pkt) == AUDIO_PKT_SEQ)
+                    {
+                        /* sequenced audio, e.g. packets replayed on resume */
+                        encoded_bytes += length;
+                        process_seq_packet(pkt, length, &seq_rx, decoder,
+                                           audio, &decoder_errors);
+                        continue;
+                    }
+
+                    if (audio_pkt_type(pkt) != AUDIO_PKT_DATA)
+                        continue;
+
+                    length -= AUDIO_HDR_LEN;
+                    encoded_bytes += length;
+                    tcp_packets++;
+                    prof_begin(&ps);
+                    num = opus_decode(decoder, &pkt[AUDIO_HDR_LEN], length,
+                                      pcm, AUDIO_FRAMES, 0);
+                    prof_end(PROF_DECODE, &ps);
 
                     if (num > 0)
                     {
-                        audio_write_frames(audio, buffer2, num);
+                        audio_write_frames(audio, (uint8_t *) pcm, num);
                     }
                     else
                     {
@@ -255,20 +976,7 @@ int main(int argc, char **argv)
                                 opus_strerror(num));
                     }
                 }
-                else if (num == 0)
-                {
-                    fprintf(stderr, "Connection closed (FD=%d)\n", net_fd);
-                    close(net_fd);
-                    net_fd = -1;
-                    connected = 0;
-                    poll_fds[0].fd = -1;
-                    audio_stop(audio);
-                }
-                else
-                {
-                    fprintf(stderr, "Error reading from net: %d / \n", num);
-                }
-
+                update_latency(&latency, audio);
             }
         }
     }
@@ -278,15 +986,44 @@ int main(int argc, char **argv)
 
   cleanup:
     close(net_fd);
+    close(udp_fd);
+    gpio_close(&ptt);
+    close(ctl_fd);
+    close(mux_fd);
+    metrics_close(&metrics);
+    metrics_series_close(&series);
+    prof_print();
     if (app.server_ip != NULL)
         free(app.server_ip);
 
     audio_stop(audio);
     audio_close(audio);
     opus_decoder_destroy(decoder);
+    if (encoder)
+        opus_encoder_destroy(encoder);
 
     fprintf(stderr, "  Encoded bytes in: %" PRIu64 "\n", encoded_bytes);
     fprintf(stderr, "  Decoder errors  : %" PRIu64 "\n", decoder_errors);
+    fprintf(stderr, "  Packets / wakeup: %.2f avg, %" PRIu32 " max\n",
+            net_rx.wakeups ? (double)net_rx.packets / net_rx.wakeups : 0.0,
+            net_rx.max_burst);
+    fprintf(stderr, "  Resync bytes    : %" PRIu64 "\n", net_rx.resyncs);
+    if (seq_rx.packets)
+    {
+        fprintf(stderr, "  SEQ packets     : %" PRIu64 "\n", seq_rx.packets);
+        fprintf(stderr, "  SEQ lost        : %" PRIu64 "\n", seq_rx.lost);
+        fprintf(stderr, "  SEQ late        : %" PRIu64 "\n", seq_rx.late);
+        fprintf(stderr, "  PLC frames      : %" PRIu64 "\n",
+                seq_rx.concealed);
+    }
+    if (latency.total)
+        audio_latency_print(&latency);
+    if (app.tx_enabled)
+    {
+        fprintf(stderr, "  Encoded bytes out: %" PRIu64 "\n",
+                tx_encoded_bytes);
+        fprintf(stderr, "  Encoder errors   : %" PRIu64 "\n", encoder_errors);
+    }
 
     exit(exit_code);
 }
@@ -0,0 +1,534 @@
+/*
+ * Headless audio backend.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#include <errno.h>
+#include <inttypes.h>           // PRIu64
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audio_headless.h"
+#include "pack.h"
+#include "prof.h"
+#include "timebase.h"
+
+#define SRC_SINE    0
+#define SRC_NOISE   1
+#define SRC_SILENCE 2
+#define SRC_FILE    3
+
+#define MAX_PERIOD_MS   100
+#define FAST_WAIT_US    200     /* poll interval while waiting with clock=fast */
+
+/**
+ * Headless backend state.
+ *
+ * @cb           The stream callback and its argument.
+ * @rb_in        Input ring buffer; capture waits for room with clock=fast.
+ * @rb_out       Output ring buffer; playback waits for data with clock=fast.
+ * @src          Signal source (SRC_*).
+ * @freq         Sine frequency.
+ * @phase        Sine phase.
+ * @rnd          Noise generator state.
+ * @in_fp        Input file.
+ * @in_data      Offset of the samples in the input file.
+ * @out_fp       Output file; NULL for the null sink.
+ * @out_wav      The output file is a WAV file.
+ * @out_frames   Frames written to the output file.
+ * @fast         clock=fast.
+ * @anchor       CLOCK_MONOTONIC time (nsec) of stream position 0 with
+ *               clock=rt; 0 to start at the time headless_start() is
+ *               called.
+ * @pos          Stream position (frames since the anchor).
+ * @period       Frames per callback.
+ * @thread       The thread calling the callback.
+ * @running      Set while the thread should run.
+ * @frames       Frames processed since start.
+ * @wall_start   Wall clock and CPU time at start (nsec).
+ * @cpu_start
+ */
+struct audio_headless {
+    PaStreamCallback *cb;
+    void           *user_data;
+    ring_buffer_t  *rb_in;
+    ring_buffer_t  *rb_out;
+    uint32_t        sample_rate;
+
+    int             src;
+    double          freq;
+    double          phase;
+    uint32_t        rnd;
+    FILE           *in_fp;
+    long            in_data;
+
+    FILE           *out_fp;
+    int             out_wav;
+    uint64_t        out_frames;
+
+    int             fast;
+    uint64_t        anchor;
+    uint64_t        pos;
+    uint32_t        period;
+
+    pthread_t       thread;
+    volatile int    running;
+    uint64_t        frames;
+    uint64_t        wall_start;
+    uint64_t        cpu_start;
+};
+
+/* CPU time of the process (nsec) */
+static uint64_t cpu_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Open the input file and find the samples.
+ *
+ * WAV files must be 16 bit mono PCM; anything that does not start with a
+ * RIFF header is read as raw 16 bit samples.
+ */
+static int open_input(struct audio_headless *h, const char *path)
+{
+    uint8_t         hdr[12], chunk[8], fmt[16];
+    uint32_t        size;
+
+    h->in_fp = fopen(path, "rb");
+    if (h->in_fp == NULL)
+    {
+        fprintf(stderr, "Error opening %s: %d: %s\n", path, errno,
+                strerror(errno));
+        return -1;
+    }
+
+    h->in_data = 0;
+    if (fread(hdr, sizeof(hdr), 1, h->in_fp) != 1 ||
+        memcmp(hdr, "RIFF", 4) || memcmp(&hdr[8], "WAVE", 4))
+    {
+        fseek(h->in_fp, 0, SEEK_SET);
+        return 0;
+    }
+
+    while (fread(chunk, sizeof(chunk), 1, h->in_fp) == 1)
+    {
+        size = get_le(&chunk[4], 4);
+        if (!memcmp(chunk, "fmt ", 4))
+        {
+            if (size < sizeof(fmt) || fread(fmt, sizeof(fmt), 1, h->in_fp) != 1)
+                break;
+            if (get_le(fmt, 2) != 1 || get_le(&fmt[2], 2) != 1 ||
+                get_le(&fmt[14], 2) != 16)
+            {
+                fprintf(stderr, "%s: only 16 bit mono PCM is supported\n",
+                        path);
+                return -1;
+            }
+            if (get_le(&fmt[4], 4) != h->sample_rate)
+                fprintf(stderr, "Warning: %s has sample rate %" PRIu32
+                        ", playing at %" PRIu32 "\n", path,
+                        (uint32_t) get_le(&fmt[4], 4), h->sample_rate);
+            fseek(h->in_fp, size - sizeof(fmt) + (size & 1), SEEK_CUR);
+        }
+        else if (!memcmp(chunk, "data", 4))
+        {
+            h->in_data = ftell(h->in_fp);
+            return 0;
+        }
+        else
+        {
+            fseek(h->in_fp, size + (size & 1), SEEK_CUR);
+        }
+    }
+
+    fprintf(stderr, "%s: invalid WAV file\n", path);
+    return -1;
+}
+
+/* Write a WAV header; the sizes are filled in when the file is closed */
+static void write_wav_header(struct audio_headless *h)
+{
+    uint8_t         hdr[WAV_HDR_LEN];
+
+    wav_header_pack(hdr, h->sample_rate, h->out_frames * 2);
+    fseek(h->out_fp, 0, SEEK_SET);
+    fwrite(hdr, sizeof(hdr), 1, h->out_fp);
+    fseek(h->out_fp, 0, SEEK_END);
+}
+
+static int parse_spec(struct audio_headless *h, const char *spec)
+{
+    char           *copy = strdup(spec);
+    char           *opt, *val, *save = NULL;
+    const char     *out = NULL;
+    int             ret = 0;
+
+    h->src = SRC_SINE;
+    h->freq = 1000;
+    h->period = h->sample_rate / 100;
+
+    for (opt = strtok_r(copy, ",", &save); opt && !ret;
+         opt = strtok_r(NULL, ",", &save))
+    {
+        val = strchr(opt, '=');
+        if (val == NULL)
+        {
+            fprintf(stderr, "Invalid audio option: %s\n", opt);
+            ret = -1;
+            break;
+        }
+        *val++ = '\0';
+
+        if (!strcmp(opt, "in"))
+        {
+            if (!strncmp(val, "sine", 4))
+            {
+                h->src = SRC_SINE;
+                if (val[4] == ':')
+                    h->freq = atof(&val[5]);
+            }
+            else if (!strcmp(val, "noise"))
+            {
+                h->src = SRC_NOISE;
+            }
+            else if (!strcmp(val, "silence"))
+            {
+                h->src = SRC_SILENCE;
+            }
+            else
+            {
+                h->src = SRC_FILE;
+                ret = open_input(h, val);
+            }
+        }
+        else if (!strcmp(opt, "out"))
+        {
+            out = strcmp(val, "null") ? spec + (val - copy) : NULL;
+        }
+        else if (!strcmp(opt, "clock"))
+        {
+            h->fast = !strcmp(val, "fast");
+        }
+        else if (!strcmp(opt, "start"))
+        {
+            h->anchor = 1000 * strtoull(val, NULL, 10);
+        }
+        else if (!strcmp(opt, "period"))
+        {
+            h->period = h->sample_rate * atoi(val) / 1000;
+            if (h->period == 0 ||
+                h->period > h->sample_rate * MAX_PERIOD_MS / 1000)
+            {
+                fprintf(stderr, "Invalid audio period: %s ms\n", val);
+                ret = -1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown audio option: %s\n", opt);
+            ret = -1;
+        }
+    }
+
+    if (!ret && out)
+    {
+        /* the value ends at the next comma in the original spec */
+        char           *path = strndup(out, strcspn(out, ","));
+
+        h->out_fp = fopen(path, "wb");
+        if (h->out_fp == NULL)
+        {
+            fprintf(stderr, "Error creating %s: %d: %s\n", path, errno,
+                    strerror(errno));
+            ret = -1;
+        }
+        else
+        {
+            h->out_wav = strlen(path) > 4 &&
+                !strcmp(&path[strlen(path) - 4], ".wav");
+            if (h->out_wav)
+                write_wav_header(h);
+        }
+        free(path);
+    }
+
+    free(copy);
+
+    return ret;
+}
+
+/* Generate or read the next block of input */
+static void make_input(struct audio_headless *h, int16_t * buf, uint32_t num)
+{
+    size_t          got = 0;
+    uint32_t        i;
+
+    switch (h->src)
+    {
+    case SRC_SINE:
+        for (i = 0; i < num; i++)
+        {
+            buf[i] = 8000 * sin(h->phase);
+            h->phase += 2 * M_PI * h->freq / h->sample_rate;
+            if (h->phase > 2 * M_PI)
+                h->phase -= 2 * M_PI;
+        }
+        break;
+
+    case SRC_NOISE:
+        for (i = 0; i < num; i++)
+        {
+            h->rnd = h->rnd * 1103515245 + 12345;
+            buf[i] = (int16_t) (h->rnd >> 16) / 4;
+        }
+        break;
+
+    case SRC_FILE:
+        while (got < num)
+        {
+            got += fread(&buf[got], 2, num - got, h->in_fp);
+            if (got < num && fseek(h->in_fp, h->in_data, SEEK_SET))
+                break;
+        }
+        memset(&buf[got], 0, (num - got) * 2);
+        break;
+
+    default:
+        memset(buf, 0, num * 2);
+    }
+}
+
+/* Wait until the pipeline can take the next block (clock=fast) */
+static void wait_for_pipeline(struct audio_headless *h)
+{
+    uint32_t        bytes = h->period * 2;
+
+    while (h->running)
+    {
+        if ((h->rb_in == NULL ||
+             ring_buffer_count(h->rb_in) + bytes <= ring_buffer_size(h->rb_in))
+            && (h->rb_out == NULL || ring_buffer_count(h->rb_out) >= bytes))
+            return;
+
+        usleep(FAST_WAIT_US);
+    }
+}
+
+/**
+ * Move the stream position to the next block boundary after the current
+ * time (clock=rt).
+ *
+ * Input that would have been captured while the stream was stopped is
+ * skipped and silence is written to the output file, so that positions in
+ * the files stay proportional to time since the anchor.
+ */
+static void align_stream(struct audio_headless *h, uint64_t anchor,
+                         int16_t * buf)
+{
+    uint64_t        now = time_ns();
+    uint64_t        pos = 0;
+    uint32_t        num;
+    int16_t         zero[256] = { 0 };
+
+    if (h->fast)
+        return;
+
+    if (now > anchor)
+    {
+        pos = (now - anchor) * h->sample_rate / 1000000000;
+        pos = (pos / h->period + 1) * h->period;
+    }
+    if (pos <= h->pos)
+        return;
+
+    while (buf && h->pos < pos)
+    {
+        num = pos - h->pos > h->period ? h->period : pos - h->pos;
+        make_input(h, buf, num);
+        h->pos += num;
+    }
+    while (h->out_fp && h->out_frames < pos)
+    {
+        num = pos - h->out_frames > 256 ? 256 : pos - h->out_frames;
+        h->out_frames += fwrite(zero, 2, num, h->out_fp);
+    }
+    h->pos = pos;
+}
+
+static void *headless_thread(void *arg)
+{
+    struct audio_headless *h = arg;
+    PaStreamCallbackTimeInfo ti;
+    int16_t        *in, *out;
+    uint64_t        next, now;
+    uint_fast32_t   start;
+    uint64_t        anchor;
+    double          period = (double)h->period / h->sample_rate;
+
+    /* unlike the PortAudio callback thread this one is ours, so the
+     * callback stage gets the perf counters too */
+    prof_thread_init();
+    in = h->rb_in ? malloc(h->period * 2) : NULL;
+    out = h->rb_out ? malloc(h->period * 2) : NULL;
+    /* without an anchor a restarted stream continues where it stopped */
+    anchor = time_ns() -
+        h->pos * 1000000000 / h->sample_rate;
+    if (h->anchor)
+    {
+        anchor = h->anchor;
+        align_stream(h, anchor, in);
+    }
+
+    while (h->running)
+    {
+        if (h->fast)
+        {
+            wait_for_pipeline(h);
+            if (!h->running)
+                break;
+        }
+        else
+        {
+            /* the callback runs when the block has been captured */
+            next = anchor + (h->pos + h->period) * 1000000000 /
+                h->sample_rate;
+            now = time_ns();
+            if (next > now)
+                usleep((next - now) / 1000);
+        }
+
+        /* The block was captured during the last period and will be
+         * played after one period, like a double buffered sound card */
+        ti.currentTime = 1.e-9 * time_ns();
+        ti.inputBufferAdcTime = in ? ti.currentTime - period : 0;
+        ti.outputBufferDacTime = out ? ti.currentTime + period : 0;
+
+        if (in)
+            make_input(h, in, h->period);
+
+        /* only the callback reads the output buffer, so it has played
+         * audio if the read position moved */
+        start = h->rb_out ? h->rb_out->start : 0;
+
+        h->cb(in, out, h->period, &ti, 0, h->user_data);
+
+        if (h->fast && out && h->rb_out->start == start)
+        {
+            /* still buffering; do not fill the output with silence */
+            if (!in)
+                usleep(FAST_WAIT_US);
+            continue;
+        }
+
+        if (out && h->out_fp)
+            h->out_frames += fwrite(out, 2, h->period, h->out_fp);
+        h->frames += h->period;
+        h->pos += h->period;
+    }
+
+    free(in);
+    free(out);
+    prof_thread_close();
+
+    return NULL;
+}
+
+struct audio_headless *headless_open(const char *spec, uint32_t sample_rate,
+                                     int in, int out, PaStreamCallback * cb,
+                                     void *user_data, ring_buffer_t * rb_in,
+                                     ring_buffer_t * rb_out)
+{
+    struct audio_headless *h = calloc(1, sizeof(struct audio_headless));
+
+    if (h == NULL)
+        return NULL;
+
+    h->cb = cb;
+    h->user_data = user_data;
+    h->rb_in = in ? rb_in : NULL;
+    h->rb_out = out ? rb_out : NULL;
+    h->sample_rate = sample_rate;
+    h->rnd = 1;
+
+    if (parse_spec(h, spec))
+    {
+        headless_close(h);
+        return NULL;
+    }
+
+    fprintf(stderr, "Headless audio: %s clock, %" PRIu32 " frames per "
+            "callback\n", h->fast ? "fast" : "real time", h->period);
+
+    return h;
+}
+
+int headless_start(struct audio_headless *h)
+{
+    if (h->running)
+        return 0;
+
+    h->frames = 0;
+    h->wall_start = time_ns();
+    h->cpu_start = cpu_time_ns();
+    h->running = 1;
+    if (pthread_create(&h->thread, NULL, headless_thread, h))
+    {
+        h->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int headless_stop(struct audio_headless *h)
+{
+    double          wall, cpu, audio;
+
+    if (!h->running)
+        return 0;
+
+    h->running = 0;
+    pthread_join(h->thread, NULL);
+
+    wall = 1.e-9 * (time_ns() - h->wall_start);
+    cpu = 1.e-9 * (cpu_time_ns() - h->cpu_start);
+    audio = (double)h->frames / h->sample_rate;
+
+    fprintf(stderr, " Headless audio:     %.1f s in %.1f s (%.1fx real "
+            "time), CPU %.1f s (%.1f%% of audio time)\n", audio, wall,
+            wall > 0 ? audio / wall : 0.0, cpu,
+            audio > 0 ? 100 * cpu / audio : 0.0);
+
+    return 0;
+}
+
+int headless_is_active(struct audio_headless *h)
+{
+    return h->running;
+}
+
+void headless_close(struct audio_headless *h)
+{
+    headless_stop(h);
+
+    if (h->in_fp)
+        fclose(h->in_fp);
+    if (h->out_fp)
+    {
+        if (h->out_wav)
+            write_wav_header(h);
+        fclose(h->out_fp);
+    }
+    free(h);
+}
@@ -0,0 +1,77 @@
+/*
+ * Headless audio backend.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __AUDIO_HEADLESS_H__
+#define __AUDIO_HEADLESS_H__
+
+#include <portaudio.h>
+#include <stdint.h>
+
+#include "ring_buffer.h"
+
+/**
+ * @file
+ * Audio backend without a sound card.
+ *
+ * A thread calls the PortAudio stream callback of audio_util the way the
+ * PortAudio host API would, so the rest of the audio pipeline runs
+ * unchanged. Captured audio comes from a signal generator or a file and
+ * played audio goes to a file or is discarded.
+ *
+ * The backend is configured using a comma separated list of options:
+ *
+ *   in=<src>     sine:<Hz> (default sine:1000), noise, silence, or a
+ *                WAV or raw 16 bit mono file, which is played in a loop.
+ *   out=<sink>   null (default) or a file; written as WAV if the name ends
+ *                with .wav, otherwise as raw 16 bit samples.
+ *   clock=<clk>  rt (default) runs the callback in real time. fast runs it
+ *                as fast as the rest of the pipeline keeps up: capture
+ *                waits for room in the input buffer and playback waits
+ *                for data instead of playing silence.
+ *   period=<ms>  Callback period (default 10 ms).
+ *   start=<usec> With clock=rt, CLOCK_MONOTONIC time of the first sample.
+ *                Input sample n is captured at start + n / sample_rate,
+ *                output sample n is played two periods after that. Used
+ *                to line up the streams of different processes.
+ *
+ * e.g. "in=voice.wav,out=rx.wav,clock=fast".
+ */
+
+struct audio_headless;
+
+/**
+ * Open the backend.
+ *
+ * @param spec         The configuration; see above.
+ * @param sample_rate  The sample rate.
+ * @param in           Set if the stream has an input.
+ * @param out          Set if the stream has an output.
+ * @param cb           The stream callback.
+ * @param user_data    Argument for the callback; the audio_t handle.
+ * @param rb_in        The input ring buffer, used to wait for room with
+ *                     clock=fast; may be NULL.
+ * @param rb_out       The output ring buffer, used to wait for data with
+ *                     clock=fast; may be NULL.
+ * @return The backend handle or NULL if the spec is invalid.
+ */
+struct audio_headless *headless_open(const char *spec, uint32_t sample_rate,
+                                     int in, int out, PaStreamCallback * cb,
+                                     void *user_data, ring_buffer_t * rb_in,
+                                     ring_buffer_t * rb_out);
+
+/** Start calling the callback. Returns 0 if OK. */
+int             headless_start(struct audio_headless *h);
+
+/** Stop calling the callback and print throughput and CPU usage. */
+int             headless_stop(struct audio_headless *h);
+
+/** Check whether the callback is being called. */
+int             headless_is_active(struct audio_headless *h);
+
+/** Close the backend; the output file is completed. */
+void            headless_close(struct audio_headless *h);
+
+#endif
@@ -0,0 +1,577 @@
+/*
+ * Audio loopback latency and quality test.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>           // PRIu64
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pack.h"
+#include "test_util.h"
+#include "timebase.h"
+
+/*
+ * The test runs audio_server and audio_client with the headless audio
+ * backend over loopback:
+ *
+ *   test.wav -> audio_server -> TCP/UDP -> audio_client -> rx.wav
+ *
+ * The test signal is a quiet tone with a loud chirp (marker) every
+ * interval. Both daemons anchor their audio clock to the same
+ * CLOCK_MONOTONIC time, so sample n of the test signal is captured at the
+ * same time as sample n of the recording would be played if the link had
+ * no delay. Each marker is found in the recording by cross-correlation;
+ * its offset is the mouth-to-ear latency. The recording is then aligned
+ * to the test signal marker by marker to compute an SNR-style quality
+ * figure, and runs of silence inserted by the client (buffer underflows)
+ * are counted as dropouts.
+ */
+
+#define LT_RATE         48000
+#define LT_PERIOD_MS    10      /* headless callback period */
+#define LT_TONE_HZ      700.0
+#define LT_TONE_AMP     3000.0
+#define LT_CHIRP_LEN    (LT_RATE / 50)  /* 20 ms */
+#define LT_CHIRP_F0     1000.0
+#define LT_CHIRP_F1     4000.0
+#define LT_CHIRP_AMP    16000.0
+#define LT_DETECT       0.5     /* min normalised correlation of a marker */
+#define LT_DROPOUT      (LT_RATE / 200) /* 5 ms of digital silence */
+#define LT_STARTUP_MS   1500    /* time for the daemons to connect */
+#define LT_MAX_ARGS     32
+
+/* Results for one configuration */
+struct lt_result {
+    int             markers;
+    int             found;
+    double         *latency;    /* msec, for each marker found */
+    uint64_t        dropouts;
+    uint64_t        dropout_frames;
+    double          snr;
+};
+
+static int      keep_running = 1;
+
+static void signal_handler(int signo)
+{
+    (void)signo;
+    keep_running = 0;
+}
+
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: audio_looptest [options] [config ...]\n"
+        "\n Each config is a list of extra audio_server options and extra\n"
+        " audio_client options separated by '|', e.g. \"-b 8000|\" or\n"
+        " \"-b 32000|-U\". Put -- before the configs. Without configs the\n"
+        " defaults are tested.\n"
+        "\n Possible options are:\n"
+        "\n"
+        "  -p    First network port (default is 42300). Each config uses\n"
+        "        the next port.\n"
+        "  -d    Test signal duration in seconds (default 20).\n"
+        "  -i    Marker interval in msec (default 1000). Must be longer\n"
+        "        than the latency.\n"
+        "  -b    Directory with audio_server and audio_client\n"
+        "        (default is the current directory).\n"
+        "  -o    Directory for the test signal and the recordings\n"
+        "        (default is /tmp).\n"
+        "  -v    Show the output of the daemons.\n"
+        "  -h    This help message.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+/* Write 16 bit mono samples to a WAV file */
+static int write_wav(const char *path, const int16_t * samples, uint32_t num)
+{
+    uint8_t         hdr[WAV_HDR_LEN];
+    FILE           *fp;
+    int             ret;
+
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Error creating %s: %d: %s\n", path, errno,
+                strerror(errno));
+        return -1;
+    }
+
+    wav_header_pack(hdr, LT_RATE, 2 * num);
+    ret = fwrite(hdr, sizeof(hdr), 1, fp) == 1 &&
+        fwrite(samples, 2, num, fp) == num ? 0 : -1;
+    fclose(fp);
+
+    return ret;
+}
+
+/* Read a WAV file written by the headless backend; returns the number of
+ * samples or -1 */
+static long read_wav(const char *path, int16_t ** samples)
+{
+    uint8_t         hdr[WAV_HDR_LEN];
+    FILE           *fp;
+    long            num;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Error opening %s: %d: %s\n", path, errno,
+                strerror(errno));
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    num = (ftell(fp) - (long)sizeof(hdr)) / 2;
+    fseek(fp, 0, SEEK_SET);
+    if (num < 0 || fread(hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr, "RIFF", 4) || memcmp(&hdr[36], "data", 4))
+    {
+        fprintf(stderr, "%s is not a WAV file from the headless backend\n",
+                path);
+        fclose(fp);
+        return -1;
+    }
+
+    *samples = malloc(2 * num + 2);
+    num = fread(*samples, 2, num, fp);
+    fclose(fp);
+
+    return num;
+}
+
+/* The marker: a Hann windowed linear chirp */
+static void make_chirp(double *chirp)
+{
+    double          t, w;
+    int             i;
+
+    for (i = 0; i < LT_CHIRP_LEN; i++)
+    {
+        t = (double)i / LT_RATE;
+        w = 0.5 - 0.5 * cos(2 * M_PI * i / (LT_CHIRP_LEN - 1));
+        chirp[i] = w * sin(2 * M_PI * (LT_CHIRP_F0 * t +
+                                       0.5 * (LT_CHIRP_F1 - LT_CHIRP_F0) *
+                                       LT_RATE / LT_CHIRP_LEN * t * t));
+    }
+}
+
+/* Tone with a marker at the start of each interval except the first */
+static int16_t *make_signal(const double *chirp, uint32_t num,
+                            uint32_t interval)
+{
+    int16_t        *sig = malloc(2 * num);
+    double          val;
+    uint32_t        i, pos;
+
+    for (i = 0; i < num; i++)
+    {
+        val = LT_TONE_AMP * sin(2 * M_PI * LT_TONE_HZ * i / LT_RATE);
+        pos = i % interval;
+        if (i >= interval && pos < LT_CHIRP_LEN)
+            val += LT_CHIRP_AMP * chirp[pos];
+        sig[i] = (int16_t) lrint(val);
+    }
+
+    return sig;
+}
+
+/**
+ * Find a marker in the recording.
+ *
+ * @return Offset of the best match in [from, to) or -1 if there is no
+ *         match above LT_DETECT.
+ */
+static long find_marker(const int16_t * rx, long num, const double *chirp,
+                        long from, long to)
+{
+    double          norm = 0, energy = 0, dot, corr, best = LT_DETECT;
+    long            pos, found = -1;
+    int             i;
+
+    if (to + LT_CHIRP_LEN > num)
+        to = num - LT_CHIRP_LEN;
+
+    for (i = 0; i < LT_CHIRP_LEN; i++)
+        norm += chirp[i] * chirp[i];
+    norm = sqrt(norm);
+
+    for (i = 0; i < LT_CHIRP_LEN && from + i < num; i++)
+        energy += (double)rx[from + i] * rx[from + i];
+
+    for (pos = from; pos < to; pos++)
+    {
+        if (energy > 1.0)
+        {
+            dot = 0;
+            for (i = 0; i < LT_CHIRP_LEN; i++)
+                dot += chirp[i] * rx[pos + i];
+            corr = dot / (norm * sqrt(energy));
+            if (corr > best)
+            {
+                best = corr;
+                found = pos;
+            }
+        }
+
+        /* slide the energy window */
+        energy += (double)rx[pos + LT_CHIRP_LEN] * rx[pos + LT_CHIRP_LEN] -
+            (double)rx[pos] * rx[pos];
+    }
+
+    return found;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double          x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Compare the recording to the test signal */
+static void analyse(const int16_t * sig, uint32_t sig_len, uint32_t interval,
+                    const double *chirp, const int16_t * rx, long rx_len,
+                    struct lt_result *res)
+{
+    double          sig_energy = 0, err_energy = 0, cross = 0, rx_energy = 0;
+    double          gain;
+    long           *offset;
+    long            p, j, run, end = 0;
+    int             k;
+
+    res->markers = sig_len / interval - 1;
+    res->found = 0;
+    res->latency = calloc(res->markers + 1, sizeof(double));
+    offset = calloc(res->markers + 1, sizeof(long));
+
+    for (k = 0; k < res->markers; k++)
+    {
+        p = (long)(k + 1) * interval;
+        j = find_marker(rx, rx_len, chirp, p, p + interval - LT_CHIRP_LEN);
+        offset[k] = j < 0 ? -1 : j - p;
+        if (j < 0)
+            continue;
+
+        /* output is played two periods after the block was captured */
+        res->latency[res->found++] = 1.e3 * (j - p) / LT_RATE +
+            2 * LT_PERIOD_MS;
+        end = j + interval;
+    }
+
+    /* Least squares gain first, then the error energy, each interval
+     * aligned on its own marker */
+    for (k = 0; k < res->markers; k++)
+    {
+        if (offset[k] < 0)
+            continue;
+        for (p = (long)(k + 1) * interval; p < (long)(k + 2) * interval &&
+             p < (long)sig_len && p + offset[k] < rx_len; p++)
+        {
+            cross += (double)sig[p] * rx[p + offset[k]];
+            rx_energy += (double)rx[p + offset[k]] * rx[p + offset[k]];
+        }
+    }
+    gain = rx_energy > 0 ? cross / rx_energy : 0;
+    for (k = 0; k < res->markers; k++)
+    {
+        if (offset[k] < 0)
+            continue;
+        for (p = (long)(k + 1) * interval; p < (long)(k + 2) * interval &&
+             p < (long)sig_len && p + offset[k] < rx_len; p++)
+        {
+            double          e = sig[p] - gain * rx[p + offset[k]];
+
+            sig_energy += (double)sig[p] * sig[p];
+            err_energy += e * e;
+        }
+    }
+    res->snr = err_energy > 0 ? 10 * log10(sig_energy / err_energy) : 99.9;
+
+    /* Dropouts: digital silence between the first and the last marker;
+     * the test signal itself is never silent */
+    res->dropouts = 0;
+    res->dropout_frames = 0;
+    for (k = 0; k < res->markers && offset[k] < 0; k++)
+        ;
+    if (k < res->markers && end > rx_len)
+        end = rx_len;
+    for (j = k < res->markers ? (long)(k + 1) * interval + offset[k] : end,
+         run = 0; j < end; j++)
+    {
+        if (rx[j] == 0)
+        {
+            run++;
+            continue;
+        }
+        if (run >= LT_DROPOUT)
+        {
+            res->dropouts++;
+            res->dropout_frames += run;
+        }
+        run = 0;
+    }
+
+    qsort(res->latency, res->found, sizeof(double), cmp_double);
+    free(offset);
+}
+
+/* Split a string of options into args; returns the number of args */
+static int split_args(char *str, char **args, int max)
+{
+    char           *save = NULL;
+    char           *tok;
+    int             num = 0;
+
+    for (tok = strtok_r(str, " \t", &save); tok && num < max;
+         tok = strtok_r(NULL, " \t", &save))
+        args[num++] = tok;
+
+    return num;
+}
+
+/* Sleep until a CLOCK_MONOTONIC time unless interrupted */
+static void sleep_until(uint64_t when)
+{
+    uint64_t        now;
+
+    while (keep_running && (now = time_us()) < when)
+        usleep(when - now > 100000 ? 100000 : when - now);
+}
+
+/**
+ * Run one configuration.
+ *
+ * @return 0 if the daemons ran and the recording was analysed.
+ */
+static int run_config(const char *config, const char *bin_dir,
+                      const char *sig_path, const char *rx_path, int port,
+                      uint32_t duration_ms, uint32_t interval_ms, int verbose)
+{
+    char           *copy = strdup(config);
+    char           *server_opts = copy;
+    char           *client_opts;
+    char           *server_args[LT_MAX_ARGS + 8];
+    char           *client_args[LT_MAX_ARGS + 10];
+    char            server_spec[320], client_spec[320], port_str[16];
+    pid_t           server_pid, client_pid;
+    uint64_t        start;
+    int             n, ret = -1;
+
+    client_opts = strchr(copy, '|');
+    if (client_opts)
+        *client_opts++ = '\0';
+    else
+        client_opts = "";
+
+    start = time_us() + 1000 * LT_STARTUP_MS;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    snprintf(server_spec, sizeof(server_spec),
+             "in=%s,clock=rt,period=%d,start=%" PRIu64, sig_path,
+             LT_PERIOD_MS, start);
+    snprintf(client_spec, sizeof(client_spec),
+             "out=%s,clock=rt,period=%d,start=%" PRIu64, rx_path,
+             LT_PERIOD_MS, start);
+
+    server_args[1] = "-A";
+    server_args[2] = server_spec;
+    server_args[3] = "-p";
+    server_args[4] = port_str;
+    n = 5 + split_args(server_opts, &server_args[5], LT_MAX_ARGS);
+    server_args[n] = NULL;
+
+    client_args[1] = "-A";
+    client_args[2] = client_spec;
+    client_args[3] = "-s";
+    client_args[4] = "127.0.0.1";
+    client_args[5] = "-p";
+    client_args[6] = port_str;
+    n = 7 + split_args(client_opts, &client_args[7], LT_MAX_ARGS);
+    client_args[n] = NULL;
+
+    server_pid = test_start_daemon(bin_dir, "audio_server", server_args,
+                                   !verbose);
+
+    /* let the server start listening before the client connects */
+    usleep(200000);
+    client_pid = test_start_daemon(bin_dir, "audio_client", client_args,
+                                   !verbose);
+
+    if (server_pid != -1 && client_pid != -1)
+    {
+        /* the last marker may arrive up to one interval late */
+        sleep_until(start + 1000ULL * (duration_ms + interval_ms) + 200000);
+        ret = keep_running ? 0 : -1;
+    }
+
+    /* stop the client first so that it completes the recording */
+    test_stop_daemon(client_pid);
+    test_stop_daemon(server_pid);
+    free(copy);
+
+    return ret;
+}
+
+static void print_result(const char *config, const struct lt_result *res,
+                         double interval_ms)
+{
+    const double   *lat = res->latency;
+    double          sum = 0;
+    int             i, n = res->found;
+
+    for (i = 0; i < n; i++)
+        sum += lat[i];
+
+    fprintf(stderr, "%-20s %4d %4d %5.1f%% %4" PRIu64 " %7.1f  ",
+            strcmp(config, "|") ? config : "(defaults)", res->markers,
+            res->markers - n,
+            res->markers ? 100.0 * (res->markers - n) / res->markers : 0.0,
+            res->dropouts, 1.e3 * res->dropout_frames / LT_RATE);
+    if (n)
+        fprintf(stderr, "%6.1f %6.1f %6.1f %6.1f %6.1f  %5.1f\n", lat[0],
+                lat[n / 2], lat[(n * 99) / 100], lat[n - 1], sum / n,
+                res->snr);
+    else
+        fprintf(stderr, "no markers found (latency > %.0f ms?)\n",
+                interval_ms);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *defaults[] = { "|" };
+
+    struct lt_result res;
+    double          chirp[LT_CHIRP_LEN];
+    char            sig_path[256], rx_path[256];
+    const char    **configs = defaults;
+    const char     *bin_dir = ".";
+    const char     *out_dir = "/tmp";
+    int16_t        *sig, *rx;
+    uint32_t        duration_ms = 20000;
+    uint32_t        interval_ms = 1000;
+    uint32_t        sig_len, interval;
+    long            rx_len;
+    int             num_configs = 1;
+    int             port = 42300;
+    int             verbose = 0;
+    int             exit_code = EXIT_SUCCESS;
+    int             option;
+    int             i;
+
+    while ((option = getopt(argc, argv, "p:d:i:b:o:vh")) != -1)
+    {
+        switch (option)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+
+        case 'd':
+            duration_ms = 1000 * atoi(optarg);
+            break;
+
+        case 'i':
+            interval_ms = atoi(optarg);
+            if (interval_ms < 100)
+                interval_ms = 100;
+            break;
+
+        case 'b':
+            bin_dir = optarg;
+            break;
+
+        case 'o':
+            out_dir = optarg;
+            break;
+
+        case 'v':
+            verbose = 1;
+            break;
+
+        case 'h':
+            help();
+            exit(EXIT_SUCCESS);
+
+        default:
+            help();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc)
+    {
+        configs = (const char **)&argv[optind];
+        num_configs = argc - optind;
+    }
+
+    if (duration_ms < 2 * interval_ms)
+        duration_ms = 2 * interval_ms;
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    /* The first interval has no marker, so the search window of the last
+     * marker does not reach a marker when the input loops */
+    interval = (uint64_t) interval_ms * LT_RATE / 1000;
+    sig_len = (duration_ms / interval_ms + 1) * interval;
+    make_chirp(chirp);
+    sig = make_signal(chirp, sig_len, interval);
+    snprintf(sig_path, sizeof(sig_path), "%s/looptest_signal.wav", out_dir);
+    if (write_wav(sig_path, sig, sig_len))
+    {
+        free(sig);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "Testing %d config(s), %d markers each, %.1f s per "
+            "config\n", num_configs, (int)(sig_len / interval) - 1,
+            1.e-3 * (LT_STARTUP_MS + duration_ms + interval_ms));
+    fprintf(stderr, "%-20s %4s %4s %6s %4s %7s  %6s %6s %6s %6s %6s  %5s\n",
+            "config", "mark", "lost", "", "drop", "ms", "min", "50%", "99%",
+            "max", "avg", "SNR");
+
+    for (i = 0; i < num_configs && keep_running; i++)
+    {
+        snprintf(rx_path, sizeof(rx_path), "%s/looptest_rx_%d.wav", out_dir,
+                 i);
+        if (run_config(configs[i], bin_dir, sig_path, rx_path, port + i,
+                       sig_len * 1000ULL / LT_RATE - interval_ms,
+                       interval_ms, verbose))
+        {
+            exit_code = EXIT_FAILURE;
+            break;
+        }
+
+        rx_len = read_wav(rx_path, &rx);
+        if (rx_len < 0)
+        {
+            exit_code = EXIT_FAILURE;
+            continue;
+        }
+
+        analyse(sig, sig_len, interval, chirp, rx, rx_len, &res);
+        print_result(configs[i], &res, interval_ms);
+        free(res.latency);
+        free(rx);
+    }
+
+    fprintf(stderr, "Latency in ms, mouth to ear; SNR in dB. Recordings "
+            "are in %s/looptest_rx_<n>.wav\n", out_dir);
+
+    free(sig);
+
+    return exit_code;
+}
@@ -10,35 +10,230 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>           // PRId64 and PRIu64
+#include <linux/sockios.h>      // SIOCOUTQ
 #include <netinet/in.h>
+#include <netinet/tcp.h>        // TCP_NOTSENT_LOWAT
 #include <opus.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <unistd.h>
 
 #include "audio_util.h"
 #include "common.h"
+#include "flightrec.h"
+#include "metrics.h"
+#include "metrics_series.h"
+#include "pkt_queue.h"
+#include "prof.h"
 
 
+#define MAX_CLIENTS         16
+
+/**
+ * State of a client that has disconnected. It is kept for RESUME_HOLD_MS
+ * so that the client can resume its session if it reconnects.
+ *
+ * @token       Session token of the client; 0 if the entry is not used.
+ * @time        Time when the client disconnected.
+ * @udp_token   UDP transport token.
+ * @udp_addr    UDP transport address.
+ * @udp_active  The UDP transport was active.
+ * @tx          The client was transmitting.
+ */
+struct resume_state {
+    uint32_t        token;
+    uint64_t        time;
+    uint32_t        udp_token;
+    struct sockaddr_in udp_addr;
+    int             udp_active;
+    int             tx;
+};
+
+/**
+ * Counters summed over clients for the metrics endpoint.
+ *
+ * @pkts_sent       Packets sent.
+ * @bytes_sent      Bytes sent.
+ * @pkts_dropped    Audio packets dropped because a client was too slow.
+ * @pkts_aged       Audio packets dropped because they were too old.
+ * @clients         Number of connected clients.
+ * @udp_clients     Number of clients receiving audio over UDP.
+ */
+struct client_totals {
+    uint64_t        pkts_sent;
+    uint64_t        bytes_sent;
+    uint64_t        pkts_dropped;
+    uint64_t        pkts_aged;
+    uint64_t        tx_ignored;
+    uint32_t        clients;
+    uint32_t        udp_clients;
+};
+
 /* application state and config */
 struct app_data {
-    int32_t         opus_bitrate;
+    int32_t         opus_bitrate;       /* current encoder bitrate */
     int32_t         opus_complexity;
+    int32_t         bitrate_min;        /* adaptive bitrate range; */
+    int32_t         bitrate_max;        /* 0 if bitrate is fixed */
+    int             rate_good;          /* intervals without congestion */
     uint32_t        sample_rate;        /* audio sample rate */
     int             device_index;       /* audio device index */
+    char           *headless_spec;      /* headless audio; NULL for sound card */
     int             network_port;       /* network port number */
+    int             max_clients;        /* max number of connected clients */
+    int             tx_enabled;         /* receive and play TX audio */
+    struct in_addr  tx_addr;            /* client granted TX; 0 if none */
+    int             ctl_port;           /* ic706_server port in mux mode */
+    uint32_t        latency_budget;     /* max msec audio waits in queue */
+    char           *metrics_spec;       /* metrics port or socket path */
+    char           *series_spec;        /* metrics time series file */
+    int             prof_interval;      /* profiler table interval in sec */
+
+    /* The client currently sending TX audio and the time of its last TX
+     * packet. Only one client can transmit at a time, and only the client
+     * in control of the radio or the one granted TX with -x can. */
+    struct client  *tx_client;
+    uint64_t        tx_last;
+
+    int             udp_fd;             /* UDP socket, -1 if not available */
 
-    /* Copy of connected client IP address in betwork byte order.
-     * Used to check whether a new conection comes from a client that has
-     * connected earlier but disappeared without properly disconnecting.
-     */
-    uint32_t        cli_addr;
+    /* The most recent audio packets and the state of disconnected clients,
+     * used to resume sessions without losing audio. */
+    pkt_queue_t     history;
+    struct resume_state resume[MAX_CLIENTS];
+
+    /* Smoothed capture and encoding delay (usec); see struct
+     * audio_latency */
+    uint32_t        lat_capture;
+    uint32_t        lat_encode;
+
+    /* Counters of closed clients and the totals served as metrics */
+    struct client_totals closed;
+    struct client_totals totals;
+    struct client  *clients;
 };
 
+#define AUDIO_HISTORY_LEN   8   /* packets kept for resume (320 msec) */
+#define AUDIO_QUEUE_LEN     16  /* packets queued per client (640 msec) */
+#define CTL_QUEUE_LEN       16  /* CI-V packets queued per client */
+#define CLIENT_STALL_MS     10000       /* disconnect clients stalled this long */
+#define CLIENT_NOTSENT_LOWAT 128        /* max unsent bytes in socket buffer */
+#define TX_HOLD_MS          200 /* TX owner is released after this time */
+#define TIMING_INTERVAL_MS  1000        /* AUDIO_CI_TIMING interval */
+
+/* Adaptive bitrate: the link state of every client is evaluated each
+ * RATE_INTERVAL_MS. The bitrate is reduced by 25% when any client is
+ * congested and increased by RATE_STEP after RATE_UP_INTERVALS
+ * consecutive intervals where all clients had room to spare. */
+#define RATE_INTERVAL_MS    1000
+#define RATE_UP_INTERVALS   5
+#define RATE_STEP           2000
+#define RATE_BACKLOG_HIGH   200 /* msec queued: congested */
+#define RATE_BACKLOG_LOW    80  /* msec queued: room to increase */
+
+/**
+ * Connected client.
+ *
+ * @fd              TCP connection to the client; -1 if the slot is free.
+ * @addr            Client address.
+ * @rx              Receive buffer for packets from the client.
+ * @udp_token       UDP transport: the client sends the token over TCP and
+ *                  then in UDP datagrams to tell us where to send the audio.
+ * @udp_addr        Where to send UDP audio (valid if udp_active is set).
+ * @ctl_fd          Connection to ic706_server in mux mode.
+ * @ctl_buf         Receive buffer for the data from ic706_server.
+ * @in_control      ic706_server has given control of the radio to the
+ *                  client's session (PKT_TYPE_CTL); only such clients and
+ *                  the one granted TX with -x may send TX audio.
+ * @ctl_last_try    Time of the last attempt to connect to ic706_server.
+ * @ctl_wanted      The client has sent CI-V data, i.e. it relays a panel.
+ *                  Only then is ctl_fd opened: ic706_server gives control
+ *                  to its first session, which must not be a listener.
+ * @ctlq            Queue of CI-V packets to send. Has priority over audioq.
+ * @audioq          Queue of audio packets to send.
+ * @curq            The queue containing a partially sent packet, if any.
+ * @stall_time      Time when the audio queue became full; 0 if not full.
+ * @pkts_sent       Number of packets sent.
+ * @bytes_sent      Number of bytes sent.
+ * @pkts_dropped    Number of audio packets dropped because the client was
+ *                  too slow (queue full or packets too old).
+ * @pkts_aged       Number of audio packets dropped because they had been
+ *                  queued for longer than the latency budget.
+ * @tx_ignored      Number of TX audio packets ignored because the client
+ *                  was not allowed to transmit.
+ * @max_depth       Largest number of audio packets in the queue.
+ * @depth_sum       Sum of the queue depth sampled each time a packet is
+ *                  queued; used to calculate the average depth.
+ * @depth_samples   Number of queue depth samples.
+ * @rep_valid       The client has sent AUDIO_CI_STATS at least once.
+ * @rep_packets     Last reported number of packets received.
+ * @rep_lost        Last reported number of packets lost.
+ * @rep_underflows  Last reported number of output underflows.
+ * @new_packets     Packets received by the client since the last
+ *                  bitrate evaluation (from the reports).
+ * @new_lost        Packets lost since the last evaluation.
+ * @new_underflows  Output underflows since the last evaluation.
+ * @rate_dropped    Value of pkts_dropped at the last evaluation.
+ * @session_token   Token sent by the client in AUDIO_CI_SESSION; 0 if the
+ *                  client does not support session resume.
+ * @seq_tcp         Send AUDIO_PKT_SEQ instead of AUDIO_PKT_DATA on TCP.
+ *                  Set for clients supporting session resume, which need
+ *                  the sequence numbers to tell where to resume.
+ * @lat_queue       Smoothed time audio packets wait in the queue (usec).
+ * @rtt             Smoothed round trip time measured using AUDIO_CI_TIMING
+ *                  (usec); 0 until the client has echoed a stamp.
+ * @timing_last     Time when AUDIO_CI_TIMING was last sent.
+ */
+struct client {
+    int             fd;
+    struct sockaddr_in addr;
+    struct audio_rx_buf *rx;
+
+    uint32_t        udp_token;
+    struct sockaddr_in udp_addr;
+    int             udp_active;
+
+    int             ctl_fd;
+    struct xfr_buf *ctl_buf;
+    int             in_control;
+    uint64_t        ctl_last_try;
+    int             ctl_wanted;
+
+    pkt_queue_t     ctlq;
+    pkt_queue_t     audioq;
+    pkt_queue_t    *curq;
+    uint64_t        stall_time;
+
+    uint64_t        pkts_sent;
+    uint64_t        bytes_sent;
+    uint64_t        pkts_dropped;
+    uint64_t        pkts_aged;
+    uint64_t        tx_ignored;
+    uint32_t        max_depth;
+    uint64_t        depth_sum;
+    uint64_t        depth_samples;
+
+    int             rep_valid;
+    uint32_t        rep_packets;
+    uint32_t        rep_lost;
+    uint32_t        rep_underflows;
+    uint32_t        new_packets;
+    uint32_t        new_lost;
+    uint32_t        new_underflows;
+    uint64_t        rate_dropped;
+
+    uint32_t        session_token;
+    int             seq_tcp;
+
+    uint32_t        lat_queue;
+    uint32_t        rtt;
+    uint64_t        timing_last;
+};
 
 static int      keep_running = 1;       /* set to 0 to exit infinite loop */
 
@@ -58,10 +253,37 @@ static void help(void)
         "  -d <num>  Audio device index (see -l).\n"
         "  -r <num>  Audio sample rate (default is 48000).\n"
         "  -l        List audio devices.\n"
+        "  -A <str>  Run without a sound card, e.g. in=sine:1000,clock=fast.\n"
+        "            Options: in=sine:<Hz>|noise|silence|<file>,\n"
+        "            out=null|<file>, clock=rt|fast, period=<ms>.\n"
         "  -b <num>  Opus encoder output rate in bits per sec (default is 16 kbps).\n"
         "  -c <num>  Opus encoder complexity 1-10 (default is 5).\n"
-        "  -p <num>  Network port number (default is 42001).\n"
-        "  -h        This help message.\n\n";
+        "  -a <min>:<max>\n"
+        "            Adapt the encoder rate to the link, between min and max\n"
+        "            bits per sec. The -b rate is used as starting point.\n"
+        "  -p <num>  Network port number (default is 42001). The same port\n"
+        "            number is used for the optional UDP transport.\n"
+        "  -t        Enable TX audio (play audio received from client).\n"
+        "            Audio is accepted from the client in control of the\n"
+        "            radio (see -m) and from the client given with -x.\n"
+        "  -x <ip>   Accept TX audio from the client at this address, e.g.\n"
+        "            when control and audio use separate connections.\n"
+        "  -m <num>  Multiplex control and audio on the same connection.\n"
+        "            CI-V data is relayed to/from ic706_server listening on\n"
+        "            the specified local port (normally 42000). The\n"
+        "            connection is opened when a client sends CI-V data.\n"
+        "  -n <num>  Maximum number of clients (default is 4, max 16).\n"
+        "  -L <num>  Latency budget in msec (default is 300). Audio that has\n"
+        "            been waiting longer than this to be sent to a slow TCP\n"
+        "            client is dropped.\n"
+        "  -M <str>  Serve live metrics in Prometheus format on the given\n"
+        "            port on 127.0.0.1 or on a Unix socket path.\n"
+        "  -T <str>  Record the metrics every second in a memory-mapped\n"
+        "            file: <path>[,interval=<ms>][,records=<num>].\n"
+        "  -P <num>  Print a CPU profile of the processing stages every\n"
+        "            <num> seconds.\n"
+        "  -h        This help message.\n"
+        "\n SIGUSR1 dumps the flight recorder, see flightrec.h.\n\n";
 
     fprintf(stderr, "%s", help_string);
 }
@@ -73,7 +295,7 @@ static void parse_options(int argc, char **argv, struct app_data *app)
 
     if (argc > 1)
     {
-        while ((option = getopt(argc, argv, "d:r:lb:c:p:h")) != -1)
+        while ((option = getopt(argc, argv, "d:r:lA:b:c:a:p:tx:m:n:L:M:T:P:h")) != -1)
         {
             switch (option)
             {
@@ -89,6 +311,10 @@ static void parse_options(int argc, char **argv, struct app_data *app)
                 audio_list_devices();
                 exit(EXIT_SUCCESS);
 
+            case 'A':
+                app->headless_spec = optarg;
+                break;
+
             case 'b':
                 app->opus_bitrate = (int32_t) atof(optarg);
                 break;
@@ -97,10 +323,64 @@ static void parse_options(int argc, char **argv, struct app_data *app)
                 app->opus_complexity = atoi(optarg);
                 break;
 
+            case 'a':
+                if (sscanf(optarg, "%d:%d", &app->bitrate_min,
+                           &app->bitrate_max) != 2 ||
+                    app->bitrate_min <= 0 ||
+                    app->bitrate_max < app->bitrate_min)
+                {
+                    fprintf(stderr, "Invalid bitrate range: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
             case 'p':
                 app->network_port = atoi(optarg);
                 break;
 
+            case 't':
+                app->tx_enabled = 1;
+                break;
+
+            case 'x':
+                if (inet_aton(optarg, &app->tx_addr) == 0)
+                {
+                    fprintf(stderr, "Invalid TX client address: %s\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'm':
+                app->ctl_port = atoi(optarg);
+                break;
+
+            case 'n':
+                app->max_clients = atoi(optarg);
+                if (app->max_clients < 1)
+                    app->max_clients = 1;
+                else if (app->max_clients > MAX_CLIENTS)
+                    app->max_clients = MAX_CLIENTS;
+                break;
+
+            case 'L':
+                app->latency_budget = atoi(optarg);
+                if (app->latency_budget < 40)
+                    app->latency_budget = 40;
+                break;
+
+            case 'M':
+                app->metrics_spec = optarg;
+                break;
+
+            case 'T':
+                app->series_spec = optarg;
+                break;
+
+            case 'P':
+                app->prof_interval = atoi(optarg);
+                break;
+
             case 'h':
                 help();
                 exit(EXIT_SUCCESS);
@@ -114,60 +394,1086 @@ static void parse_options(int argc, char **argv, struct app_data *app)
     }
 }
 
+/* Highest audio bandwidth worth encoding at the given bitrate */
+static opus_int32 bitrate_to_bandwidth(opus_int32 bitrate)
+{
+    if (bitrate < 12000)
+        return OPUS_BANDWIDTH_NARROWBAND;
+    else if (bitrate < 16000)
+        return OPUS_BANDWIDTH_MEDIUMBAND;
+    else
+        return OPUS_BANDWIDTH_WIDEBAND;
+}
+
+static void set_encoder_bitrate(OpusEncoder * encoder, opus_int32 bitrate)
+{
+    opus_encoder_ctl(encoder,
+                     OPUS_SET_MAX_BANDWIDTH(bitrate_to_bandwidth(bitrate)));
+    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(bitrate));
+}
+
 static void setup_encoder(OpusEncoder * encoder, struct app_data *app)
 {
     opus_int32      x;
 
     fprintf(stderr, "Configuring opus encoder:\n");
 
-    opus_encoder_ctl(encoder, OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_WIDEBAND));
-    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(app->opus_bitrate));
+    if (app->bitrate_max)
+    {
+        if (app->opus_bitrate < app->bitrate_min)
+            app->opus_bitrate = app->bitrate_min;
+        else if (app->opus_bitrate > app->bitrate_max)
+            app->opus_bitrate = app->bitrate_max;
+    }
+
+    set_encoder_bitrate(encoder, app->opus_bitrate);
     opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(app->opus_complexity));
 
     opus_encoder_ctl(encoder, OPUS_GET_COMPLEXITY(&x));
     fprintf(stderr, "  Complexity: %d\n", x);
     opus_encoder_ctl(encoder, OPUS_GET_BITRATE(&x));
     fprintf(stderr, "  Bitrate   : %d\n", x);
+    if (app->bitrate_max)
+        fprintf(stderr, "  Adaptive  : %d - %d\n", app->bitrate_min,
+                app->bitrate_max);
+}
+
+/* TX audio is played with as little buffering as possible */
+#define TX_PLAY_THRESHOLD  2880         /* 60 msec: 48000 * 0.06 */
+#define TX_AUDIO_FRAMES    5760         /* allows decoding 120 msec frames */
+
+/* Allocate buffers for a client slot */
+static int client_alloc(struct client *c)
+{
+    c->fd = -1;
+    c->ctl_fd = -1;
+    c->rx = (struct audio_rx_buf *)malloc(sizeof(struct audio_rx_buf));
+    if (c->rx == NULL)
+        return -1;
+
+    c->ctl_buf = (struct xfr_buf *)malloc(sizeof(struct xfr_buf));
+    if (c->ctl_buf == NULL)
+        return -1;
+
+    if (pkt_queue_init(&c->ctlq, CTL_QUEUE_LEN, AUDIO_HDR_LEN + RDBUF_SIZE))
+        return -1;
+
+    return pkt_queue_init(&c->audioq, AUDIO_QUEUE_LEN,
+                          AUDIO_MAX_PKT_LEN + 1);
+}
+
+static void client_free(struct client *c)
+{
+    free(c->rx);
+    free(c->ctl_buf);
+    pkt_queue_free(&c->ctlq);
+    pkt_queue_free(&c->audioq);
+}
+
+/* Open control connection to ic706_server in mux mode */
+static void open_ctl_connection(struct client *c, int port)
+{
+    c->ctl_last_try = time_ms();
+    c->ctl_buf->wridx = 0;
+    c->ctl_buf->pktlen = 0;
+    c->in_control = 0;
+    c->ctl_fd = connect_server("127.0.0.1", port);
+    if (c->ctl_fd == -1)
+        fprintf(stderr, "Error connecting to ic706_server: %d: %s\n",
+                errno, strerror(errno));
+    else
+        fprintf(stderr, "Connected to ic706_server (FD=%d)\n", c->ctl_fd);
+}
+
+static void close_ctl_connection(struct client *c)
+{
+    if (c->ctl_fd == -1)
+        return;
+
+    close(c->ctl_fd);
+    c->ctl_fd = -1;
+    c->in_control = 0;
+}
+
+/* Initialize client slot for a new connection */
+static void client_open(struct client *c, int fd, struct sockaddr_in *addr)
+{
+    c->fd = fd;
+    c->addr = *addr;
+    audio_rx_init(c->rx);
+    flightrec_event(FR_EV_CONNECT, 0, fd, ntohl(addr->sin_addr.s_addr));
+
+    c->udp_token = 0;
+    c->udp_active = 0;
+
+    pkt_queue_clear(&c->ctlq);
+    pkt_queue_clear(&c->audioq);
+    c->curq = NULL;
+    c->stall_time = 0;
+
+    c->pkts_sent = 0;
+    c->bytes_sent = 0;
+    c->pkts_dropped = 0;
+    c->pkts_aged = 0;
+    c->tx_ignored = 0;
+    c->max_depth = 0;
+    c->depth_sum = 0;
+    c->depth_samples = 0;
+
+    c->rep_valid = 0;
+    c->new_packets = 0;
+    c->new_lost = 0;
+    c->new_underflows = 0;
+    c->rate_dropped = 0;
+
+    c->session_token = 0;
+    c->seq_tcp = 0;
+
+    c->lat_queue = 0;
+    c->rtt = 0;
+    c->timing_last = time_ms();
+
+    /* sends are queued and never block the main loop */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    /* Keep the backlog in our queue, where old packets can be dropped,
+     * instead of in the socket buffer, where they would be played late */
+    set_nodelay(fd);
+#ifdef TCP_NOTSENT_LOWAT
+    {
+        int             lowat = CLIENT_NOTSENT_LOWAT;
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                       sizeof(lowat)) == -1)
+            fprintf(stderr, "Error setting TCP_NOTSENT_LOWAT: %d: %s\n",
+                    errno, strerror(errno));
+    }
+#endif
+
+    c->ctl_fd = -1;
+    c->in_control = 0;
+    c->ctl_last_try = 0;
+    c->ctl_wanted = 0;
+}
+
+static void client_print_stats(struct client *c)
+{
+    fprintf(stderr, "  Client %s (FD=%d):\n", inet_ntoa(c->addr.sin_addr),
+            c->fd);
+    fprintf(stderr, "    Packets sent   : %" PRIu64 "\n", c->pkts_sent);
+    fprintf(stderr, "    Bytes sent     : %" PRIu64 "\n", c->bytes_sent);
+    fprintf(stderr, "    Packets dropped: %" PRIu64 " (%" PRIu64 " too old)\n",
+            c->pkts_dropped, c->pkts_aged);
+    if (c->tx_ignored)
+        fprintf(stderr, "    TX ignored     : %" PRIu64 " packets\n",
+                c->tx_ignored);
+    fprintf(stderr, "    Queue depth    : %.1f avg, %" PRIu32 " max\n",
+            c->depth_samples ? (double)c->depth_sum / c->depth_samples : 0.0,
+            c->max_depth);
+    fprintf(stderr, "    Queue delay    : %.1f ms avg, RTT %.1f ms\n",
+            1.e-3 * c->lat_queue, 1.e-3 * c->rtt);
+    fprintf(stderr, "    Packets in     : %" PRIu64 "\n", c->rx->packets);
+    fprintf(stderr, "    Resync bytes   : %" PRIu64 "\n", c->rx->resyncs);
+}
+
+/* Save client state so that the client can resume its session */
+static void client_save_state(struct client *c, struct app_data *app)
+{
+    struct resume_state *r = NULL;
+    uint64_t        now = time_ms();
+    int             i;
+
+    /* use a free or expired entry, or the oldest one */
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (r == NULL || app->resume[i].token == 0 ||
+            app->resume[i].time < r->time)
+            r = &app->resume[i];
+        if (r->token == 0 || now - r->time > RESUME_HOLD_MS)
+            break;
+    }
+
+    r->token = c->session_token;
+    r->time = now;
+    r->udp_token = c->udp_token;
+    r->udp_addr = c->udp_addr;
+    r->udp_active = c->udp_active;
+    r->tx = (app->tx_client == c);
+}
+
+/* Check whether there are disconnected clients that may resume */
+static int resume_pending(struct app_data *app)
+{
+    uint64_t        now = time_ms();
+    int             i;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (app->resume[i].token && now - app->resume[i].time <= RESUME_HOLD_MS)
+            return 1;
+
+    return 0;
+}
+
+/* Add the counters of a client to the totals */
+static void client_totals_add(struct client_totals *t, struct client *c)
+{
+    t->pkts_sent += c->pkts_sent;
+    t->bytes_sent += c->bytes_sent;
+    t->pkts_dropped += c->pkts_dropped;
+    t->pkts_aged += c->pkts_aged;
+    t->tx_ignored += c->tx_ignored;
+}
+
+static void client_close(struct client *c, struct app_data *app)
+{
+    fprintf(stderr, "Connection closed (FD=%d)\n", c->fd);
+    flightrec_event(FR_EV_DISCONNECT, 0, c->fd, 0);
+    client_print_stats(c);
+    client_totals_add(&app->closed, c);
+
+    if (c->session_token)
+        client_save_state(c, app);
+
+    close(c->fd);
+    c->fd = -1;
+    close_ctl_connection(c);
+
+    if (app->tx_client == c)
+        app->tx_client = NULL;
+}
+
+/**
+ * Drop audio packets that have been queued for longer than the budget.
+ *
+ * @return 0 if OK, -1 if the client has not accepted any data for more
+ *         than CLIENT_STALL_MS and should be disconnected.
+ */
+static int client_drop_aged(struct client *c, uint64_t now, uint32_t budget)
+{
+    int             num;
+
+    if (now < budget)
+        return 0;
+
+    num = pkt_queue_drop_older(&c->audioq, now - budget);
+    if (!num)
+        return 0;
+
+    c->pkts_aged += num;
+    c->pkts_dropped += num;
+    flightrec_event(FR_EV_DROP, 0, c->fd, num);
+
+    if (c->stall_time == 0)
+        c->stall_time = now;
+    else if (now - c->stall_time > CLIENT_STALL_MS)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Send as much queued data as possible.
+ *
+ * @param c      The client.
+ * @param budget The latency budget in msec. Audio packets queued for
+ *               longer than this are dropped instead of sent.
+ * @return 0 if OK, -1 if the connection should be closed.
+ *
+ * A partially sent packet is always completed first. After that CI-V
+ * packets are sent before audio packets.
+ */
+static int client_flush(struct client *c, uint32_t budget)
+{
+    struct prof_sample ps;
+    uint8_t        *data;
+    uint16_t        len = 0;
+    int             num;
+
+    while (1)
+    {
+        if (c->curq == NULL)
+        {
+            if (pkt_queue_count(&c->ctlq))
+                c->curq = &c->ctlq;
+            else if (client_drop_aged(c, time_ms(), budget))
+                return -1;
+            else if (pkt_queue_count(&c->audioq))
+                c->curq = &c->audioq;
+            else
+                return 0;
+        }
+
+        data = pkt_queue_front(c->curq, &len);
+        prof_begin(&ps);
+        num = send(c->fd, data, len, MSG_NOSIGNAL);
+        prof_end(PROF_WRITE, &ps);
+        if (num < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            flightrec_event(FR_EV_WRITE_ERR, 0, c->fd, errno);
+            fprintf(stderr, "Error writing to client (FD=%d): %d: %s\n",
+                    c->fd, errno, strerror(errno));
+            return -1;
+        }
+
+        c->bytes_sent += num;
+        if (c->curq == &c->audioq && num == len)
+            audio_latency_smooth(&c->lat_queue, 1000 *
+                                 (time_ms() -
+                                  pkt_queue_front_stamp(&c->audioq)));
+
+        /* the type is in the first byte, which a partial send has passed */
+        data = pkt_queue_peek(c->curq, 0, &len);
+        if (pkt_queue_consume(c->curq, num))
+        {
+            flightrec_event(FR_EV_TX, audio_pkt_type(data), c->fd, len);
+            c->pkts_sent++;
+            c->stall_time = 0;
+            c->curq = NULL;
+        }
+    }
+}
+
+/* Check whether there is anything waiting to be sent */
+static int client_has_pending(struct client *c)
+{
+    return c->curq || pkt_queue_count(&c->ctlq) || pkt_queue_count(&c->audioq);
+}
+
+/**
+ * Queue audio packet for sending.
+ *
+ * @return 0 if OK, -1 if the client has been stalled for more than
+ *         CLIENT_STALL_MS and should be disconnected.
+ *
+ * Packets older than the latency budget are dropped first. If the queue is
+ * still full the oldest packet is dropped so that a slow client gets the
+ * most recent audio once it catches up. A client that can not keep up does
+ * not affect the other clients.
+ */
+static int client_queue_audio(struct client *c, const uint8_t * pkt,
+                              uint16_t len, uint32_t budget)
+{
+    uint64_t        now = time_ms();
+
+    if (client_drop_aged(c, now, budget))
+        return -1;
+
+    if (pkt_queue_is_full(&c->audioq))
+    {
+        if (c->stall_time == 0)
+            c->stall_time = now;
+        else if (now - c->stall_time > CLIENT_STALL_MS)
+            return -1;
+
+        if (pkt_queue_drop_oldest(&c->audioq))
+        {
+            c->pkts_dropped++;
+            flightrec_event(FR_EV_DROP, 0, c->fd, 1);
+        }
+    }
+
+    pkt_queue_push_stamped(&c->audioq, pkt, len, now);
+    if (pkt_queue_count(&c->audioq) > c->max_depth)
+        c->max_depth = pkt_queue_count(&c->audioq);
+    c->depth_sum += pkt_queue_count(&c->audioq);
+    c->depth_samples++;
+
+    return 0;
+}
+
+/**
+ * Queue AUDIO_CI_TIMING with the latency measured on this side.
+ *
+ * Audio sent over UDP is not queued, so the queue delay is only reported
+ * for TCP. The client echoes the stamp, which gives the round trip time.
+ */
+static void client_queue_timing(struct client *c, struct app_data *app)
+{
+    uint8_t         pkt[AUDIO_HDR_LEN + 22];
+    uint32_t        val[5] = {
+        app->lat_capture,
+        app->lat_encode,
+        c->udp_active ? 0 : c->lat_queue,
+        c->rtt,
+        (uint32_t) time_us(),
+    };
+    int             i;
+
+    audio_pkt_set_header(pkt, sizeof(pkt), AUDIO_PKT_CTRL);
+    pkt[2] = AUDIO_CI_TIMING & 0xFF;
+    pkt[3] = AUDIO_CI_TIMING >> 8;
+    for (i = 0; i < 5; i++)
+    {
+        pkt[4 + 4 * i] = val[i] & 0xFF;
+        pkt[5 + 4 * i] = (val[i] >> 8) & 0xFF;
+        pkt[6 + 4 * i] = (val[i] >> 16) & 0xFF;
+        pkt[7 + 4 * i] = (val[i] >> 24) & 0xFF;
+    }
+
+    pkt_queue_push(&c->ctlq, pkt, sizeof(pkt));
+    c->timing_last = time_ms();
+}
+
+/**
+ * Relay data from ic706_server to the client.
+ *
+ * @return The number of bytes relayed or -1 on EOF or error.
+ *
+ * The data is relayed one packet at a time so that the CTL replies telling
+ * whether the client's session has control can be seen on the way. Invalid
+ * data is relayed as is and left to ic706_client.
+ */
+static int client_relay_ctl(struct client *c)
+{
+    struct xfr_buf *buf = c->ctl_buf;
+    uint8_t         pkt[AUDIO_HDR_LEN + RDBUF_SIZE];
+    int             pkt_type;
+    int             num = 0;
+
+    do
+    {
+        pkt_type = read_data(c->ctl_fd, buf);
+        if (pkt_type == PKT_TYPE_EOF ||
+            (pkt_type == PKT_TYPE_INVALID && buf->pktlen == 0))
+            return -1;
+
+        if (pkt_type == PKT_TYPE_INCOMPLETE)
+            break;
+
+        if (pkt_type == PKT_TYPE_CTL && c->in_control != buf->data[2])
+        {
+            c->in_control = buf->data[2];
+            fprintf(stderr, "Client %s (FD=%d) %s control of the radio\n",
+                    inet_ntoa(c->addr.sin_addr), c->fd,
+                    c->in_control ? "is in" : "is not in");
+        }
+
+        memcpy(&pkt[AUDIO_HDR_LEN], buf->data, buf->pktlen);
+        audio_pkt_set_header(pkt, buf->pktlen + AUDIO_HDR_LEN, AUDIO_PKT_CIV);
+        if (pkt_queue_push(&c->ctlq, pkt, buf->pktlen + AUDIO_HDR_LEN))
+            fprintf(stderr, "Control queue full; dropped %d bytes (FD=%d)\n",
+                    buf->pktlen, c->fd);
+        num += buf->pktlen;
+    }
+    while (packet_pending(buf));
+
+    return num;
+}
+
+/**
+ * Send the audio packets in the history starting at a sequence number.
+ *
+ * @return The number of packets sent or queued.
+ */
+static int client_replay(struct client *c, struct app_data *app,
+                         uint16_t next_seq)
+{
+    uint8_t        *pkt;
+    uint16_t        len;
+    uint16_t        seq;
+    int             num = 0;
+    int             i;
+
+    for (i = 0; (pkt = pkt_queue_peek(&app->history, i, &len)); i++)
+    {
+        seq = pkt[2] | (pkt[3] << 8);
+        if ((int16_t) (seq - next_seq) < 0)
+            continue;
+
+        if (c->udp_active)
+            sendto(app->udp_fd, pkt, len, MSG_DONTWAIT,
+                   (struct sockaddr *)&c->udp_addr, sizeof(c->udp_addr));
+        else if (client_queue_audio(c, pkt, len, app->latency_budget))
+            break;
+
+        num++;
+    }
+
+    return num;
+}
+
+/**
+ * Process AUDIO_CI_SESSION from the client.
+ *
+ * If the client had a session that disconnected less than RESUME_HOLD_MS
+ * ago, the UDP transport and TX ownership are restored and the audio the
+ * client missed is sent again from the history. The reply tells the client
+ * whether the session was resumed.
+ */
+static void client_resume(struct client *c, struct app_data *app,
+                          uint32_t token, int seq_valid, uint16_t next_seq)
+{
+    struct resume_state *r = NULL;
+    uint8_t         reply[AUDIO_HDR_LEN + 7];
+    uint64_t        now = time_ms();
+    int             replayed = 0;
+    int             i;
+
+    c->session_token = token;
+    c->seq_tcp = 1;
+
+    for (i = 0; i < MAX_CLIENTS && token; i++)
+    {
+        if (app->resume[i].token == token &&
+            now - app->resume[i].time <= RESUME_HOLD_MS)
+        {
+            r = &app->resume[i];
+            break;
+        }
+    }
+
+    if (r)
+    {
+        c->udp_token = r->udp_token;
+        c->udp_addr = r->udp_addr;
+        c->udp_active = r->udp_active;
+        if (r->tx && app->tx_client == NULL)
+            app->tx_client = c;
+        r->token = 0;
+
+        if (seq_valid)
+            replayed = client_replay(c, app, next_seq);
+
+        fprintf(stderr, "Session %08X resumed after %" PRIu64
+                " ms (FD=%d); %d packets replayed\n", token, now - r->time,
+                c->fd, replayed);
+    }
+
+    audio_pkt_set_header(reply, sizeof(reply), AUDIO_PKT_CTRL);
+    reply[2] = AUDIO_CI_SESSION & 0xFF;
+    reply[3] = AUDIO_CI_SESSION >> 8;
+    reply[4] = token & 0xFF;
+    reply[5] = (token >> 8) & 0xFF;
+    reply[6] = (token >> 16) & 0xFF;
+    reply[7] = (token >> 24) & 0xFF;
+    reply[8] = r ? 0x01 : 0x00;
+    pkt_queue_push(&c->ctlq, reply, sizeof(reply));
+}
+
+/* Process a control item received from the client */
+static void process_ctrl_item(const uint8_t * pkt, uint16_t length,
+                              struct client *c, struct app_data *app)
+{
+    uint16_t        item;
+
+    if (length < AUDIO_HDR_LEN + 2)
+        return;
+
+    item = pkt[2] | (pkt[3] << 8);
+    switch (item)
+    {
+    case AUDIO_CI_UDP:
+        if (length < AUDIO_HDR_LEN + 6)
+            break;
+        /* a resumed session keeps sending to the known UDP address */
+        if (audio_get_le32(&pkt[4]) != c->udp_token)
+            c->udp_active = 0;
+        c->udp_token = audio_get_le32(&pkt[4]);
+        fprintf(stderr, "Client requested UDP transport (token %08X)\n",
+                c->udp_token);
+        break;
+
+    case AUDIO_CI_STATS:
+        if (length < AUDIO_HDR_LEN + 18)
+            break;
+
+        /* the counters are cumulative; accumulate the increments until the
+         * next bitrate evaluation */
+        if (c->rep_valid)
+        {
+            c->new_packets += audio_get_le32(&pkt[4]) - c->rep_packets;
+            c->new_lost += audio_get_le32(&pkt[8]) - c->rep_lost;
+            c->new_underflows += audio_get_le32(&pkt[16]) - c->rep_underflows;
+        }
+        c->rep_packets = audio_get_le32(&pkt[4]);
+        c->rep_lost = audio_get_le32(&pkt[8]);
+        c->rep_underflows = audio_get_le32(&pkt[16]);
+        c->rep_valid = 1;
+        break;
+
+    case AUDIO_CI_TIMING:
+        if (length < AUDIO_HDR_LEN + 6)
+            break;
+        audio_latency_smooth(&c->rtt,
+                             (uint32_t) time_us() - audio_get_le32(&pkt[4]));
+        break;
+
+    case AUDIO_CI_SESSION:
+        if (length < AUDIO_HDR_LEN + 9)
+            break;
+        client_resume(c, app, audio_get_le32(&pkt[4]), pkt[8] & 0x01,
+                      pkt[9] | (pkt[10] << 8));
+        break;
+
+    default:
+        fprintf(stderr, "Unknown control item 0x%04X\n", item);
+    }
+}
+
+/**
+ * Read packets from the client.
+ *
+ * @return PKT_TYPE_EOF if the connection has been closed, otherwise
+ *         PKT_TYPE_INCOMPLETE.
+ *
+ * All complete packets are processed: control items are handled and TX
+ * audio packets are decoded and written to the audio output buffer (if TX
+ * is enabled and no other client is transmitting).
+ */
+static int process_net_input(struct client *c, struct app_data *app,
+                             OpusDecoder * decoder, audio_t * audio,
+                             uint64_t * decoder_errors)
+{
+    opus_int16      pcm[TX_AUDIO_FRAMES];
+    struct prof_sample ps;
+    uint8_t        *pkt;
+    uint16_t        length;
+    uint64_t        now;
+    int             num;
+
+    if (audio_rx_read(c->fd, c->rx) <= 0)
+        return PKT_TYPE_EOF;
+
+    while ((pkt = audio_rx_next(c->rx, &length)) != NULL)
+    {
+        flightrec_event(FR_EV_RX, audio_pkt_type(pkt), c->fd, length);
+        switch (audio_pkt_type(pkt))
+        {
+        case AUDIO_PKT_CTRL:
+            process_ctrl_item(pkt, length, c, app);
+            break;
+
+        case AUDIO_PKT_CIV:
+            /* control data from ic706_client */
+            if (!app->ctl_port)
+                break;
+
+            c->ctl_wanted = 1;
+            if (c->ctl_fd == -1 && time_ms() - c->ctl_last_try > 1000)
+                open_ctl_connection(c, app->ctl_port);
+            if (c->ctl_fd != -1 &&
+                write(c->ctl_fd, &pkt[AUDIO_HDR_LEN],
+                      length - AUDIO_HDR_LEN) != length - AUDIO_HDR_LEN)
+                fprintf(stderr, "Error writing to ic706_server\n");
+            break;
+
+        case AUDIO_PKT_DATA:
+            if (!decoder)
+                break;
+
+            /* only the client in control of the radio may transmit */
+            if (!c->in_control &&
+                c->addr.sin_addr.s_addr != app->tx_addr.s_addr)
+            {
+                c->tx_ignored++;
+                break;
+            }
+
+            now = time_ms();
+            if (app->tx_client != c)
+            {
+                if (app->tx_client && now - app->tx_last < TX_HOLD_MS)
+                    break;
+
+                /* new transmitting client */
+                app->tx_client = c;
+                opus_decoder_ctl(decoder, OPUS_RESET_STATE);
+            }
+            app->tx_last = now;
+
+            prof_begin(&ps);
+            num = opus_decode(decoder, &pkt[AUDIO_HDR_LEN],
+                              length - AUDIO_HDR_LEN, pcm, TX_AUDIO_FRAMES, 0);
+            prof_end(PROF_DECODE, &ps);
+            if (num > 0)
+            {
+                audio_write_frames(audio, (uint8_t *) pcm, num);
+            }
+            else
+            {
+                (*decoder_errors)++;
+                fprintf(stderr, "TX decoder error: %d (%s)\n", num,
+                        opus_strerror(num));
+            }
+            break;
+        }
+    }
+
+    return PKT_TYPE_INCOMPLETE;
+}
+
+/* Read UDP datagram and check whether it is a UDP hello from a client */
+static void process_udp_input(int fd, struct client *clients, int num_clients)
+{
+    struct sockaddr_in addr;
+    socklen_t       addr_len = sizeof(addr);
+    struct client  *c;
+    uint8_t         buf[64];
+    uint32_t        token;
+    int             num;
+    int             i;
+
+    num = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr,
+                   &addr_len);
+    if (num < AUDIO_HDR_LEN + 6 || audio_pkt_length(buf) != num ||
+        audio_pkt_type(buf) != AUDIO_PKT_CTRL ||
+        (buf[2] | (buf[3] << 8)) != AUDIO_CI_UDP)
+        return;
+
+    token = audio_get_le32(&buf[4]);
+    for (i = 0; i < num_clients; i++)
+    {
+        c = &clients[i];
+        if (c->fd == -1 || c->udp_token == 0 || c->udp_token != token)
+            continue;
+
+        if (!c->udp_active ||
+            c->udp_addr.sin_addr.s_addr != addr.sin_addr.s_addr ||
+            c->udp_addr.sin_port != addr.sin_port)
+        {
+            fprintf(stderr, "Sending audio to %s:%d using UDP\n",
+                    inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        }
+
+        c->udp_addr = addr;
+        c->udp_active = 1;
+        break;
+    }
+}
+
+#define LINK_CONGESTED  -1
+#define LINK_STEADY      0
+#define LINK_GOOD        1
+
+/**
+ * Evaluate the link to a client since the last call.
+ *
+ * @return LINK_CONGESTED if packets were dropped or lost, the client ran out
+ *         of audio, or more than RATE_BACKLOG_HIGH msec of audio is waiting
+ *         to be sent. LINK_GOOD if none of this happened and less than
+ *         RATE_BACKLOG_LOW msec is waiting. Otherwise LINK_STEADY.
+ *
+ * The backlog on TCP connections is the audio queue plus the data in the
+ * kernel send buffer (SIOCOUTQ) converted to time at the current bitrate.
+ */
+static int client_link_state(struct client *c, struct app_data *app,
+                             const char **reason)
+{
+    uint64_t        dropped = c->pkts_dropped - c->rate_dropped;
+    uint32_t        backlog = 0;        /* msec */
+    int             outq = 0;
+    int             state = LINK_GOOD;
+
+    if (!c->udp_active)
+    {
+        if (ioctl(c->fd, SIOCOUTQ, &outq) == -1)
+            outq = 0;
+
+        backlog = 40 * pkt_queue_count(&c->audioq) +
+            (uint64_t) outq * 8000 / app->opus_bitrate;
+    }
+
+    if (dropped)
+    {
+        *reason = "packets dropped";
+        state = LINK_CONGESTED;
+    }
+    else if (c->new_lost && c->new_lost * 50 >= c->new_packets)
+    {
+        /* more than 2% packet loss */
+        *reason = "packet loss";
+        state = LINK_CONGESTED;
+    }
+    else if (c->new_underflows)
+    {
+        *reason = "client underflow";
+        state = LINK_CONGESTED;
+    }
+    else if (backlog > RATE_BACKLOG_HIGH)
+    {
+        *reason = "send backlog";
+        state = LINK_CONGESTED;
+    }
+    else if (c->new_lost || backlog > RATE_BACKLOG_LOW)
+    {
+        state = LINK_STEADY;
+    }
+
+    c->rate_dropped = c->pkts_dropped;
+    c->new_packets = 0;
+    c->new_lost = 0;
+    c->new_underflows = 0;
+
+    return state;
+}
+
+/**
+ * Adapt the encoder bitrate to the worst client link.
+ *
+ * The bitrate is reduced quickly when a link is congested and increased
+ * slowly when all links have had spare capacity for a while. Every change
+ * is logged.
+ */
+static void update_bitrate(OpusEncoder * encoder, struct client *clients,
+                           struct app_data *app)
+{
+    const char     *reason = NULL;
+    const char     *worst_reason = NULL;
+    int32_t         bitrate = app->opus_bitrate;
+    int             worst = LINK_GOOD;
+    int             state;
+    int             i;
+
+    for (i = 0; i < app->max_clients; i++)
+    {
+        if (clients[i].fd == -1)
+            continue;
+
+        state = client_link_state(&clients[i], app, &reason);
+        if (state < worst)
+        {
+            worst = state;
+            worst_reason = reason;
+        }
+    }
+
+    if (worst == LINK_CONGESTED)
+    {
+        bitrate = bitrate * 3 / 4;
+        app->rate_good = 0;
+    }
+    else if (worst == LINK_GOOD && ++app->rate_good >= RATE_UP_INTERVALS)
+    {
+        bitrate += RATE_STEP;
+        worst_reason = "link has spare capacity";
+        app->rate_good = 0;
+    }
+    else if (worst != LINK_GOOD)
+    {
+        app->rate_good = 0;
+    }
+
+    if (bitrate < app->bitrate_min)
+        bitrate = app->bitrate_min;
+    else if (bitrate > app->bitrate_max)
+        bitrate = app->bitrate_max;
+
+    if (bitrate == app->opus_bitrate)
+        return;
+
+    fprintf(stderr, "Bitrate %d -> %d bps (%s)\n", app->opus_bitrate,
+            bitrate, worst_reason);
+    app->opus_bitrate = bitrate;
+    set_encoder_bitrate(encoder, bitrate);
+}
+
+/* Create UDP socket bound to port */
+static int create_udp_socket(int port)
+{
+    struct sockaddr_in addr;
+    int             fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Send encoded audio packet to all clients.
+ *
+ * @param pkt   The packet incl. AUDIO_SEQ_HDR_LEN bytes header. TCP clients
+ *              that do not support session resume get the same packet with
+ *              the short header.
+ * @param len   The packet length.
+ * @return The number of clients the packet was sent or queued to.
+ *
+ * The packet is encoded once and only copied into the send queue of each
+ * client, so the CPU cost per client is small. The packet is also kept in
+ * the history so that it can be sent again to a client resuming its
+ * session.
+ */
+static int send_audio(int udp_fd, const uint8_t * pkt, uint16_t len,
+                      struct client *clients, struct app_data *app)
+{
+    uint8_t         tcp_pkt[AUDIO_MAX_PKT_LEN + 1];
+    uint16_t        tcp_len = len - (AUDIO_SEQ_HDR_LEN - AUDIO_HDR_LEN);
+    struct prof_sample ps;
+    struct client  *c;
+    ssize_t         num;
+    int             sent = 0;
+    int             i;
+
+    memcpy(tcp_pkt, &pkt[AUDIO_SEQ_HDR_LEN - AUDIO_HDR_LEN], tcp_len);
+    audio_pkt_set_header(tcp_pkt, tcp_len, AUDIO_PKT_DATA);
+
+    if (pkt_queue_is_full(&app->history))
+        pkt_queue_drop_oldest(&app->history);
+    pkt_queue_push(&app->history, pkt, len);
+
+    for (i = 0; i < app->max_clients; i++)
+    {
+        c = &clients[i];
+        if (c->fd == -1)
+            continue;
+
+        if (c->udp_active)
+        {
+            prof_begin(&ps);
+            num = sendto(udp_fd, pkt, len, MSG_DONTWAIT,
+                         (struct sockaddr *)&c->udp_addr, sizeof(c->udp_addr));
+            prof_end(PROF_WRITE, &ps);
+
+            if (num == len)
+            {
+                flightrec_event(FR_EV_TX, audio_pkt_type(pkt), udp_fd, len);
+                c->pkts_sent++;
+                c->bytes_sent += len;
+            }
+            else
+            {
+                flightrec_event(FR_EV_DROP, 0, c->fd, 1);
+                c->pkts_dropped++;
+            }
+        }
+        else if ((c->seq_tcp ?
+                  client_queue_audio(c, pkt, len, app->latency_budget) :
+                  client_queue_audio(c, tcp_pkt, tcp_len,
+                                     app->latency_budget)) ||
+                 client_flush(c, app->latency_budget))
+        {
+            fprintf(stderr, "Client too slow or gone (FD=%d)\n", c->fd);
+            client_close(c, app);
+            continue;
+        }
+
+        sent++;
+    }
+
+    return sent;
+}
+
+/* Calculate the client totals for the metrics endpoint */
+static void update_metrics(void *arg)
+{
+    struct app_data *app = arg;
+    struct client_totals *t = &app->totals;
+    int             i;
+
+    *t = app->closed;
+    t->clients = 0;
+    t->udp_clients = 0;
+
+    for (i = 0; i < app->max_clients; i++)
+    {
+        if (app->clients[i].fd == -1)
+            continue;
+
+        client_totals_add(t, &app->clients[i]);
+        t->clients++;
+        t->udp_clients += app->clients[i].udp_active != 0;
+    }
 }
 
 int main(int argc, char **argv)
 {
     int             exit_code = EXIT_FAILURE;
     int             sock_fd;
+    int             udp_fd;
     struct sockaddr_in cli_addr;
     socklen_t       cli_addr_len;
 
-    struct pollfd   poll_fds[2];
-    int             connected;
+    struct pollfd   poll_fds[3 + 2 * MAX_CLIENTS];
+    struct client   clients[MAX_CLIENTS];
+    struct client  *c;
+    int             num_clients;        /* number of connected clients */
+    int             audio_running = 0;
+    int             i;
+    uint16_t        seq = 0;
+    uint64_t        last_rate_update = 0;
 
     audio_t        *audio;
     OpusEncoder    *encoder;
+    OpusDecoder    *decoder = NULL;
     uint64_t        encoded_bytes = 0;
     uint64_t        encoder_errors = 0;
+    uint64_t        decoder_errors = 0;
     int             error;
+    struct metrics  metrics;
+    struct metrics_series series;
+    struct prof_sample ps;
 
 
     struct app_data app = {
         .opus_bitrate = 16000,
         .opus_complexity = 5,
+        .bitrate_min = 0,
+        .bitrate_max = 0,
+        .rate_good = 0,
         .sample_rate = 48000,
         .device_index = -1,
         .network_port = DEFAULT_AUDIO_PORT,
-        .cli_addr = 0,
-    };
-
-    struct xfr_buf  net_in_buf = {
-        .wridx = 0,
-        .write_errors = 0,
-        .valid_pkts = 0,
-        .invalid_pkts = 0,
+        .max_clients = 4,
+        .tx_enabled = 0,
+        .tx_addr = {0},
+        .ctl_port = 0,
+        .latency_budget = 300,
+        .tx_client = NULL,
+        .tx_last = 0,
+        .udp_fd = -1,
+        .metrics_spec = NULL,
+        .series_spec = NULL,
+        .prof_interval = 0,
+        .clients = clients,
     };
 
     parse_options(argc, argv, &app);
+    if (app.prof_interval)
+        prof_init(app.prof_interval);
     fprintf(stderr, "Using network port %d\n", app.network_port);
+    fprintf(stderr, "Max number of clients: %d\n", app.max_clients);
+    fprintf(stderr, "Latency budget: %" PRIu32 " msec\n", app.latency_budget);
+
+    for (i = 0; i < app.max_clients; i++)
+    {
+        if (client_alloc(&clients[i]))
+        {
+            fprintf(stderr, "Error allocating client buffers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memset(app.resume, 0, sizeof(app.resume));
+    memset(&app.closed, 0, sizeof(app.closed));
+    memset(&app.totals, 0, sizeof(app.totals));
+    if (pkt_queue_init(&app.history, AUDIO_HISTORY_LEN, AUDIO_MAX_PKT_LEN + 1))
+    {
+        fprintf(stderr, "Error allocating audio history\n");
+        exit(EXIT_FAILURE);
+    }
 
     /* initialize audio subsystem */
-    audio = audio_init(app.device_index, app.sample_rate, AUDIO_CONF_INPUT);
+    if (app.headless_spec)
+        audio = audio_init_headless(app.headless_spec, app.sample_rate,
+                                    app.tx_enabled ? AUDIO_CONF_DUPLEX :
+                                    AUDIO_CONF_INPUT);
+    else
+        audio = audio_init(app.device_index, app.sample_rate,
+                           app.tx_enabled ? AUDIO_CONF_DUPLEX : AUDIO_CONF_INPUT);
     if (audio == NULL)
         exit(EXIT_FAILURE);
 
@@ -183,48 +1489,179 @@ int main(int argc, char **argv)
     }
     setup_encoder(encoder, &app);
 
+    /* TX audio decoder */
+    if (app.tx_enabled)
+    {
+        decoder = opus_decoder_create(app.sample_rate, 1, &error);
+        if (error != OPUS_OK)
+        {
+            fprintf(stderr, "Error creating opus decoder: %d (%s)\n",
+                    error, opus_strerror(error));
+            opus_encoder_destroy(encoder);
+            audio_close(audio);
+            exit(EXIT_FAILURE);
+        }
+        audio_set_play_threshold(audio, TX_PLAY_THRESHOLD);
+    }
+
     /* setup signal handler */
     if (signal(SIGINT, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGINT\n");
     if (signal(SIGTERM, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGTERM\n");
 
+    /* write errors on closed connections are handled where they occur */
+    signal(SIGPIPE, SIG_IGN);
+
+    flightrec_init("audio_server", SIGUSR1);
+
     /* network socket (listening for connections) */
     sock_fd = create_server_socket(app.network_port);
     poll_fds[0].fd = sock_fd;
     poll_fds[0].events = POLLIN;
 
-    /* network socket to client (when connected)
-     * FIXME: we could use it to check when writing is wont block
-     */
-    poll_fds[1].fd = -1;
+    /* UDP socket for optional UDP transport (same port number) */
+    udp_fd = create_udp_socket(app.network_port);
+    if (udp_fd == -1)
+        fprintf(stderr, "Error creating UDP socket: %d: %s\n", errno,
+                strerror(errno));
+    poll_fds[1].fd = udp_fd;
+    poll_fds[1].events = POLLIN;
+    app.udp_fd = udp_fd;
+
     memset(&cli_addr, 0, sizeof(struct sockaddr_in));
     cli_addr_len = sizeof(cli_addr);
-    connected = 0;
+    num_clients = 0;
+
+    metrics_init(&metrics, "audio_server");
+    metrics_series_init(&series, &metrics);
+    if (app.metrics_spec || app.series_spec)
+    {
+        METRICS_ADD(&metrics, "encoded_bytes_total", METRIC_COUNTER,
+                    "Bytes produced by the Opus encoder.", encoded_bytes);
+        METRICS_ADD(&metrics, "encoder_errors_total", METRIC_COUNTER,
+                    "Opus encoder errors.", encoder_errors);
+        METRICS_ADD(&metrics, "tx_decoder_errors_total", METRIC_COUNTER,
+                    "Opus decoder errors on TX audio.", decoder_errors);
+        METRICS_ADD(&metrics, "bitrate_bps", METRIC_GAUGE,
+                    "Current Opus encoder bitrate.", app.opus_bitrate);
+        METRICS_ADD(&metrics, "packets_sent_total", METRIC_COUNTER,
+                    "Packets sent to clients.", app.totals.pkts_sent);
+        METRICS_ADD(&metrics, "bytes_sent_total", METRIC_COUNTER,
+                    "Bytes sent to clients.", app.totals.bytes_sent);
+        METRICS_ADD(&metrics, "packets_dropped_total", METRIC_COUNTER,
+                    "Audio packets dropped for slow clients.",
+                    app.totals.pkts_dropped);
+        METRICS_ADD(&metrics, "packets_aged_total", METRIC_COUNTER,
+                    "Audio packets dropped for exceeding the latency budget.",
+                    app.totals.pkts_aged);
+        METRICS_ADD(&metrics, "tx_ignored_total", METRIC_COUNTER,
+                    "TX audio packets from clients not allowed to transmit.",
+                    app.totals.tx_ignored);
+        METRICS_ADD(&metrics, "clients", METRIC_GAUGE,
+                    "Connected clients.", app.totals.clients);
+        METRICS_ADD(&metrics, "udp_clients", METRIC_GAUGE,
+                    "Clients receiving audio over UDP.",
+                    app.totals.udp_clients);
+        METRICS_ADD(&metrics, "latency_capture_us", METRIC_GAUGE,
+                    "Smoothed delay from ADC to encoder input.",
+                    app.lat_capture);
+        METRICS_ADD(&metrics, "latency_encode_us", METRIC_GAUGE,
+                    "Smoothed Opus encoding time.", app.lat_encode);
+        audio_register_metrics(audio, &metrics);
+        metrics.update = update_metrics;
+        metrics.update_arg = &app;
+        if (app.metrics_spec && metrics_open(&metrics, app.metrics_spec))
+            goto cleanup;
+        if (app.series_spec && metrics_series_open(&series, app.series_spec))
+            goto cleanup;
+    }
+    poll_fds[2 + 2 * app.max_clients].events = POLLIN;
 
     while (keep_running)
     {
+        /* Audio keeps running while a disconnected client may resume its
+         * session, so that the stream continues where it left off */
+        if (audio_running && num_clients == 0 && !resume_pending(&app))
+        {
+            audio_stop(audio);
+            audio_running = 0;
+            pkt_queue_clear(&app.history);
+        }
 
-        if (poll(poll_fds, 2, 10) < 0)
+        /* Client sockets are at 2 + 2 * i, connections to ic706_server in
+         * mux mode at 3 + 2 * i. Negative file descriptors are ignored. */
+        for (i = 0; i < app.max_clients; i++)
+        {
+            c = &clients[i];
+            if (c->fd != -1 && c->ctl_wanted && c->ctl_fd == -1 &&
+                time_ms() - c->ctl_last_try > 1000)
+                open_ctl_connection(c, app.ctl_port);
+
+            poll_fds[2 + 2 * i].fd = c->fd;
+            poll_fds[2 + 2 * i].events = POLLIN;
+            if (c->fd != -1 && client_has_pending(c))
+                poll_fds[2 + 2 * i].events |= POLLOUT;
+
+            poll_fds[3 + 2 * i].fd = c->fd == -1 ? -1 : c->ctl_fd;
+            poll_fds[3 + 2 * i].events = POLLIN;
+        }
+        poll_fds[2 + 2 * app.max_clients].fd = metrics_fd(&metrics);
+        metrics_series_process(&series, time_ms());
+        prof_process(time_ms());
+
+        if (poll(poll_fds, 3 + 2 * app.max_clients, 10) < 0)
             continue;
 
-        /* service network socket */
-        if (connected && (poll_fds[1].revents & POLLIN))
+        if (poll_fds[2 + 2 * app.max_clients].revents & POLLIN)
+            metrics_process(&metrics);
+
+        for (i = 0; i < app.max_clients; i++)
         {
-            switch (read_data(poll_fds[1].fd, &net_in_buf))
+            c = &clients[i];
+            if (c->fd == -1)
+                continue;
+
+            /* Relay control data first so that it is never queued behind
+             * audio in the send path */
+            if (poll_fds[3 + 2 * i].revents & (POLLIN | POLLHUP))
             {
-            case PKT_TYPE_EOF:
-                fprintf(stderr, "Connection closed (FD=%d)\n", poll_fds[1].fd);
-                close(poll_fds[1].fd);
-                poll_fds[1].fd = -1;
-                poll_fds[1].events = 0;
-                connected = 0;
-                app.cli_addr = 0;
-                audio_stop(audio);
-                break;
+                if (client_relay_ctl(c) < 0)
+                {
+                    fprintf(stderr, "Connection to ic706_server closed\n");
+                    close_ctl_connection(c);
+                }
             }
 
-            net_in_buf.wridx = 0;
+            /* service network socket */
+            if ((poll_fds[2 + 2 * i].revents & (POLLIN | POLLHUP)) &&
+                process_net_input(c, &app, decoder, audio,
+                                  &decoder_errors) == PKT_TYPE_EOF)
+            {
+                client_close(c, &app);
+                num_clients--;
+                continue;
+            }
+
+            if (time_ms() - c->timing_last >= TIMING_INTERVAL_MS)
+                client_queue_timing(c, &app);
+
+            if (client_has_pending(c) &&
+                client_flush(c, app.latency_budget))
+            {
+                client_close(c, &app);
+                num_clients--;
+            }
+        }
+
+        if (poll_fds[1].revents & POLLIN)
+            process_udp_input(udp_fd, clients, app.max_clients);
+
+        if (app.bitrate_max && num_clients &&
+            time_ms() - last_rate_update >= RATE_INTERVAL_MS)
+        {
+            update_bitrate(encoder, clients, &app);
+            last_rate_update = time_ms();
         }
 
         /* check if there are any new connections pending */
@@ -244,45 +1681,49 @@ int main(int argc, char **argv)
             fprintf(stderr, "New connection from %s\n",
                     inet_ntoa(cli_addr.sin_addr));
 
-            if (!connected)
+            for (i = 0; i < app.max_clients; i++)
+                if (clients[i].fd == -1)
+                    break;
+
+            if (i < app.max_clients)
             {
                 fprintf(stderr, "Connection accepted (FD=%d)\n", new);
-                poll_fds[1].fd = new;
-                poll_fds[1].events = POLLIN;
-
-                connected = 1;
-                app.cli_addr = cli_addr.sin_addr.s_addr;
+                client_open(&clients[i], new, &cli_addr);
 
-                audio_start(audio);
-            }
-            else if (app.cli_addr == cli_addr.sin_addr.s_addr)
-            {
-                /* this is the same client reconnecting */
-                fprintf(stderr,
-                        "Client already connected; reconnect (FD= %d -> %d)\n",
-                        poll_fds[1].fd, new);
-                close(poll_fds[1].fd);
-                poll_fds[1].fd = new;
+                num_clients++;
+                if (!audio_running)
+                {
+                    audio_start(audio);
+                    audio_running = 1;
+                }
             }
             else
             {
-                fprintf(stderr, "Connection refused\n");
+                fprintf(stderr, "Connection refused (%d clients)\n",
+                        num_clients);
                 close(new);
             }
         }
 
         /* process available audio data */
-        if (connected)
+        if (audio_running)
         {
 #define AUDIO_FRAMES 1920       // 40 msec: 48000 * 0.04
 #define AUDIO_BUFLEN 3840
             uint8_t         buffer1[AUDIO_BUFLEN];
-            uint8_t         buffer2[AUDIO_BUFLEN + 2];
-            uint16_t        length;
+            uint8_t         buffer2[AUDIO_BUFLEN + AUDIO_SEQ_HDR_LEN];
+            uint32_t        timestamp;
+            uint64_t        start;
+            int             length;
 
             if (audio_frames_available(audio) < AUDIO_FRAMES)
                 continue;
 
+            audio_latency_smooth(&app.lat_capture,
+                                 audio_input_delay_us(audio));
+
+            /* capture timestamp of the first frame we are going to read */
+            timestamp = audio->frames_tot - audio_frames_available(audio);
             length = audio_read_frames(audio, buffer1, AUDIO_FRAMES);
 
             if (length != AUDIO_FRAMES)
@@ -290,37 +1731,40 @@ int main(int argc, char **argv)
                 fprintf(stderr,
                         "Error reading audio (got %d instead of %d frames)\n",
                         length, AUDIO_FRAMES);
+                continue;
             }
-            else
+
+            /* encode audio frame leaving room for the largest header */
+            start = time_us();
+            prof_begin(&ps);
+            length = opus_encode(encoder, (opus_int16 *) buffer1,
+                                 AUDIO_FRAMES, &buffer2[AUDIO_SEQ_HDR_LEN],
+                                 AUDIO_BUFLEN);
+            prof_end(PROF_ENCODE, &ps);
+            audio_latency_smooth(&app.lat_encode, time_us() - start);
+            if (length <= 0)
             {
-                /* encode audio frame (items 0, 1 are reserved for header) */
-                length = opus_encode(encoder, (opus_int16 *) buffer1,
-                                     AUDIO_FRAMES, &buffer2[2], AUDIO_BUFLEN);
-                if (length > 0)
-                {
-                    encoded_bytes += length;
-
-                    /* Add header according to RemoteSDR ICD:
-                     *   byte 1: LSB of buffer length incl header
-                     *   byte 2: 0x80 & 5 bit MSB of buffer length incl. header
-                     */
-                    length += 2;
-                    buffer2[0] = (uint8_t) (length & 0xFF);
-                    buffer2[1] = (uint8_t) (0x80 | ((length >> 8) & 0x1F));
-                    if (write(poll_fds[1].fd, buffer2, length) < 0)
-                        fprintf(stderr,
-                                "Error writing audio to network socket\n");
-                    //else
-                    //    fprintf(stderr, "SENT: %d\n", length);
-                }
-                else
-                {
-                    encoder_errors++;
-                    fprintf(stderr, "Encoder error: %d (%s)\n",
-                            length, opus_strerror(length));
-                }
+                encoder_errors++;
+                fprintf(stderr, "Encoder error: %d (%s)\n",
+                        length, opus_strerror(length));
+                continue;
             }
 
+            encoded_bytes += length;
+
+            length += AUDIO_SEQ_HDR_LEN;
+            audio_pkt_set_header(buffer2, length, AUDIO_PKT_SEQ);
+            buffer2[2] = seq & 0xFF;
+            buffer2[3] = seq >> 8;
+            buffer2[4] = timestamp & 0xFF;
+            buffer2[5] = (timestamp >> 8) & 0xFF;
+            buffer2[6] = (timestamp >> 16) & 0xFF;
+            buffer2[7] = (timestamp >> 24) & 0xFF;
+            seq++;
+
+            send_audio(udp_fd, buffer2, length, clients, &app);
+            for (i = 0, num_clients = 0; i < app.max_clients; i++)
+                num_clients += clients[i].fd != -1;
         }
 
     }
@@ -329,19 +1773,30 @@ int main(int argc, char **argv)
     exit_code = EXIT_SUCCESS;
 
   cleanup:
-    close(poll_fds[0].fd);
-    close(poll_fds[1].fd);
+    close(sock_fd);
+    close(udp_fd);
+    metrics_close(&metrics);
+    metrics_series_close(&series);
+    prof_print();
+    for (i = 0; i < app.max_clients; i++)
+    {
+        if (clients[i].fd != -1)
+            client_close(&clients[i], &app);
+        client_free(&clients[i]);
+    }
+    pkt_queue_free(&app.history);
 
     audio_stop(audio);
     audio_close(audio);
 
     opus_encoder_destroy(encoder);
-
-    //fprintf(stderr, "  Audio bytes: %" PRIu64 "\n", abuf.bytes_read);
-    //fprintf(stderr, "  Average read: %" PRIu64 "\n", abuf.avg_read);
+    if (decoder)
+        opus_decoder_destroy(decoder);
 
     fprintf(stderr, "  Encoded bytes : %" PRIu64 "\n", encoded_bytes);
     fprintf(stderr, "  Encoder errors: %" PRIu64 "\n", encoder_errors);
+    if (app.tx_enabled)
+        fprintf(stderr, "  TX dec. errors: %" PRIu64 "\n", decoder_errors);
 
     exit(exit_code);
 }
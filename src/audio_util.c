@@ -10,8 +10,16 @@
 #include <portaudio.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
+#include "audio_headless.h"
 #include "audio_util.h"
+#include "flightrec.h"
+#include "pack.h"
+#include "prof.h"
+#include "timebase.h"
 
 
 #define SAMPLE_RATE 48000
@@ -24,99 +32,230 @@
 #define PLAYBACK_THRESHOLD (SAMPLE_RATE * FRAME_SIZE) * 0.2
 
 
-int audio_reader_cb(const void *input, void *output, unsigned long frame_cnt,
-                    const PaStreamCallbackTimeInfo * timeInfo,
-                    PaStreamCallbackFlags statusFlags, void *user_data)
+/* Copy captured samples into the input ring buffer */
+static void capture_frames(audio_t * audio, const void *input,
+                           unsigned long frame_cnt)
 {
-    (void)output;
-    (void)timeInfo;
-
-    audio_t        *audio = (audio_t *) user_data;
-    PaStreamCallbackResult result = paContinue;
     unsigned long   byte_cnt = frame_cnt * FRAME_SIZE;
+    unsigned long   count = ring_buffer_count(audio->rb_in);
+    struct prof_sample ps;
 
-    if (byte_cnt + ring_buffer_count(audio->rb) > ring_buffer_size(audio->rb))
+    if (byte_cnt + count > ring_buffer_size(audio->rb_in))
     {
-        audio->overflows++;
+        metric_add(audio->overflows, 1);
+        flightrec_event(FR_EV_OVERFLOW, 0, 0,
+                        byte_cnt + count - ring_buffer_size(audio->rb_in));
     }
+    flightrec_event(FR_EV_AUDIO_LEVEL, 0, 0, count);
 
-    ring_buffer_write(audio->rb, (unsigned char *)input, byte_cnt);
-    audio->frames_tot += frame_cnt;
-
-    if (audio->frames_avg)
-        audio->frames_avg = (audio->frames_avg + frame_cnt) / 2;
-    else
-        audio->frames_avg = frame_cnt;
-
-    if (statusFlags)
-        audio->status_errors++;
-
-    return result;
+    prof_begin(&ps);
+    ring_buffer_write(audio->rb_in, (unsigned char *)input, byte_cnt);
+    prof_end(PROF_CALLBACK, &ps);
 }
 
-
-int audio_writer_cb(const void *input, void *output, unsigned long frame_cnt,
-                    const PaStreamCallbackTimeInfo * timeInfo,
-                    PaStreamCallbackFlags statusFlags, void *user_data)
+/* Copy samples from the output ring buffer to the output.
+ * Returns 1 if samples were played, 0 if silence was played. */
+static int play_frames(audio_t * audio, void *output, unsigned long frame_cnt)
 {
-    (void)input;
-    (void)timeInfo;
-
-    audio_t        *audio = (audio_t *) user_data;
-    PaStreamCallbackResult result = paContinue;
     unsigned long   byte_cnt = frame_cnt * FRAME_SIZE;
     unsigned long   i;
     uint16_t       *out = (uint16_t *) output;
+    struct prof_sample ps;
 
+    flightrec_event(FR_EV_AUDIO_LEVEL, 1, 0, ring_buffer_count(audio->rb_out));
 
     if (audio->player_state == AUDIO_STATE_BUFFERING)
     {
-        if (ring_buffer_count(audio->rb) < PLAYBACK_THRESHOLD)
+        if (ring_buffer_count(audio->rb_out) < audio->play_threshold)
         {
             for (i = 0; i < frame_cnt; i++)
                 out[i] = 0;
 
-            return result;
+            return 0;
         }
         /* there is enough data in buffer to start playback */
         audio->player_state = AUDIO_STATE_PLAYING;
     }
 
 
-    if (byte_cnt > ring_buffer_count(audio->rb))
+    if (byte_cnt > ring_buffer_count(audio->rb_out))
     {
         for (i = 0; i < frame_cnt; i++)
             out[i] = 0;
 
         /* switch back to buffering */
         audio->player_state = AUDIO_STATE_BUFFERING;
-        audio->underflows++;
+        metric_add(audio->underflows, 1);
+        flightrec_event(FR_EV_UNDERFLOW, 0, 0,
+                        ring_buffer_count(audio->rb_out));
+
+        return 0;
     }
-    else
+
+    prof_begin(&ps);
+    ring_buffer_read(audio->rb_out, (unsigned char *)output, byte_cnt);
+    prof_end(PROF_CALLBACK, &ps);
+
+    return 1;
+}
+
+/* Convert a PaTime difference to usec, limited to 0 for negative values */
+static uint32_t patime_to_us(PaTime t)
+{
+    return t > 0 ? (uint32_t) (t * 1.e6) : 0;
+}
+
+/* Record callback timing at the start of the callback; returns the time */
+static uint64_t cb_enter(audio_t * audio, unsigned long frame_cnt,
+                         const PaStreamCallbackTimeInfo * timeInfo)
+{
+    uint64_t        now = time_us();
+
+    if (audio->cb_last)
+        metric_hist_add(&audio->cb_interval, now - audio->cb_last);
+    audio->cb_last = now;
+    metric_hist_add(&audio->cb_frames, frame_cnt);
+
+    if (timeInfo && timeInfo->inputBufferAdcTime > 0)
     {
-        ring_buffer_read(audio->rb, (unsigned char *)output, byte_cnt);
-        audio->frames_tot += frame_cnt;
+        metric_set(audio->adc_delay,
+                   patime_to_us(timeInfo->currentTime -
+                                timeInfo->inputBufferAdcTime));
+        metric_hist_add(&audio->in_latency, audio->adc_delay);
+    }
+    if (timeInfo && timeInfo->outputBufferDacTime > 0)
+    {
+        metric_set(audio->dac_delay,
+                   patime_to_us(timeInfo->outputBufferDacTime -
+                                timeInfo->currentTime));
+        metric_hist_add(&audio->out_latency, audio->dac_delay);
     }
 
-    /* update statistics */
-    if (audio->frames_avg)
-        audio->frames_avg = (audio->frames_avg + frame_cnt) / 2;
-    else
-        audio->frames_avg = frame_cnt;
+    return now;
+}
+
+/* Record the time spent in the callback and the status */
+static void cb_leave(audio_t * audio, uint64_t start,
+                     PaStreamCallbackFlags statusFlags)
+{
+    metric_hist_add(&audio->cb_duration, time_us() - start);
 
     if (statusFlags)
-        audio->status_errors++;
+        metric_add(audio->status_errors, 1);
+}
+
+static void clear_stats(audio_t * audio)
+{
+    audio->frames_tot = 0;
+    audio->status_errors = 0;
+    audio->overflows = 0;
+    audio->underflows = 0;
+    audio->cb_last = 0;
+    audio->adc_delay = 0;
+    audio->dac_delay = 0;
+    metric_hist_clear(&audio->cb_interval);
+    metric_hist_clear(&audio->cb_frames);
+    metric_hist_clear(&audio->cb_duration);
+    metric_hist_clear(&audio->in_latency);
+    metric_hist_clear(&audio->out_latency);
+}
+
+static void print_hist(const char *label, const struct metric_hist *h)
+{
+    if (h->count == 0)
+        return;
+
+    fprintf(stderr, " %-19s %" PRIu32 " / %" PRIu32 " / %" PRIu32 " / %"
+            PRIu32 " / %" PRIu32 "\n", label, h->min,
+            metric_hist_percentile(h, 50), metric_hist_percentile(h, 99),
+            h->max, (uint32_t) (h->sum / h->count));
+}
+
+int audio_reader_cb(const void *input, void *output, unsigned long frame_cnt,
+                    const PaStreamCallbackTimeInfo * timeInfo,
+                    PaStreamCallbackFlags statusFlags, void *user_data)
+{
+    (void)output;
+
+    audio_t        *audio = (audio_t *) user_data;
+    uint64_t        start = cb_enter(audio, frame_cnt, timeInfo);
 
-    return result;
+    capture_frames(audio, input, frame_cnt);
+    metric_add(audio->frames_tot, frame_cnt);
+    cb_leave(audio, start, statusFlags);
+
+    return paContinue;
 }
 
 
+int audio_writer_cb(const void *input, void *output, unsigned long frame_cnt,
+                    const PaStreamCallbackTimeInfo * timeInfo,
+                    PaStreamCallbackFlags statusFlags, void *user_data)
+{
+    (void)input;
+
+    audio_t        *audio = (audio_t *) user_data;
+    uint64_t        start = cb_enter(audio, frame_cnt, timeInfo);
+
+    if (play_frames(audio, output, frame_cnt))
+        metric_add(audio->frames_tot, frame_cnt);
+
+    cb_leave(audio, start, statusFlags);
+
+    return paContinue;
+}
+
+/* Full duplex callback: frames_tot counts the captured frames */
+int audio_duplex_cb(const void *input, void *output, unsigned long frame_cnt,
+                    const PaStreamCallbackTimeInfo * timeInfo,
+                    PaStreamCallbackFlags statusFlags, void *user_data)
+{
+    audio_t        *audio = (audio_t *) user_data;
+    uint64_t        start = cb_enter(audio, frame_cnt, timeInfo);
+
+    capture_frames(audio, input, frame_cnt);
+    play_frames(audio, output, frame_cnt);
+    metric_add(audio->frames_tot, frame_cnt);
+    cb_leave(audio, start, statusFlags);
+
+    return paContinue;
+}
+
+
+static void alloc_buffers(audio_t * audio)
+{
+    if (audio->conf & AUDIO_CONF_INPUT)
+    {
+        audio->rb_in = (ring_buffer_t *) malloc(sizeof(ring_buffer_t));
+        ring_buffer_init(audio->rb_in, BUFFER_SIZE);
+    }
+    if (audio->conf & AUDIO_CONF_OUTPUT)
+    {
+        audio->rb_out = (ring_buffer_t *) malloc(sizeof(ring_buffer_t));
+        ring_buffer_init(audio->rb_out, BUFFER_SIZE);
+    }
+}
+
+static void free_buffers(audio_t * audio)
+{
+    if (audio->rb_in)
+    {
+        ring_buffer_free(audio->rb_in);
+        free(audio->rb_in);
+    }
+    if (audio->rb_out)
+    {
+        ring_buffer_free(audio->rb_out);
+        free(audio->rb_out);
+    }
+}
+
 audio_t        *audio_init(int index, uint32_t sample_rate, uint8_t conf)
 {
     audio_t        *audio;
     PaError         error;
 
-    if ((conf != AUDIO_CONF_INPUT) && (conf != AUDIO_CONF_OUTPUT))
+    if ((conf & AUDIO_CONF_DUPLEX) == 0 || (conf & ~AUDIO_CONF_DUPLEX))
     {
         fprintf(stderr, "%s: conf %d not implemented\n", __func__, conf);
         return NULL;
@@ -134,17 +273,20 @@ audio_t        *audio_init(int index, uint32_t sample_rate, uint8_t conf)
     if (!audio)
         return NULL;
 
-    audio->frames_tot = 0;
-    audio->frames_avg = 0;
-    audio->status_errors = 0;
-    audio->overflows = 0;
-    audio->underflows = 0;
+    clear_stats(audio);
     audio->conf = conf;
     audio->player_state = AUDIO_STATE_STOPPED;
+    audio->play_threshold = PLAYBACK_THRESHOLD;
+    audio->rb_in = NULL;
+    audio->rb_out = NULL;
+    audio->headless = NULL;
 
     if (index < 0)
     {
-        audio->input_param.device = Pa_GetDefaultInputDevice();
+        if (conf & AUDIO_CONF_INPUT)
+            audio->input_param.device = Pa_GetDefaultInputDevice();
+        else
+            audio->input_param.device = Pa_GetDefaultOutputDevice();
         fprintf(stderr, "Audio device not specified. Default is %d\n",
                 audio->input_param.device);
     }
@@ -162,6 +304,12 @@ audio_t        *audio_init(int index, uint32_t sample_rate, uint8_t conf)
     audio->input_param.hostApiSpecificStreamInfo = NULL;
     audio->input_param.suggestedLatency = 0.04f;        //audio->device_info->defaultLowInputLatency;
 
+    /* full duplex uses the same device for output unless the default
+       device was requested */
+    audio->output_param = audio->input_param;
+    if (index < 0 && conf == AUDIO_CONF_DUPLEX)
+        audio->output_param.device = Pa_GetDefaultOutputDevice();
+
     audio->device_info = Pa_GetDeviceInfo(audio->input_param.device);
     fprintf(stderr, "Using audio device no. %d: %s\n",
             audio->input_param.device, audio->device_info->name);
@@ -170,6 +318,7 @@ audio_t        *audio_init(int index, uint32_t sample_rate, uint8_t conf)
     if (sample_rate == 0)
         sample_rate = audio->device_info->defaultSampleRate;
     fprintf(stderr, "Sample rate: %d\n", sample_rate);
+    audio->sample_rate = sample_rate;
 
     fprintf(stderr, "Latencies (LH): %d  %.d\n",
             (int)(1.e3 * audio->device_info->defaultLowInputLatency),
@@ -184,11 +333,18 @@ audio_t        *audio_init(int index, uint32_t sample_rate, uint8_t conf)
         break;
 
     case AUDIO_CONF_OUTPUT:
-        error = Pa_OpenStream(&audio->stream, NULL, &audio->input_param,
+        error = Pa_OpenStream(&audio->stream, NULL, &audio->output_param,
                               sample_rate, paFramesPerBufferUnspecified,
                               paClipOff | paDitherOff, audio_writer_cb, audio);
         break;
 
+    case AUDIO_CONF_DUPLEX:
+        error = Pa_OpenStream(&audio->stream, &audio->input_param,
+                              &audio->output_param,
+                              sample_rate, paFramesPerBufferUnspecified,
+                              paClipOff | paDitherOff, audio_duplex_cb, audio);
+        break;
+
     default:
         /* should never happen */
         fprintf(stderr, "%s: Invalid conf %d\n", __func__, conf);
@@ -205,30 +361,84 @@ audio_t        *audio_init(int index, uint32_t sample_rate, uint8_t conf)
         return NULL;
     }
 
-    /* allocate ring buffer */
-    audio->rb = (ring_buffer_t *) malloc(sizeof(ring_buffer_t));
-    ring_buffer_init(audio->rb, BUFFER_SIZE);
+    alloc_buffers(audio);
 
     fprintf(stderr, "Audio stream opened\n");
 
     return audio;
 }
 
+audio_t        *audio_init_headless(const char *spec, uint32_t sample_rate,
+                                    uint8_t conf)
+{
+    audio_t        *audio;
+    PaStreamCallback *cb;
+
+    switch (conf)
+    {
+    case AUDIO_CONF_INPUT:
+        cb = audio_reader_cb;
+        break;
+    case AUDIO_CONF_OUTPUT:
+        cb = audio_writer_cb;
+        break;
+    case AUDIO_CONF_DUPLEX:
+        cb = audio_duplex_cb;
+        break;
+    default:
+        fprintf(stderr, "%s: conf %d not implemented\n", __func__, conf);
+        return NULL;
+    }
+
+    audio = (audio_t *) calloc(1, sizeof(audio_t));
+    if (!audio)
+        return NULL;
+
+    clear_stats(audio);
+    audio->conf = conf;
+    audio->player_state = AUDIO_STATE_STOPPED;
+    audio->play_threshold = PLAYBACK_THRESHOLD;
+    audio->sample_rate = sample_rate ? sample_rate : SAMPLE_RATE;
+    fprintf(stderr, "Sample rate: %d\n", audio->sample_rate);
+
+    /* the backend waits on the ring buffers so they must exist first */
+    alloc_buffers(audio);
+
+    audio->headless = headless_open(spec, audio->sample_rate,
+                                    conf & AUDIO_CONF_INPUT,
+                                    conf & AUDIO_CONF_OUTPUT, cb, audio,
+                                    audio->rb_in, audio->rb_out);
+    if (audio->headless == NULL)
+    {
+        free_buffers(audio);
+        free(audio);
+        return NULL;
+    }
+
+    return audio;
+}
+
 int audio_close(audio_t * audio)
 {
-    PaError         error;
+    PaError         error = paNoError;
 
-    error = Pa_CloseStream(audio->stream);
-    if (error != paNoError)
-        fprintf(stderr, "Error closing audio stream %d: %s\n",
-                error, Pa_GetErrorText(error));
+    if (audio->headless)
+    {
+        headless_close(audio->headless);
+    }
     else
-        fprintf(stderr, "Stream closed\n");
+    {
+        error = Pa_CloseStream(audio->stream);
+        if (error != paNoError)
+            fprintf(stderr, "Error closing audio stream %d: %s\n",
+                    error, Pa_GetErrorText(error));
+        else
+            fprintf(stderr, "Stream closed\n");
 
-    Pa_Terminate();
+        Pa_Terminate();
+    }
 
-    ring_buffer_free(audio->rb);
-    free(audio->rb);
+    free_buffers(audio);
     free(audio);
 
     return error;
@@ -238,15 +448,17 @@ int audio_start(audio_t * audio)
 {
     PaError         error;
 
-    audio->frames_tot = 0;
-    audio->frames_avg = 0;
-    audio->status_errors = 0;
-    audio->overflows = 0;
-    audio->underflows = 0;
+    clear_stats(audio);
 
-    ring_buffer_clear(audio->rb);
+    if (audio->rb_in)
+        ring_buffer_clear(audio->rb_in);
+    if (audio->rb_out)
+        ring_buffer_clear(audio->rb_out);
 
-    error = Pa_StartStream(audio->stream);
+    if (audio->headless)
+        error = headless_start(audio->headless) ? paInternalError : paNoError;
+    else
+        error = Pa_StartStream(audio->stream);
     if (error != paNoError)
     {
         fprintf(stderr, "Error starting audio stream %d: %s\n",
@@ -265,7 +477,12 @@ int audio_stop(audio_t * audio)
 {
     PaError         error = 0;
 
-    if (Pa_IsStreamActive(audio->stream))
+    if (audio->headless && headless_is_active(audio->headless))
+    {
+        headless_stop(audio->headless);
+        fprintf(stderr, "Audio stream stopped\n");
+    }
+    else if (!audio->headless && Pa_IsStreamActive(audio->stream))
     {
         error = Pa_StopStream(audio->stream);
         if (error != paNoError)
@@ -282,36 +499,181 @@ int audio_stop(audio_t * audio)
     audio->player_state = AUDIO_STATE_STOPPED;
 
     fprintf(stderr, " Audio frames (tot): %" PRIu64 "\n", audio->frames_tot);
-    fprintf(stderr, " Audio frames (avg): %" PRIu32 "\n", audio->frames_avg);
     fprintf(stderr, " Status errors:      %" PRIu32 "\n",
             audio->status_errors);
     fprintf(stderr, " Buffer overflows:   %" PRIu32 "\n", audio->overflows);
     fprintf(stderr, " Buffer underflows:  %" PRIu32 "\n", audio->underflows);
+    fprintf(stderr, " Callback timing     min / 50%% / 99%% / max / avg\n");
+    print_hist("Frames:", &audio->cb_frames);
+    print_hist("Interval (usec):", &audio->cb_interval);
+    print_hist("Duration (usec):", &audio->cb_duration);
+    print_hist("ADC latency (usec):", &audio->in_latency);
+    print_hist("DAC latency (usec):", &audio->out_latency);
 
     return error;
 }
 
+void audio_set_play_threshold(audio_t * audio, uint32_t frames)
+{
+    audio->play_threshold = frames * FRAME_SIZE;
+}
+
+uint32_t audio_input_delay_us(audio_t * audio)
+{
+    uint64_t        frames = audio_frames_available(audio);
+
+    return __atomic_load_n(&audio->adc_delay, __ATOMIC_RELAXED) +
+        frames * 1000000 / audio->sample_rate;
+}
+
+uint32_t audio_output_delay_us(audio_t * audio)
+{
+    uint64_t        frames = ring_buffer_count(audio->rb_out) / FRAME_SIZE;
+
+    return frames * 1000000 / audio->sample_rate;
+}
+
 uint32_t audio_frames_available(audio_t * audio)
 {
-    return ring_buffer_count(audio->rb) / FRAME_SIZE;
+    return ring_buffer_count(audio->rb_in) / FRAME_SIZE;
 }
 
 uint32_t audio_read_frames(audio_t * audio, unsigned char *buffer,
                            uint32_t frames)
 {
-    uint32_t        frames_read = ring_buffer_count(audio->rb) / FRAME_SIZE;
+    uint32_t        frames_read = ring_buffer_count(audio->rb_in) / FRAME_SIZE;
+    struct prof_sample ps;
 
     if (frames_read > frames)
         frames_read = frames;
 
-    ring_buffer_read(audio->rb, buffer, frames_read * FRAME_SIZE);
+    prof_begin(&ps);
+    ring_buffer_read(audio->rb_in, buffer, frames_read * FRAME_SIZE);
+    prof_end(PROF_RING, &ps);
 
     return frames_read;
 }
 
 void audio_write_frames(audio_t * audio, uint8_t * buffer, uint32_t frames)
 {
-    ring_buffer_write(audio->rb, buffer, frames * FRAME_SIZE);
+    struct prof_sample ps;
+
+    prof_begin(&ps);
+    ring_buffer_write(audio->rb_out, buffer, frames * FRAME_SIZE);
+    prof_end(PROF_RING, &ps);
+}
+
+void audio_pkt_set_header(uint8_t * buffer, uint16_t length, uint8_t type)
+{
+    buffer[0] = (uint8_t) (length & 0xFF);
+    buffer[1] = (uint8_t) (type | ((length >> 8) & 0x1F));
+}
+
+uint16_t audio_pkt_length(const uint8_t * buffer)
+{
+    return buffer[0] + ((buffer[1] & 0x1F) << 8);
+}
+
+uint8_t audio_pkt_type(const uint8_t * buffer)
+{
+    return buffer[1] & AUDIO_PKT_TYPE_MASK;
+}
+
+uint32_t audio_get_le32(const uint8_t * buffer)
+{
+    return (uint32_t) get_le(buffer, 4);
+}
+
+void audio_rx_init(struct audio_rx_buf *rx)
+{
+    rx->rdidx = 0;
+    rx->wridx = 0;
+    rx->wakeups = 0;
+    rx->packets = 0;
+    rx->resyncs = 0;
+    rx->max_burst = 0;
+    rx->burst = 0;
+}
+
+int audio_rx_read(int fd, struct audio_rx_buf *rx)
+{
+    struct prof_sample ps;
+    int             num;
+
+    /* move partial packet to the beginning of the buffer */
+    if (rx->rdidx > 0)
+    {
+        rx->wridx -= rx->rdidx;
+        memmove(rx->data, &rx->data[rx->rdidx], rx->wridx);
+        rx->rdidx = 0;
+    }
+
+    prof_begin(&ps);
+    num = recv(fd, &rx->data[rx->wridx], AUDIO_RX_BUFLEN - rx->wridx, 0);
+    prof_end(PROF_READ, &ps);
+    if (num > 0)
+    {
+        rx->wridx += num;
+        rx->wakeups++;
+        rx->burst = 0;
+    }
+
+    return num;
+}
+
+uint8_t        *audio_rx_next(struct audio_rx_buf *rx, uint16_t * length)
+{
+    struct prof_sample ps;
+    uint8_t        *pkt;
+    uint8_t         type;
+
+    prof_begin(&ps);
+    while (rx->wridx - rx->rdidx >= AUDIO_HDR_LEN)
+    {
+        pkt = &rx->data[rx->rdidx];
+        *length = audio_pkt_length(pkt);
+        type = audio_pkt_type(pkt);
+
+        if ((type != AUDIO_PKT_CTRL && type != AUDIO_PKT_DATA &&
+             type != AUDIO_PKT_SEQ && type != AUDIO_PKT_CIV) ||
+            *length <= AUDIO_HDR_LEN)
+        {
+            /* not a valid header; skip one byte and try again */
+            rx->rdidx++;
+            rx->resyncs++;
+            continue;
+        }
+
+        if (*length > rx->wridx - rx->rdidx)
+            break;
+
+        rx->rdidx += *length;
+        rx->packets++;
+        if (++rx->burst > rx->max_burst)
+            rx->max_burst = rx->burst;
+
+        prof_end(PROF_FRAMING, &ps);
+        return pkt;
+    }
+    prof_end(PROF_FRAMING, &ps);
+
+    return NULL;
+}
+
+int audio_relay_civ(int ifd, int ofd)
+{
+    uint8_t         buffer[AUDIO_HDR_LEN + 2048];
+    int             num;
+
+    num = read(ifd, &buffer[AUDIO_HDR_LEN], sizeof(buffer) - AUDIO_HDR_LEN);
+    if (num <= 0)
+        return num;
+
+    audio_pkt_set_header(buffer, num + AUDIO_HDR_LEN, AUDIO_PKT_CIV);
+    if (write(ofd, buffer, num + AUDIO_HDR_LEN) != num + AUDIO_HDR_LEN)
+        return -1;
+
+    return num;
 }
 
 int audio_list_devices(void)
@@ -360,3 +722,47 @@ int audio_list_devices(void)
 
     return num_devices;
 }
+
+void audio_register_metrics(audio_t * audio, struct metrics *m)
+{
+    METRICS_ADD(m, "audio_frames_total", METRIC_COUNTER,
+                "Audio frames captured or played.", audio->frames_tot);
+    METRICS_ADD_HIST(m, "audio_callback_frames",
+                     "Frames per audio callback.", audio->cb_frames);
+    METRICS_ADD_HIST(m, "audio_callback_interval_us",
+                     "Time between audio callbacks.", audio->cb_interval);
+    METRICS_ADD_HIST(m, "audio_callback_duration_us",
+                     "Time spent in the audio callback.", audio->cb_duration);
+    METRICS_ADD_HIST(m, "audio_adc_latency_us",
+                     "Time from audio capture to the callback.",
+                     audio->in_latency);
+    METRICS_ADD_HIST(m, "audio_dac_latency_us",
+                     "Time from the callback to audio output.",
+                     audio->out_latency);
+    METRICS_ADD(m, "audio_status_errors_total", METRIC_COUNTER,
+                "Audio callbacks with status flags set.",
+                audio->status_errors);
+    METRICS_ADD(m, "audio_overflows_total", METRIC_COUNTER,
+                "Captured audio written into a full buffer.",
+                audio->overflows);
+    METRICS_ADD(m, "audio_underflows_total", METRIC_COUNTER,
+                "Audio output requests with not enough buffered audio.",
+                audio->underflows);
+    if (audio->rb_in)
+        METRICS_ADD(m, "audio_input_buffer_bytes", METRIC_GAUGE,
+                    "Captured audio waiting to be encoded.",
+                    audio->rb_in->count);
+    if (audio->rb_out)
+        METRICS_ADD(m, "audio_output_buffer_bytes", METRIC_GAUGE,
+                    "Decoded audio waiting to be played.",
+                    audio->rb_out->count);
+}
+
+void audio_latency_print(const struct audio_latency *lat)
+{
+    fprintf(stderr, "  Latency (msec)  : %.1f total = %.1f capture + %.1f "
+            "encode + %.1f queue + %.1f network + %.1f buffer + %.1f output\n",
+            1.e-3 * lat->total, 1.e-3 * lat->capture, 1.e-3 * lat->encode,
+            1.e-3 * lat->queue, 1.e-3 * lat->network, 1.e-3 * lat->buffer,
+            1.e-3 * lat->output);
+}
@@ -12,6 +12,7 @@
 #include <portaudio.h>
 #include <stdint.h>
 
+#include "metrics.h"
 #include "ring_buffer.h"
 
 /**
@@ -20,9 +21,10 @@
  * @stream          Audio stream handle.
  * @device_info     Audio device info.
  * @input_param     Input parameters.
- * @rb              Ring buffer for storing audio data.
+ * @output_param    Output parameters.
+ * @rb_in           Ring buffer for storing captured audio data.
+ * @rb_out          Ring buffer for storing audio data to be played.
  * @frames_tot      Total number of frames received.
- * @frames_avg      Average number of frames received per period.
  * @status_errors   Status errors received in the callback function.
  * @overflows       Number of times we wrote incoming audio data into a full
  *                  buffer
@@ -30,22 +32,61 @@
  *                  had in the buffer.
  * @conf            Audio configuration flags (input, output duplex).
  * @player_state    Audio player state (stopped, buffering, playing).
+ * @play_threshold  Number of bytes that must be in the output buffer before
+ *                  playback is started.
+ * @cb_last         Time when the previous callback started (usec); 0 before
+ *                  the first callback.
+ * @cb_interval     Time between the start of consecutive callbacks (usec).
+ * @cb_frames       Number of frames per callback.
+ * @cb_duration     Time spent inside the callback (usec).
+ * @in_latency      Time from capture of the first input frame (ADC time)
+ *                  to the start of the callback (usec).
+ * @out_latency     Time from the start of the callback until the first
+ *                  output frame is played (DAC time) (usec).
+ * @sample_rate     The sample rate.
+ * @adc_delay       ADC latency in the last callback (usec).
+ * @dac_delay       DAC latency in the last callback (usec).
+ * @headless        Headless backend used instead of PortAudio; NULL when
+ *                  a sound card is used.
+ *
+ * The callback timing shows where audio jitter comes from: irregular
+ * intervals point at the audio driver or scheduling, long durations at the
+ * callback itself. The latencies are only recorded if the host API
+ * provides the ADC/DAC times.
+ *
+ * The counters are updated by the audio callback using metric_add() so that
+ * they can be read by the metrics endpoint from the main thread.
  */
 struct audio_data {
     PaStream       *stream;
     const PaDeviceInfo *device_info;
     PaStreamParameters input_param;
+    PaStreamParameters output_param;
 
-    ring_buffer_t  *rb;
+    ring_buffer_t  *rb_in;
+    ring_buffer_t  *rb_out;
 
     uint64_t        frames_tot;
-    uint32_t        frames_avg;
     uint32_t        status_errors;
     uint32_t        overflows;
     uint32_t        underflows;
     uint8_t         conf;
 
     uint8_t         player_state;
+    uint32_t        play_threshold;
+
+    uint64_t        cb_last;
+    struct metric_hist cb_interval;
+    struct metric_hist cb_frames;
+    struct metric_hist cb_duration;
+    struct metric_hist in_latency;
+    struct metric_hist out_latency;
+
+    uint32_t        sample_rate;
+    uint32_t        adc_delay;
+    uint32_t        dac_delay;
+
+    struct audio_headless *headless;
 };
 
 typedef struct audio_data audio_t;
@@ -58,6 +99,116 @@ typedef struct audio_data audio_t;
 #define AUDIO_STATE_BUFFERING   0x01
 #define AUDIO_STATE_PLAYING     0x02
 
+/* Audio packets sent over the network start with a 2 byte header according
+ * to the RemoteSDR ICD:
+ *
+ *   byte 0: LSB of packet length incl. header
+ *   byte 1: 3 bit packet type | 5 bit MSB of packet length incl. header
+ *
+ * Packet types:
+ *
+ *   AUDIO_PKT_CTRL     Control item: 2 byte item code followed by parameters.
+ *   AUDIO_PKT_DATA     Opus packet.
+ *   AUDIO_PKT_SEQ      Opus packet preceded by a 2 byte sequence number and
+ *                      a 4 byte capture timestamp (sample count). Used on the
+ *                      UDP transport and on TCP for clients that support
+ *                      session resume.
+ *   AUDIO_PKT_CIV      CI-V data relayed between ic706_server and
+ *                      ic706_client when control and audio share the same
+ *                      connection.
+ *
+ * All multi-byte fields are little endian.
+ */
+#define AUDIO_HDR_LEN       2
+#define AUDIO_SEQ_HDR_LEN   8
+#define AUDIO_MAX_PKT_LEN   0x1FFF
+
+#define AUDIO_PKT_CTRL      0x00
+#define AUDIO_PKT_DATA      0x80
+#define AUDIO_PKT_CIV       0xA0
+#define AUDIO_PKT_SEQ       0xC0
+#define AUDIO_PKT_TYPE_MASK 0xE0
+
+/* Control items */
+#define AUDIO_CI_UDP        0x0001      /* UDP transport; param: 4 byte token */
+#define AUDIO_CI_STATS      0x0002      /* Receiver statistics sent by the
+                                         * client once per second; params:
+                                         * 4 byte packets received, lost,
+                                         * late and output underflows (all
+                                         * counted since connecting) */
+#define AUDIO_CI_SESSION    0x0003      /* Session resume. Client->server:
+                                         * 4 byte token, 1 byte flags (bit 0:
+                                         * next seq is valid), 2 byte next
+                                         * expected seq. Server->client:
+                                         * 4 byte token, 1 byte flags (bit 0:
+                                         * session resumed). Clients sending
+                                         * this get AUDIO_PKT_SEQ on TCP. */
+#define AUDIO_CI_TIMING     0x0004      /* Latency accounting. Server->client
+                                         * once per second: 4 byte capture,
+                                         * encode and queue delay and round
+                                         * trip time (usec, smoothed), and a
+                                         * 4 byte stamp. Client->server: the
+                                         * stamp, echoed at once so that the
+                                         * server can measure the RTT. */
+
+/**
+ * Mouth-to-ear latency by pipeline stage (usec, smoothed).
+ *
+ * @capture  From ADC until the audio is read for encoding: input device and
+ *           input buffer.
+ * @encode   Opus encoding.
+ * @queue    Waiting in the server's send queue.
+ * @network  One way network delay, estimated as half the round trip time.
+ * @buffer   Waiting in the client's playout buffer.
+ * @output   From the output callback to the DAC.
+ *
+ * The server measures the first three stages and sends them to the client
+ * using AUDIO_CI_TIMING; the client measures the rest.
+ */
+struct audio_latency {
+    uint32_t        capture;
+    uint32_t        encode;
+    uint32_t        queue;
+    uint32_t        network;
+    uint32_t        buffer;
+    uint32_t        output;
+    uint32_t        total;
+};
+
+/** Add a sample to a smoothed latency value. */
+static inline void audio_latency_smooth(uint32_t * avg, uint32_t val)
+{
+    if (*avg == 0)
+        *avg = val;
+    else
+        *avg = *avg - (*avg >> 3) + (val >> 3);
+}
+
+/**
+ * Receive buffer used to reassemble audio packets from a stream socket.
+ *
+ * @data        Received data.
+ * @rdidx       Index of the first byte not yet processed.
+ * @wridx       Next available write slot.
+ * @wakeups     Number of reads that returned data.
+ * @packets     Number of complete packets returned.
+ * @resyncs     Number of bytes discarded while searching for a valid header.
+ * @max_burst   Largest number of packets processed after a single read.
+ * @burst       Number of packets processed since the last read.
+ */
+#define AUDIO_RX_BUFLEN     (4 * AUDIO_MAX_PKT_LEN)
+struct audio_rx_buf {
+    uint8_t         data[AUDIO_RX_BUFLEN];
+    int             rdidx;
+    int             wridx;
+
+    uint64_t        wakeups;
+    uint64_t        packets;
+    uint64_t        resyncs;
+    uint32_t        max_burst;
+    uint32_t        burst;
+};
+
 /**
  * Initialize audio backend.
  *
@@ -72,6 +223,21 @@ typedef struct audio_data audio_t;
  */
 audio_t        *audio_init(int index, uint32_t sample_rate, uint8_t conf);
 
+/**
+ * Initialize audio without a sound card.
+ *
+ * @param   spec    Headless backend configuration, e.g. "in=sine:1000",
+ *                  see audio_headless.h.
+ * @param   sample_rate Sample rate. Use 0 for 48 kHz.
+ * @param   conf    Audio configuration, see AUDIO_CONF_xyz.
+ * @return  Pointer to the audio handle or NULL if the spec is invalid.
+ *
+ * The returned handle is used like one from audio_init(); the stream
+ * callback is called by the headless backend instead of PortAudio.
+ */
+audio_t        *audio_init_headless(const char *spec, uint32_t sample_rate,
+                                    uint8_t conf);
+
 /**
  * Close audio stream and terminate portaudio session.
  *
@@ -96,6 +262,40 @@ int             audio_start(audio_t * audio);
  */
 int             audio_stop(audio_t * audio);
 
+/**
+ * Set playback threshold.
+ *
+ * @param audio  The audio handle.
+ * @param frames The number of frames that must be buffered before playback
+ *               is (re)started.
+ *
+ * The default threshold is 200 ms, which is suitable for receiving audio
+ * over a network. Applications that need lower latency, e.g. transmit audio
+ * going to the radio, can use a lower threshold.
+ */
+void            audio_set_play_threshold(audio_t * audio, uint32_t frames);
+
+/**
+ * Estimate how long the oldest frame in the input buffer has been waiting.
+ *
+ * @param audio Pointer to the audio handle.
+ * @return The time since the oldest frame was captured (usec).
+ *
+ * This is the capture latency of audio read from the buffer now: the ADC
+ * latency reported to the callback plus the time spent in the buffer. It
+ * may be up to one callback period too high.
+ */
+uint32_t        audio_input_delay_us(audio_t * audio);
+
+/**
+ * Get the time until audio written to the output buffer now is played.
+ *
+ * @param audio Pointer to the audio handle.
+ * @return The duration of the buffered output audio (usec), not including
+ *         the DAC latency (see audio_t.dac_delay).
+ */
+uint32_t        audio_output_delay_us(audio_t * audio);
+
 /**
  * Get number of audio frames available for read.
  *
@@ -128,6 +328,69 @@ uint32_t        audio_read_frames(audio_t * audio, unsigned char *buffer,
 void            audio_write_frames(audio_t * audio, uint8_t * buffer,
                                    uint32_t frames);
 
+/**
+ * Write audio packet header.
+ *
+ * @param buffer Pointer to the start of the packet.
+ * @param length The packet length including the header.
+ * @param type   The packet type, see AUDIO_PKT_xyz.
+ */
+void            audio_pkt_set_header(uint8_t * buffer, uint16_t length,
+                                     uint8_t type);
+
+/** Get the packet length incl. header from an audio packet header. */
+uint16_t        audio_pkt_length(const uint8_t * buffer);
+
+/** Get the packet type from an audio packet header. */
+uint8_t         audio_pkt_type(const uint8_t * buffer);
+
+/** Get a little endian 32 bit field from an audio packet. */
+uint32_t        audio_get_le32(const uint8_t * buffer);
+
+/** Reset audio receive buffer including statistics. */
+void            audio_rx_init(struct audio_rx_buf *rx);
+
+/**
+ * Read available data into receive buffer.
+ *
+ * @param  fd  The file descriptor of the stream socket.
+ * @param  rx  The receive buffer.
+ * @return The number of bytes read, 0 on EOF or -1 if an error occurred.
+ *
+ * All data available in the socket (up to the free space in the buffer) is
+ * read using a single recv() call. Use audio_rx_next() to get the complete
+ * packets afterwards.
+ */
+int             audio_rx_read(int fd, struct audio_rx_buf *rx);
+
+/**
+ * Get next complete packet from receive buffer.
+ *
+ * @param  rx      The receive buffer.
+ * @param  length  Set to the length of the packet incl. header.
+ * @return Pointer to the packet or NULL if there are no more complete
+ *         packets in the buffer.
+ *
+ * The returned pointer is valid until the next call to audio_rx_read().
+ * Invalid headers are skipped one byte at a time until a valid header is
+ * found. Partial packets are kept in the buffer and completed by
+ * subsequent reads.
+ */
+uint8_t        *audio_rx_next(struct audio_rx_buf *rx, uint16_t * length);
+
+/**
+ * Relay CI-V data from a control connection to the audio connection.
+ *
+ * @param  ifd  The control connection (ic706_server or ic706_client side).
+ * @param  ofd  The multiplexed audio connection.
+ * @return The number of bytes relayed, 0 on EOF or -1 if an error occurred.
+ *
+ * The available data is read with a single read() and sent as one
+ * AUDIO_PKT_CIV packet. The CI-V byte stream is forwarded as is; framing
+ * is left to the ic706 programs on each side.
+ */
+int             audio_relay_civ(int ifd, int ofd);
+
 /**
  * List available audio devices.
  * 
@@ -138,4 +401,15 @@ void            audio_write_frames(audio_t * audio, uint8_t * buffer,
  */
 int             audio_list_devices(void);
 
+/**
+ * Register the audio counters and buffer levels with a metrics registry.
+ *
+ * @param audio Pointer to the audio handle.
+ * @param m     The metrics registry.
+ */
+void            audio_register_metrics(audio_t * audio, struct metrics *m);
+
+/** Print latency breakdown. */
+void            audio_latency_print(const struct audio_latency *lat);
+
 #endif
@@ -0,0 +1,101 @@
+/*
+ * Helpers for the benchmark programs.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "timebase.h"
+
+/**
+ * @file
+ * CSV output and options shared by the bench_* programs built by
+ * 'make bench'. The cases are timed using time_ns(), see timebase.h.
+ *
+ * Every benchmark prints one CSV line per case to stdout:
+ *
+ *   bench,case,param,iterations,ns_per_op,mb_per_s
+ *
+ * @param   identifies the variant, e.g. the frame size or the bitrate.
+ * @mb_per_s is 0 when the case does not process a byte stream. Progress
+ * and errors go to stderr, so the output can be appended to a file and
+ * compared between builds and hardware.
+ */
+
+#define BENCH_CSV_HEADER "bench,case,param,iterations,ns_per_op,mb_per_s\n"
+
+/** Number of iterations; may be changed using bench_options(). */
+static uint64_t bench_iterations = 100000;
+
+/**
+ * Print the result of a case.
+ *
+ * @param bench      Name of the benchmark program.
+ * @param name       Name of the case.
+ * @param param      Variant of the case.
+ * @param iterations Number of operations timed.
+ * @param ns         Total time (nsec).
+ * @param bytes      Bytes processed per operation; 0 if not applicable.
+ */
+static inline void bench_report(const char *bench, const char *name,
+                                const char *param, uint64_t iterations,
+                                uint64_t ns, uint64_t bytes)
+{
+    double          per_op = (double)ns / iterations;
+
+    printf("%s,%s,%s,%" PRIu64 ",%.1f,%.1f\n", bench, name, param,
+           iterations, per_op, bytes ? 1.e3 * bytes / per_op : 0.0);
+    fflush(stdout);
+}
+
+/**
+ * Parse the options common to all benchmarks.
+ *
+ *   -n    Number of iterations per case.
+ *   -H    Do not print the CSV header, e.g. when appending to a file.
+ *   -h    Help.
+ */
+static inline void bench_options(int argc, char **argv, const char *help)
+{
+    int             header = 1;
+    int             option;
+
+    while ((option = getopt(argc, argv, "n:Hh")) != -1)
+    {
+        switch (option)
+        {
+        case 'n':
+            bench_iterations = strtoull(optarg, NULL, 10);
+            if (bench_iterations == 0)
+                bench_iterations = 1;
+            break;
+
+        case 'H':
+            header = 0;
+            break;
+
+        case 'h':
+        default:
+            fprintf(stderr, "%s\n Options:\n\n"
+                    "  -n    Number of iterations per case (default %"
+                    PRIu64 ").\n"
+                    "  -H    Do not print the CSV header.\n"
+                    "  -h    This help message.\n\n", help,
+                    bench_iterations);
+            exit(option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (header)
+        printf(BENCH_CSV_HEADER);
+}
+
+#endif
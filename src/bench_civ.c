@@ -0,0 +1,122 @@
+/*
+ * CI-V frame parsing benchmark.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "common.h"
+
+static const char help_string[] =
+    "\n Usage: bench_civ [options]\n\n"
+    " Feed front panel frames through a socket pair into read_data(), which\n"
+    " is how ic706_server and ic706_client read the UART and the network.\n"
+    " One operation is one write of the frame(s) plus the read_data() calls\n"
+    " needed to collect them, so the cost includes the system calls.\n";
+
+/* Write data and read it back using read_data() in one or more parts */
+static int run_case(int fds[2], const uint8_t * frame, int len, int parts,
+                    struct xfr_buf *buf)
+{
+    int             part = len / parts;
+    int             ofs = 0;
+    int             type = PKT_TYPE_INCOMPLETE;
+
+    buf->wridx = 0;
+    buf->pktlen = 0;
+    while (ofs < len)
+    {
+        if (ofs + part > len || parts == 1)
+            part = len - ofs;
+        if (write(fds[0], &frame[ofs], part) != part)
+            return -1;
+        type = read_data(fds[1], buf);
+        ofs += part;
+    }
+
+    /* the other frames of a burst are split off without reading */
+    while (packet_pending(buf))
+        read_data(fds[1], buf);
+
+    return type;
+}
+
+static void bench_frame(int fds[2], const char *name, const uint8_t * frame,
+                        int len, int parts)
+{
+    struct xfr_buf  buf;
+    char            param[16];
+    uint64_t        start, i;
+
+    memset(&buf, 0, sizeof(buf));
+    if (run_case(fds, frame, len, parts, &buf) == PKT_TYPE_INCOMPLETE)
+    {
+        fprintf(stderr, "%s: frame not recognized\n", name);
+        return;
+    }
+
+    start = time_ns();
+    for (i = 0; i < bench_iterations; i++)
+        run_case(fds, frame, len, parts, &buf);
+
+    snprintf(param, sizeof(param), "%d_bytes/%d", len, parts);
+    bench_report("civ", name, param, bench_iterations,
+                 time_ns() - start, len);
+}
+
+int main(int argc, char **argv)
+{
+    /* PTT pressed; the shortest panel frame */
+    static const uint8_t ptt_frame[] = { 0xFE, PKT_TYPE_PTT, 0x01, 0xFD };
+
+    /* tuning knob step */
+    static const uint8_t tune_frame[] = { 0xFE, PKT_TYPE_TUNE, 0x01, 0xFD };
+
+    /* LCD update from the radio, which makes up most of the traffic */
+    static const uint8_t lcd_frame[] = {
+        0xFE, PKT_TYPE_LCD, 0x00, 0x14, 0x07, 0x05, 0x00, 0x00, 0x21, 0x30,
+        0x02, 0x00, 0x10, 0x00, 0x00, 0x08, 0x00, 0x40, 0x00, 0x00, 0x01,
+        0x00, 0x00, 0xFD
+    };
+    uint8_t         burst[8 * (sizeof(lcd_frame) + sizeof(tune_frame))];
+    int             fds[2];
+    int             i, len;
+
+    bench_options(argc, argv, help_string);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+        perror("socketpair");
+        return EXIT_FAILURE;
+    }
+
+    /* LCD updates and knob steps interleaved, as while tuning */
+    for (i = 0, len = 0; i < 8; i++)
+    {
+        memcpy(&burst[len], lcd_frame, sizeof(lcd_frame));
+        len += sizeof(lcd_frame);
+        memcpy(&burst[len], tune_frame, sizeof(tune_frame));
+        len += sizeof(tune_frame);
+    }
+
+    bench_frame(fds, "read_data", ptt_frame, sizeof(ptt_frame), 1);
+    bench_frame(fds, "read_data", lcd_frame, sizeof(lcd_frame), 1);
+
+    /* frame arriving in pieces, as from a UART at 19200 baud */
+    bench_frame(fds, "read_data_split", lcd_frame, sizeof(lcd_frame), 2);
+    bench_frame(fds, "read_data_split", lcd_frame, sizeof(lcd_frame), 4);
+
+    /* back to back frames collected by a single read */
+    bench_frame(fds, "read_data_burst", burst, len, 1);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+/*
+ * Opus encoder and decoder benchmark.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#include <math.h>
+#include <opus.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#define SAMPLE_RATE     48000
+#define MAX_FRAMES      2880            /* 60 msec */
+#define SIGNAL_FRAMES   (SAMPLE_RATE * 2)       /* 2 sec of test signal */
+
+static const int bitrates[] = { 8000, 16000, 32000, 64000 };
+static const int complexities[] = { 0, 2, 5, 8, 10 };
+static const int frame_sizes[] = { 960, 1920 };        /* 20 and 40 msec */
+
+static const char help_string[] =
+    "\n Usage: bench_opus [options]\n\n"
+    " Encode and decode a synthetic voice band signal with the settings\n"
+    " used by audio_server (VOIP application, mono, 48 kHz) for a range of\n"
+    " complexities, bitrates and frame sizes. One operation is one frame;\n"
+    " ns_per_op divided by the frame duration gives the CPU load.\n";
+
+/* Tones, a slow vibrato and some noise; roughly as hard to code as SSB */
+static void make_signal(opus_int16 * pcm, int num)
+{
+    uint32_t        rnd = 1;
+    double          t;
+    int             i;
+
+    for (i = 0; i < num; i++)
+    {
+        t = (double)i / SAMPLE_RATE;
+        rnd = rnd * 1103515245 + 12345;
+        pcm[i] = 6000 * sin(2 * M_PI * (700 + 50 * sin(2 * M_PI * 3 * t)) * t)
+            + 3000 * sin(2 * M_PI * 1900 * t)
+            + (int16_t) (rnd >> 16) / 16;
+    }
+}
+
+static void bench_codec(const opus_int16 * pcm, int frames, int complexity,
+                        int bitrate)
+{
+    OpusEncoder    *encoder;
+    OpusDecoder    *decoder;
+    opus_int16      out[MAX_FRAMES];
+    unsigned char   packet[4000];
+    char            param[48];
+    uint64_t        enc_ns = 0, dec_ns = 0, bytes = 0, start, i;
+    int             ofs = 0;
+    int             len;
+    int             error;
+
+    encoder = opus_encoder_create(SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP,
+                                  &error);
+    if (error != OPUS_OK)
+    {
+        fprintf(stderr, "Error creating encoder: %s\n", opus_strerror(error));
+        return;
+    }
+    decoder = opus_decoder_create(SAMPLE_RATE, 1, &error);
+    if (error != OPUS_OK)
+    {
+        fprintf(stderr, "Error creating decoder: %s\n", opus_strerror(error));
+        opus_encoder_destroy(encoder);
+        return;
+    }
+
+    opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(complexity));
+    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(bitrate));
+
+    for (i = 0; i < bench_iterations; i++)
+    {
+        if (ofs + frames > SIGNAL_FRAMES)
+            ofs = 0;
+
+        start = time_ns();
+        len = opus_encode(encoder, &pcm[ofs], frames, packet, sizeof(packet));
+        enc_ns += time_ns() - start;
+        if (len <= 0)
+        {
+            fprintf(stderr, "Encoder error: %s\n", opus_strerror(len));
+            break;
+        }
+        bytes += len;
+
+        start = time_ns();
+        len = opus_decode(decoder, packet, len, out, MAX_FRAMES, 0);
+        dec_ns += time_ns() - start;
+        if (len <= 0)
+        {
+            fprintf(stderr, "Decoder error: %s\n", opus_strerror(len));
+            break;
+        }
+
+        ofs += frames;
+    }
+
+    if (i == bench_iterations)
+    {
+        snprintf(param, sizeof(param), "c%d/%dbps/%dms", complexity, bitrate,
+                 frames * 1000 / SAMPLE_RATE);
+        bench_report("opus", "encode", param, i, enc_ns, 2 * frames);
+        bench_report("opus", "decode", param, i, dec_ns, 2 * frames);
+        fprintf(stderr, "%s: %.1f bytes per frame\n", param,
+                (double)bytes / i);
+    }
+
+    opus_decoder_destroy(decoder);
+    opus_encoder_destroy(encoder);
+}
+
+int main(int argc, char **argv)
+{
+    opus_int16     *pcm;
+    unsigned int    b, c, f;
+
+    /* each case takes a while; the default is 10 or 20 sec of audio */
+    bench_iterations = 500;
+    bench_options(argc, argv, help_string);
+
+    pcm = malloc(SIGNAL_FRAMES * sizeof(opus_int16));
+    make_signal(pcm, SIGNAL_FRAMES);
+
+    for (f = 0; f < sizeof(frame_sizes) / sizeof(frame_sizes[0]); f++)
+        for (c = 0; c < sizeof(complexities) / sizeof(complexities[0]); c++)
+            for (b = 0; b < sizeof(bitrates) / sizeof(bitrates[0]); b++)
+                bench_codec(pcm, frame_sizes[f], complexities[c],
+                            bitrates[b]);
+
+    free(pcm);
+
+    return EXIT_SUCCESS;
+}
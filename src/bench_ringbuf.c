@@ -0,0 +1,81 @@
+/*
+ * Ring buffer benchmark.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "ring_buffer.h"
+
+#define SAMPLE_RATE     48000
+#define FRAME_SIZE      2               /* 16 bit mono */
+#define BUFFER_SIZE     (SAMPLE_RATE * FRAME_SIZE * 48 / 100)   /* as audio_util */
+
+/* Opus frame durations in 1/10 msec */
+static const int durations[] = { 25, 50, 100, 200, 400, 600 };
+
+static const char help_string[] =
+    "\n Usage: bench_ringbuf [options]\n\n"
+    " Write and read audio frames through a ring buffer of the size used by\n"
+    " audio_util for every Opus frame duration. One operation is one write\n"
+    " followed by one read of the same size.\n";
+
+int main(int argc, char **argv)
+{
+    ring_buffer_t   rb;
+    unsigned char  *frame;
+    char            param[24];
+    uint64_t        start, i;
+    uint32_t        len;
+    unsigned int    d;
+
+    bench_options(argc, argv, help_string);
+
+    /* large enough to fill half the buffer at once */
+    frame = malloc(BUFFER_SIZE);
+    for (i = 0; i < BUFFER_SIZE; i++)
+        frame[i] = i;
+
+    ring_buffer_init(&rb, BUFFER_SIZE);
+
+    for (d = 0; d < sizeof(durations) / sizeof(durations[0]); d++)
+    {
+        len = SAMPLE_RATE * FRAME_SIZE * durations[d] / 10000;
+        snprintf(param, sizeof(param), "%d.%d_ms", durations[d] / 10,
+                 durations[d] % 10);
+
+        /* a half full buffer as in steady state; the sizes do not divide
+         * the buffer size, so the copies wrap around at varying offsets */
+        ring_buffer_clear(&rb);
+        ring_buffer_write(&rb, frame, BUFFER_SIZE / 2);
+
+        start = time_ns();
+        for (i = 0; i < bench_iterations; i++)
+        {
+            ring_buffer_write(&rb, frame, len);
+            ring_buffer_read(&rb, frame, len);
+        }
+        bench_report("ringbuf", "write_read", param, bench_iterations,
+                     time_ns() - start, 2 * len);
+
+        /* writes only, as the capture callback does; the buffer is
+         * emptied when it would overflow */
+        start = time_ns();
+        for (i = 0; i < bench_iterations; i++)
+        {
+            if (rb.count + len > rb.size)
+                ring_buffer_clear(&rb);
+            ring_buffer_write(&rb, frame, len);
+        }
+        bench_report("ringbuf", "write", param, bench_iterations,
+                     time_ns() - start, len);
+    }
+
+    ring_buffer_free(&rb);
+    free(frame);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,175 @@
+/*
+ * CI-V traffic capture files.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "civ_capture.h"
+#include "pack.h"
+
+static const char magic[6] = { 'C', 'I', 'V', 'C', 'A', 'P' };
+
+int civ_capture_create(struct civ_capture *cap, const char *path,
+                       uint64_t now)
+{
+    uint8_t         hdr[CIV_CAP_HDR_LEN];
+
+    cap->fp = fopen(path, "wb");
+    if (cap->fp == NULL)
+    {
+        fprintf(stderr, "Error creating %s: %d: %s\n", path, errno,
+                strerror(errno));
+        return -1;
+    }
+
+    /* large buffer; the gateway must not wait for the disk */
+    setvbuf(cap->fp, NULL, _IOFBF, 64 * 1024);
+
+    memcpy(hdr, magic, sizeof(magic));
+    hdr[6] = CIV_CAP_VERSION;
+    hdr[7] = 0;
+    put_le(&hdr[8], now, 8);
+
+    cap->start = now;
+    cap->last = now;
+    cap->frames = 0;
+    cap->bytes = 0;
+
+    return fwrite(hdr, sizeof(hdr), 1, cap->fp) == 1 ? 0 : -1;
+}
+
+/* Write one record */
+static int write_record(struct civ_capture *cap, uint32_t delta, int dir,
+                        const uint8_t * frame, int len)
+{
+    uint8_t         hdr[CIV_CAP_REC_LEN];
+
+    put_le(hdr, delta, 4);
+    hdr[4] = dir;
+    put_le(&hdr[5], len, 2);
+
+    if (fwrite(hdr, sizeof(hdr), 1, cap->fp) != 1 ||
+        (len && fwrite(frame, len, 1, cap->fp) != 1))
+        return -1;
+
+    return 0;
+}
+
+int civ_capture_write(struct civ_capture *cap, int dir, const uint8_t * data,
+                      int len, uint64_t now)
+{
+    int             start = 0;
+    int             i;
+
+    if (cap->fp == NULL)
+        return 0;
+
+    /* the clock may have been stepped back */
+    if (now < cap->last)
+        now = cap->last;
+
+    while (now - cap->last > CIV_CAP_MAX_DELTA)
+    {
+        if (write_record(cap, CIV_CAP_MAX_DELTA, dir, NULL, 0))
+            return -1;
+        cap->last += CIV_CAP_MAX_DELTA;
+    }
+
+    for (i = 0; i < len; i++)
+    {
+        if (data[i] != 0xFD && i != len - 1)
+            continue;
+
+        /* frames read together get the same time */
+        if (write_record(cap, now - cap->last, dir, &data[start],
+                         i - start + 1))
+            return -1;
+
+        cap->last = now;
+        cap->frames++;
+        cap->bytes += i - start + 1;
+        start = i + 1;
+    }
+
+    return 0;
+}
+
+void civ_capture_flush(struct civ_capture *cap)
+{
+    if (cap->fp)
+        fflush(cap->fp);
+}
+
+int civ_capture_open(struct civ_capture *cap, const char *path)
+{
+    uint8_t         hdr[CIV_CAP_HDR_LEN];
+
+    cap->fp = fopen(path, "rb");
+    if (cap->fp == NULL)
+    {
+        fprintf(stderr, "Error opening %s: %d: %s\n", path, errno,
+                strerror(errno));
+        return -1;
+    }
+
+    if (fread(hdr, sizeof(hdr), 1, cap->fp) != 1 ||
+        memcmp(hdr, magic, sizeof(magic)) || hdr[6] != CIV_CAP_VERSION)
+    {
+        fprintf(stderr, "%s is not a CI-V capture file\n", path);
+        fclose(cap->fp);
+        cap->fp = NULL;
+        return -1;
+    }
+
+    cap->start = get_le(&hdr[8], 8);
+    cap->last = cap->start;
+    cap->frames = 0;
+    cap->bytes = 0;
+
+    return 0;
+}
+
+int civ_capture_read(struct civ_capture *cap, int *dir, uint8_t * frame,
+                     int size, uint64_t * time)
+{
+    uint8_t         hdr[CIV_CAP_REC_LEN];
+    int             len;
+
+    do
+    {
+        if (fread(hdr, sizeof(hdr), 1, cap->fp) != 1)
+            return 0;
+
+        len = get_le(&hdr[5], 2);
+        if (len > size || (len && fread(frame, len, 1, cap->fp) != 1))
+            return -1;
+
+        cap->last += get_le(hdr, 4);
+    }
+    while (len == 0);           /* skip gap records */
+
+    *dir = hdr[4];
+    *time = cap->last;
+    cap->frames++;
+    cap->bytes += len;
+
+    return len;
+}
+
+void civ_capture_rewind(struct civ_capture *cap)
+{
+    fseek(cap->fp, CIV_CAP_HDR_LEN, SEEK_SET);
+    cap->last = cap->start;
+}
+
+void civ_capture_close(struct civ_capture *cap)
+{
+    if (cap->fp)
+        fclose(cap->fp);
+    cap->fp = NULL;
+}
@@ -0,0 +1,117 @@
+/*
+ * CI-V traffic capture files.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __CIV_CAPTURE_H__
+#define __CIV_CAPTURE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @file
+ * Binary capture of the frames exchanged between radio and panel.
+ *
+ * A capture file starts with a 16 byte header:
+ *
+ *   "CIVCAP" + version (1 byte) + 0 (1 byte) + start time (8 bytes, usec
+ *   since the epoch, little endian)
+ *
+ * followed by one record per frame:
+ *
+ *   delta (4 bytes) + direction (1 byte) + length (2 bytes) + frame
+ *
+ * where delta is the time since the previous record in usec and all
+ * numbers are little endian. Gaps longer than CIV_CAP_MAX_DELTA are
+ * written as empty records. The 7 byte record header keeps a busy hour of
+ * traffic in a few MB.
+ */
+
+#define CIV_CAP_VERSION     1
+#define CIV_CAP_HDR_LEN     16
+#define CIV_CAP_REC_LEN     7
+#define CIV_CAP_MAX_DELTA   0xFFFFFFFF
+
+/* Direction of a frame */
+#define CIV_DIR_RADIO       0   /* sent by the radio to the panel */
+#define CIV_DIR_PANEL       1   /* sent by the panel to the radio */
+
+/**
+ * Capture file.
+ *
+ * @fp      The file.
+ * @start   Time of the first record (usec since the epoch).
+ * @last    Time of the last record.
+ * @frames  Number of frames written or read.
+ * @bytes   Number of frame bytes written or read.
+ */
+struct civ_capture {
+    FILE           *fp;
+    uint64_t        start;
+    uint64_t        last;
+    uint64_t        frames;
+    uint64_t        bytes;
+};
+
+/**
+ * Create a capture file.
+ *
+ * @param cap   The capture handle.
+ * @param path  The file to create; existing files are overwritten.
+ * @param now   The current time (usec since the epoch).
+ * @return 0 if OK, -1 if an error occurred.
+ */
+int             civ_capture_create(struct civ_capture *cap, const char *path,
+                                   uint64_t now);
+
+/**
+ * Write the frames in a buffer to a capture file.
+ *
+ * @param cap   The capture handle.
+ * @param dir   CIV_DIR_RADIO or CIV_DIR_PANEL.
+ * @param data  The data, one or more frames.
+ * @param len   The number of bytes in the buffer.
+ * @param now   The time the data was received (usec since the epoch).
+ * @return 0 if OK, -1 if an error occurred.
+ *
+ * The data is split into frames at each 0xFD, so that frames that were
+ * read together get a record each. Writes are buffered; the data may not
+ * be on disk until civ_capture_close() or civ_capture_flush() is called.
+ */
+int             civ_capture_write(struct civ_capture *cap, int dir,
+                                  const uint8_t * data, int len,
+                                  uint64_t now);
+
+/** Write buffered records to the file. */
+void            civ_capture_flush(struct civ_capture *cap);
+
+/**
+ * Open a capture file for reading.
+ *
+ * @return 0 if OK, -1 if the file can not be opened or is not a capture.
+ */
+int             civ_capture_open(struct civ_capture *cap, const char *path);
+
+/**
+ * Read the next frame from a capture file.
+ *
+ * @param cap   The capture handle.
+ * @param dir   Set to the direction of the frame.
+ * @param frame Buffer for the frame.
+ * @param size  The size of the buffer.
+ * @param time  Set to the time of the frame (usec since the epoch).
+ * @return The length of the frame, 0 at the end of the file or -1 if the
+ *         file is damaged.
+ */
+int             civ_capture_read(struct civ_capture *cap, int *dir,
+                                 uint8_t * frame, int size, uint64_t * time);
+
+/** Go back to the first frame. */
+void            civ_capture_rewind(struct civ_capture *cap);
+
+/** Close a capture file. */
+void            civ_capture_close(struct civ_capture *cap);
+
+#endif
@@ -0,0 +1,352 @@
+/*
+ * Replay CI-V traffic recorded by serial_gateway.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>           // PRIu64
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "civ_capture.h"
+#include "common.h"
+#include "test_util.h"
+
+#define DIR_ALL     -1
+
+static int      keep_running = 1;
+
+static void signal_handler(int signo)
+{
+    (void)signo;
+    keep_running = 0;
+}
+
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: civ_replay [options] <capture file>\n"
+        "\n Possible options are:\n"
+        "\n"
+        "  -u    Write the frames to a UART, e.g. /dev/ttyO1. Use 'pty' to\n"
+        "        create a pseudo-terminal; its name is printed so that a\n"
+        "        daemon can be started on it.\n"
+        "  -s    Write the frames to a TCP server, e.g. 127.0.0.1:42000\n"
+        "        for ic706_server.\n"
+        "  -d    Frames to replay: radio, panel or all (default). Use\n"
+        "        radio to stand in for the radio, panel for the panel.\n"
+        "  -x    Speed: 1 is real time (default), 10 is ten times faster\n"
+        "        and 0 is as fast as possible.\n"
+        "  -n    Number of times to play the capture; 0 for forever\n"
+        "        (default 1).\n"
+        "  -w    Seconds to wait before starting (default 2 with -u pty,\n"
+        "        otherwise 0).\n"
+        "  -v    Print the frames as they are sent.\n"
+        "  -h    This help message.\n\n"
+        " Without -u and -s the frames are printed.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+static void print_frame(uint64_t time, int dir, const uint8_t * frame,
+                        int len)
+{
+    int             i;
+
+    printf("%12.6f %s", 1.e-6 * time,
+           dir == CIV_DIR_RADIO ? "radio->panel" : "panel->radio");
+    for (i = 0; i < len; i++)
+        printf(" %02X", frame[i]);
+    printf("\n");
+}
+
+/* Create a pseudo-terminal and return the master */
+static int open_pty(void)
+{
+    char            path[64];
+    int             slave;
+    int             fd;
+
+    /* the slave stays open so that the master does not get EIO when the
+     * daemon closes it; it is closed when we exit */
+    fd = test_open_pty(path, sizeof(path), &slave);
+    if (fd == -1)
+        return -1;
+
+    /* writes block until the daemon has read the data, like on a UART */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    fprintf(stderr, "Replaying on %s\n", path);
+
+    return fd;
+}
+
+static int open_target(const char *uart, const char *server)
+{
+    char            ip[64];
+    char           *colon;
+    int             fd;
+
+    if (server)
+    {
+        snprintf(ip, sizeof(ip), "%s", server);
+        colon = strchr(ip, ':');
+        if (colon == NULL)
+        {
+            fprintf(stderr, "Server must be given as IP:port\n");
+            return -1;
+        }
+        *colon = '\0';
+
+        fd = connect_server(ip, atoi(colon + 1));
+        if (fd == -1)
+            fprintf(stderr, "Error connecting to %s: %d: %s\n", server,
+                    errno, strerror(errno));
+        else
+            fprintf(stderr, "Connected to %s\n", server);
+
+        return fd;
+    }
+
+    if (!strcmp(uart, "pty"))
+        return open_pty();
+
+    fd = open(uart, O_RDWR | O_NOCTTY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error opening %s: %d: %s\n", uart, errno,
+                strerror(errno));
+        return -1;
+    }
+
+    /* 19200 bps, 8n1, blocking */
+    if (set_serial_config(fd, B19200, 0, 1) == -1)
+        fprintf(stderr, "Warning: %s is not a serial port\n", uart);
+
+    return fd;
+}
+
+/**
+ * Wait until a time while discarding the data sent back by the target.
+ *
+ * @return Number of bytes read, or -1 if the target has gone.
+ */
+static int wait_until(int fd, uint64_t when)
+{
+    uint8_t         buf[RDBUF_SIZE];
+    struct pollfd   pfd = {.fd = fd,.events = POLLIN };
+    uint64_t        now;
+    int             total = 0;
+    int             num;
+
+    while (keep_running)
+    {
+        now = time_us();
+        if (now >= when)
+            break;
+
+        if (poll(&pfd, 1, (when - now) / 1000) <= 0)
+        {
+            /* sleep the part below one msec */
+            now = time_us();
+            if (now < when && when - now < 1000)
+                usleep(when - now);
+            continue;
+        }
+
+        num = read(fd, buf, sizeof(buf));
+        if (num <= 0)
+            return -1;
+        total += num;
+    }
+
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    struct civ_capture cap;
+    uint8_t         frame[RDBUF_SIZE];
+    uint64_t        time, start, t0, due, now, max_late = 0;
+    uint64_t        frames = 0, bytes = 0, received = 0;
+    const char     *uart = NULL;
+    const char     *server = NULL;
+    double          speed = 1.0;
+    int             dir, play = DIR_ALL;
+    int             loops = 1, loop;
+    int             wait = -1;
+    int             verbose = 0;
+    int             fd = -1;
+    int             len, num;
+    int             option;
+
+    while ((option = getopt(argc, argv, "u:s:d:x:n:w:vh")) != -1)
+    {
+        switch (option)
+        {
+        case 'u':
+            uart = optarg;
+            break;
+
+        case 's':
+            server = optarg;
+            break;
+
+        case 'd':
+            if (!strcmp(optarg, "radio"))
+                play = CIV_DIR_RADIO;
+            else if (!strcmp(optarg, "panel"))
+                play = CIV_DIR_PANEL;
+            else if (!strcmp(optarg, "all"))
+                play = DIR_ALL;
+            else
+            {
+                fprintf(stderr, "Unknown direction: %s\n", optarg);
+                help();
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'x':
+            speed = atof(optarg);
+            break;
+
+        case 'n':
+            loops = atoi(optarg);
+            break;
+
+        case 'w':
+            wait = atoi(optarg);
+            break;
+
+        case 'v':
+            verbose = 1;
+            break;
+
+        case 'h':
+            help();
+            exit(EXIT_SUCCESS);
+
+        default:
+            help();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc)
+    {
+        help();
+        exit(EXIT_FAILURE);
+    }
+
+    if (civ_capture_open(&cap, argv[optind]))
+        exit(EXIT_FAILURE);
+
+    /* print the capture */
+    if (uart == NULL && server == NULL)
+    {
+        while ((len = civ_capture_read(&cap, &dir, frame, sizeof(frame),
+                                       &time)) > 0)
+            if (play == DIR_ALL || play == dir)
+                print_frame(time - cap.start, dir, frame, len);
+
+        if (len < 0)
+            fprintf(stderr, "Capture file damaged after %" PRIu64
+                    " frames\n", cap.frames);
+        civ_capture_close(&cap);
+        exit(len < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    fd = open_target(uart, server);
+    if (fd == -1)
+    {
+        civ_capture_close(&cap);
+        exit(EXIT_FAILURE);
+    }
+
+    if (wait < 0)
+        wait = (uart && !strcmp(uart, "pty")) ? 2 : 0;
+    if (wait)
+        wait_until(fd, time_us() + 1000000ULL * wait);
+
+    start = t0 = time_us();
+    for (loop = 0; keep_running && (loops == 0 || loop < loops); loop++)
+    {
+        civ_capture_rewind(&cap);
+        while (keep_running && (len = civ_capture_read(&cap, &dir, frame,
+                                                       sizeof(frame),
+                                                       &time)) > 0)
+        {
+            if (play != DIR_ALL && play != dir)
+                continue;
+
+            if (speed > 0)
+            {
+                due = t0 + (time - cap.start) / speed;
+                num = wait_until(fd, due);
+                if (num < 0)
+                {
+                    fprintf(stderr, "Target closed the connection\n");
+                    keep_running = 0;
+                    break;
+                }
+                received += num;
+
+                /* wait_until() returns early when interrupted */
+                now = time_us();
+                if (now > due && now - due > max_late)
+                    max_late = now - due;
+            }
+
+            if (write(fd, frame, len) != len)
+            {
+                fprintf(stderr, "Error writing frame: %d: %s\n", errno,
+                        strerror(errno));
+                keep_running = 0;
+                break;
+            }
+            if (verbose)
+                print_frame(time - cap.start, dir, frame, len);
+
+            frames++;
+            bytes += len;
+        }
+
+        if (len < 0)
+        {
+            fprintf(stderr, "Capture file damaged after %" PRIu64
+                    " frames\n", cap.frames);
+            break;
+        }
+
+        /* the next loop starts where this one ended */
+        t0 += (cap.last - cap.start) / (speed > 0 ? speed : 1);
+    }
+
+    fprintf(stderr, "  Frames / bytes sent: %" PRIu64 " / %" PRIu64 "\n",
+            frames, bytes);
+    fprintf(stderr, "  Bytes received     : %" PRIu64 "\n", received);
+    fprintf(stderr, "  Elapsed time       : %.3f s\n",
+            1.e-6 * (time_us() - start));
+    if (speed > 0)
+        fprintf(stderr, "  Max lateness       : %.3f ms\n", 1.e-3 * max_late);
+
+    close(fd);
+    civ_capture_close(&cap);
+
+    return EXIT_SUCCESS;
+}
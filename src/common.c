@@ -8,16 +8,20 @@
  */
 #include <arpa/inet.h>
 #include <errno.h>
-#include <fcntl.h>              /* O_WRONLY */
+#include <fcntl.h>              /* O_RDONLY */
+#include <inttypes.h>           /* PRIu64 */
+#include <netinet/tcp.h>        /* TCP_NODELAY */
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <sys/time.h>
 #include <termios.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "flightrec.h"
+#include "prof.h"
 
 /* Print an array of chars as HEX numbers */
 inline void print_buffer(int from, int to, const uint8_t * buf,
@@ -84,6 +88,16 @@ int set_serial_config(int fd, int speed, int parity, int blocking)
 }
 
 int create_server_socket(int port)
+{
+    return create_server_socket_addr(INADDR_ANY, port);
+}
+
+int create_local_server_socket(int port)
+{
+    return create_server_socket_addr(htonl(INADDR_LOOPBACK), port);
+}
+
+int create_server_socket_addr(uint32_t addr, int port)
 {
     struct sockaddr_in serv_addr;
     int             sock_fd = -1;
@@ -105,7 +119,7 @@ int create_server_socket(int port)
     /* bind socket to host address */
     memset(&serv_addr, 0, sizeof(struct sockaddr_in));
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_addr.s_addr = addr;
     serv_addr.sin_port = htons(port);
     if (bind(sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1)
     {
@@ -126,72 +140,216 @@ int create_server_socket(int port)
     return sock_fd;
 }
 
-int read_data(int fd, struct xfr_buf *buffer)
+int connect_server(const char *ip, int port)
 {
-    uint8_t        *buf = buffer->data;
-    int             type = PKT_TYPE_INCOMPLETE;
-    size_t          num;
+    struct sockaddr_in serv_addr;
+    int             sock_fd;
 
-    /* read data */
-    num = read(fd, &buf[buffer->wridx], RDBUF_SIZE - buffer->wridx);
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &serv_addr.sin_addr) != 1)
+        return -1;
 
-    if (num > 0)
+    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd == -1)
+        return -1;
+
+    if (connect(sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr))
+        == -1)
     {
-        buffer->wridx += num;
-
-        /* There is at least one character in the buffer.
-         *
-         * If buf[0] = 0xFE then this is a regular packet. Check if
-         * buf[end] = 0xFD, if yes, the packet is complete and return
-         * the packet type.
-         *
-         * If buf[0] = 0x00 and wridx = 1 then this is an EOS packet.
-         * If buf[0] = 0x00 and wridx > 1 then this is an invalid
-         * packet (does not start with 0xFE).
-         */
-        if (buf[0] == 0xFE)
-        {
-            if (buf[buffer->wridx - 1] == 0xFD)
-                type = buf[1];
-            else
-                type = PKT_TYPE_INCOMPLETE;
-        }
-        else if ((buf[0] == 0x00) && (buffer->wridx == 1))
-        {
-            type = PKT_TYPE_EOS;
-        }
-        else
+        int             err = errno;
+
+        close(sock_fd);
+        errno = err;
+        return -1;
+    }
+
+    return sock_fd;
+}
+
+int set_nodelay(int fd)
+{
+    int             yes = 1;
+
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+
+/* Length of the packets we introduced; 0 for the others */
+static int local_packet_len(int pkt_type)
+{
+    switch (pkt_type)
+    {
+    case PKT_TYPE_PWK:
+    case PKT_TYPE_CTL:
+        return 4;
+
+    case PKT_TYPE_PING:
+        return PING_MSG_LEN;
+
+    case PKT_TYPE_SESSION:
+        return SESSION_MSG_LEN;
+
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Find the first packet in the data.
+ *
+ * @param buf  The data.
+ * @param len  Number of bytes in buf.
+ * @param pktlen  Set to the length of the packet; 0 if it is incomplete.
+ * @return The packet type.
+ *
+ * Bytes before the next 0xFE that do not form an EOS packet are returned as
+ * a PKT_TYPE_INVALID packet so that they can be skipped. So are our own
+ * packets with the wrong length, because their payload is read without
+ * further checks.
+ */
+static int parse_packet(const uint8_t * buf, int len, int *pktlen)
+{
+    int             i;
+
+    *pktlen = 0;
+    if (len == 0)
+        return PKT_TYPE_INCOMPLETE;
+
+    /* End of session is a single 0x00 */
+    if (buf[0] == 0x00)
+    {
+        *pktlen = 1;
+        return PKT_TYPE_EOS;
+    }
+
+    if (buf[0] != 0xFE)
+    {
+        for (i = 1; i < len && buf[i] != 0xFE; i++) ;
+        *pktlen = i;
+        return PKT_TYPE_INVALID;
+    }
+
+    for (i = 1; i < len; i++)
+    {
+        if (buf[i] == 0xFD)
         {
-            type = PKT_TYPE_INVALID;
+            *pktlen = i + 1;
+            if (i < 2 || (local_packet_len(buf[1]) &&
+                          local_packet_len(buf[1]) != *pktlen))
+                return PKT_TYPE_INVALID;
+
+            return buf[1];
         }
     }
-    else if (num == 0)
+
+    /* a full buffer without 0xFD can never be completed */
+    if (len == RDBUF_SIZE)
+    {
+        *pktlen = len;
+        return PKT_TYPE_INVALID;
+    }
+
+    return PKT_TYPE_INCOMPLETE;
+}
+
+/* Remove the current packet and get the next one if it is complete */
+static int next_packet(struct xfr_buf *buffer)
+{
+    if (buffer->pktlen)
+    {
+        buffer->wridx -= buffer->pktlen;
+        memmove(buffer->data, &buffer->data[buffer->pktlen], buffer->wridx);
+    }
+
+    return parse_packet(buffer->data, buffer->wridx, &buffer->pktlen);
+}
+
+int packet_pending(const struct xfr_buf *buffer)
+{
+    int             len;
+
+    return parse_packet(&buffer->data[buffer->pktlen],
+                        buffer->wridx - buffer->pktlen,
+                        &len) != PKT_TYPE_INCOMPLETE;
+}
+
+int is_local_packet(int pkt_type)
+{
+    switch (pkt_type)
+    {
+    case PKT_TYPE_KEEPALIVE:
+    case PKT_TYPE_INIT1:
+    case PKT_TYPE_INIT2:
+    case PKT_TYPE_PWK:
+    case PKT_TYPE_CTL:
+    case PKT_TYPE_PING:
+    case PKT_TYPE_SESSION:
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+int read_data(int fd, struct xfr_buf *buffer)
+{
+    int             type;
+    ssize_t         num;
+    struct prof_sample ps;
+
+    /* packets left from the previous read come first */
+    type = next_packet(buffer);
+    if (type != PKT_TYPE_INCOMPLETE)
+        return type;
+
+    /* read data */
+    prof_begin(&ps);
+    num = read(fd, &buffer->data[buffer->wridx], RDBUF_SIZE - buffer->wridx);
+    prof_end(PROF_READ, &ps);
+
+    if (num == 0)
     {
-        type = PKT_TYPE_EOF;
         fprintf(stderr, "Received EOF from FD %d\n", fd);
+        return PKT_TYPE_EOF;
     }
-    else
+    else if (num < 0)
     {
-        type = PKT_TYPE_INVALID;
         fprintf(stderr, "Error reading from FD %d: %d: %s\n", fd, errno,
                 strerror(errno));
+        return PKT_TYPE_INVALID;
     }
 
+    prof_begin(&ps);
+    buffer->wridx += num;
+    type = parse_packet(buffer->data, buffer->wridx, &buffer->pktlen);
+    prof_end(PROF_FRAMING, &ps);
+
     return type;
 }
 
-int transfer_data(int ifd, int ofd, struct xfr_buf *buffer)
+int receive_data(int ifd, struct xfr_buf *buffer)
 {
     uint8_t         init1_resp[] = { 0xFE, 0xF0, 0xFD };
     uint8_t         init2_resp[] = { 0xFE, 0xF1, 0xFD };
     int             pkt_type;
 
+    /* skip invalid packets; a read error also counts as one */
     pkt_type = read_data(ifd, buffer);
+    while (pkt_type == PKT_TYPE_INVALID)
+    {
+        flightrec_event(FR_EV_RX, pkt_type, ifd, buffer->pktlen);
+        buffer->invalid_pkts++;
+        pkt_type = next_packet(buffer);
+    }
+
+    if (pkt_type != PKT_TYPE_INCOMPLETE)
+        flightrec_event(FR_EV_RX, pkt_type, ifd, buffer->pktlen);
+
     switch (pkt_type)
     {
     case PKT_TYPE_KEEPALIVE:
         /* emulated on server side; do not forward */
-        buffer->wridx = 0;
         buffer->valid_pkts++;
 
     case PKT_TYPE_INIT1:
@@ -199,7 +357,6 @@ int transfer_data(int ifd, int ofd, struct xfr_buf *buffer)
            Expects PKT_TYPE_INIT1 + PKT_TYPE_INIT2 in response. */
         buffer->write_errors += write(ifd, init1_resp, 3) != 3;
         buffer->write_errors += write(ifd, init2_resp, 3) != 3;
-        buffer->wridx = 0;
         buffer->valid_pkts++;
         break;
 
@@ -207,194 +364,261 @@ int transfer_data(int ifd, int ofd, struct xfr_buf *buffer)
         /* Sent by the panel when powered on and the radio is already on.
            Expects PKT_TYPE_INIT2 in response. */
         buffer->write_errors += write(ifd, init2_resp, 3);
-        buffer->wridx = 0;
         buffer->valid_pkts++;
         break;
 
     case PKT_TYPE_PWK:
         /* Power on/off message sent by panel; leave handling to server */
+    case PKT_TYPE_CTL:
+        /* Control request/status; handled by server and client */
+    case PKT_TYPE_PING:
+        /* Link probe; answered by the receiver, see link_make_pong() */
+    case PKT_TYPE_SESSION:
+        /* Session token; handled by server */
 #if DEBUG
-        print_buffer(ifd, ofd, buffer->data, buffer->wridx);
+        print_buffer(ifd, -1, buffer->data, buffer->pktlen);
 #endif
-        buffer->wridx = 0;
         buffer->valid_pkts++;
         break;
 
-    case PKT_TYPE_INCOMPLETE:
+    default:
+        /* Packet should be forwarded, or incomplete, or EOF */
         break;
+    }
 
-    case PKT_TYPE_INVALID:
-        buffer->invalid_pkts++;
-        buffer->wridx = 0;
-        break;
+    return pkt_type;
+}
 
-    default:
-        /* we also "send" on EOF packet because buffer may not be empty */
+int transfer_data(int ifd, int ofd, struct xfr_buf *buffer)
+{
+    struct prof_sample ps;
+    ssize_t         num;
+    int             pkt_type;
+
+    pkt_type = receive_data(ifd, buffer);
+    if (pkt_type != PKT_TYPE_INCOMPLETE && pkt_type != PKT_TYPE_EOF &&
+        !is_local_packet(pkt_type))
+    {
 #if DEBUG
-        print_buffer(ifd, ofd, buffer->data, buffer->wridx);
+        print_buffer(ifd, ofd, buffer->data, buffer->pktlen);
 #endif
-        buffer->write_errors +=
-            write(ofd, buffer->data, buffer->wridx) != buffer->wridx;
+        prof_begin(&ps);
+        num = write(ofd, buffer->data, buffer->pktlen);
+        prof_end(PROF_WRITE, &ps);
+
+        if (num == buffer->pktlen)
+        {
+            flightrec_event(FR_EV_TX, pkt_type, ofd, buffer->pktlen);
+        }
+        else
+        {
+            flightrec_event(FR_EV_WRITE_ERR, 0, ofd, errno);
+            buffer->write_errors++;
+        }
 
-        buffer->wridx = 0;
         buffer->valid_pkts++;
     }
 
     return pkt_type;
 }
 
-uint64_t time_ms(void)
+int send_keepalive(int fd)
 {
-    struct timeval  tval;
-
-    gettimeofday(&tval, NULL);
+    char            msg[] = { 0xFE, 0x0B, 0x00, 0xFD };
 
-    return 1e3 * tval.tv_sec + 1e-3 * tval.tv_usec;
+    return (write(fd, msg, 4) != 4);
 }
 
-uint64_t time_us(void)
+int send_ctl_message(int fd, int control)
 {
-    struct timeval  tval;
+    char            msg[] = { 0xFE, PKT_TYPE_CTL, 0x00, 0xFD };
 
-    gettimeofday(&tval, NULL);
+    if (control)
+        msg[2] = 0x01;
 
-    return 1e6 * tval.tv_sec + tval.tv_usec;
+    return (write(fd, msg, 4) != 4);
 }
 
-int send_keepalive(int fd)
+void link_init(struct link_stats *link)
 {
-    char            msg[] = { 0xFE, 0x0B, 0x00, 0xFD };
+    memset(link, 0, sizeof(struct link_stats));
+    link->last_pong = time_ms();
+}
 
-    return (write(fd, msg, 4) != 4);
+int link_ping_due(struct link_stats *link, uint64_t now)
+{
+    return (now - link->ping_time / 1000 >= PING_INTERVAL_MS);
 }
 
-void send_pwr_message(int fd, int poweron)
+void link_make_ping(struct link_stats *link, uint8_t * msg)
 {
-    char            msg[] = { 0xFE, 0xA0, 0x00, 0xFD };
+    if (link->pending)
+        link->lost++;
+
+    link->seq = (link->seq + 1) & 0x7F;
+    link->pending = 1;
+    link->ping_time = time_us();
+    link->pings++;
+
+    msg[0] = 0xFE;
+    msg[1] = PKT_TYPE_PING;
+    msg[2] = 0x00;
+    msg[3] = link->seq;
+    msg[4] = 0xFD;
+}
 
-    if (poweron)
-        msg[2] = 0x01;
+int link_make_pong(const uint8_t * ping, uint8_t * msg)
+{
+    if (ping[2] != 0x00)
+        return 0;
 
-    if (write(fd, msg, 4) == -1)
-        fprintf(stderr, "Error sending PWR message %d (%s)\n", errno,
-                strerror(errno));
+    msg[0] = 0xFE;
+    msg[1] = PKT_TYPE_PING;
+    msg[2] = 0x01;
+    msg[3] = ping[3] & 0x7F;
+    msg[4] = 0xFD;
+
+    return 1;
 }
 
-int pwk_init(void)
+void link_process_pong(struct link_stats *link, const uint8_t * pong)
 {
-    int             fd;
-    int             wr_err = 0;
+    uint32_t        rtt;
+    uint32_t        diff;
 
+    /* pongs for older pings have already been counted as lost */
+    if (!link->pending || pong[3] != link->seq)
+        return;
 
-    /*  Export GPIO7 unless it is already exported */
-    if (access("/sys/class/gpio/gpio7", F_OK) == -1)
-    {
-        /*  $ echo 7 > /sys/class/gpio/export */
-        fd = open("/sys/class/gpio/export", O_WRONLY);
-        if (fd < 0)
-            return -1;
+    rtt = time_us() - link->ping_time;
+    diff = rtt > link->rtt ? rtt - link->rtt : link->rtt - rtt;
 
-        wr_err += write(fd, "7", 1) != 1;
-        close(fd);
+    if (link->pongs == 0)
+    {
+        link->rtt_min = rtt;
+        link->rtt_max = rtt;
+        link->srtt = rtt;
+        link->jitter = 0;
+    }
+    else
+    {
+        if (rtt < link->rtt_min)
+            link->rtt_min = rtt;
+        if (rtt > link->rtt_max)
+            link->rtt_max = rtt;
+
+        /* same smoothing as TCP (RFC 6298) and RTP (RFC 3550) */
+        link->srtt = (7 * (uint64_t) link->srtt + rtt) / 8;
+        link->jitter = ((int64_t) link->jitter * 15 + diff) / 16;
     }
 
-    /*  $ echo "in" > /sys/class/gpio/gpio7/direction */
-    fd = open("/sys/class/gpio/gpio7/direction", O_WRONLY);
-    if (fd < 0)
-        return -1;
-
-    wr_err += write(fd, "in", 2) != 2;
-    close(fd);
+    link->rtt = rtt;
+    link->pending = 0;
+    link->alive = 1;
+    link->last_pong = time_ms();
+    link->pongs++;
+}
 
-    /*  $ echo 1 > /sys/class/gpio/gpio7/active_low */
-    fd = open("/sys/class/gpio/gpio7/active_low", O_WRONLY);
-    if (fd < 0)
-        return -1;
+int link_is_dead(struct link_stats *link, uint64_t now)
+{
+    return link->alive && (now - link->last_pong > LINK_TIMEOUT_MS);
+}
 
-    wr_err += write(fd, "1", 1) != 1;
-    close(fd);
+void link_print_stats(struct link_stats *link)
+{
+    if (!link->pongs)
+    {
+        fprintf(stderr, "  Link: no probe replies (%" PRIu64 " sent)\n",
+                link->pings);
+        return;
+    }
 
-    /*  $ echo "falling" > /sys/class/gpio/gpio7/edge  */
-    fd = open("/sys/class/gpio/gpio7/edge", O_WRONLY);
-    if (fd < 0)
-        return -1;
+    fprintf(stderr, "  Link RTT (ms) min / avg / max: %.1f / %.1f / %.1f\n",
+            1e-3 * link->rtt_min, 1e-3 * link->srtt, 1e-3 * link->rtt_max);
+    fprintf(stderr, "  Link jitter: %.1f ms, probes sent / lost: %" PRIu64
+            " / %" PRIu64 "\n", 1e-3 * link->jitter, link->pings, link->lost);
+}
 
-    wr_err += write(fd, "falling", 7) != 7;
-    close(fd);
+int random_bytes(void *buf, size_t len)
+{
+    int             fd;
+    int             res = 0;
 
-    fd = open("/sys/class/gpio/gpio7/value", O_RDONLY);
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1 || read(fd, buf, len) != (ssize_t) len)
+    {
+        fprintf(stderr, "Error reading /dev/urandom: %d: %s\n", errno,
+                strerror(errno));
+        res = -1;
+    }
 
-    if (wr_err)
-        fprintf(stderr, "Write errors during PWK_INIT: %d\n", wr_err);
+    if (fd != -1)
+        close(fd);
 
-    return fd;
+    return res;
 }
 
-
-#define SYSFS_GPIO_DIR "/sys/class/gpio/"
-#define MAX_GPIO_BUF   100
-
-int gpio_init_out(unsigned int gpio)
+uint32_t session_token_create(void)
 {
-    int             fd;
-    int             len;
-    int             wr_err = 0;
-    char            buf[MAX_GPIO_BUF];
+    uint32_t        token;
 
-
-    /* check whether GPIO is already exported, if not, export it */
-    snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "gpio%d", gpio);
-    if (access(buf, F_OK) == -1)
+    do
     {
-        /* export GPIO */
-        fd = open(SYSFS_GPIO_DIR "export", O_WRONLY);
-        if (fd < 0)
-            return -1;
+        if (random_bytes(&token, sizeof(token)))
+            return 0;
 
-        len = snprintf(buf, sizeof(buf), "%d", gpio);
-        wr_err += write(fd, buf, len) != len;
-        close(fd);
+        token &= SESSION_TOKEN_MASK;
     }
+    while (token == 0);
 
-    /* set direction to "out" */
-    snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "gpio%d/direction", gpio);
-    fd = open(buf, O_WRONLY);
-    if (fd < 0)
-        return -1;
+    return token;
+}
 
-    wr_err += write(fd, "out", 3) != 3;
-    close(fd);
+int send_session_message(int fd, uint32_t token)
+{
+    uint8_t         msg[SESSION_MSG_LEN];
+    int             i;
 
-    /* intialize with a 0 */
-    if (gpio_set_value(20, 0) < 0)
-        return -1;
+    msg[0] = 0xFE;
+    msg[1] = PKT_TYPE_SESSION;
+    for (i = 0; i < 4; i++)
+        msg[2 + i] = (token >> (7 * i)) & 0x7F;
+    msg[6] = 0xFD;
 
-    if (wr_err)
-    {
-        fprintf(stderr, "Write errors during GPIO init out: %d\n", wr_err);
-        return -1;
-    }
+    return (write(fd, msg, SESSION_MSG_LEN) != SESSION_MSG_LEN);
+}
 
-    return 0;
+uint32_t session_token_get(const uint8_t * pkt)
+{
+    uint32_t        token = 0;
+    int             i;
+
+    for (i = 0; i < 4; i++)
+        token |= (uint32_t) (pkt[2 + i] & 0x7F) << (7 * i);
+
+    return token;
 }
 
-int gpio_set_value(unsigned int gpio, unsigned int value)
+uint32_t reconnect_delay_ms(unsigned int attempt)
 {
-    int             fd;
-    int             wr_err = 0;
-    char            buf[MAX_GPIO_BUF];
+    if (attempt == 0)
+        return 0;
 
-    snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "gpio%d/value", gpio);
-    fd = open(buf, O_WRONLY);
-    if (fd < 0)
-        return -1;
+    if (attempt > 5)
+        return RECONNECT_MAX_MS;
 
-    if (value == 1)
-        wr_err += write(fd, "1", 1) != 1;
-    else
-        wr_err += write(fd, "0", 1) != 1;
+    return (100 << (attempt - 1)) < RECONNECT_MAX_MS ?
+        (100 << (attempt - 1)) : RECONNECT_MAX_MS;
+}
+
+void send_pwr_message(int fd, int poweron)
+{
+    char            msg[] = { 0xFE, 0xA0, 0x00, 0xFD };
 
-    close(fd);
+    if (poweron)
+        msg[2] = 0x01;
 
-    return -wr_err;
+    if (write(fd, msg, 4) == -1)
+        fprintf(stderr, "Error sending PWR message %d (%s)\n", errno,
+                strerror(errno));
 }
@@ -11,6 +11,8 @@
 
 #include <stdint.h>
 
+#include "timebase.h"
+
 /* Use 1 = debug, 0 = release */
 #define DEBUG 0
 
@@ -74,16 +76,89 @@
  */
 #define PKT_TYPE_PWK        0xA0
 
+/* Control of the radio when several clients are connected to the server:
+ * 0xFE 0xA1 0x01 0xFD -- client->server: request control
+ *                        server->client: control granted
+ * 0xFE 0xA1 0x00 0xFD -- client->server: release control
+ *                        server->client: observer (read only)
+ */
+#define PKT_TYPE_CTL        0xA1
+
+/* Link probes used to measure round trip time and to detect dead
+ * connections:
+ * 0xFE 0xA2 0x00 <seq> 0xFD -- ping
+ * 0xFE 0xA2 0x01 <seq> 0xFD -- pong; reply to ping with the same seq
+ * The sequence number is 7 bit so that the payload never contains 0xFD or
+ * 0xFE. Probes are answered by the receiver and never forwarded.
+ */
+#define PKT_TYPE_PING       0xA2
+#define PING_MSG_LEN        5
+#define PING_INTERVAL_MS    1000        /* time between pings */
+#define LINK_TIMEOUT_MS     3000        /* no pong for this long: dead */
+
+/* Session token sent by the client after connecting:
+ * 0xFE 0xA3 <t0> <t1> <t2> <t3> 0xFD
+ * The token is 28 bit, sent as four 7 bit bytes starting with the least
+ * significant. A client reconnecting with the same token within
+ * RESUME_HOLD_MS resumes its previous session, e.g. gets control of the
+ * radio back.
+ */
+#define PKT_TYPE_SESSION    0xA3
+#define SESSION_MSG_LEN     7
+#define SESSION_TOKEN_MASK  0x0FFFFFFF
+#define RESUME_HOLD_MS      10000
+
+/* Reconnect delay grows from 0 (immediate retry) up to this value */
+#define RECONNECT_MAX_MS    2000
+
 
 /* convenience struct for data transfers */
 struct xfr_buf {
     uint8_t         data[RDBUF_SIZE];
     int             wridx;              /* next available write slot. */
+    int             pktlen;             /* length of the packet at data[0] */
     uint32_t        write_errors;       /* write errors */
     uint64_t        valid_pkts;         /* number of valid packets */
     uint64_t        invalid_pkts;       /* number of invalid packets */
 };
 
+/**
+ * Link quality measured using PKT_TYPE_PING probes.
+ *
+ * @seq         Sequence number of the last ping.
+ * @pending     The last ping has not been answered yet.
+ * @alive       At least one pong has been received, i.e. the peer supports
+ *              probes and dead link detection can be used.
+ * @ping_time   Time when the last ping was sent (usec).
+ * @last_pong   Time when the last pong was received or when the link was
+ *              initialized (msec).
+ * @rtt         Last round trip time (usec).
+ * @rtt_min     Smallest round trip time (usec).
+ * @rtt_max     Largest round trip time (usec).
+ * @srtt        Smoothed round trip time (usec).
+ * @jitter      Smoothed variation of the round trip time (usec).
+ * @pings       Number of pings sent.
+ * @pongs       Number of pongs received in time.
+ * @lost        Number of pings without answer.
+ */
+struct link_stats {
+    uint8_t         seq;
+    int             pending;
+    int             alive;
+    uint64_t        ping_time;
+    uint64_t        last_pong;
+
+    uint32_t        rtt;
+    uint32_t        rtt_min;
+    uint32_t        rtt_max;
+    uint32_t        srtt;
+    uint32_t        jitter;
+
+    uint64_t        pings;
+    uint64_t        pongs;
+    uint64_t        lost;
+};
+
 /**
  * Create a server socket.
  * 
@@ -93,32 +168,88 @@ struct xfr_buf {
  */
 int             create_server_socket(int port);
 
+/** Create a server socket listening on the loopback interface only. */
+int             create_local_server_socket(int port);
+
+/**
+ * Create a server socket bound to a specific address.
+ *
+ * @param addr  The IPv4 address in network byte order.
+ * @param port  The network port to listen on.
+ * @return      The file descriptor of the server socket or -1 if an error
+ *              occured during the setup.
+ */
+int             create_server_socket_addr(uint32_t addr, int port);
+
+/**
+ * Connect to a TCP server.
+ *
+ * @param ip    The IPv4 address of the server as string.
+ * @param port  The network port of the server.
+ * @return      The file descriptor of the connected socket or -1 if the
+ *              connection could not be established (errno is set).
+ */
+int             connect_server(const char *ip, int port);
+
+/** Disable Nagle's algorithm on a TCP socket. Returns 0 if OK. */
+int             set_nodelay(int fd);
+
 /**
  * Read data from file descriptor.
  *
  * @param  fd      The file descriptor.
  * @param  buffer  Pointer to the serial_buffer structure to use.
- * @returns The packet type if the packet is complete.
+ * @returns The packet type if a packet is complete.
  *
- * This function will read all available data from the UART and put the
- * data into the buffer starting at index buffer->wridx. When the read
- * is finished buffer->wridx will again point to the first available
- * slot in buffer, which mneans that it is also equal to the number of
- * bytes in the buffer.
+ * The packet returned by the previous call is removed from the buffer
+ * first. If the buffer already contains another complete packet, it is
+ * returned without reading. Otherwise the function reads the available data
+ * from the UART or socket and puts it into the buffer starting at index
+ * buffer->wridx.
  *
- * If the last byte read was 0xFD the packet is considered complete
- * and the function will return the packet type. The caller can use this
- * information to decide whether the packet should be forwarded to the
- * network interface.
+ * A packet starts with 0xFE and ends with the first 0xFD; a single 0x00 is
+ * a PKT_TYPE_EOS packet. PWK, CTL, PING and SESSION packets must have
+ * their full length, otherwise they are invalid. The packet is at the
+ * start of buffer->data and is buffer->pktlen bytes long. A read() may
+ * return several packets, so call read_data() again while
+ * packet_pending() is true; a part of the next packet stays in the buffer
+ * until the rest is read.
  *
- * If the last byte is not 0xFD then the read is only partial and the
- * function returns PKT_TYPE_INCOMPLETE to indicate this to the caller.
- *
- * @bug We assume that 0xFD can only occur as the last byte during a
- *      read() op, which is not always the case.
+ * If there is no complete packet the function returns
+ * PKT_TYPE_INCOMPLETE. PKT_TYPE_EOF is returned when read() returns 0 and
+ * PKT_TYPE_INVALID on a read error or for bytes that are not a packet.
  */
 int             read_data(int fd, struct xfr_buf *buffer);
 
+/**
+ * Check whether the buffer contains another complete packet after the
+ * current one, i.e. the next read_data() or receive_data() will return it
+ * without reading.
+ */
+int             packet_pending(const struct xfr_buf *buffer);
+
+/**
+ * Check whether a packet type is handled by the receiver instead of being
+ * forwarded (INIT, keepalive, PWK, CTL, PING and SESSION).
+ */
+int             is_local_packet(int pkt_type);
+
+/**
+ * Receive data and handle packets that are not forwarded.
+ *
+ * @param ifd    Input file descriptor.
+ * @param buffer Pointer to the buffer structure used to collect packets.
+ * @return The packet type that was read.
+ *
+ * This function reads data using read_data() and answers the INIT packets.
+ * Invalid packets are counted and skipped. Any other packet is returned in
+ * the buffer as for read_data(); is_local_packet() tells whether it should
+ * be forwarded. Local packets are counted as valid here, the caller is
+ * responsible for counting forwarded packets. Call again while
+ * packet_pending() is true.
+ */
+int             receive_data(int ifd, struct xfr_buf *buffer);
+
 /**
  * Transfer data from one interface to the other.
  *
@@ -128,7 +259,8 @@ int             read_data(int fd, struct xfr_buf *buffer);
  *               packets from the serial port.
  * @return The packet type that was read.
  *
- * @todo Some packet type are transfered, others are not
+ * Reads one packet using receive_data() and forwards it unless it is a
+ * local packet. Call again while packet_pending() is true.
  */
 int             transfer_data(int ifd, int ofd, struct xfr_buf *buffer);
 
@@ -136,12 +268,6 @@ inline void     print_buffer(int from, int to, const uint8_t * buf,
                              unsigned int len);
 int             set_serial_config(int fd, int speed, int parity, int blocking);
 
-/** Get current time in milliseconds. */
-uint64_t        time_ms(void);
-
-/** Get current time in microseconds. */
-uint64_t        time_us(void);
-
 /**
  * Send keep-alive messages to FD.
  *
@@ -150,56 +276,94 @@ uint64_t        time_us(void);
 int             send_keepalive(int fd);
 
 /**
- * Send a PKT_TYPE_PWK message.
+ * Send a PKT_TYPE_CTL message.
  *
- * @param fd The file descriptor to where the message should be sent.
- * @param poweron The power status.
+ * @param fd      The file descriptor to where the message should be sent.
+ * @param control 1 to request / grant control, 0 to release control.
+ * @return 0 if the write was successful.
  */
-void            send_pwr_message(int fd, int poweron);
+int             send_ctl_message(int fd, int control);
+
+/** Reset link statistics; call when a connection is established. */
+void            link_init(struct link_stats *link);
+
+/** Check whether it is time to send a new ping (now in msec). */
+int             link_ping_due(struct link_stats *link, uint64_t now);
 
 /**
- * Initialize GPIO_7 used to sense PWK signal.
+ * Create a new ping message.
  *
- * @return A sysfs file descriptor for the GPIO or -1 in case of error.
+ * @param link The link statistics.
+ * @param msg  Buffer for the message, must be PING_MSG_LEN bytes.
  *
- * The GPIO is configured as an "active low" input and with interrupt trigger
- * on both edges (to allow using the file desciptor in the select call). The
- * setup corresponds to the following shell sequence:
+ * The ping is recorded as sent; if the previous ping was not answered it
+ * is counted as lost.
+ */
+void            link_make_ping(struct link_stats *link, uint8_t * msg);
+
+/**
+ * Create the reply to a ping message.
  *
- *  $ echo 7 > /sys/class/gpio/export
- *  $ echo "in" > /sys/class/gpio/gpio7/direction
- *  $ echo 1 > /sys/class/gpio/gpio7/active_low
- *  $ echo "both" > /sys/class/gpio/gpio7/edge
+ * @param ping The received ping packet.
+ * @param msg  Buffer for the reply, must be PING_MSG_LEN bytes.
+ * @return 1 if the packet is a ping that should be answered, 0 if it is
+ *         a pong.
+ */
+int             link_make_pong(const uint8_t * ping, uint8_t * msg);
+
+/** Process received pong and update the statistics. */
+void            link_process_pong(struct link_stats *link,
+                                  const uint8_t * pong);
+
+/**
+ * Check whether the link is dead.
  *
- * Ref: https://www.kernel.org/doc/Documentation/gpio/sysfs.txt
+ * @return 1 if the peer has answered pings before but has not answered any
+ *         for LINK_TIMEOUT_MS (now in msec).
  */
-int             pwk_init(void);
+int             link_is_dead(struct link_stats *link, uint64_t now);
+
+/** Print link statistics to stderr. */
+void            link_print_stats(struct link_stats *link);
 
 /**
- * Initialize a GPIO for output.
+ * Read random bytes from /dev/urandom.
  *
- * @param  gpio The number of the gpio to initialize
- * @retval  0   Initialization was successfull
- * @retval -1   An error occurred (errno is set)
+ * @return 0 if OK, -1 if the random data could not be read.
  *
- * The initialization is performed using sysfs and corresponds to the
- * following shell commands (using GPIO20 as example):
+ * Use this for tokens that must not be guessed; rand() seeded with the
+ * time and PID is easy to reproduce.
+ */
+int             random_bytes(void *buf, size_t len);
+
+/**
+ * Create a new random session token.
  *
- *  $ echo 20 > /sys/class/gpio/export
- *  $ echo "out" > /sys/class/gpio/gpio20/direction
- *  $ echo 1 > /sys/class/gpio/gpio20/value
- *  $ echo 0 > /sys/class/gpio/gpio20/value
- * 
+ * @return The token, or 0 (no session) if no random data is available.
  */
-int             gpio_init_out(unsigned int gpio);
+uint32_t        session_token_create(void);
+
+/** Send a PKT_TYPE_SESSION message. Returns 0 if the write was successful. */
+int             send_session_message(int fd, uint32_t token);
+
+/** Get the session token from a PKT_TYPE_SESSION packet. */
+uint32_t        session_token_get(const uint8_t * pkt);
 
 /**
- * Set GPIO value.
+ * Get delay before the next connection attempt.
  *
- * @param  gpio The number of the GPIO to set (must be initialized).
- * @retval  0   The operation was successful.
- * @retval -1   An error occurred (errno is set).
+ * @param attempt The number of failed attempts since the last connection.
+ * @return The delay in msec: 0 for the first attempt, then doubling from
+ *         100 msec up to RECONNECT_MAX_MS.
  */
-int             gpio_set_value(unsigned int gpio, unsigned int value);
+uint32_t        reconnect_delay_ms(unsigned int attempt);
+
+/**
+ * Send a PKT_TYPE_PWK message.
+ *
+ * @param fd The file descriptor to where the message should be sent.
+ * @param poweron The power status.
+ */
+void            send_pwr_message(int fd, int poweron);
 
 #endif
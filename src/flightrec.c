@@ -0,0 +1,117 @@
+/*
+ * Flight recorder: in-memory ring of recent events.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flightrec.h"
+
+struct fr_ring  flightrec;
+
+static char     dump_path[256];
+static char     dump_name[16];
+
+int flightrec_dump(int signo)
+{
+    struct fr_header hdr;
+    const char     *buf;
+    size_t          len, done;
+    ssize_t         num;
+    int             fd;
+
+    if (dump_path[0] == '\0')
+        return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, FLIGHTREC_MAGIC, sizeof(hdr.magic));
+    hdr.version = FLIGHTREC_VERSION;
+    hdr.event_size = sizeof(struct fr_event);
+    hdr.events = FLIGHTREC_EVENTS;
+    hdr.head = __atomic_load_n(&flightrec.head, __ATOMIC_ACQUIRE);
+    hdr.pid = getpid();
+    memcpy(hdr.name, dump_name, sizeof(hdr.name));
+    hdr.signo = signo;
+    hdr.mono_time = time_trace_ns();
+    hdr.real_time = time_wall_us() * 1000;
+
+    fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+
+    /* write() may be partial; no stdio in a signal handler */
+    buf = (const char *)&hdr;
+    len = sizeof(hdr);
+    for (done = 0; done < len; done += num)
+        if ((num = write(fd, buf + done, len - done)) <= 0)
+            break;
+
+    buf = (const char *)flightrec.events;
+    len = sizeof(flightrec.events);
+    for (done = 0; done < len; done += num)
+        if ((num = write(fd, buf + done, len - done)) <= 0)
+            break;
+
+    close(fd);
+
+    return done == len ? 0 : -1;
+}
+
+/* The signal may arrive between a failed call and the check of errno in
+ * the daemon, so errno must survive the dump */
+static void dump_handler(int signo)
+{
+    int             saved = errno;
+
+    flightrec_event(FR_EV_SIGNAL, signo, 0, 0);
+    flightrec_dump(signo);
+    errno = saved;
+}
+
+/* Dump on a crash, then let the default action terminate the process;
+ * the handler has been reset by SA_RESETHAND */
+static void crash_handler(int signo)
+{
+    dump_handler(signo);
+    raise(signo);
+}
+
+void flightrec_init(const char *name, int signo)
+{
+    static const int crash_signals[] = {
+        SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT
+    };
+    struct sigaction sa;
+    const char     *dir = getenv("FLIGHTREC_DIR");
+    size_t          i;
+
+    time_trace_init();
+    snprintf(dump_name, sizeof(dump_name), "%s", name);
+    snprintf(dump_path, sizeof(dump_path), "%s/%s.%d.fr",
+             dir ? dir : "/tmp", name, (int)getpid());
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = dump_handler;
+    if (sigaction(signo, &sa, NULL) == -1)
+        fprintf(stderr, "Warning: Can't catch signal %d\n", signo);
+
+    sa.sa_flags = SA_RESETHAND;
+    sa.sa_handler = crash_handler;
+    for (i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++)
+        sigaction(crash_signals[i], &sa, NULL);
+
+    flightrec_event(FR_EV_START, 0, 0, getpid());
+    fprintf(stderr, "Flight recorder: send signal %d to dump to %s\n",
+            signo, dump_path);
+}
@@ -0,0 +1,171 @@
+/*
+ * Flight recorder: in-memory ring of recent events.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __FLIGHTREC_H__
+#define __FLIGHTREC_H__
+
+#include <stdint.h>
+
+#include "timebase.h"
+
+/**
+ * @file
+ * Always-on event recorder for post-mortem analysis.
+ *
+ * Each daemon records packets, connection events, errors and audio buffer
+ * levels in a fixed-size ring in memory. Recording an event costs a read
+ * of the trace clock, see time_trace_ns(), and a few stores; no locks are
+ * taken, so events can be recorded from the audio callback as well as from
+ * the main loop.
+ *
+ * The ring is written to <dir>/<name>.<pid>.fr when the dump signal is
+ * received (SIGUSR1 in most daemons) and when the daemon crashes. The dump
+ * only uses async-signal-safe calls. flightrec_print prints a dump as text.
+ *
+ * An event that is being recorded while the ring is dumped may be
+ * inconsistent; everything else is exact.
+ */
+
+#define FLIGHTREC_EVENTS    16384       /* must be a power of two */
+#define FLIGHTREC_MAGIC     "FLTREC"
+#define FLIGHTREC_VERSION   1
+
+/*
+ * Event types. The meaning of code, id and value depends on the type:
+ *
+ *                          code            id          value
+ *   FR_EV_START            -               -           pid
+ *   FR_EV_RX               packet type     fd          length
+ *   FR_EV_TX               packet type     fd          length
+ *   FR_EV_CONNECT          -               fd          IPv4 address
+ *   FR_EV_DISCONNECT       -               fd          -
+ *   FR_EV_WRITE_ERR        -               fd          errno
+ *   FR_EV_DROP             -               fd          packets dropped
+ *   FR_EV_CONTROL          1 granted       fd          -
+ *                          0 released
+ *   FR_EV_UNDERFLOW        -               -           bytes buffered
+ *   FR_EV_OVERFLOW         -               -           bytes lost
+ *   FR_EV_AUDIO_LEVEL      0 in, 1 out     -           bytes buffered
+ *   FR_EV_LOSS             -               -           packets lost
+ *   FR_EV_SIGNAL           signal          -           -
+ *   FR_EV_GPIO             value           GPIO        usec from edge to read
+ *
+ * Packet types are PKT_TYPE_xyz for CI-V traffic and AUDIO_PKT_xyz for
+ * audio traffic.
+ */
+#define FR_EV_START         1
+#define FR_EV_RX            2
+#define FR_EV_TX            3
+#define FR_EV_CONNECT       4
+#define FR_EV_DISCONNECT    5
+#define FR_EV_WRITE_ERR     6
+#define FR_EV_DROP          7
+#define FR_EV_CONTROL       8
+#define FR_EV_UNDERFLOW     9
+#define FR_EV_OVERFLOW      10
+#define FR_EV_AUDIO_LEVEL   11
+#define FR_EV_LOSS          12
+#define FR_EV_SIGNAL        13
+#define FR_EV_GPIO          14
+
+/**
+ * A recorded event; 16 bytes.
+ *
+ * @time   Trace clock time (nsec), see time_trace_ns().
+ * @type   Event type, FR_EV_xyz.
+ * @code   Event specific code, e.g. the packet type.
+ * @id     Event specific id, e.g. the file descriptor.
+ * @value  Event specific value, e.g. the packet length.
+ */
+struct fr_event {
+    uint64_t        time;
+    uint8_t         type;
+    uint8_t         code;
+    uint16_t        id;
+    uint32_t        value;
+};
+
+/**
+ * Dump file header, followed by FLIGHTREC_EVENTS events in ring order.
+ *
+ * @magic       FLIGHTREC_MAGIC.
+ * @version     FLIGHTREC_VERSION.
+ * @event_size  sizeof(struct fr_event).
+ * @events      Number of events in the ring.
+ * @pid         Process id.
+ * @head        Number of events recorded since start; the oldest event
+ *              in the ring is at (head - events) if head > events.
+ * @mono_time   Trace clock time of the dump (nsec).
+ * @real_time   CLOCK_REALTIME time of the dump (nsec), to convert event
+ *              times to wall clock time.
+ * @signo       Signal that caused the dump; 0 if none.
+ * @reserved    0.
+ * @name        Daemon name.
+ *
+ * All numbers are in host byte order.
+ */
+struct fr_header {
+    char            magic[6];
+    uint8_t         version;
+    uint8_t         event_size;
+    uint32_t        events;
+    uint32_t        pid;
+    uint64_t        head;
+    uint64_t        mono_time;
+    uint64_t        real_time;
+    uint32_t        signo;
+    uint32_t        reserved;
+    char            name[16];
+};
+
+/** The ring; only accessed through the functions below. */
+struct fr_ring {
+    uint64_t        head;
+    struct fr_event events[FLIGHTREC_EVENTS];
+};
+
+extern struct fr_ring flightrec;
+
+/** Record an event. */
+static inline void flightrec_event(uint8_t type, uint8_t code, uint16_t id,
+                                   uint32_t value)
+{
+    struct fr_event *ev;
+    uint64_t        now = time_trace_ns();
+    uint64_t        i;
+
+    i = __atomic_fetch_add(&flightrec.head, 1, __ATOMIC_RELAXED);
+    ev = &flightrec.events[i & (FLIGHTREC_EVENTS - 1)];
+    ev->time = now;
+    ev->code = code;
+    ev->id = id;
+    ev->value = value;
+    __atomic_store_n(&ev->type, type, __ATOMIC_RELEASE);
+}
+
+/**
+ * Start recording and install the signal handlers.
+ *
+ * @param name   Daemon name, used for the dump file name.
+ * @param signo  Signal that dumps the ring, e.g. SIGUSR1.
+ *
+ * The ring is also dumped on SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT,
+ * after which the signal is raised again with the default action. The dump
+ * directory is $FLIGHTREC_DIR or /tmp.
+ */
+void            flightrec_init(const char *name, int signo);
+
+/**
+ * Write the ring to the dump file.
+ *
+ * @param signo  Signal that caused the dump; 0 if none.
+ * @return 0 if OK, -1 if the file could not be written.
+ *
+ * Safe to call from a signal handler.
+ */
+int             flightrec_dump(int signo);
+
+#endif
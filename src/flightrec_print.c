@@ -0,0 +1,241 @@
+/*
+ * Print a flight recorder dump.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#define _DEFAULT_SOURCE
+
+#include <arpa/inet.h>
+#include <inttypes.h>           // PRIu64
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flightrec.h"
+
+static const char *event_names[] = {
+    "?", "START", "RX", "TX", "CONNECT", "DISCONNECT", "WRITE_ERR", "DROP",
+    "CONTROL", "UNDERFLOW", "OVERFLOW", "LEVEL", "LOSS", "SIGNAL",
+    "GPIO"
+};
+
+#define NUM_EVENT_NAMES (sizeof(event_names) / sizeof(event_names[0]))
+
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: flightrec_print [options] <dump file>\n"
+        "\n Possible options are:\n"
+        "\n"
+        "  -n    Print only the last n events.\n"
+        "  -t    Print only events of this type, e.g. RX or DISCONNECT.\n"
+        "  -h    This help message.\n\n"
+        " Times are relative to the dump in msec, followed by the wall\n"
+        " clock time.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+static void print_event(const struct fr_header *hdr,
+                        const struct fr_event *ev)
+{
+    struct in_addr  addr;
+    struct tm       tm;
+    uint64_t        real;
+    time_t          secs;
+    char            clock[16];
+
+    /* the wall clock may have been stepped since the event */
+    real = hdr->real_time - (hdr->mono_time - ev->time);
+    secs = real / 1000000000;
+    localtime_r(&secs, &tm);
+    strftime(clock, sizeof(clock), "%H:%M:%S", &tm);
+
+    printf("%12.3f  %s.%06u  %-10s", 1.e-6 * ((int64_t) ev->time -
+                                              (int64_t) hdr->mono_time),
+           clock, (unsigned)(real % 1000000000 / 1000),
+           event_names[ev->type < NUM_EVENT_NAMES ? ev->type : 0]);
+
+    switch (ev->type)
+    {
+    case FR_EV_START:
+        printf("  pid=%" PRIu32, ev->value);
+        break;
+
+    case FR_EV_RX:
+    case FR_EV_TX:
+        printf("  type=0x%02X  fd=%u  len=%" PRIu32, ev->code, ev->id,
+               ev->value);
+        break;
+
+    case FR_EV_CONNECT:
+        addr.s_addr = htonl(ev->value);
+        printf("  fd=%u  addr=%s", ev->id, inet_ntoa(addr));
+        break;
+
+    case FR_EV_DISCONNECT:
+        printf("  fd=%u", ev->id);
+        break;
+
+    case FR_EV_WRITE_ERR:
+        printf("  fd=%u  errno=%" PRIu32 " (%s)", ev->id, ev->value,
+               strerror(ev->value));
+        break;
+
+    case FR_EV_DROP:
+        printf("  fd=%u  packets=%" PRIu32, ev->id, ev->value);
+        break;
+
+    case FR_EV_CONTROL:
+        printf("  fd=%u  %s", ev->id, ev->code ? "granted" : "released");
+        break;
+
+    case FR_EV_UNDERFLOW:
+        printf("  buffered=%" PRIu32, ev->value);
+        break;
+
+    case FR_EV_OVERFLOW:
+        printf("  lost=%" PRIu32, ev->value);
+        break;
+
+    case FR_EV_AUDIO_LEVEL:
+        printf("  %s  buffered=%" PRIu32, ev->code ? "out" : "in", ev->value);
+        break;
+
+    case FR_EV_LOSS:
+        printf("  packets=%" PRIu32, ev->value);
+        break;
+
+    case FR_EV_SIGNAL:
+        printf("  signal=%u", ev->code);
+        break;
+
+    case FR_EV_GPIO:
+        printf("  gpio=%u  value=%u  delay=%" PRIu32 " us", ev->id, ev->code,
+               ev->value);
+        break;
+
+    default:
+        printf("  code=%u  id=%u  value=%" PRIu32, ev->code, ev->id,
+               ev->value);
+        break;
+    }
+
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct fr_header hdr;
+    struct fr_event *events = NULL;
+    const char     *type_name = NULL;
+    uint64_t        first, i, last = 0;
+    FILE           *file;
+    int             type = -1;
+    int             option;
+    int             exit_code = EXIT_FAILURE;
+
+    while ((option = getopt(argc, argv, "n:t:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'n':
+            last = strtoull(optarg, NULL, 10);
+            break;
+
+        case 't':
+            type_name = optarg;
+            break;
+
+        case 'h':
+        default:
+            help();
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        help();
+        return EXIT_FAILURE;
+    }
+
+    if (type_name)
+    {
+        for (i = 1; i < NUM_EVENT_NAMES; i++)
+            if (strcasecmp(type_name, event_names[i]) == 0)
+                type = i;
+
+        if (type == -1)
+        {
+            fprintf(stderr, "Unknown event type: %s\n", type_name);
+            return EXIT_FAILURE;
+        }
+    }
+
+    file = fopen(argv[optind], "rb");
+    if (file == NULL)
+    {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+        memcmp(hdr.magic, FLIGHTREC_MAGIC, sizeof(hdr.magic)) != 0)
+    {
+        fprintf(stderr, "%s is not a flight recorder dump\n", argv[optind]);
+        goto cleanup;
+    }
+
+    if (hdr.version != FLIGHTREC_VERSION ||
+        hdr.event_size != sizeof(struct fr_event) || hdr.events == 0 ||
+        (hdr.events & (hdr.events - 1)))
+    {
+        fprintf(stderr, "Unsupported dump version %u\n", hdr.version);
+        goto cleanup;
+    }
+
+    events = malloc(hdr.events * sizeof(struct fr_event));
+    if (events == NULL ||
+        fread(events, sizeof(struct fr_event), hdr.events, file) !=
+        hdr.events)
+    {
+        fprintf(stderr, "Error reading events from %s\n", argv[optind]);
+        goto cleanup;
+    }
+
+    hdr.name[sizeof(hdr.name) - 1] = '\0';
+    printf("# %s, pid %" PRIu32 ", %" PRIu64 " events recorded", hdr.name,
+           hdr.pid, hdr.head);
+    if (hdr.signo)
+        printf(", dumped on signal %" PRIu32, hdr.signo);
+    printf("\n");
+
+    /* the ring holds the last hdr.events events */
+    first = hdr.head > hdr.events ? hdr.head - hdr.events : 0;
+    if (last && hdr.head - first > last)
+        first = hdr.head - last;
+
+    for (i = first; i < hdr.head; i++)
+    {
+        struct fr_event *ev = &events[i & (hdr.events - 1)];
+
+        if (ev->type == 0 || (type != -1 && ev->type != type))
+            continue;
+
+        print_event(&hdr, ev);
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+  cleanup:
+    free(events);
+    fclose(file);
+
+    return exit_code;
+}
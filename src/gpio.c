@@ -0,0 +1,464 @@
+/*
+ * GPIO lines using the GPIO character device or sysfs.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "gpio.h"
+#include "timebase.h"
+
+#define SYSFS_GPIO_DIR "/sys/class/gpio/"
+#define MAX_GPIO_BUF   300
+
+#define GPIO_CONSUMER  "ic706"
+
+/* Read a sysfs attribute without the trailing newline */
+static int read_attr(const char *path, char *buf, size_t len)
+{
+    ssize_t         num;
+    int             fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    num = read(fd, buf, len - 1);
+    close(fd);
+    if (num <= 0)
+        return -1;
+
+    buf[num] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+
+    return 0;
+}
+
+/* Write a string to a sysfs GPIO attribute.
+ * Returns 0 if OK, 1 if the write failed and -1 if the file can not be
+ * opened. */
+static int write_attr(unsigned int gpio, const char *attr, const char *value)
+{
+    int             fd;
+    int             len = strlen(value);
+    int             wr_err;
+    char            buf[MAX_GPIO_BUF];
+
+    snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "gpio%u/%s", gpio, attr);
+    fd = open(buf, O_WRONLY);
+    if (fd < 0)
+        return -1;
+
+    wr_err = write(fd, value, len) != len;
+    close(fd);
+
+    return wr_err;
+}
+
+/**
+ * Find the GPIO chip of a global GPIO number.
+ *
+ * @param pin     The global number.
+ * @param offset  The offset of the line on the chip.
+ * @return The file descriptor of the chip, or -1 if not found.
+ *
+ * The chip numbers of /dev/gpiochipN are not related to the global
+ * numbers, so the chip is matched by the label of the sysfs gpiochip entry
+ * whose range contains the number.
+ */
+static int open_chip_of(unsigned int pin, unsigned int *offset)
+{
+    struct gpiochip_info info;
+    struct dirent  *ent;
+    DIR            *dir;
+    unsigned long   base, ngpio;
+    char            path[MAX_GPIO_BUF];
+    char            buf[32];
+    char            label[sizeof(info.label)];
+    int             fd;
+    int             i;
+
+    dir = opendir(SYSFS_GPIO_DIR);
+    if (dir == NULL)
+        return -1;
+
+    label[0] = '\0';
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strncmp(ent->d_name, "gpiochip", 8) != 0)
+            continue;
+
+        snprintf(path, sizeof(path), SYSFS_GPIO_DIR "%s/base", ent->d_name);
+        if (read_attr(path, buf, sizeof(buf)))
+            continue;
+        base = strtoul(buf, NULL, 10);
+
+        snprintf(path, sizeof(path), SYSFS_GPIO_DIR "%s/ngpio", ent->d_name);
+        if (read_attr(path, buf, sizeof(buf)))
+            continue;
+        ngpio = strtoul(buf, NULL, 10);
+
+        if (pin < base || pin >= base + ngpio)
+            continue;
+
+        snprintf(path, sizeof(path), SYSFS_GPIO_DIR "%s/label", ent->d_name);
+        if (read_attr(path, label, sizeof(label)) == 0)
+            *offset = pin - base;
+        break;
+    }
+    closedir(dir);
+
+    if (label[0] == '\0')
+    {
+        errno = ENODEV;
+        return -1;
+    }
+
+    for (i = 0;; i++)
+    {
+        snprintf(path, sizeof(path), "/dev/gpiochip%d", i);
+        fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            break;
+
+        if (ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info) == 0 &&
+            strncmp(info.label, label, sizeof(info.label)) == 0)
+            return fd;
+
+        close(fd);
+    }
+
+    errno = ENODEV;
+    return -1;
+}
+
+/**
+ * Open the GPIO chip of a line.
+ *
+ * @param line    The line; the pin is set.
+ * @param pin     "<number>" or "<chip>:<offset>".
+ * @param offset  The offset of the line on the chip.
+ * @return The file descriptor of the chip, or -1 if the character device
+ *         can not be used. line->sysfs is set if sysfs can be used instead.
+ */
+static int open_chip(struct gpio_line *line, const char *pin,
+                     unsigned int *offset)
+{
+    char            path[MAX_GPIO_BUF];
+    char           *end;
+    unsigned long   num;
+    int             fd;
+
+    num = strtoul(pin, &end, 10);
+    if (end == pin || (*end != '\0' && *end != ':'))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (*end == '\0')
+    {
+        line->pin = num;
+        line->sysfs = 1;
+
+        return open_chip_of(num, offset);
+    }
+
+    line->pin = *offset = strtoul(end + 1, NULL, 10);
+    snprintf(path, sizeof(path), "/dev/gpiochip%lu", num);
+    fd = open(path, O_RDWR | O_CLOEXEC);
+
+    return fd;
+}
+
+/* Export a GPIO to sysfs unless it is already exported */
+static int sysfs_export(unsigned int gpio)
+{
+    int             fd;
+    int             len;
+    int             wr_err;
+    char            buf[MAX_GPIO_BUF];
+
+    snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "gpio%u", gpio);
+    if (access(buf, F_OK) == 0)
+        return 0;
+
+    fd = open(SYSFS_GPIO_DIR "export", O_WRONLY);
+    if (fd < 0)
+        return -1;
+
+    len = snprintf(buf, sizeof(buf), "%u", gpio);
+    wr_err = write(fd, buf, len) != len;
+    close(fd);
+
+    return wr_err;
+}
+
+/*  $ echo 7 > /sys/class/gpio/export
+ *  $ echo "in" > /sys/class/gpio/gpio7/direction
+ *  $ echo 1 > /sys/class/gpio/gpio7/active_low
+ *  $ echo "both" > /sys/class/gpio/gpio7/edge
+ *
+ * Ref: https://www.kernel.org/doc/Documentation/gpio/sysfs.txt
+ */
+static int sysfs_open_in(struct gpio_line *line)
+{
+    static const char *edges[] = { "none", "rising", "falling", "both" };
+    char            buf[MAX_GPIO_BUF];
+    int             res;
+    int             wr_err;
+
+    if ((wr_err = sysfs_export(line->pin)) < 0)
+        return -1;
+
+    if ((res = write_attr(line->pin, "direction", "in")) < 0)
+        return -1;
+    wr_err += res;
+
+    if ((res = write_attr(line->pin, "active_low", "1")) < 0)
+        return -1;
+    wr_err += res;
+
+    if ((res = write_attr(line->pin, "edge", edges[line->edge])) < 0)
+        return -1;
+    wr_err += res;
+
+    if (wr_err)
+        fprintf(stderr, "Write errors during GPIO%u init in: %d\n",
+                line->pin, wr_err);
+
+    snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "gpio%u/value", line->pin);
+    line->fd = open(buf, O_RDONLY | O_CLOEXEC);
+    if (line->fd < 0)
+        return -1;
+
+    /* read the value now so that poll() does not report an edge at once */
+    gpio_get(line);
+
+    return 0;
+}
+
+/*  $ echo 20 > /sys/class/gpio/export
+ *  $ echo "low" > /sys/class/gpio/gpio20/direction
+ *
+ * "low" and "high" set the direction and the initial value at once.
+ */
+static int sysfs_open_out(struct gpio_line *line, int value)
+{
+    char            buf[MAX_GPIO_BUF];
+    int             res;
+    int             wr_err;
+
+    if ((wr_err = sysfs_export(line->pin)) < 0)
+        return -1;
+
+    if ((res = write_attr(line->pin, "direction",
+                          value ? "high" : "low")) < 0)
+        return -1;
+    wr_err += res;
+
+    if (wr_err)
+    {
+        fprintf(stderr, "Write errors during GPIO%u init out: %d\n",
+                line->pin, wr_err);
+        errno = EIO;
+        return -1;
+    }
+
+    snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "gpio%u/value", line->pin);
+    line->fd = open(buf, O_RDWR | O_CLOEXEC);
+
+    return line->fd < 0 ? -1 : 0;
+}
+
+void gpio_init(struct gpio_line *line)
+{
+    line->fd = -1;
+    line->sysfs = 0;
+    line->pin = 0;
+    line->edge = GPIO_EDGE_NONE;
+}
+
+int gpio_open_in(struct gpio_line *line, const char *pin, int edge)
+{
+    struct gpioevent_request ereq;
+    struct gpiohandle_request hreq;
+    unsigned int    offset = 0;
+    int             chip_fd;
+    int             res;
+
+    gpio_init(line);
+    line->edge = edge & GPIO_EDGE_BOTH;
+
+    chip_fd = open_chip(line, pin, &offset);
+    if (chip_fd < 0)
+        return line->sysfs ? sysfs_open_in(line) : -1;
+
+    if (line->edge == GPIO_EDGE_NONE)
+    {
+        memset(&hreq, 0, sizeof(hreq));
+        hreq.lineoffsets[0] = offset;
+        hreq.lines = 1;
+        hreq.flags = GPIOHANDLE_REQUEST_INPUT | GPIOHANDLE_REQUEST_ACTIVE_LOW;
+        snprintf(hreq.consumer_label, sizeof(hreq.consumer_label), "%s",
+                 GPIO_CONSUMER);
+        res = ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &hreq);
+        line->fd = hreq.fd;
+    }
+    else
+    {
+        /* Both edges are always requested and the unwanted ones are
+         * dropped in gpio_read_event(): older kernels do not invert the
+         * requested edge of an active low line, but the reported edge is
+         * always the logical one. */
+        memset(&ereq, 0, sizeof(ereq));
+        ereq.lineoffset = offset;
+        ereq.handleflags =
+            GPIOHANDLE_REQUEST_INPUT | GPIOHANDLE_REQUEST_ACTIVE_LOW;
+        ereq.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+        snprintf(ereq.consumer_label, sizeof(ereq.consumer_label), "%s",
+                 GPIO_CONSUMER);
+        res = ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &ereq);
+        line->fd = ereq.fd;
+
+        /* gpio_read_event() must not block */
+        if (res == 0)
+            fcntl(line->fd, F_SETFL, O_NONBLOCK);
+    }
+    close(chip_fd);
+
+    /* EBUSY: the line is exported to sysfs */
+    if (res == -1)
+    {
+        line->fd = -1;
+        return line->sysfs ? sysfs_open_in(line) : -1;
+    }
+
+    line->sysfs = 0;
+
+    return 0;
+}
+
+int gpio_open_out(struct gpio_line *line, const char *pin, int value)
+{
+    struct gpiohandle_request req;
+    unsigned int    offset = 0;
+    int             chip_fd;
+    int             res;
+
+    gpio_init(line);
+
+    chip_fd = open_chip(line, pin, &offset);
+    if (chip_fd < 0)
+        return line->sysfs ? sysfs_open_out(line, value) : -1;
+
+    memset(&req, 0, sizeof(req));
+    req.lineoffsets[0] = offset;
+    req.lines = 1;
+    req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+    req.default_values[0] = !!value;
+    snprintf(req.consumer_label, sizeof(req.consumer_label), "%s",
+             GPIO_CONSUMER);
+    res = ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &req);
+    close(chip_fd);
+
+    if (res == -1)
+        return line->sysfs ? sysfs_open_out(line, value) : -1;
+
+    line->fd = req.fd;
+    line->sysfs = 0;
+
+    return 0;
+}
+
+int gpio_set(struct gpio_line *line, int value)
+{
+    struct gpiohandle_data data;
+
+    if (line->sysfs)
+        return pwrite(line->fd, value ? "1" : "0", 1, 0) == 1 ? 0 : -1;
+
+    memset(&data, 0, sizeof(data));
+    data.values[0] = !!value;
+
+    return ioctl(line->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
+}
+
+int gpio_get(struct gpio_line *line)
+{
+    struct gpiohandle_data data;
+    char            ch;
+
+    /* reading from the start also clears a pending sysfs edge */
+    if (line->sysfs)
+        return pread(line->fd, &ch, 1, 0) == 1 ? ch == '1' : -1;
+
+    if (ioctl(line->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) == -1)
+        return -1;
+
+    return data.values[0];
+}
+
+short gpio_poll_events(const struct gpio_line *line)
+{
+    return line->sysfs ? POLLPRI : POLLIN;
+}
+
+int gpio_read_event(struct gpio_line *line, struct gpio_event *ev)
+{
+    struct gpioevent_data data;
+    uint64_t        now;
+    ssize_t         num;
+
+    if (line->sysfs)
+    {
+        ev->time = time_ns();
+        ev->delay = 0;
+        ev->value = gpio_get(line);
+        if (ev->value < 0)
+            return -1;
+    }
+    else
+    {
+        num = read(line->fd, &data, sizeof(data));
+        if (num == -1)
+            return errno == EAGAIN ? 0 : -1;
+        if (num != sizeof(data))
+            return 0;
+
+        /* kernels before 5.7 stamp the events with CLOCK_REALTIME */
+        ev->time = data.timestamp;
+        now = time_ns();
+        if (ev->time > now)
+            ev->time -= time_wall_us() * 1000 - now;
+        ev->delay = now > ev->time ? (now - ev->time) / 1000 : 0;
+
+        ev->value = data.id == GPIOEVENT_EVENT_RISING_EDGE;
+    }
+
+    if ((ev->value && !(line->edge & GPIO_EDGE_RISING)) ||
+        (!ev->value && !(line->edge & GPIO_EDGE_FALLING)))
+        return 0;
+
+    return 1;
+}
+
+void gpio_close(struct gpio_line *line)
+{
+    if (line->fd >= 0)
+        close(line->fd);
+
+    line->fd = -1;
+}
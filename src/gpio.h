@@ -0,0 +1,134 @@
+/*
+ * GPIO lines using the GPIO character device or sysfs.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __GPIO_H__
+#define __GPIO_H__
+
+#include <stdint.h>
+
+/**
+ * @file
+ * GPIO inputs and outputs that stay open while the daemon runs.
+ *
+ * A line is requested from the GPIO character device, /dev/gpiochipN, when
+ * the kernel has one. Setting an output is then a single ioctl() on the
+ * line handle, and edges on an input are queued by the kernel with a
+ * timestamp taken in the interrupt handler. Otherwise the line is exported
+ * through /sys/class/gpio, as in the past, and the value file is kept open.
+ *
+ * Lines are given as strings: either the global GPIO number known from
+ * sysfs, e.g. "20", or a chip and line offset, e.g. "0:20" for line 20 of
+ * /dev/gpiochip0. Global numbers are mapped to a chip through the gpiochip
+ * entries in /sys/class/gpio; the sysfs backend is used if that fails or if
+ * the line has already been exported to sysfs, e.g. by a boot script.
+ *
+ * Inputs are active low.
+ */
+
+#define GPIO_EDGE_NONE      0
+#define GPIO_EDGE_RISING    1
+#define GPIO_EDGE_FALLING   2
+#define GPIO_EDGE_BOTH      3
+
+/**
+ * An open GPIO line.
+ *
+ * @fd     Line handle or event file descriptor, or the sysfs value file;
+ *         -1 if the line is not open.
+ * @sysfs  Non-zero if the line uses sysfs.
+ * @pin    The global GPIO number; the line offset for "chip:offset".
+ * @edge   The edges reported by gpio_read_event(), GPIO_EDGE_xyz.
+ */
+struct gpio_line {
+    int             fd;
+    int             sysfs;
+    unsigned int    pin;
+    int             edge;
+};
+
+/**
+ * An edge on an input.
+ *
+ * @time   CLOCK_MONOTONIC time of the edge (nsec).
+ * @delay  Time from the edge until it was read (usec); 0 with sysfs.
+ * @value  The logical value after the edge.
+ */
+struct gpio_event {
+    uint64_t        time;
+    uint32_t        delay;
+    int             value;
+};
+
+/** Initialize a line that is not open; gpio_close() is a no-op. */
+void            gpio_init(struct gpio_line *line);
+
+/**
+ * Open a GPIO as an active low input.
+ *
+ * @param line  The line.
+ * @param pin   The GPIO, "<number>" or "<chip>:<offset>".
+ * @param edge  The edges to report, GPIO_EDGE_xyz.
+ * @return 0 if OK, -1 if an error occurred (errno is set).
+ *
+ * Poll line->fd for gpio_poll_events() to wait for edges.
+ */
+int             gpio_open_in(struct gpio_line *line, const char *pin,
+                             int edge);
+
+/**
+ * Open a GPIO as an output.
+ *
+ * @param line   The line.
+ * @param pin    The GPIO, "<number>" or "<chip>:<offset>".
+ * @param value  The initial value.
+ * @return 0 if OK, -1 if an error occurred (errno is set).
+ */
+int             gpio_open_out(struct gpio_line *line, const char *pin,
+                              int value);
+
+/**
+ * Set the value of an output.
+ *
+ * @return 0 if OK, -1 if an error occurred (errno is set).
+ */
+int             gpio_set(struct gpio_line *line, int value);
+
+/**
+ * Get the current value of a line.
+ *
+ * @return The logical value, or -1 if an error occurred (errno is set).
+ */
+int             gpio_get(struct gpio_line *line);
+
+/**
+ * Get the poll() events that signal an edge on an input: POLLIN for the
+ * character device and POLLPRI for sysfs. With select(), use readfds and
+ * exceptfds respectively.
+ */
+short           gpio_poll_events(const struct gpio_line *line);
+
+/**
+ * Read an edge after poll() has signalled one.
+ *
+ * @param line  The line.
+ * @param ev    The edge.
+ * @retval  1   An edge was read.
+ * @retval  0   No edge is pending, or it was not one of the requested
+ *              edges.
+ * @retval -1   An error occurred (errno is set).
+ *
+ * Reads at most one edge; if more are queued, the file descriptor stays
+ * ready. A sysfs line can not tell whether an edge is pending, so only call
+ * this when poll() says so. The sysfs backend has no kernel timestamp, so
+ * the time of the read is used.
+ */
+int             gpio_read_event(struct gpio_line *line,
+                                struct gpio_event *ev);
+
+/** Close the line. */
+void            gpio_close(struct gpio_line *line);
+
+#endif
@@ -21,17 +21,35 @@
 #include <unistd.h>
 
 #include "common.h"
-
-/* GPIO pin controlling panel power */
-#define  PANEL_PWR_PIN 20
+#include "flightrec.h"
+#include "gpio.h"
+#include "metrics.h"
+#include "metrics_series.h"
+#include "prof.h"
 
 static char    *uart = NULL;    /* UART port */
 static char    *server_ip = NULL;       /* Server IP */
+static char    *metrics_spec = NULL;    /* metrics port or socket path */
+static char    *series_spec = NULL;     /* metrics time series file */
+static char    *pwk_pin = NULL; /* GPIO sensing the power button */
+static char    *panel_pin = NULL;       /* GPIO controlling panel power */
+static int      prof_interval = 0;      /* profiler table interval in sec */
 static int      server_port = 42000;    /* Network port */
 static int      keep_running = 1;       /* set to 0 to exit infinite loop */
+static int      observer = 0;   /* don't request control of the radio */
+static int      use_gpio = 1;   /* power button and panel power GPIOs */
+
+/* Set by SIGUSR1 / SIGUSR2 to request / release control of the radio */
+static volatile sig_atomic_t ctl_request = -1;
 
 void signal_handler(int signo)
 {
+    if (signo == SIGUSR1 || signo == SIGUSR2)
+    {
+        ctl_request = (signo == SIGUSR1);
+        return;
+    }
+
     if (signo == SIGINT)
         fprintf(stderr, "\nCaught SIGINT\n");
     else if (signo == SIGTERM)
@@ -50,7 +68,20 @@ static void help(void)
         "  -s    Server IP (default is 127.0.0.1).\n"
         "  -p    Network port number (default is 42000).\n"
         "  -u    Uart port (default is /dev/ttyO1).\n"
-        "  -h    This help message.\n\n";
+        "  -o    Observer; don't request control of the radio.\n"
+        "  -g    Don't use GPIO, e.g. when testing with ic706_sim.\n"
+        "  -W    GPIO sensing the power button, <number> or\n"
+        "        <chip>:<offset> (default is 7).\n"
+        "  -E    GPIO controlling the panel power (default is 20).\n"
+        "  -M    Serve live metrics in Prometheus format on the given\n"
+        "        port on 127.0.0.1 or on a Unix socket path.\n"
+        "  -T    Record the metrics every second in a memory-mapped file:\n"
+        "        <path>[,interval=<ms>][,records=<num>].\n"
+        "  -P    Print a CPU profile of the processing stages every given\n"
+        "        number of seconds.\n"
+        "  -h    This help message.\n\n"
+        " Send SIGUSR1 to request control and SIGUSR2 to release it.\n"
+        " SIGQUIT dumps the flight recorder, see flightrec.h.\n\n";
 
     fprintf(stderr, "%s", help_string);
 }
@@ -62,7 +93,7 @@ static void parse_options(int argc, char **argv)
 
     if (argc > 1)
     {
-        while ((option = getopt(argc, argv, "s:p:u:h")) != -1)
+        while ((option = getopt(argc, argv, "s:p:u:ogW:E:M:T:P:h")) != -1)
         {
             switch (option)
             {
@@ -78,6 +109,34 @@ static void parse_options(int argc, char **argv)
                 uart = strdup(optarg);
                 break;
 
+            case 'o':
+                observer = 1;
+                break;
+
+            case 'g':
+                use_gpio = 0;
+                break;
+
+            case 'W':
+                pwk_pin = strdup(optarg);
+                break;
+
+            case 'E':
+                panel_pin = strdup(optarg);
+                break;
+
+            case 'M':
+                metrics_spec = strdup(optarg);
+                break;
+
+            case 'T':
+                series_spec = strdup(optarg);
+                break;
+
+            case 'P':
+                prof_interval = atoi(optarg);
+                break;
+
             case 'h':
                 help();
                 exit(EXIT_SUCCESS);
@@ -96,22 +155,38 @@ int main(int argc, char **argv)
     int             exit_code = EXIT_FAILURE;
     int             net_fd = -1;
     int             uart_fd = -1;
-    int             pwk_fd = -1;
     int             connected = 0;
+    int             in_control = 0;
     int             poweron = 0;
+    unsigned int    attempts = 0;   /* failed connection attempts */
+    uint32_t        token;
     struct sockaddr_in serv_addr;
     struct xfr_buf  uart_buf, net_buf;
+    struct link_stats link;
+    struct gpio_line pwk, panel;
+    struct gpio_event edge;
+    uint8_t         ping[PING_MSG_LEN];
     fd_set          readfds, exceptfds;
 
     struct timeval  timeout;
     int             res;
+    int             mfd;
+    struct metrics  metrics;
+    struct metrics_series series;
+
+    metrics_init(&metrics, "ic706_client");
+    gpio_init(&pwk);
+    gpio_init(&panel);
+    metrics_series_init(&series, &metrics);
 
     /* initialize buffers */
     uart_buf.wridx = 0;
+    uart_buf.pktlen = 0;
     uart_buf.write_errors = 0;
     uart_buf.valid_pkts = 0;
     uart_buf.invalid_pkts = 0;
     net_buf.wridx = 0;
+    net_buf.pktlen = 0;
     net_buf.write_errors = 0;
     net_buf.valid_pkts = 0;
     net_buf.invalid_pkts = 0;
@@ -121,12 +196,25 @@ int main(int argc, char **argv)
         printf("Warning: Can't catch SIGINT\n");
     if (signal(SIGTERM, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGTERM\n");
+    if (signal(SIGUSR1, signal_handler) == SIG_ERR)
+        printf("Warning: Can't catch SIGUSR1\n");
+    if (signal(SIGUSR2, signal_handler) == SIG_ERR)
+        printf("Warning: Can't catch SIGUSR2\n");
 
     parse_options(argc, argv);
     if (uart == NULL)
         uart = strdup("/dev/ttyO1");
     if (server_ip == NULL)
         server_ip = strdup("127.0.0.1");
+    if (pwk_pin == NULL)
+        pwk_pin = strdup("7");
+    if (panel_pin == NULL)
+        panel_pin = strdup("20");
+
+    /* SIGUSR1 is taken by control requests */
+    flightrec_init("ic706_client", SIGQUIT);
+    if (prof_interval)
+        prof_init(prof_interval);
 
     fprintf(stderr, "Using UART %s\n", uart);
     fprintf(stderr, "Using server IP %s\n", server_ip);
@@ -149,30 +237,24 @@ int main(int argc, char **argv)
         goto cleanup;
     }
 
-    /* power button input */
-    pwk_fd = pwk_init();
-    if (pwk_fd < 0)
+    /* power button input; a press is a falling edge of the active low
+     * input, i.e. when the button is released */
+    if (!use_gpio)
     {
-        fprintf(stderr, "Error configuring PWK GPIO: %d: %s\n", errno,
-                strerror(errno));
-        goto cleanup;
+        fprintf(stderr, "Not using GPIO\n");
     }
-    else
+    else if (gpio_open_in(&pwk, pwk_pin, GPIO_EDGE_FALLING) == -1)
     {
-        /* read the gpio now to prevent the first trig */
-        char            ch;
-
-        if (read(pwk_fd, &ch, 1) == -1)
-            fprintf(stderr, "Error reading PWK: %d: %s\n",
-                    errno, strerror(errno));
-
+        fprintf(stderr, "Error configuring PWK GPIO %s: %d: %s\n", pwk_pin,
+                errno, strerror(errno));
+        goto cleanup;
     }
 
     /* Control panel power */
-    if (gpio_init_out(PANEL_PWR_PIN) == -1)
+    if (use_gpio && gpio_open_out(&panel, panel_pin, 0) == -1)
     {
-        fprintf(stderr, "Error configuring panel GPIO: %d: %s\n", errno,
-                strerror(errno));
+        fprintf(stderr, "Error configuring panel GPIO %s: %d: %s\n",
+                panel_pin, errno, strerror(errno));
         goto cleanup;
     }
 
@@ -186,11 +268,56 @@ int main(int argc, char **argv)
         goto cleanup;
     }
 
+    if (metrics_spec || series_spec)
+    {
+        METRICS_ADD(&metrics, "uart_valid_packets_total", METRIC_COUNTER,
+                    "Valid packets received from the panel.",
+                    uart_buf.valid_pkts);
+        METRICS_ADD(&metrics, "uart_invalid_packets_total", METRIC_COUNTER,
+                    "Invalid packets received from the panel.",
+                    uart_buf.invalid_pkts);
+        METRICS_ADD(&metrics, "uart_write_errors_total", METRIC_COUNTER,
+                    "Errors writing panel data to the server.",
+                    uart_buf.write_errors);
+        METRICS_ADD(&metrics, "net_valid_packets_total", METRIC_COUNTER,
+                    "Valid packets received from the server.",
+                    net_buf.valid_pkts);
+        METRICS_ADD(&metrics, "net_invalid_packets_total", METRIC_COUNTER,
+                    "Invalid packets received from the server.",
+                    net_buf.invalid_pkts);
+        METRICS_ADD(&metrics, "net_write_errors_total", METRIC_COUNTER,
+                    "Errors writing to the panel or the server.",
+                    net_buf.write_errors);
+        METRICS_ADD(&metrics, "connected", METRIC_GAUGE,
+                    "1 if connected to the server.", connected);
+        METRICS_ADD(&metrics, "in_control", METRIC_GAUGE,
+                    "1 if this client has control of the radio.",
+                    in_control);
+        METRICS_ADD(&metrics, "link_srtt_us", METRIC_GAUGE,
+                    "Smoothed round trip time to the server.", link.srtt);
+        METRICS_ADD(&metrics, "link_jitter_us", METRIC_GAUGE,
+                    "Round trip time variation.", link.jitter);
+        METRICS_ADD(&metrics, "link_probes_total", METRIC_COUNTER,
+                    "Link probes sent since connecting.", link.pings);
+        METRICS_ADD(&metrics, "link_probes_lost_total", METRIC_COUNTER,
+                    "Link probes without reply since connecting.",
+                    link.lost);
+        if (metrics_spec && metrics_open(&metrics, metrics_spec))
+            goto cleanup;
+        if (series_spec && metrics_series_open(&series, series_spec))
+            goto cleanup;
+    }
+
     FD_ZERO(&readfds);
     FD_ZERO(&exceptfds);
 
+    /* identifies this client when reconnecting */
+    token = session_token_create();
+
     while (keep_running)
     {
+        metrics_series_process(&series, time_ms());
+
         if (net_fd == -1)
         {
             net_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -202,7 +329,9 @@ int main(int argc, char **argv)
             }
         }
 
-        /* Try to connect to server */
+        /* Try to connect to server; the first attempt after losing the
+         * connection is immediate */
+        usleep(1000 * reconnect_delay_ms(attempts));
         if (connect(net_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr))
             == -1)
         {
@@ -212,7 +341,7 @@ int main(int argc, char **argv)
             if (errno == ECONNREFUSED || errno == ENETUNREACH ||
                 errno == ETIMEDOUT)
             {
-                sleep(1);
+                attempts++;
                 continue;
             }
             else
@@ -222,62 +351,161 @@ int main(int argc, char **argv)
         }
 
         connected = 1;
+        attempts = 0;
+        if (set_nodelay(net_fd))
+            fprintf(stderr, "Error setting TCP_NODELAY: %d: %s\n", errno,
+                    strerror(errno));
+        net_buf.wridx = 0;
+        net_buf.pktlen = 0;
         fprintf(stderr, "Connected...\n");
+        flightrec_event(FR_EV_CONNECT, 0, net_fd,
+                        ntohl(serv_addr.sin_addr.s_addr));
+        link_init(&link);
+
+        /* The session token lets the server restore our previous session,
+         * e.g. give control back after a short outage. The server gives
+         * control to the first client; tell it what we want in case we are
+         * not the first or we are an observer. */
+        net_buf.write_errors += send_session_message(net_fd, token);
+        net_buf.write_errors += send_ctl_message(net_fd, !observer);
 
         while (keep_running && connected)
         {
             /* FIXME: don't need to set this every time? */
             FD_SET(net_fd, &readfds);
             FD_SET(uart_fd, &readfds);
-            FD_SET(pwk_fd, &exceptfds);
+            if (pwk.fd != -1)
+                FD_SET(pwk.fd, pwk.sysfs ? &exceptfds : &readfds);
+            mfd = metrics_fd(&metrics);
+            if (mfd != -1)
+                FD_SET(mfd, &readfds);
+
+            /* A dead link is detected much faster using probes than by
+             * TCP; reconnect right away */
+            if (link_is_dead(&link, time_ms()))
+            {
+                fprintf(stderr, "No reply to link probes for %d ms\n",
+                        LINK_TIMEOUT_MS);
+                link_print_stats(&link);
+                flightrec_event(FR_EV_DISCONNECT, 0, net_fd, 0);
+                FD_CLR(net_fd, &readfds);
+                close(net_fd);
+                net_fd = -1;
+                connected = 0;
+                break;
+            }
+
+            if (link_ping_due(&link, time_ms()))
+            {
+                link_make_ping(&link, ping);
+                net_buf.write_errors +=
+                    write(net_fd, ping, PING_MSG_LEN) != PING_MSG_LEN;
+            }
+
+            if (ctl_request != -1)
+            {
+                net_buf.write_errors += send_ctl_message(net_fd, ctl_request);
+                ctl_request = -1;
+            }
 
             /* previous select may have altered timeout */
-            timeout.tv_sec = 1;
-            timeout.tv_usec = 0;
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 200000;
+            metrics_series_process(&series, time_ms());
+            prof_process(time_ms());
             res = select(FD_SETSIZE, &readfds, NULL, &exceptfds, &timeout);
 
             if (res <= 0)
                 continue;
 
-            /* service network socket */
+            if (mfd != -1 && FD_ISSET(mfd, &readfds))
+            {
+                /* the descriptor may change; don't leave it in the set */
+                FD_CLR(mfd, &readfds);
+                metrics_process(&metrics);
+            }
+
+            /* service network socket; one read may return several
+             * packets */
             if (FD_ISSET(net_fd, &readfds))
             {
-                if (transfer_data(net_fd, uart_fd, &net_buf) == PKT_TYPE_EOF)
+                do
                 {
-                    fprintf(stderr, "Connection closed (FD=%d)\n", net_fd);
-                    FD_CLR(net_fd, &readfds);
-                    close(net_fd);
-                    net_fd = -1;
-                    connected = 0;
+                    switch (transfer_data(net_fd, uart_fd, &net_buf))
+                    {
+                    case PKT_TYPE_PING:
+                        if (!link_make_pong(net_buf.data, ping))
+                            link_process_pong(&link, net_buf.data);
+                        else
+                            net_buf.write_errors +=
+                                write(net_fd, ping,
+                                      PING_MSG_LEN) != PING_MSG_LEN;
+                        break;
+
+                    case PKT_TYPE_CTL:
+                        in_control = net_buf.data[2];
+                        fprintf(stderr, "%s\n", in_control ?
+                                "In control of the radio" :
+                                "Observing the radio");
+                        break;
+
+                    case PKT_TYPE_PWK:
+                        /* power state of the radio; sent by the server
+                         * when we connect */
+                        if (net_buf.data[2] != poweron)
+                        {
+                            poweron = net_buf.data[2];
+                            fprintf(stderr,
+                                    "Power status: %d (from server)\n",
+                                    poweron);
+                            if (use_gpio)
+                                gpio_set(&panel, poweron);
+                        }
+                        break;
+
+                    case PKT_TYPE_EOF:
+                        fprintf(stderr, "Connection closed (FD=%d)\n",
+                                net_fd);
+                        link_print_stats(&link);
+                        flightrec_event(FR_EV_DISCONNECT, 0, net_fd, 0);
+                        FD_CLR(net_fd, &readfds);
+                        close(net_fd);
+                        net_fd = -1;
+                        connected = 0;
+                        break;
+                    }
                 }
+                while (connected && packet_pending(&net_buf));
             }
 
             /* service UART port */
             if (FD_ISSET(uart_fd, &readfds))
-                transfer_data(uart_fd, net_fd, &uart_buf);
+            {
+                do
+                    transfer_data(uart_fd, net_fd, &uart_buf);
+                while (packet_pending(&uart_buf));
+            }
 
             /* power button interrupts */
-            if (FD_ISSET(pwk_fd, &exceptfds))
+            if (pwk.fd != -1 &&
+                FD_ISSET(pwk.fd, pwk.sysfs ? &exceptfds : &readfds))
             {
-                /* FIXME: If pin is debounce-filtered and we only trigger on
-                   one edge we don't really need to read the value */
-                char            ch;
-
-                lseek(pwk_fd, 0, SEEK_SET);
-                if (read(pwk_fd, &ch, 1) == -1)
+                res = gpio_read_event(&pwk, &edge);
+                if (res == -1)
                 {
                     fprintf(stderr,
                             "Error reading PWK after button press %d (%s)\n",
                             errno, strerror(errno));
                 }
-                else if (ch == '0')
+                else if (res == 1)
                 {
-                    /* falling edge */
                     poweron = !poweron;
-                    fprintf(stderr, "Power status: %d\n", poweron);
-                    gpio_set_value(PANEL_PWR_PIN, poweron);
+                    gpio_set(&panel, poweron);
                     if (connected)
                         send_pwr_message(net_fd, poweron);
+                    flightrec_event(FR_EV_GPIO, edge.value, pwk.pin,
+                                    edge.delay);
+                    fprintf(stderr, "Power status: %d\n", poweron);
                 }
             }
 
@@ -288,14 +516,32 @@ int main(int argc, char **argv)
     fprintf(stderr, "Shutting down...\n");
     exit_code = EXIT_SUCCESS;
 
+    /* release control so that the server does not reserve it for us */
+    if (connected && in_control)
+        send_ctl_message(net_fd, 0);
+
   cleanup:
+    if (connected)
+        link_print_stats(&link);
     close(net_fd);
     close(uart_fd);
-    close(pwk_fd);
+    gpio_close(&pwk);
+    gpio_close(&panel);
+    metrics_close(&metrics);
+    metrics_series_close(&series);
+    prof_print();
     if (uart != NULL)
         free(uart);
     if (server_ip != NULL)
         free(server_ip);
+    if (metrics_spec != NULL)
+        free(metrics_spec);
+    if (series_spec != NULL)
+        free(series_spec);
+    if (pwk_pin != NULL)
+        free(pwk_pin);
+    if (panel_pin != NULL)
+        free(panel_pin);
 
     fprintf(stderr, "  Valid packets uart / net: %" PRIu64 " / %" PRIu64 "\n",
             uart_buf.valid_pkts, net_buf.valid_pkts);
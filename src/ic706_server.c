@@ -15,26 +15,122 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/poll.h>
 #include <sys/socket.h>
 #include <termios.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "flightrec.h"
+#include "gpio.h"
+#include "metrics.h"
+#include "metrics_series.h"
+#include "pkt_queue.h"
+#include "prof.h"
 
 
 static char    *uart = NULL;    /* UART port */
+static char    *metrics_spec = NULL;    /* metrics port or socket path */
+static char    *series_spec = NULL;     /* metrics time series file */
+static char    *pwk_pin = NULL; /* GPIO driving the PWK line */
+static int      prof_interval = 0;      /* profiler table interval in sec */
 static int      port = 42000;   /* Network port */
+static int      max_sessions = 8;       /* Max number of connections */
+static int      use_gpio = 1;   /* drive the PWK line */
 static int      keep_running = 1;       /* set to 0 to exit infinite loop */
 
-/* Copy of connected client IP address in betwork byte order.
- * Used to check whether a new conection comes from a client that has
- * connected earlier but disappeared without properly disconnecting.
+/* Maximum number of simultaneous connections (-n option) */
+#define MAX_SESSIONS        16
+
+/* Number of frames queued per connection */
+#define SESSION_QUEUE_LEN   32
+
+/* Disconnect a session that has not accepted any data for this long */
+#define SESSION_STALL_MS    10000
+
+/**
+ * Client connection.
+ *
+ * @fd              The socket or -1 if the slot is not in use.
+ * @addr            The address of the client.
+ * @buf             Buffer used to collect panel data from the client.
+ * @outq            Frames waiting to be sent to the client.
+ * @stall_time      Time when the queue first overflowed, 0 if not stalled.
+ * @frames_sent     Number of frames sent to the client.
+ * @frames_dropped  Number of frames dropped because the queue was full.
+ * @frames_ignored  Number of panel frames ignored because the session did
+ *                  not have control.
+ * @link            Round trip time and probe statistics.
+ * @token           Session token sent by the client; 0 if none.
+ *
+ * Each session has its own output queue. A slow connection only causes
+ * frames to be dropped from its own queue and does not delay the others.
+ */
+struct session {
+    int             fd;
+    struct sockaddr_in addr;
+    struct xfr_buf  buf;
+    pkt_queue_t     outq;
+    uint64_t        stall_time;
+
+    uint64_t        frames_sent;
+    uint64_t        frames_dropped;
+    uint64_t        frames_ignored;
+
+    struct link_stats link;
+    uint32_t        token;
+};
+
+/* The session that has control of the radio, NULL if nobody has. Only the
+ * controlling session can send panel data (PTT, buttons, tuning, power)
+ * to the radio; the other sessions are read-only observers.
  */
-uint32_t        client_addr = 0;
+static struct session *controller = NULL;
 
-/* GPIO pin used to emulate PWK signal */
-#define  GPIO_PWK 20
+/* When the controller disconnects without releasing control, control is
+ * reserved for its session token for RESUME_HOLD_MS so that the client can
+ * resume after a short outage without an observer taking over.
+ */
+static uint32_t reserved_token = 0;
+static uint64_t reserved_until = 0;
+
+/* The last LCD frame from the radio; sent to new sessions so that the
+ * display is restored at once */
+static uint8_t  lcd_cache[RDBUF_SIZE];
+static int      lcd_cache_len = 0;
+
+/* Frame counters of closed sessions; see update_metrics() */
+static uint64_t closed_frames_sent = 0;
+static uint64_t closed_frames_dropped = 0;
+static uint64_t closed_frames_ignored = 0;
+
+/**
+ * Totals over all sessions, computed when the metrics are requested.
+ *
+ * @net_valid       Valid packets received from clients.
+ * @net_invalid     Invalid packets received from clients.
+ * @net_errors      Write errors on the UART for panel data.
+ * @frames_sent     Frames sent to clients.
+ * @frames_dropped  Frames dropped because a client was too slow.
+ * @frames_ignored  Panel frames ignored because the client was observer.
+ * @sessions        Number of open sessions.
+ * @controlled      1 if a session has control of the radio.
+ */
+struct server_metrics {
+    uint64_t        net_valid;
+    uint64_t        net_invalid;
+    uint64_t        net_errors;
+    uint64_t        frames_sent;
+    uint64_t        frames_dropped;
+    uint64_t        frames_ignored;
+    uint32_t        sessions;
+    uint32_t        controlled;
+};
+
+static int control_reserved(uint64_t now)
+{
+    return reserved_token && now < reserved_until;
+}
 
 void signal_handler(int signo)
 {
@@ -56,7 +152,20 @@ static void help(void)
         "\n"
         "  -p    Network port number (default is 42000).\n"
         "  -u    Uart port (default is /dev/ttyO1).\n"
-        "  -h    This help message.\n\n";
+        "  -n    Max number of connections (default is 8, max 16).\n"
+        "        The first client gets control of the radio, the others\n"
+        "        are observers until control is released.\n"
+        "  -g    Don't use GPIO, e.g. when testing with ic706_sim.\n"
+        "  -W    GPIO driving the PWK line, <number> or <chip>:<offset>\n"
+        "        (default is 20).\n"
+        "  -M    Serve live metrics in Prometheus format on the given\n"
+        "        port on 127.0.0.1 or on a Unix socket path.\n"
+        "  -T    Record the metrics every second in a memory-mapped file:\n"
+        "        <path>[,interval=<ms>][,records=<num>].\n"
+        "  -P    Print a CPU profile of the processing stages every given\n"
+        "        number of seconds.\n"
+        "  -h    This help message.\n"
+        "\n SIGUSR1 dumps the flight recorder, see flightrec.h.\n\n";
 
     fprintf(stderr, "%s", help_string);
 }
@@ -68,7 +177,7 @@ static void parse_options(int argc, char **argv)
 
     if (argc > 1)
     {
-        while ((option = getopt(argc, argv, "p:u:h")) != -1)
+        while ((option = getopt(argc, argv, "p:u:n:gW:M:T:P:h")) != -1)
         {
             switch (option)
             {
@@ -80,6 +189,34 @@ static void parse_options(int argc, char **argv)
                 uart = strdup(optarg);
                 break;
 
+            case 'n':
+                max_sessions = atoi(optarg);
+                if (max_sessions < 1)
+                    max_sessions = 1;
+                else if (max_sessions > MAX_SESSIONS)
+                    max_sessions = MAX_SESSIONS;
+                break;
+
+            case 'g':
+                use_gpio = 0;
+                break;
+
+            case 'W':
+                pwk_pin = strdup(optarg);
+                break;
+
+            case 'M':
+                metrics_spec = strdup(optarg);
+                break;
+
+            case 'T':
+                series_spec = strdup(optarg);
+                break;
+
+            case 'P':
+                prof_interval = atoi(optarg);
+                break;
+
             case 'h':
                 help();
                 exit(EXIT_SUCCESS);
@@ -92,38 +229,377 @@ static void parse_options(int argc, char **argv)
     }
 }
 
+static void session_reset_buf(struct session *s)
+{
+    s->buf.wridx = 0;
+    s->buf.pktlen = 0;
+    s->buf.write_errors = 0;
+    s->buf.valid_pkts = 0;
+    s->buf.invalid_pkts = 0;
+}
+
+static void session_open(struct session *s, int fd, struct sockaddr_in *addr)
+{
+    s->fd = fd;
+    s->addr = *addr;
+    s->stall_time = 0;
+    s->frames_sent = 0;
+    s->frames_dropped = 0;
+    s->frames_ignored = 0;
+    session_reset_buf(s);
+    link_init(&s->link);
+    s->token = 0;
+    pkt_queue_clear(&s->outq);
+    flightrec_event(FR_EV_CONNECT, 0, fd, ntohl(addr->sin_addr.s_addr));
+}
+
+static void session_close(struct session *s, struct xfr_buf *totals)
+{
+    flightrec_event(FR_EV_DISCONNECT, 0, s->fd, 0);
+    fprintf(stderr, "Connection closed (FD=%d)%s\n", s->fd,
+            s == controller ? "; control released" : "");
+    fprintf(stderr, "  Frames sent / dropped / ignored: %" PRIu64 " / %"
+            PRIu64 " / %" PRIu64 "\n", s->frames_sent, s->frames_dropped,
+            s->frames_ignored);
+    link_print_stats(&s->link);
+
+    totals->valid_pkts += s->buf.valid_pkts;
+    totals->invalid_pkts += s->buf.invalid_pkts;
+    totals->write_errors += s->buf.write_errors;
+    closed_frames_sent += s->frames_sent;
+    closed_frames_dropped += s->frames_dropped;
+    closed_frames_ignored += s->frames_ignored;
+
+    if (s == controller)
+    {
+        controller = NULL;
+        flightrec_event(FR_EV_CONTROL, 0, s->fd, 0);
+        if (s->token)
+        {
+            reserved_token = s->token;
+            reserved_until = time_ms() + RESUME_HOLD_MS;
+        }
+    }
+
+    close(s->fd);
+    s->fd = -1;
+    pkt_queue_clear(&s->outq);
+}
+
+/**
+ * Send as much of the output queue as the socket accepts.
+ *
+ * @return 0 if OK, -1 if a write error occurred.
+ */
+static int session_flush(struct session *s)
+{
+    struct prof_sample ps;
+    uint8_t        *data;
+    uint16_t        len = 0;
+    int             num;
+
+    while ((data = pkt_queue_front(&s->outq, &len)) != NULL)
+    {
+        prof_begin(&ps);
+        num = send(s->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        prof_end(PROF_WRITE, &ps);
+        if (num < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            fprintf(stderr, "Error writing to client (FD=%d): %d: %s\n",
+                    s->fd, errno, strerror(errno));
+            return -1;
+        }
+
+        if (pkt_queue_consume(&s->outq, num))
+        {
+            s->frames_sent++;
+            s->stall_time = 0;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Queue a frame for the session and try to send it right away.
+ *
+ * @return 0 if OK, -1 if the session should be closed because of a write
+ *         error or because it has been stalled for more than
+ *         SESSION_STALL_MS.
+ *
+ * If the queue is full the oldest frame is dropped, so a client that can
+ * not keep up gets the current state of the display once it catches up.
+ */
+static int session_send(struct session *s, const uint8_t * data,
+                        uint16_t len, uint64_t now)
+{
+    if (pkt_queue_is_full(&s->outq))
+    {
+        if (pkt_queue_drop_oldest(&s->outq))
+        {
+            s->frames_dropped++;
+            flightrec_event(FR_EV_DROP, 0, s->fd, 1);
+        }
+
+        if (!s->stall_time)
+            s->stall_time = now;
+        else if (now - s->stall_time > SESSION_STALL_MS)
+            return -1;
+    }
+
+    if (pkt_queue_push(&s->outq, data, len))
+    {
+        s->frames_dropped++;
+        flightrec_event(FR_EV_DROP, 0, s->fd, 1);
+    }
+
+    return session_flush(s);
+}
+
+static int session_send_ctl(struct session *s, int control, uint64_t now)
+{
+    uint8_t         msg[] = { 0xFE, PKT_TYPE_CTL, 0x00, 0xFD };
+
+    msg[2] = control ? 0x01 : 0x00;
+
+    return session_send(s, msg, 4, now);
+}
+
+/**
+ * Send ping to the client if it is time and check for a dead link.
+ *
+ * @return 0 if OK, -1 if the session should be closed.
+ */
+static int session_probe(struct session *s, uint64_t now)
+{
+    uint8_t         msg[PING_MSG_LEN];
+
+    if (link_is_dead(&s->link, now))
+    {
+        fprintf(stderr, "No reply to link probes for %d ms (FD=%d)\n",
+                LINK_TIMEOUT_MS, s->fd);
+        return -1;
+    }
+
+    if (!link_ping_due(&s->link, now))
+        return 0;
+
+    link_make_ping(&s->link, msg);
+
+    return session_send(s, msg, PING_MSG_LEN, now);
+}
+
+/**
+ * Process session token from a client.
+ *
+ * If control is reserved for the token, the client is reconnecting after
+ * losing the connection and gets control back right away.
+ */
+static int process_session_token(struct session *s, uint32_t token,
+                                 uint64_t now)
+{
+    s->token = token;
+
+    if (controller != NULL || !control_reserved(now) ||
+        token != reserved_token)
+        return 0;
+
+    controller = s;
+    reserved_token = 0;
+    flightrec_event(FR_EV_CONTROL, 1, s->fd, 0);
+    fprintf(stderr, "Session resumed by %s (FD=%d); control restored\n",
+            inet_ntoa(s->addr.sin_addr), s->fd);
+
+    return session_send_ctl(s, 1, now);
+}
+
+/**
+ * Send the current state of the radio to a new session.
+ *
+ * The client gets the power state and the last LCD frame right away
+ * instead of waiting for the radio to send the next update. They are
+ * queued right after the CTL reply and usually arrive in the same read as
+ * it; the client relies on receive_data() returning every packet of a
+ * read.
+ */
+static int session_send_state(struct session *s, int rig_is_on, uint64_t now)
+{
+    uint8_t         pwr[] = { 0xFE, PKT_TYPE_PWK, 0x00, 0xFD };
+
+    pwr[2] = rig_is_on ? 0x01 : 0x00;
+    if (session_send(s, pwr, sizeof(pwr), now))
+        return -1;
+
+    if (lcd_cache_len)
+        return session_send(s, lcd_cache, lcd_cache_len, now);
+
+    return 0;
+}
+
+/**
+ * Process control request from a client.
+ *
+ * A request is granted if nobody else has control. Releasing control
+ * leaves the radio without a controller until another session requests it.
+ * The client is always told whether it has control after the request.
+ */
+static int process_ctl_request(struct session *s, int request, uint64_t now)
+{
+    if (request)
+    {
+        if (controller == NULL && control_reserved(now) &&
+            s->token != reserved_token)
+        {
+            fprintf(stderr, "Control denied to %s (FD=%d); reserved for "
+                    "reconnecting client\n", inet_ntoa(s->addr.sin_addr),
+                    s->fd);
+        }
+        else if (controller == NULL)
+        {
+            reserved_token = 0;
+            controller = s;
+            flightrec_event(FR_EV_CONTROL, 1, s->fd, 0);
+            fprintf(stderr, "Control granted to %s (FD=%d)\n",
+                    inet_ntoa(s->addr.sin_addr), s->fd);
+        }
+        else if (controller != s)
+        {
+            fprintf(stderr, "Control denied to %s (FD=%d); held by FD=%d\n",
+                    inet_ntoa(s->addr.sin_addr), s->fd, controller->fd);
+        }
+    }
+    else if (controller == s)
+    {
+        controller = NULL;
+        flightrec_event(FR_EV_CONTROL, 0, s->fd, 0);
+        fprintf(stderr, "Control released by %s (FD=%d)\n",
+                inet_ntoa(s->addr.sin_addr), s->fd);
+    }
+
+    return session_send_ctl(s, controller == s, now);
+}
+
+/* Context for update_metrics() */
+struct metrics_ctx {
+    struct server_metrics *totals;
+    struct session *sessions;
+    struct xfr_buf *closed;
+};
+
+/* Add up the counters of closed and open sessions */
+static void update_metrics(void *arg)
+{
+    struct metrics_ctx *ctx = arg;
+    struct server_metrics *t = ctx->totals;
+    struct session *s;
+    int             i;
+
+    t->net_valid = ctx->closed->valid_pkts;
+    t->net_invalid = ctx->closed->invalid_pkts;
+    t->net_errors = ctx->closed->write_errors;
+    t->frames_sent = closed_frames_sent;
+    t->frames_dropped = closed_frames_dropped;
+    t->frames_ignored = closed_frames_ignored;
+    t->sessions = 0;
+    t->controlled = controller != NULL;
+
+    for (i = 0; i < max_sessions; i++)
+    {
+        s = &ctx->sessions[i];
+        if (s->fd == -1)
+            continue;
+
+        t->net_valid += s->buf.valid_pkts;
+        t->net_invalid += s->buf.invalid_pkts;
+        t->net_errors += s->buf.write_errors;
+        t->frames_sent += s->frames_sent;
+        t->frames_dropped += s->frames_dropped;
+        t->frames_ignored += s->frames_ignored;
+        t->sessions++;
+    }
+}
+
+static void register_metrics(struct metrics *m, struct server_metrics *t,
+                             struct xfr_buf *uart_buf, int *rig_is_on)
+{
+    METRICS_ADD(m, "uart_valid_packets_total", METRIC_COUNTER,
+                "Valid packets received from the radio.",
+                uart_buf->valid_pkts);
+    METRICS_ADD(m, "uart_invalid_packets_total", METRIC_COUNTER,
+                "Invalid packets received from the radio.",
+                uart_buf->invalid_pkts);
+    METRICS_ADD(m, "uart_write_errors_total", METRIC_COUNTER,
+                "Errors writing radio data to clients.",
+                uart_buf->write_errors);
+    METRICS_ADD(m, "net_valid_packets_total", METRIC_COUNTER,
+                "Valid packets received from clients.", t->net_valid);
+    METRICS_ADD(m, "net_invalid_packets_total", METRIC_COUNTER,
+                "Invalid packets received from clients.", t->net_invalid);
+    METRICS_ADD(m, "net_write_errors_total", METRIC_COUNTER,
+                "Errors writing panel data to the radio.", t->net_errors);
+    METRICS_ADD(m, "frames_sent_total", METRIC_COUNTER,
+                "Frames sent to clients.", t->frames_sent);
+    METRICS_ADD(m, "frames_dropped_total", METRIC_COUNTER,
+                "Frames dropped for slow clients.", t->frames_dropped);
+    METRICS_ADD(m, "frames_ignored_total", METRIC_COUNTER,
+                "Panel frames ignored from observers.", t->frames_ignored);
+    METRICS_ADD(m, "sessions", METRIC_GAUGE,
+                "Connected clients.", t->sessions);
+    METRICS_ADD(m, "controlled", METRIC_GAUGE,
+                "1 if a client has control of the radio.", t->controlled);
+    METRICS_ADD(m, "rig_on", METRIC_GAUGE,
+                "1 if the radio is on.", *rig_is_on);
+}
+
 
 int main(int argc, char **argv)
 {
     int             exit_code = EXIT_FAILURE;
     int             sock_fd = -1;
-    int             net_fd = -1;
     int             uart_fd = -1;
-    struct sockaddr_in serv_addr, cli_addr;
+    struct sockaddr_in cli_addr;
     socklen_t       cli_addr_len;
 
-    struct timeval  timeout;
-    fd_set          active_fds, read_fds;
-    int             res;
-    int             connected;
+    struct pollfd   poll_fds[3 + MAX_SESSIONS];
+    struct session  sessions[MAX_SESSIONS];
+    struct session *s;
+    struct prof_sample ps;
+    ssize_t         num;
+    int             i;
     int             rig_is_on;
 
     uint64_t        pwk_on_time;        /* time used when PWK line is activated */
+    struct gpio_line pwk;
     uint64_t        last_keepalive;
     uint64_t        current_time;
 
     struct xfr_buf  uart_buf, net_buf;
+    struct metrics  metrics;
+    struct metrics_series series;
+    struct server_metrics totals;
+    struct metrics_ctx metrics_ctx = { &totals, sessions, &net_buf };
+
+    metrics_init(&metrics, "ic706_server");
+    gpio_init(&pwk);
+    metrics_series_init(&series, &metrics);
 
     /* initialize buffers */
     uart_buf.wridx = 0;
+    uart_buf.pktlen = 0;
     uart_buf.write_errors = 0;
     uart_buf.valid_pkts = 0;
     uart_buf.invalid_pkts = 0;
     net_buf.wridx = 0;
+    net_buf.pktlen = 0;
     net_buf.write_errors = 0;
     net_buf.valid_pkts = 0;
     net_buf.invalid_pkts = 0;
 
+    for (i = 0; i < MAX_SESSIONS; i++)
+        sessions[i].fd = -1;
 
     /* setup signal handler */
     if (signal(SIGINT, signal_handler) == SIG_ERR)
@@ -134,9 +610,26 @@ int main(int argc, char **argv)
     parse_options(argc, argv);
     if (uart == NULL)
         uart = strdup("/dev/ttyO1");
+    if (pwk_pin == NULL)
+        pwk_pin = strdup("20");
+
+    flightrec_init("ic706_server", SIGUSR1);
+    if (prof_interval)
+        prof_init(prof_interval);
 
     fprintf(stderr, "Using network port %d\n", port);
     fprintf(stderr, "Using UART port %s\n", uart);
+    fprintf(stderr, "Max number of connections: %d\n", max_sessions);
+
+    for (i = 0; i < max_sessions; i++)
+    {
+        if (pkt_queue_init(&sessions[i].outq, SESSION_QUEUE_LEN, RDBUF_SIZE))
+        {
+            fprintf(stderr, "Error allocating session queues\n");
+            max_sessions = i + 1;
+            goto cleanup;
+        }
+    }
 
     /* open and configure serial interface */
     uart_fd = open(uart, O_RDWR | O_NOCTTY | O_NONBLOCK);
@@ -144,7 +637,7 @@ int main(int argc, char **argv)
     {
         fprintf(stderr, "Error opening UART: %d: %s\n", errno,
                 strerror(errno));
-        exit(EXIT_FAILURE);
+        goto cleanup;
     }
 
     /* 19200 bps, 8n1, blocking */
@@ -156,51 +649,35 @@ int main(int argc, char **argv)
     }
 
     /* PWK signal to radio */
-    if (gpio_init_out(GPIO_PWK) == -1)
+    if (use_gpio && gpio_open_out(&pwk, pwk_pin, 0) == -1)
     {
-        fprintf(stderr, "Error configuring PWK GPIO: %d: %s\n", errno,
-                strerror(errno));
+        fprintf(stderr, "Error configuring PWK GPIO %s: %d: %s\n", pwk_pin,
+                errno, strerror(errno));
         goto cleanup;
     }
 
     /* open and configure network interface */
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sock_fd = create_server_socket(port);
     if (sock_fd == -1)
-    {
-        fprintf(stderr, "Error creating socket: %d: %s\n", errno,
-                strerror(errno));
         goto cleanup;
-    }
-
-    int             yes = 1;
 
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
-        fprintf(stderr, "Error setting SO_REUSEADDR: %d: %s\n", errno,
-                strerror(errno));
-
-    /* bind socket to host address */
-    memset(&serv_addr, 0, sizeof(struct sockaddr_in));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(port);
-    if (bind(sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1)
-    {
-        fprintf(stderr, "bind() error: %d: %s\n", errno, strerror(errno));
-        goto cleanup;
-    }
+    memset(&cli_addr, 0, sizeof(struct sockaddr_in));
 
-    if (listen(sock_fd, 1) == -1)
+    if (metrics_spec || series_spec)
     {
-        fprintf(stderr, "listen() error: %d: %s\n", errno, strerror(errno));
-        goto cleanup;
+        register_metrics(&metrics, &totals, &uart_buf, &rig_is_on);
+        metrics.update = update_metrics;
+        metrics.update_arg = &metrics_ctx;
+        if (metrics_spec && metrics_open(&metrics, metrics_spec))
+            goto cleanup;
+        if (series_spec && metrics_series_open(&series, series_spec))
+            goto cleanup;
     }
 
-    memset(&cli_addr, 0, sizeof(struct sockaddr_in));
-    cli_addr_len = sizeof(cli_addr);
-
-    FD_ZERO(&active_fds);
-    FD_SET(uart_fd, &active_fds);
-    FD_SET(sock_fd, &active_fds);
+    poll_fds[0].fd = uart_fd;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = sock_fd;
+    poll_fds[1].events = POLLIN;
 
     /* rig_is_on is set to 1 every time we receive a PKT_TYPE_LCD. While
      * rig_is_on=1 a PKT_TYPE_KEEPALIVE is sent to the UART every 150 ms.
@@ -212,7 +689,6 @@ int main(int argc, char **argv)
      * client.
      */
     rig_is_on = 0;
-    connected = 0;
     last_keepalive = 0;
     pwk_on_time = 0;
 
@@ -220,79 +696,222 @@ int main(int argc, char **argv)
     {
         /* check if we should send a PKT_TYPE_KEEPALIVE to the UART */
         current_time = time_ms();
+        metrics_series_process(&series, current_time);
+        prof_process(current_time);
         if (rig_is_on && (current_time - last_keepalive) > 150)
         {
             send_keepalive(uart_fd);
             last_keepalive = current_time;
         }
 
-        /* check if GPIO_PWK needs to be reset */
+        /* check if the PWK line needs to be reset */
         if (pwk_on_time && (current_time - pwk_on_time) > 500)
         {
-            gpio_set_value(GPIO_PWK, 0);
+            if (use_gpio)
+                gpio_set(&pwk, 0);
             pwk_on_time = 0;
         }
 
-        /* previous select may have altered timeout */
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000;
-        read_fds = active_fds;
+        for (i = 0; i < max_sessions; i++)
+        {
+            s = &sessions[i];
+            if (s->fd != -1 && session_probe(s, current_time))
+                session_close(s, &net_buf);
+
+            poll_fds[2 + i].fd = s->fd;
+            poll_fds[2 + i].events = POLLIN;
+            if (pkt_queue_count(&s->outq))
+                poll_fds[2 + i].events |= POLLOUT;
+        }
+        poll_fds[2 + max_sessions].fd = metrics_fd(&metrics);
+        poll_fds[2 + max_sessions].events = POLLIN;
 
-        res = select(FD_SETSIZE, &read_fds, NULL, NULL, &timeout);
-        if (res <= 0)
+        if (poll(poll_fds, 3 + max_sessions, 50) <= 0)
             continue;
 
-        /* service UART port */
-        if (FD_ISSET(uart_fd, &read_fds))
+        if (poll_fds[2 + max_sessions].revents & POLLIN)
+            metrics_process(&metrics);
+
+        /* service UART port; one read may return several packets */
+        if (poll_fds[0].revents & POLLIN)
         {
-            switch (transfer_data(uart_fd, net_fd, &uart_buf))
+            int             pkt_type;
+
+            do
             {
-            case PKT_TYPE_INIT2:
-                rig_is_on = 1;
-                uart_buf.write_errors += send_keepalive(uart_fd);
-                last_keepalive = current_time;
-                break;
+                pkt_type = receive_data(uart_fd, &uart_buf);
+                switch (pkt_type)
+                {
+                case PKT_TYPE_INIT2:
+                    rig_is_on = 1;
+                    uart_buf.write_errors += send_keepalive(uart_fd);
+                    last_keepalive = current_time;
+                    break;
+
+                case PKT_TYPE_EOS:
+                    rig_is_on = 0;
+                    lcd_cache_len = 0;
+                    break;
+
+                case PKT_TYPE_LCD:
+                    memcpy(lcd_cache, uart_buf.data, uart_buf.pktlen);
+                    lcd_cache_len = uart_buf.pktlen;
+                    break;
+                }
 
-            case PKT_TYPE_EOS:
-                rig_is_on = 0;
-                break;
+                if (pkt_type == PKT_TYPE_INCOMPLETE ||
+                    pkt_type == PKT_TYPE_EOF || is_local_packet(pkt_type))
+                    continue;
+
+                /* fan out frame to all connections */
+                for (i = 0; i < max_sessions; i++)
+                {
+                    s = &sessions[i];
+                    if (s->fd == -1)
+                        continue;
+
+                    if (session_send(s, uart_buf.data, uart_buf.pktlen,
+                                     current_time))
+                    {
+                        fprintf(stderr, "Client too slow or gone (FD=%d)\n",
+                                s->fd);
+                        uart_buf.write_errors++;
+                        session_close(s, &net_buf);
+                    }
+                }
+
+                uart_buf.valid_pkts++;
             }
+            while (packet_pending(&uart_buf));
         }
 
-        /* service network socket */
-        if (connected && FD_ISSET(net_fd, &read_fds))
+        /* service network sockets */
+        for (i = 0; i < max_sessions; i++)
         {
-            switch (transfer_data(net_fd, uart_fd, &net_buf))
+            s = &sessions[i];
+            if (s->fd == -1 || poll_fds[2 + i].fd != s->fd)
+                continue;
+
+            if ((poll_fds[2 + i].revents & POLLOUT) && session_flush(s))
+            {
+                session_close(s, &net_buf);
+                continue;
+            }
+
+            if (poll_fds[2 + i].revents & POLLERR)
+            {
+                session_close(s, &net_buf);
+                continue;
+            }
+
+            if (!(poll_fds[2 + i].revents & (POLLIN | POLLHUP)))
+                continue;
+
+            /* one read may return several packets; stop if the session
+             * is closed */
+            do
             {
-            case PKT_TYPE_PWK:
-                /* power on/off message */
-                fprintf(stderr, "POWER: %s\n", net_buf.data[2] ? "on" : "off");
+                int             pkt_type = receive_data(s->fd, &s->buf);
 
-                if (net_buf.data[2] != rig_is_on)
+                switch (pkt_type)
                 {
-                    /* Activate PWK line; will be reset by main loop */
-                    gpio_set_value(GPIO_PWK, 1);
-                    pwk_on_time = current_time;
+                case PKT_TYPE_CTL:
+                    if (process_ctl_request(s, s->buf.data[2], current_time))
+                        session_close(s, &net_buf);
+                    break;
+
+                case PKT_TYPE_PING:
+                    {
+                        uint8_t         pong[PING_MSG_LEN];
+
+                        if (!link_make_pong(s->buf.data, pong))
+                            link_process_pong(&s->link, s->buf.data);
+                        else if (session_send(s, pong, PING_MSG_LEN,
+                                              current_time))
+                            session_close(s, &net_buf);
+                    }
+                    break;
+
+                case PKT_TYPE_SESSION:
+                    if (process_session_token(s,
+                                              session_token_get(s->buf.data),
+                                              current_time))
+                        session_close(s, &net_buf);
+                    break;
+
+                case PKT_TYPE_PWK:
+                    /* power on/off message */
+                    if (s != controller)
+                    {
+                        s->frames_ignored++;
+                        break;
+                    }
+
+                    fprintf(stderr, "POWER: %s\n",
+                            s->buf.data[2] ? "on" : "off");
+
+                    if (s->buf.data[2] != rig_is_on)
+                    {
+                        /* Activate PWK line; will be reset by main loop */
+                        if (use_gpio)
+                            gpio_set(&pwk, 1);
+                        pwk_on_time = current_time;
+                    }
+                    break;
+
+                case PKT_TYPE_EOF:
+                    session_close(s, &net_buf);
+                    break;
+
+                case PKT_TYPE_INCOMPLETE:
+                    break;
+
+                default:
+                    if (is_local_packet(pkt_type))
+                        break;
+
+                    /* panel data is only accepted from the controller */
+                    if (s == controller)
+                    {
+#if DEBUG
+                        print_buffer(s->fd, uart_fd, s->buf.data,
+                                     s->buf.pktlen);
+#endif
+                        prof_begin(&ps);
+                        num = write(uart_fd, s->buf.data, s->buf.pktlen);
+                        prof_end(PROF_WRITE, &ps);
+
+                        if (num == s->buf.pktlen)
+                        {
+                            flightrec_event(FR_EV_TX, pkt_type, uart_fd,
+                                            s->buf.pktlen);
+                        }
+                        else
+                        {
+                            flightrec_event(FR_EV_WRITE_ERR, 0, uart_fd,
+                                            errno);
+                            s->buf.write_errors++;
+                        }
+                        s->buf.valid_pkts++;
+                    }
+                    else
+                    {
+                        s->frames_ignored++;
+                    }
+                    break;
                 }
-                break;
-
-            case PKT_TYPE_EOF:
-                fprintf(stderr, "Connection closed (FD=%d)\n", net_fd);
-                FD_CLR(net_fd, &active_fds);
-                close(net_fd);
-                net_fd = -1;
-                connected = 0;
-                client_addr = 0;
-                break;
             }
+            while (s->fd != -1 && packet_pending(&s->buf));
         }
 
         /* check if there are any new connections pending */
-        if (FD_ISSET(sock_fd, &read_fds))
+        if (poll_fds[1].revents & POLLIN)
         {
-            int             new = accept(sock_fd, (struct sockaddr *)&cli_addr,
-                                         &cli_addr_len);
+            int             new;
 
+            cli_addr_len = sizeof(cli_addr);
+            new = accept(sock_fd, (struct sockaddr *)&cli_addr,
+                         &cli_addr_len);
             if (new == -1)
             {
                 fprintf(stderr, "accept() error: %d: %s\n", errno,
@@ -303,30 +922,44 @@ int main(int argc, char **argv)
             fprintf(stderr, "New connection from %s\n",
                     inet_ntoa(cli_addr.sin_addr));
 
-            if (!connected)
+            for (s = NULL, i = 0; i < max_sessions; i++)
             {
-                fprintf(stderr, "Connection accepted (FD=%d)\n", new);
-                net_fd = new;
-                client_addr = cli_addr.sin_addr.s_addr;
-                FD_SET(net_fd, &active_fds);
-                connected = 1;
+                if (sessions[i].fd == -1)
+                {
+                    s = &sessions[i];
+                    break;
+                }
             }
-            else if (client_addr == cli_addr.sin_addr.s_addr)
+
+            if (s == NULL)
             {
-                /* this is the same client reconnecting */
-                fprintf(stderr,
-                        "Client already connected; reconnect (FD= %d -> %d)\n",
-                        net_fd, new);
-
-                FD_CLR(net_fd, &active_fds);
-                close(net_fd);
-                net_fd = new;
-                FD_SET(net_fd, &active_fds);
+                fprintf(stderr, "Connection refused; too many clients\n");
+                close(new);
             }
             else
             {
-                fprintf(stderr, "Connection refused\n");
-                close(new);
+                /* panel frames are small and the client rarely sends
+                 * anything to piggyback the ACKs on, so Nagle would hold
+                 * back frames until the delayed ACK */
+                if (set_nodelay(new))
+                    fprintf(stderr, "Error setting TCP_NODELAY: %d: %s\n",
+                            errno, strerror(errno));
+                session_open(s, new, &cli_addr);
+
+                /* the first client gets control without asking so that
+                 * a single client works the same way as before */
+                if (controller == NULL && !control_reserved(current_time))
+                {
+                    controller = s;
+                    flightrec_event(FR_EV_CONTROL, 1, new, 0);
+                }
+
+                fprintf(stderr, "Connection accepted (FD=%d) as %s\n", new,
+                        s == controller ? "controller" : "observer");
+
+                if (session_send_ctl(s, s == controller, current_time) ||
+                    session_send_state(s, rig_is_on, current_time))
+                    session_close(s, &net_buf);
             }
         }
 
@@ -337,11 +970,26 @@ int main(int argc, char **argv)
     exit_code = EXIT_SUCCESS;
 
   cleanup:
+    for (i = 0; i < max_sessions; i++)
+    {
+        if (sessions[i].fd != -1)
+            session_close(&sessions[i], &net_buf);
+        pkt_queue_free(&sessions[i].outq);
+    }
     close(uart_fd);
-    close(net_fd);
     close(sock_fd);
+    gpio_close(&pwk);
+    metrics_close(&metrics);
+    metrics_series_close(&series);
+    prof_print();
     if (uart != NULL)
         free(uart);
+    if (metrics_spec != NULL)
+        free(metrics_spec);
+    if (series_spec != NULL)
+        free(series_spec);
+    if (pwk_pin != NULL)
+        free(pwk_pin);
 
     fprintf(stderr, "  Valid packets uart / net: %" PRIu64 " / %" PRIu64 "\n",
             uart_buf.valid_pkts, net_buf.valid_pkts);
@@ -0,0 +1,562 @@
+/*
+ * IC-706 radio and panel simulator.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>           // PRIu64
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "metrics.h"
+#include "test_util.h"
+
+/*
+ * The simulator creates two pseudo-terminals standing in for the UARTs of
+ * the radio and the panel, starts ic706_server on the radio side and
+ * ic706_client on the panel side, and plays both ends of the link:
+ *
+ *   radio pty <-> ic706_server <-> TCP <-> ic706_client <-> panel pty
+ *
+ * The radio answers INIT2 like a radio being switched on, and the panel
+ * sends INIT1 like a panel being switched on. Once both directions work,
+ * the radio sends LCD frames and the panel sends tuning knob frames at the
+ * configured rate. Every test frame carries a sequence number, which is
+ * used to measure the end-to-end latency and loss.
+ */
+
+#define SIM_HISTORY     65536   /* frames in flight that can be tracked */
+#define SIM_INIT_MS     500     /* INIT retry interval */
+#define SIM_WARMUP_MS   10000   /* max time to get both directions working */
+#define SIM_DRAIN_MS    1000    /* wait for frames in flight at the end */
+
+/* Test traffic in one direction */
+struct sim_dir {
+    const char     *name;
+    uint8_t         type;       /* packet type of test frames */
+    int             len;        /* test frame length */
+    uint32_t        seq;        /* next sequence number to send */
+    uint32_t        first;      /* first sequence number measured */
+    uint32_t        last_rx;    /* last sequence number received */
+    uint64_t        next_send;  /* time of next frame (usec) */
+    uint64_t        sent;
+    uint64_t        received;
+    uint64_t        reordered;  /* received after a later frame */
+    uint64_t        send_errors;        /* pty full */
+    int             ready;      /* a frame has made it through */
+    uint64_t        stamp[SIM_HISTORY];
+    struct metric_hist latency; /* usec */
+};
+
+/* One end of the link */
+struct sim_end {
+    const char     *name;
+    int             fd;         /* pty master */
+    int             slave_fd;   /* kept open so that the master never EOFs */
+    char            path[64];   /* pty slave */
+    uint8_t         buf[RDBUF_SIZE];
+    int             len;
+    uint64_t        invalid;    /* bytes outside frames */
+    uint64_t        unexpected; /* frames the real radio or panel would not
+                                 * get, e.g. link probes */
+};
+
+static int      keep_running = 1;
+
+static void signal_handler(int signo)
+{
+    (void)signo;
+    keep_running = 0;
+}
+
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: ic706_sim [options]\n"
+        "\n Possible options are:\n"
+        "\n"
+        "  -p    Network port for ic706_server (default is 42100).\n"
+        "  -r    Test frames per second in each direction (default 20).\n"
+        "  -d    Measurement duration in seconds (default 10).\n"
+        "  -l    Length of the LCD frames in bytes (default 24).\n"
+        "  -b    Directory with ic706_server and ic706_client\n"
+        "        (default is the current directory).\n"
+        "  -x    Don't start the daemons; print the pty names and wait\n"
+        "        for the daemons to be started by hand.\n"
+        "  -q    Discard the output of the daemons.\n"
+        "  -h    This help message.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+/* Create the pty of one end */
+static int open_pty(struct sim_end *end)
+{
+    end->fd = test_open_pty(end->path, sizeof(end->path), &end->slave_fd);
+    end->len = 0;
+    end->invalid = 0;
+    end->unexpected = 0;
+
+    return end->fd == -1 ? -1 : 0;
+}
+
+static int send_frame(struct sim_end *end, const uint8_t * frame, int len)
+{
+    return write(end->fd, frame, len) != len;
+}
+
+/* Send a test frame */
+static void send_test_frame(struct sim_end *end, struct sim_dir *dir,
+                            uint64_t now)
+{
+    uint8_t         frame[RDBUF_SIZE];
+
+    test_frame_make(frame, dir->type, dir->seq, dir->len);
+    if (send_frame(end, frame, dir->len))
+    {
+        dir->send_errors++;
+        return;
+    }
+
+    dir->stamp[dir->seq % SIM_HISTORY] = now;
+    dir->seq++;
+    dir->sent++;
+}
+
+/* Account a test frame received at the other end */
+static void recv_test_frame(struct sim_dir *dir, const uint8_t * frame,
+                            int len, uint64_t now)
+{
+    uint32_t        seq;
+
+    if (len < TEST_FRAME_MIN_LEN)
+        return;
+
+    seq = test_frame_seq(frame, dir->seq);
+
+    dir->ready = 1;
+    if (seq < dir->first || dir->seq - seq > SIM_HISTORY)
+        return;
+
+    if (dir->received && seq < dir->last_rx)
+        dir->reordered++;
+    else
+        dir->last_rx = seq;
+
+    dir->received++;
+    metric_hist_add(&dir->latency, now - dir->stamp[seq % SIM_HISTORY]);
+}
+
+/* Start measuring from the next frame */
+static void reset_dir(struct sim_dir *dir, uint64_t now)
+{
+    dir->first = dir->seq;
+    dir->sent = 0;
+    dir->received = 0;
+    dir->reordered = 0;
+    dir->send_errors = 0;
+    dir->next_send = now;
+    metric_hist_clear(&dir->latency);
+}
+
+/**
+ * Read from a pty and call handler for each complete frame.
+ *
+ * Frames start with 0xFE and end with 0xFD; a single 0x00 is an EOS packet.
+ * Anything else is counted as invalid.
+ */
+static void read_frames(struct sim_end *end,
+                        void (*handler) (const uint8_t * frame, int len,
+                                         void *arg), void *arg)
+{
+    ssize_t         num;
+    int             start = 0;
+    int             i;
+
+    num = read(end->fd, &end->buf[end->len], sizeof(end->buf) - end->len);
+    if (num <= 0)
+        return;
+    end->len += num;
+
+    for (i = 0; i < end->len; i++)
+    {
+        if (end->buf[start] != 0xFE)
+        {
+            end->invalid += end->buf[start] != 0x00;
+            start = i + 1;
+        }
+        else if (end->buf[i] == 0xFD)
+        {
+            handler(&end->buf[start], i - start + 1, arg);
+            start = i + 1;
+        }
+    }
+
+    /* keep the incomplete frame; drop it if it can never complete */
+    end->len -= start;
+    if (end->len == sizeof(end->buf))
+    {
+        end->invalid += end->len;
+        end->len = 0;
+    }
+    memmove(end->buf, &end->buf[start], end->len);
+}
+
+/* simulator state shared by the frame handlers */
+struct sim {
+    struct sim_end  radio;
+    struct sim_end  panel;
+    struct sim_dir  down;       /* radio to panel */
+    struct sim_dir  up;         /* panel to radio */
+    int             radio_on;   /* radio got INIT2 from the server */
+    int             panel_on;   /* panel got INIT1 + INIT2 responses */
+    uint64_t        keepalives;
+    uint64_t        first_keepalive;
+    uint64_t        last_keepalive;
+    uint64_t        ptt_on;     /* PTT frames seen by the radio */
+    uint64_t        ptt_off;
+};
+
+static void radio_handler(const uint8_t * frame, int len, void *arg)
+{
+    struct sim     *sim = arg;
+    uint64_t        now = time_us();
+
+    switch (frame[1])
+    {
+    case PKT_TYPE_INIT2:
+        if (!sim->radio_on)
+            fprintf(stderr, "Radio: switched on\n");
+        sim->radio_on = 1;
+        break;
+
+    case PKT_TYPE_KEEPALIVE:
+        if (sim->keepalives++ == 0)
+            sim->first_keepalive = now;
+        sim->last_keepalive = now;
+        break;
+
+    case PKT_TYPE_PTT:
+        if (len == 4 && frame[2])
+            sim->ptt_on++;
+        else if (len == 4)
+            sim->ptt_off++;
+        break;
+
+    case PKT_TYPE_TUNE:
+        recv_test_frame(&sim->up, frame, len, now);
+        break;
+
+    default:
+        sim->radio.unexpected++;
+    }
+}
+
+static void panel_handler(const uint8_t * frame, int len, void *arg)
+{
+    struct sim     *sim = arg;
+
+    switch (frame[1])
+    {
+    case PKT_TYPE_INIT1:
+        break;
+
+    case PKT_TYPE_INIT2:
+        if (!sim->panel_on)
+            fprintf(stderr, "Panel: switched on\n");
+        sim->panel_on = 1;
+        break;
+
+    case PKT_TYPE_LCD:
+        recv_test_frame(&sim->down, frame, len, time_us());
+        break;
+
+    default:
+        sim->panel.unexpected++;
+    }
+}
+
+static void print_dir(struct sim_dir *dir)
+{
+    uint64_t        lost = dir->sent - dir->received;
+
+    fprintf(stderr, "%-14s %8" PRIu64 " %8" PRIu64 " %6" PRIu64 " %5.1f%% "
+            "%6" PRIu64 "  %6.1f %6.1f %6.1f %6.1f %6.1f\n",
+            dir->name, dir->sent, dir->received, lost,
+            dir->sent ? 100.0 * lost / dir->sent : 0.0, dir->reordered,
+            dir->latency.count ? 1.e-3 * dir->latency.min : 0.0,
+            1.e-3 * metric_hist_percentile(&dir->latency, 50),
+            1.e-3 * metric_hist_percentile(&dir->latency, 99),
+            1.e-3 * dir->latency.max,
+            dir->latency.count ?
+            1.e-3 * dir->latency.sum / dir->latency.count : 0.0);
+    if (dir->send_errors)
+        fprintf(stderr, "%-14s %" PRIu64 " frames not sent (pty full)\n", "",
+                dir->send_errors);
+}
+
+int main(int argc, char **argv)
+{
+    static struct sim sim;
+    static const uint8_t init1[] = { 0xFE, PKT_TYPE_INIT1, 0xFD };
+    static const uint8_t init2[] = { 0xFE, PKT_TYPE_INIT2, 0xFD };
+    static const uint8_t ptt_on[] = { 0xFE, PKT_TYPE_PTT, 0x01, 0xFD };
+    static const uint8_t ptt_off[] = { 0xFE, PKT_TYPE_PTT, 0x00, 0xFD };
+    static const uint8_t eos[] = { 0x00 };
+
+    struct pollfd   poll_fds[2];
+    char            port_str[16];
+    char           *server_args[8];
+    char           *client_args[10];
+    const char     *dir = ".";
+    pid_t           server_pid = -1;
+    pid_t           client_pid = -1;
+    uint64_t        now, last_init = 0, phase_start;
+    uint64_t        interval;
+    int             port = 42100;
+    int             rate = 20;
+    int             duration = 10;
+    int             lcd_len = 24;
+    int             external = 0;
+    int             quiet = 0;
+    int             measuring = 0;
+    int             exit_code = EXIT_FAILURE;
+    int             option;
+
+    while ((option = getopt(argc, argv, "p:r:d:l:b:xqh")) != -1)
+    {
+        switch (option)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+
+        case 'r':
+            rate = atoi(optarg);
+            if (rate < 1)
+                rate = 1;
+            break;
+
+        case 'd':
+            duration = atoi(optarg);
+            break;
+
+        case 'l':
+            lcd_len = atoi(optarg);
+            if (lcd_len < TEST_FRAME_MIN_LEN)
+                lcd_len = TEST_FRAME_MIN_LEN;
+            else if (lcd_len > RDBUF_SIZE)
+                lcd_len = RDBUF_SIZE;
+            break;
+
+        case 'b':
+            dir = optarg;
+            break;
+
+        case 'x':
+            external = 1;
+            break;
+
+        case 'q':
+            quiet = 1;
+            break;
+
+        case 'h':
+            help();
+            exit(EXIT_SUCCESS);
+
+        default:
+            help();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    sim.radio.name = "radio";
+    sim.radio.fd = sim.radio.slave_fd = -1;
+    sim.panel.name = "panel";
+    sim.panel.fd = sim.panel.slave_fd = -1;
+    if (open_pty(&sim.radio) || open_pty(&sim.panel))
+        goto cleanup;
+
+    sim.down.name = "radio->panel";
+    sim.down.type = PKT_TYPE_LCD;
+    sim.down.len = lcd_len;
+    sim.up.name = "panel->radio";
+    sim.up.type = PKT_TYPE_TUNE;
+    sim.up.len = 6;
+    metric_hist_clear(&sim.down.latency);
+    metric_hist_clear(&sim.up.latency);
+
+    fprintf(stderr, "Radio UART: %s\n", sim.radio.path);
+    fprintf(stderr, "Panel UART: %s\n", sim.panel.path);
+
+    if (!external)
+    {
+        snprintf(port_str, sizeof(port_str), "%d", port);
+        server_args[1] = "-u";
+        server_args[2] = sim.radio.path;
+        server_args[3] = "-p";
+        server_args[4] = port_str;
+        server_args[5] = "-g";
+        server_args[6] = NULL;
+        server_pid = test_start_daemon(dir, "ic706_server", server_args,
+                                       quiet);
+
+        /* let the server start listening before the client connects */
+        usleep(200000);
+
+        client_args[1] = "-u";
+        client_args[2] = sim.panel.path;
+        client_args[3] = "-s";
+        client_args[4] = "127.0.0.1";
+        client_args[5] = "-p";
+        client_args[6] = port_str;
+        client_args[7] = "-g";
+        client_args[8] = NULL;
+        client_pid = test_start_daemon(dir, "ic706_client", client_args,
+                                       quiet);
+
+        if (server_pid == -1 || client_pid == -1)
+            goto cleanup;
+    }
+
+    poll_fds[0].fd = sim.radio.fd;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = sim.panel.fd;
+    poll_fds[1].events = POLLIN;
+
+    interval = 1000000 / rate;
+    phase_start = time_us();
+
+    /* Warm up: switch radio and panel on and send a test frame in each
+     * direction every 100 ms until both have made it through. The client
+     * must have connected and taken control before panel frames reach the
+     * radio. */
+    while (keep_running)
+    {
+        now = time_us();
+
+        if (!measuring)
+        {
+            if (sim.radio_on && sim.panel_on && sim.down.ready && sim.up.ready)
+            {
+                fprintf(stderr, "Link up after %" PRIu64 " ms; measuring "
+                        "%d frames/s for %d s\n",
+                        (now - phase_start) / 1000, rate, duration);
+                reset_dir(&sim.down, now);
+                reset_dir(&sim.up, now);
+                sim.keepalives = 0;
+                send_frame(&sim.panel, ptt_on, sizeof(ptt_on));
+                measuring = 1;
+                phase_start = now;
+                continue;
+            }
+
+            if (!external && now - phase_start > 1000 * SIM_WARMUP_MS)
+            {
+                fprintf(stderr, "Link not up after %d ms\n", SIM_WARMUP_MS);
+                goto cleanup;
+            }
+
+            if (now - last_init > 1000 * SIM_INIT_MS)
+            {
+                if (!sim.radio_on)
+                    send_frame(&sim.radio, init2, sizeof(init2));
+                if (!sim.panel_on)
+                    send_frame(&sim.panel, init1, sizeof(init1));
+                last_init = now;
+            }
+
+            if (sim.radio_on && sim.panel_on && now >= sim.down.next_send)
+            {
+                send_test_frame(&sim.radio, &sim.down, now);
+                send_test_frame(&sim.panel, &sim.up, now);
+                sim.down.next_send = now + 100000;
+            }
+        }
+        else if (now - phase_start < 1000000ULL * duration)
+        {
+            /* catch up if we were late, but never send bursts */
+            if (now >= sim.down.next_send)
+            {
+                send_test_frame(&sim.radio, &sim.down, now);
+                sim.down.next_send += interval;
+                if (sim.down.next_send < now)
+                    sim.down.next_send = now + interval;
+            }
+            if (now >= sim.up.next_send)
+            {
+                send_test_frame(&sim.panel, &sim.up, now);
+                sim.up.next_send += interval;
+                if (sim.up.next_send < now)
+                    sim.up.next_send = now + interval;
+            }
+        }
+        else if (measuring == 1)
+        {
+            send_frame(&sim.panel, ptt_off, sizeof(ptt_off));
+            measuring = 2;
+        }
+        else if (now - phase_start > 1000ULL * (1000 * duration +
+                                                SIM_DRAIN_MS))
+        {
+            exit_code = EXIT_SUCCESS;
+            break;
+        }
+
+        if (poll(poll_fds, 2, 1) <= 0)
+            continue;
+
+        if (poll_fds[0].revents & POLLIN)
+            read_frames(&sim.radio, radio_handler, &sim);
+        if (poll_fds[1].revents & POLLIN)
+            read_frames(&sim.panel, panel_handler, &sim);
+    }
+
+    /* switch the radio off */
+    send_frame(&sim.radio, eos, sizeof(eos));
+
+    if (measuring)
+    {
+        fprintf(stderr, "\n%-14s %8s %8s %6s %6s %6s  %6s %6s %6s %6s %6s\n",
+                "Direction", "sent", "recv", "lost", "", "ooo",
+                "min", "p50", "p99", "max", "avg");
+        print_dir(&sim.down);
+        print_dir(&sim.up);
+        fprintf(stderr, "Latency in ms.\n");
+        fprintf(stderr, "Keepalives        : %" PRIu64 " (%.1f ms interval)\n",
+                sim.keepalives, sim.keepalives > 1 ?
+                1.e-3 * (sim.last_keepalive - sim.first_keepalive) /
+                (sim.keepalives - 1) : 0.0);
+        fprintf(stderr, "PTT on / off      : %" PRIu64 " / %" PRIu64 "\n",
+                sim.ptt_on, sim.ptt_off);
+        fprintf(stderr, "Unexpected frames : %" PRIu64 " radio, %" PRIu64
+                " panel\n", sim.radio.unexpected, sim.panel.unexpected);
+        fprintf(stderr, "Invalid bytes     : %" PRIu64 " radio, %" PRIu64
+                " panel\n", sim.radio.invalid, sim.panel.invalid);
+    }
+
+  cleanup:
+    test_stop_daemon(client_pid);
+    test_stop_daemon(server_pid);
+    close(sim.radio.fd);
+    close(sim.radio.slave_fd);
+    close(sim.panel.fd);
+    close(sim.panel.slave_fd);
+
+    return exit_code;
+}
@@ -0,0 +1,640 @@
+/*
+ * Load generator for finding the forwarding limits of ic706_server.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>           // PRIu64
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "metrics.h"
+#include "test_util.h"
+
+/*
+ * The stress test starts ic706_server on a pseudo-terminal and plays both
+ * the radio on the UART side and a client on the network side:
+ *
+ *   radio pty <-> ic706_server <-> TCP <-> stress client
+ *
+ * For each frame size it sends test frames in both directions at
+ * escalating rates, doubling the rate every step until the server no
+ * longer delivers what is offered. Every step reports the sustained
+ * throughput, the latency percentiles, the CPU time ic706_server used per
+ * forwarded frame (from /proc) and the change of the server's error
+ * counters (from its metrics endpoint), which shows where the server
+ * starts to break down before frames are actually lost.
+ */
+
+#define ST_HISTORY      (1 << 20)       /* frames in flight that can be tracked */
+#define ST_OUTBUF       65536   /* max bytes queued towards the server */
+#define ST_CONNECT_MS   5000    /* max time to get control of the radio */
+#define ST_DRAIN_MS     300     /* wait for frames in flight after a step */
+#define ST_SATURATED    0.95    /* delivered / offered below this stops */
+#define ST_MAX_SIZES    16
+
+/* Test traffic in one direction */
+struct st_dir {
+    const char     *name;
+    uint8_t         type;       /* packet type of test frames */
+    int             len;        /* test frame length in this step */
+    int             enabled;
+    uint32_t        seq;        /* next sequence number to send */
+    uint32_t        first;      /* first sequence number of this step */
+    uint64_t        offered;    /* frames due at the configured rate */
+    uint64_t        sent;       /* frames queued towards the server */
+    uint64_t        received;
+    uint64_t        corrupt;    /* test frames with the wrong length */
+    uint64_t       *stamp;
+    struct metric_hist latency; /* usec */
+};
+
+/* One end of the link */
+struct st_end {
+    int             fd;
+    uint8_t         in[RDBUF_SIZE];
+    int             in_len;
+    uint8_t         out[ST_OUTBUF];
+    int             out_len;
+    uint64_t        invalid;    /* bytes outside frames */
+    uint64_t        other;      /* frames that are not test frames */
+};
+
+/* Server counters read from the metrics endpoint */
+struct st_counters {
+    uint64_t        invalid;    /* UART + network invalid packets */
+    uint64_t        write_errors;       /* UART + network write errors */
+    uint64_t        dropped;    /* frames dropped for slow clients */
+    uint64_t        cpu_ticks;  /* user + system time */
+};
+
+static int      keep_running = 1;
+
+static void signal_handler(int signo)
+{
+    (void)signo;
+    keep_running = 0;
+}
+
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: ic706_stress [options]\n"
+        "\n Possible options are:\n"
+        "\n"
+        "  -p    Network port for ic706_server (default is 42200).\n"
+        "  -s    Comma separated frame sizes in bytes, 6 to RDBUF_SIZE\n"
+        "        (default 6,24,128,512,2048).\n"
+        "  -r    First rate in frames per second per direction\n"
+        "        (default 100). The rate doubles every step.\n"
+        "  -R    Highest rate (default 200000).\n"
+        "  -d    Step duration in seconds (default 2).\n"
+        "  -D    Direction: down (radio to client), up (client to radio)\n"
+        "        or both (default).\n"
+        "  -b    Directory with ic706_server (default is the current\n"
+        "        directory).\n"
+        "  -q    Discard the output of the server.\n"
+        "  -h    This help message.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+/* Get user + system CPU time of a process in clock ticks */
+static uint64_t process_cpu_ticks(pid_t pid)
+{
+    char            path[64], buf[1024];
+    char           *p;
+    unsigned long long utime, stime;
+    FILE           *fp;
+    size_t          len;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return 0;
+    len = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[len] = '\0';
+
+    /* the command name may contain spaces; fields 14 and 15 follow it */
+    p = strrchr(buf, ')');
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u "
+                            "%*u %*u %llu %llu", &utime, &stime) != 2)
+        return 0;
+
+    return utime + stime;
+}
+
+/* Read the server counters from its metrics socket */
+static int read_counters(const char *path, pid_t pid, struct st_counters *c)
+{
+    struct sockaddr_un addr;
+    char            buf[16384];
+    char           *line, *save = NULL;
+    char            name[128];
+    unsigned long long val;
+    int             fd, len = 0, num;
+
+    memset(c, 0, sizeof(*c));
+    c->cpu_ticks = process_cpu_ticks(pid);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    while ((num = read(fd, &buf[len], sizeof(buf) - 1 - len)) > 0)
+        len += num;
+    close(fd);
+    buf[len] = '\0';
+
+    for (line = strtok_r(buf, "\n", &save); line;
+         line = strtok_r(NULL, "\n", &save))
+    {
+        if (line[0] == '#' || sscanf(line, "%127s %llu", name, &val) != 2)
+            continue;
+
+        if (strstr(name, "_invalid_packets_total"))
+            c->invalid += val;
+        else if (strstr(name, "_write_errors_total"))
+            c->write_errors += val;
+        else if (strstr(name, "_frames_dropped_total"))
+            c->dropped += val;
+    }
+
+    return 0;
+}
+
+/* Write queued data; returns -1 if the connection is gone */
+static int flush_end(struct st_end *end)
+{
+    ssize_t         num;
+
+    if (end->out_len == 0)
+        return 0;
+
+    num = write(end->fd, end->out, end->out_len);
+    if (num < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+    end->out_len -= num;
+    memmove(end->out, &end->out[num], end->out_len);
+
+    return 0;
+}
+
+/* Queue a frame; returns -1 if the queue is full */
+static int queue_frame(struct st_end *end, const uint8_t * frame, int len)
+{
+    if (end->out_len + len > ST_OUTBUF)
+        return -1;
+
+    memcpy(&end->out[end->out_len], frame, len);
+    end->out_len += len;
+
+    return 0;
+}
+
+/* Queue the next test frame */
+static void send_test_frame(struct st_end *end, struct st_dir *dir,
+                            uint64_t now)
+{
+    uint8_t         frame[RDBUF_SIZE];
+
+    test_frame_make(frame, dir->type, dir->seq, dir->len);
+
+    dir->offered++;
+    if (queue_frame(end, frame, dir->len))
+        return;
+
+    dir->stamp[dir->seq % ST_HISTORY] = now;
+    dir->seq++;
+    dir->sent++;
+}
+
+/* Account a test frame received at the other end */
+static void recv_test_frame(struct st_dir *dir, const uint8_t * frame,
+                            int len, uint64_t now)
+{
+    uint32_t        seq;
+
+    if (len < TEST_FRAME_MIN_LEN)
+    {
+        dir->corrupt++;
+        return;
+    }
+
+    /* frames of the previous step may still arrive after a size change */
+    seq = test_frame_seq(frame, dir->seq);
+    if (seq < dir->first || seq >= dir->seq || dir->seq - seq > ST_HISTORY)
+        return;
+
+    /* parts of different frames merged by the server */
+    if (len != dir->len)
+    {
+        dir->corrupt++;
+        return;
+    }
+
+    dir->received++;
+    metric_hist_add(&dir->latency, now - dir->stamp[seq % ST_HISTORY]);
+}
+
+/**
+ * Read from one end and account the frames.
+ *
+ * Test frames are accounted in dir. The client end answers link probes
+ * and takes note of control messages.
+ *
+ * @return -1 if the connection is gone.
+ */
+static int read_end(struct st_end *end, struct st_dir *dir, int is_client,
+                    int *control)
+{
+    uint8_t        *frame;
+    uint8_t         pong[PING_MSG_LEN];
+    uint64_t        now;
+    ssize_t         num;
+    int             start = 0, len;
+    int             i;
+
+    num = read(end->fd, &end->in[end->in_len],
+               sizeof(end->in) - end->in_len);
+    if (num == 0 || (num < 0 && errno != EAGAIN && errno != EINTR))
+        return -1;
+    if (num < 0)
+        return 0;
+    end->in_len += num;
+    now = time_us();
+
+    for (i = 0; i < end->in_len; i++)
+    {
+        if (end->in[start] != 0xFE)
+        {
+            end->invalid += end->in[start] != 0x00;
+            start = i + 1;
+            continue;
+        }
+        if (end->in[i] != 0xFD)
+            continue;
+
+        frame = &end->in[start];
+        len = i - start + 1;
+        start = i + 1;
+
+        if (frame[1] == dir->type)
+            recv_test_frame(dir, frame, len, now);
+        else if (is_client && frame[1] == PKT_TYPE_PING &&
+                 len == PING_MSG_LEN && link_make_pong(frame, pong))
+            queue_frame(end, pong, PING_MSG_LEN);
+        else if (is_client && frame[1] == PKT_TYPE_CTL && len >= 4)
+            *control = frame[2];
+        else
+            end->other++;
+    }
+
+    /* keep the incomplete frame; drop it if it can never complete */
+    end->in_len -= start;
+    if (end->in_len == sizeof(end->in))
+    {
+        end->invalid += end->in_len;
+        end->in_len = 0;
+    }
+    memmove(end->in, &end->in[start], end->in_len);
+
+    return 0;
+}
+
+/* Start a new step */
+static void reset_dir(struct st_dir *dir, int len)
+{
+    dir->len = len;
+    dir->first = dir->seq;
+    dir->offered = 0;
+    dir->sent = 0;
+    dir->received = 0;
+    dir->corrupt = 0;
+    metric_hist_clear(&dir->latency);
+}
+
+/* Print one step; returns 1 if the server did not keep up */
+static int print_step(int size, uint32_t rate, struct st_dir *dir,
+                      double elapsed, const struct st_counters *before,
+                      const struct st_counters *after, uint64_t forwarded,
+                      double tick_us)
+{
+    double          cpu_us = (after->cpu_ticks - before->cpu_ticks) * tick_us;
+    double          ratio = dir->offered ?
+        (double)dir->received / dir->offered : 1.0;
+
+    fprintf(stderr, "%5d %7" PRIu32 " %-5s %8.0f %8.1f %5.1f%% %5" PRIu64
+            " %7.2f %7.2f %7.2f  %6.1f %5.1f%%  %5" PRIu64 " %5" PRIu64
+            " %5" PRIu64 "\n",
+            size, rate, dir->name, dir->received / elapsed,
+            dir->received * size / elapsed / 1024,
+            100.0 * (1.0 - ratio), dir->corrupt,
+            1.e-3 * metric_hist_percentile(&dir->latency, 50),
+            1.e-3 * metric_hist_percentile(&dir->latency, 99),
+            1.e-3 * dir->latency.max,
+            forwarded ? cpu_us / forwarded : 0.0,
+            100.0 * cpu_us / (1.e6 * elapsed),
+            after->invalid - before->invalid,
+            after->write_errors - before->write_errors,
+            after->dropped - before->dropped);
+
+    return ratio < ST_SATURATED;
+}
+
+int main(int argc, char **argv)
+{
+    static struct st_dir down = {.name = "down",.type = PKT_TYPE_LCD };
+    static struct st_dir up = {.name = "up",.type = PKT_TYPE_TUNE };
+    static struct st_end radio, client;
+
+    struct st_counters before, after;
+    struct pollfd   poll_fds[2];
+    char            pty_path[64], port_str[16], metrics_path[64];
+    char           *server_args[10];
+    char           *sizes_arg = "6,24,128,512,2048";
+    char           *tok, *save = NULL;
+    const char     *dir = ".";
+    const char     *direction = "both";
+    pid_t           server_pid = -1;
+    uint64_t        start, now, end, due;
+    uint64_t        forwarded;
+    uint32_t        rate, first_rate = 100, max_rate = 200000;
+    uint32_t        knee[ST_MAX_SIZES] = { 0 };
+    uint32_t        first_error[ST_MAX_SIZES] = { 0 };
+    double          tick_us = 1.e6 / sysconf(_SC_CLK_TCK);
+    double          elapsed;
+    int             sizes[ST_MAX_SIZES];
+    int             num_sizes = 0;
+    int             port = 42200;
+    int             duration = 2;
+    int             quiet = 0;
+    int             slave_fd = -1;
+    int             control = 0;
+    int             exit_code = EXIT_FAILURE;
+    int             saturated, errors;
+    int             link_lost = 0;
+    int             option;
+    int             i;
+
+    while ((option = getopt(argc, argv, "p:s:r:R:d:D:b:qh")) != -1)
+    {
+        switch (option)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+
+        case 's':
+            sizes_arg = optarg;
+            break;
+
+        case 'r':
+            first_rate = atoi(optarg);
+            if (first_rate < 1)
+                first_rate = 1;
+            break;
+
+        case 'R':
+            max_rate = atoi(optarg);
+            break;
+
+        case 'd':
+            duration = atoi(optarg);
+            if (duration < 1)
+                duration = 1;
+            break;
+
+        case 'D':
+            direction = optarg;
+            break;
+
+        case 'b':
+            dir = optarg;
+            break;
+
+        case 'q':
+            quiet = 1;
+            break;
+
+        case 'h':
+            help();
+            exit(EXIT_SUCCESS);
+
+        default:
+            help();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (tok = strtok_r(sizes_arg, ",", &save);
+         tok && num_sizes < ST_MAX_SIZES; tok = strtok_r(NULL, ",", &save))
+    {
+        sizes[num_sizes] = atoi(tok);
+        if (sizes[num_sizes] < TEST_FRAME_MIN_LEN)
+            sizes[num_sizes] = TEST_FRAME_MIN_LEN;
+        else if (sizes[num_sizes] > RDBUF_SIZE)
+            sizes[num_sizes] = RDBUF_SIZE;
+        num_sizes++;
+    }
+
+    down.enabled = strcmp(direction, "up") != 0;
+    up.enabled = strcmp(direction, "down") != 0;
+    down.stamp = malloc(ST_HISTORY * sizeof(uint64_t));
+    up.stamp = malloc(ST_HISTORY * sizeof(uint64_t));
+    radio.fd = client.fd = -1;
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    radio.fd = test_open_pty(pty_path, sizeof(pty_path), &slave_fd);
+    if (radio.fd == -1)
+        goto cleanup;
+
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    snprintf(metrics_path, sizeof(metrics_path), "/tmp/ic706_stress.%d",
+             (int)getpid());
+    server_args[1] = "-u";
+    server_args[2] = pty_path;
+    server_args[3] = "-p";
+    server_args[4] = port_str;
+    server_args[5] = "-g";
+    server_args[6] = "-M";
+    server_args[7] = metrics_path;
+    server_args[8] = NULL;
+    server_pid = test_start_daemon(dir, "ic706_server", server_args, quiet);
+    if (server_pid == -1)
+        goto cleanup;
+
+    /* connect as the first client, which gets control of the radio */
+    start = time_us();
+    while (keep_running && client.fd == -1 &&
+           time_us() - start < 1000 * ST_CONNECT_MS)
+    {
+        usleep(100000);
+        client.fd = connect_server("127.0.0.1", port);
+    }
+    if (client.fd == -1)
+    {
+        fprintf(stderr, "Could not connect to ic706_server on port %d\n",
+                port);
+        goto cleanup;
+    }
+    set_nodelay(client.fd);
+    fcntl(client.fd, F_SETFL, fcntl(client.fd, F_GETFL) | O_NONBLOCK);
+
+    poll_fds[0].fd = radio.fd;
+    poll_fds[1].fd = client.fd;
+
+    while (keep_running && !control &&
+           time_us() - start < 1000 * ST_CONNECT_MS)
+    {
+        poll_fds[0].events = poll_fds[1].events = POLLIN;
+        if (poll(poll_fds, 2, 100) > 0 && (poll_fds[1].revents & POLLIN) &&
+            read_end(&client, &down, 1, &control))
+            break;
+    }
+    if (!control)
+    {
+        fprintf(stderr, "Did not get control of the radio\n");
+        goto cleanup;
+    }
+
+    fprintf(stderr, "Server pid %d on %s; %d s per step, direction %s\n",
+            (int)server_pid, pty_path, duration, direction);
+    fprintf(stderr, "%5s %7s %-5s %8s %8s %6s %5s %7s %7s %7s  %6s %6s  "
+            "%5s %5s %5s\n", "size", "rate", "dir", "frames/s", "kB/s",
+            "loss", "bad", "50%", "99%", "max", "us/frm", "cpu", "inval",
+            "wrerr", "drop");
+
+    for (i = 0; i < num_sizes && keep_running && !link_lost; i++)
+    {
+        for (rate = first_rate; rate <= max_rate && keep_running; rate *= 2)
+        {
+            reset_dir(&down, sizes[i]);
+            reset_dir(&up, sizes[i]);
+            if (read_counters(metrics_path, server_pid, &before))
+            {
+                fprintf(stderr, "Error reading metrics from %s\n",
+                        metrics_path);
+                goto cleanup;
+            }
+
+            start = time_us();
+            end = start + 1000000ULL * duration;
+            now = start;
+            while (keep_running && now < end + 1000 * ST_DRAIN_MS)
+            {
+                /* queue the frames that are due; stop sending at the end
+                 * of the step and wait for the frames in flight */
+                due = now < end ? (now - start) * rate / 1000000 + 1 : 0;
+                while (down.enabled && down.offered < due)
+                    send_test_frame(&radio, &down, now);
+                while (up.enabled && up.offered < due)
+                    send_test_frame(&client, &up, now);
+
+                if (flush_end(&radio) || flush_end(&client))
+                    break;
+
+                poll_fds[0].events = POLLIN | (radio.out_len ? POLLOUT : 0);
+                poll_fds[1].events = POLLIN | (client.out_len ? POLLOUT : 0);
+                if (poll(poll_fds, 2, 1) > 0)
+                {
+                    if (((poll_fds[0].revents & POLLIN) &&
+                         read_end(&radio, &up, 0, &control)) ||
+                        ((poll_fds[1].revents & (POLLIN | POLLHUP)) &&
+                         read_end(&client, &down, 1, &control)))
+                        break;
+                }
+                now = time_us();
+            }
+
+            /* e.g. the server closed the session because the link probes
+             * were not answered in time */
+            if (keep_running && now < end + 1000 * ST_DRAIN_MS)
+            {
+                fprintf(stderr, "%5d %7" PRIu32 " server closed the "
+                        "connection\n", sizes[i], rate);
+                first_error[i] = first_error[i] ? first_error[i] : rate;
+                link_lost = 1;
+                break;
+            }
+            elapsed = 1.e-6 * (end - start);
+
+            read_counters(metrics_path, server_pid, &after);
+            forwarded = down.received + up.received;
+            saturated = 0;
+            if (down.enabled)
+                saturated |= print_step(sizes[i], rate, &down, elapsed,
+                                        &before, &after, forwarded, tick_us);
+            if (up.enabled)
+                saturated |= print_step(sizes[i], rate, &up, elapsed,
+                                        &before, &after, forwarded, tick_us);
+
+            errors = after.invalid != before.invalid ||
+                after.write_errors != before.write_errors ||
+                after.dropped != before.dropped;
+            if (errors && !first_error[i])
+                first_error[i] = rate;
+            if (saturated)
+                break;
+            knee[i] = rate;
+        }
+    }
+
+    fprintf(stderr, "\nHighest rate delivered with less than %.0f%% loss "
+            "(frames/s per direction):\n", 100 * (1 - ST_SATURATED));
+    for (i = 0; i < num_sizes; i++)
+    {
+        fprintf(stderr, "  %5d bytes: %7" PRIu32, sizes[i], knee[i]);
+        if (first_error[i])
+            fprintf(stderr, "   (server errors from %" PRIu32 " frames/s)",
+                    first_error[i]);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "Bytes outside frames: %" PRIu64 " from the UART, %"
+            PRIu64 " from the network\n", radio.invalid, client.invalid);
+    fprintf(stderr, "Other frames: %" PRIu64 " on the UART (e.g. link "
+            "probes forwarded to the radio), %" PRIu64 " from the network\n",
+            radio.other, client.other);
+
+    exit_code = EXIT_SUCCESS;
+
+  cleanup:
+    if (client.fd != -1)
+        close(client.fd);
+    test_stop_daemon(server_pid);
+    if (radio.fd != -1)
+        close(radio.fd);
+    if (slave_fd != -1)
+        close(slave_fd);
+    free(down.stamp);
+    free(up.stamp);
+
+    return exit_code;
+}
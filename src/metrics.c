@@ -0,0 +1,339 @@
+/*
+ * Live metrics endpoint.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#include <errno.h>
+#include <inttypes.h>           /* PRIu64 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "metrics.h"
+
+#define METRICS_BUFLEN      (METRICS_MAX * 1024)
+
+static const char *http_header =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Connection: close\r\n\r\n";
+
+
+void metrics_init(struct metrics *m, const char *prefix)
+{
+    m->prefix = prefix;
+    m->num = 0;
+    m->listen_fd = -1;
+    m->client_fd = -1;
+    m->http = 0;
+    m->path[0] = '\0';
+    m->update = NULL;
+    m->update_arg = NULL;
+    m->scrapes = 0;
+}
+
+void metrics_add(struct metrics *m, const char *name, int type,
+                 const char *help, const void *value, int size)
+{
+    struct metric  *metric;
+
+    if (m->num == METRICS_MAX || (size != 4 && size != 8))
+    {
+        fprintf(stderr, "%s: can not add %s\n", __func__, name);
+        return;
+    }
+
+    metric = &m->list[m->num++];
+    metric->name = name;
+    metric->help = help;
+    metric->type = type;
+    metric->size = size;
+    metric->value = value;
+}
+
+static int open_unix_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int             fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Metrics socket path too long: %s\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error creating socket: %d: %s\n", errno,
+                strerror(errno));
+        return -1;
+    }
+
+    /* remove stale socket from a previous run */
+    unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, 1) == -1)
+    {
+        fprintf(stderr, "Error opening %s: %d: %s\n", path, errno,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int metrics_open(struct metrics *m, const char *spec)
+{
+    if (spec[0] == '/' || spec[0] == '.')
+    {
+        m->listen_fd = open_unix_socket(spec);
+        if (m->listen_fd == -1)
+            return -1;
+
+        strcpy(m->path, spec);
+        m->http = 0;
+        fprintf(stderr, "Metrics available on %s\n", spec);
+    }
+    else
+    {
+        m->listen_fd = create_local_server_socket(atoi(spec));
+        if (m->listen_fd == -1)
+            return -1;
+
+        m->http = 1;
+        fprintf(stderr, "Metrics available on http://127.0.0.1:%d/\n",
+                atoi(spec));
+    }
+
+    return 0;
+}
+
+int metrics_fd(struct metrics *m)
+{
+    /* a client that connects and never sends a request would otherwise
+     * block all later scrapes */
+    if (m->client_fd != -1 && time_ms() >= m->client_deadline)
+    {
+        fprintf(stderr, "Metrics client sent no request; closed\n");
+        close(m->client_fd);
+        m->client_fd = -1;
+    }
+
+    /* one request at a time; new connections wait in the backlog */
+    return m->client_fd != -1 ? m->client_fd : m->listen_fd;
+}
+
+uint64_t metric_value(const struct metric *metric)
+{
+    if (metric->size == 8)
+        return __atomic_load_n((const uint64_t *)metric->value,
+                               __ATOMIC_RELAXED);
+
+    return __atomic_load_n((const uint32_t *)metric->value,
+                           __ATOMIC_RELAXED);
+}
+
+/* Get the smallest value counted in a bucket */
+static uint32_t hist_bucket_low(int b)
+{
+    if (b < 4)
+        return b;
+
+    return (uint32_t) (4 + (b & 3)) << (b / 4 - 1);
+}
+
+/* Get the largest value counted in a bucket */
+static uint32_t hist_bucket_high(int b)
+{
+    return b == METRIC_HIST_BUCKETS - 1 ? UINT32_MAX :
+        hist_bucket_low(b + 1) - 1;
+}
+
+uint32_t metric_hist_percentile(const struct metric_hist *h, int pct)
+{
+    uint64_t        target, cum = 0;
+    uint32_t        count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    uint32_t        min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    uint32_t        max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    uint32_t        num = 0, low, high;
+    int             i;
+
+    if (count == 0)
+        return 0;
+
+    target = ((uint64_t) count * pct + 99) / 100;
+    if (target == 0)
+        target = 1;
+
+    for (i = 0; i < METRIC_HIST_BUCKETS; i++)
+    {
+        num = __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+        if (cum + num >= target)
+            break;
+        cum += num;
+    }
+
+    if (i == METRIC_HIST_BUCKETS)
+        return max;
+
+    /* assume the values are evenly spread within the bucket */
+    low = hist_bucket_low(i) > min ? hist_bucket_low(i) : min;
+    high = hist_bucket_high(i) < max ? hist_bucket_high(i) : max;
+    if (high <= low)
+        return low;
+
+    return low + (uint32_t) ((uint64_t) (high - low) * (target - cum) / num);
+}
+
+/* Render a histogram with cumulative buckets. Only the boundaries between
+ * powers of two are rendered to keep the output short. */
+static int render_hist(char *buf, int size, const char *prefix,
+                       const struct metric *metric)
+{
+    const struct metric_hist *h = metric->value;
+    uint64_t        cum = 0;
+    int             len;
+    int             i;
+
+    len = snprintf(buf, size, "# HELP %s_%s %s\n# TYPE %s_%s histogram\n",
+                   prefix, metric->name, metric->help, prefix, metric->name);
+
+    for (i = 0; i < METRIC_HIST_BUCKETS - 1 && len < size; i++)
+    {
+        cum += __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+        if (i >= 4 && (i & 3) != 3)
+            continue;
+
+        len += snprintf(&buf[len], size - len,
+                        "%s_%s_bucket{le=\"%" PRIu32 "\"} %" PRIu64 "\n",
+                        prefix, metric->name, hist_bucket_high(i), cum);
+    }
+
+    /* the count is taken from the buckets so that the histogram is
+     * consistent even while it is being updated */
+    cum += __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+    if (len < size)
+        len += snprintf(&buf[len], size - len,
+                        "%s_%s_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+                        "%s_%s_sum %" PRIu64 "\n"
+                        "%s_%s_count %" PRIu64 "\n",
+                        prefix, metric->name, cum,
+                        prefix, metric->name,
+                        __atomic_load_n(&h->sum, __ATOMIC_RELAXED),
+                        prefix, metric->name, cum);
+
+    return len;
+}
+
+/* Render all metrics; returns the number of bytes in buf */
+static int metrics_render(struct metrics *m, char *buf, int size)
+{
+    const struct metric *metric;
+    int             len = 0;
+    int             i;
+
+    if (m->update)
+        m->update(m->update_arg);
+
+    for (i = 0; i < m->num && len < size; i++)
+    {
+        metric = &m->list[i];
+        if (metric->type == METRIC_HISTOGRAM)
+        {
+            len += render_hist(&buf[len], size - len, m->prefix, metric);
+            continue;
+        }
+
+        len += snprintf(&buf[len], size - len,
+                        "# HELP %s_%s %s\n"
+                        "# TYPE %s_%s %s\n"
+                        "%s_%s %" PRIu64 "\n",
+                        m->prefix, metric->name, metric->help,
+                        m->prefix, metric->name,
+                        metric->type == METRIC_COUNTER ? "counter" : "gauge",
+                        m->prefix, metric->name, metric_value(metric));
+    }
+
+    return len < size ? len : size;
+}
+
+/* Send the metrics and close the connection */
+static void metrics_reply(struct metrics *m, int fd)
+{
+    static char     buf[METRICS_BUFLEN];
+    int             len = 0;
+
+    if (m->http)
+        len = snprintf(buf, sizeof(buf), "%s", http_header);
+
+    len += metrics_render(m, &buf[len], sizeof(buf) - len);
+
+    if (send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len)
+        fprintf(stderr, "Error sending metrics: %d: %s\n", errno,
+                strerror(errno));
+
+    m->scrapes++;
+    close(fd);
+}
+
+void metrics_process(struct metrics *m)
+{
+    char            req[2048];
+    ssize_t         num;
+    int             fd;
+
+    if (m->client_fd == -1)
+    {
+        fd = accept(m->listen_fd, NULL, NULL);
+        if (fd == -1)
+            return;
+
+        /* Unix socket clients just read; HTTP clients send a request
+         * first, which must be read before replying */
+        if (m->http)
+        {
+            m->client_fd = fd;
+            m->client_deadline = time_ms() + METRICS_CLIENT_MS;
+        }
+        else
+            metrics_reply(m, fd);
+
+        return;
+    }
+
+    /* the request is not parsed; any request gets the metrics */
+    num = recv(m->client_fd, req, sizeof(req), MSG_DONTWAIT);
+    if (num > 0)
+        metrics_reply(m, m->client_fd);
+    else if (num == 0 || (errno != EAGAIN && errno != EINTR))
+        close(m->client_fd);
+    else
+        return;
+
+    m->client_fd = -1;
+}
+
+void metrics_close(struct metrics *m)
+{
+    if (m->client_fd != -1)
+        close(m->client_fd);
+    if (m->listen_fd != -1)
+        close(m->listen_fd);
+    if (m->path[0])
+        unlink(m->path);
+
+    m->client_fd = -1;
+    m->listen_fd = -1;
+    m->path[0] = '\0';
+}
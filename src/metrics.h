@@ -0,0 +1,240 @@
+/*
+ * Live metrics endpoint.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+/**
+ * @file
+ * Registry of counters, gauges and histograms served in Prometheus text
+ * format.
+ *
+ * A daemon registers pointers to the variables it already maintains and
+ * calls metrics_process() when the descriptor returned by metrics_fd() is
+ * readable. The endpoint is either a TCP port on the loopback interface,
+ * serving HTTP so that Prometheus can scrape it directly, or a Unix socket
+ * path, which returns the plain text to any client that connects.
+ *
+ * Values are read with relaxed atomic loads, so variables updated by
+ * another thread (e.g. the audio callback) can be registered as long as
+ * that thread updates them using metric_add() or metric_set(). Nothing
+ * is locked and the hot paths pay only for a plain store.
+ */
+
+#define METRICS_MAX         48
+#define METRICS_CLIENT_MS   1000        /* time for an HTTP request */
+
+#define METRIC_COUNTER      0
+#define METRIC_GAUGE        1
+#define METRIC_HISTOGRAM    2
+
+#define METRIC_HIST_BUCKETS 80      /* values up to 2^21 */
+
+/**
+ * Update a variable that is read by the metrics endpoint.
+ *
+ * Only one thread may update a given variable; the store is atomic so that
+ * readers never see a torn 64 bit value.
+ */
+#define metric_set(var, val) \
+    __atomic_store_n(&(var), (val), __ATOMIC_RELAXED)
+#define metric_add(var, n)   metric_set(var, (var) + (n))
+
+/**
+ * Histogram with logarithmic buckets.
+ *
+ * @count   Number of values added.
+ * @min     Smallest value; UINT32_MAX if count is 0.
+ * @max     Largest value.
+ * @sum     Sum of all values.
+ * @bucket  Values 0 to 3 have their own bucket. Larger values are counted
+ *          in four equally wide buckets per power of two, which keeps the
+ *          relative error of percentiles below 25%. The last bucket also
+ *          counts larger values.
+ *
+ * Adding a value costs a few instructions and never locks, so histograms
+ * can be updated from the audio callback. Like other metrics, a histogram
+ * has only one writer.
+ */
+struct metric_hist {
+    uint32_t        count;
+    uint32_t        min;
+    uint32_t        max;
+    uint64_t        sum;
+    uint32_t        bucket[METRIC_HIST_BUCKETS];
+};
+
+static inline void metric_hist_clear(struct metric_hist *h)
+{
+    int             i;
+
+    metric_set(h->count, 0);
+    metric_set(h->min, UINT32_MAX);
+    metric_set(h->max, 0);
+    metric_set(h->sum, 0);
+    for (i = 0; i < METRIC_HIST_BUCKETS; i++)
+        metric_set(h->bucket[i], 0);
+}
+
+/* Get the bucket for a value; see struct metric_hist */
+static inline int metric_hist_bucket(uint32_t val)
+{
+    int             e;
+
+    if (val < 4)
+        return val;
+
+    e = 31 - __builtin_clz(val);
+
+    return 4 * (e - 1) + ((val >> (e - 2)) & 3);
+}
+
+static inline void metric_hist_add(struct metric_hist *h, uint32_t val)
+{
+    int             i = metric_hist_bucket(val);
+
+    if (i >= METRIC_HIST_BUCKETS)
+        i = METRIC_HIST_BUCKETS - 1;
+
+    metric_add(h->bucket[i], 1);
+    metric_add(h->sum, val);
+    if (val < h->min)
+        metric_set(h->min, val);
+    if (val > h->max)
+        metric_set(h->max, val);
+    metric_add(h->count, 1);
+}
+
+/**
+ * Estimate a percentile of the values in a histogram.
+ *
+ * @param h    The histogram.
+ * @param pct  The percentile, 0 to 100.
+ * @return The percentile interpolated within its bucket and limited to the
+ *         smallest and largest value; 0 if the histogram is empty.
+ */
+uint32_t        metric_hist_percentile(const struct metric_hist *h, int pct);
+
+/**
+ * A registered metric.
+ *
+ * @name   Metric name without the daemon prefix.
+ * @help   Description used for the HELP line.
+ * @type   METRIC_COUNTER, METRIC_GAUGE or METRIC_HISTOGRAM.
+ * @size   Size of the variable; 4 or 8 bytes. Not used for histograms.
+ * @value  Pointer to the variable or the struct metric_hist.
+ */
+struct metric {
+    const char     *name;
+    const char     *help;
+    uint8_t         type;
+    uint8_t         size;
+    const void     *value;
+};
+
+/**
+ * Read a counter or gauge.
+ *
+ * Uses a relaxed atomic load; see metric_set() for the writer side.
+ */
+uint64_t        metric_value(const struct metric *metric);
+
+/**
+ * Metrics registry and endpoint.
+ *
+ * @prefix      Prefix for all metric names, e.g. the daemon name.
+ * @list        The registered metrics.
+ * @num         The number of registered metrics.
+ * @listen_fd   Listening socket; -1 if the endpoint is disabled.
+ * @client_fd   Accepted HTTP connection waiting for its request; -1 if
+ *              none.
+ * @client_deadline  Time when a client that has not sent its request is
+ *              closed (msec, see time_ms()).
+ * @http        Non-zero if the endpoint serves HTTP.
+ * @path        Unix socket path, removed when the endpoint is closed.
+ * @update      Called before the metrics are rendered, e.g. to compute
+ *              totals over all clients. May be NULL.
+ * @update_arg  Argument for @update.
+ * @scrapes     Number of requests served.
+ */
+struct metrics {
+    const char     *prefix;
+    struct metric   list[METRICS_MAX];
+    int             num;
+
+    int             listen_fd;
+    int             client_fd;
+    uint64_t        client_deadline;
+    int             http;
+    char            path[108];
+
+    void            (*update) (void *arg);
+    void           *update_arg;
+
+    uint64_t        scrapes;
+};
+
+/** Initialize the registry; the endpoint is disabled until metrics_open(). */
+void            metrics_init(struct metrics *m, const char *prefix);
+
+/**
+ * Register a metric.
+ *
+ * @param m      The metrics registry.
+ * @param name   Metric name; the prefix is added when rendering.
+ * @param type   METRIC_COUNTER or METRIC_GAUGE; histograms are added using
+ *               METRICS_ADD_HIST().
+ * @param help   Description of the metric.
+ * @param value  Pointer to a 32 or 64 bit unsigned variable.
+ * @param size   sizeof the variable.
+ *
+ * Use the METRICS_ADD() macro which gets the size right. The variable must
+ * stay valid as long as the registry is used.
+ */
+void            metrics_add(struct metrics *m, const char *name, int type,
+                            const char *help, const void *value, int size);
+
+#define METRICS_ADD(m, name, type, help, var) \
+    metrics_add(m, name, type, help, &(var), sizeof(var))
+
+/** Register a histogram; see metrics_add(). */
+#define METRICS_ADD_HIST(m, name, help, hist) \
+    metrics_add(m, name, METRIC_HISTOGRAM, help, &(hist), 8)
+
+/**
+ * Open the endpoint.
+ *
+ * @param m      The metrics registry.
+ * @param spec   A port number for HTTP on 127.0.0.1 or a Unix socket path
+ *               (anything starting with '/' or '.').
+ * @return 0 if OK, -1 if an error occurred.
+ */
+int             metrics_open(struct metrics *m, const char *spec);
+
+/**
+ * Get the file descriptor to poll for POLLIN.
+ *
+ * @return The descriptor or -1 if the endpoint is disabled.
+ *
+ * Call before every poll(). An HTTP client that has not sent its request
+ * within METRICS_CLIENT_MS is closed here, so that it can not block the
+ * endpoint.
+ */
+int             metrics_fd(struct metrics *m);
+
+/**
+ * Serve the endpoint; call when metrics_fd() is readable.
+ *
+ * Accepts a connection or answers a pending request. Never blocks.
+ */
+void            metrics_process(struct metrics *m);
+
+/** Close the endpoint. */
+void            metrics_close(struct metrics *m);
+
+#endif
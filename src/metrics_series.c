@@ -0,0 +1,302 @@
+/*
+ * Metrics time series in a memory-mapped file.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "metrics_series.h"
+#include "timebase.h"
+
+void metrics_series_init(struct metrics_series *s, struct metrics *m)
+{
+    s->m = m;
+    s->hdr = NULL;
+    s->map_size = 0;
+    s->interval = MSERIES_INTERVAL_MS;
+    s->next = 0;
+    s->prev = NULL;
+}
+
+/* Get the number of columns for the registered metrics */
+static uint32_t count_columns(const struct metrics *m)
+{
+    uint32_t        num = 0;
+    int             i;
+
+    for (i = 0; i < m->num; i++)
+        num += m->list[i].type == METRIC_HISTOGRAM ? 3 : 1;
+
+    return num;
+}
+
+static void set_column(struct mseries_column *col, const char *name,
+                       const char *suffix, int type)
+{
+    memset(col, 0, sizeof(*col));
+    snprintf(col->name, sizeof(col->name), "%s%s", name, suffix);
+    col->type = type;
+}
+
+/* Fill in the header and column descriptions that the file must have */
+static void make_header(const struct metrics_series *s, uint32_t records,
+                        struct mseries_header *hdr,
+                        struct mseries_column *cols)
+{
+    const struct metric *metric;
+    long            page = sysconf(_SC_PAGESIZE);
+    uint32_t        num = count_columns(s->m);
+    uint32_t        c = 0;
+    int             i;
+
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, MSERIES_MAGIC, sizeof(hdr->magic));
+    hdr->version = MSERIES_VERSION;
+    hdr->header_size = sizeof(*hdr) + num * sizeof(*cols);
+    hdr->header_size = (hdr->header_size + page - 1) / page * page;
+    hdr->columns = num;
+    hdr->record_size = sizeof(uint64_t) * (num + 1);
+    hdr->records = records;
+    hdr->interval = s->interval;
+    snprintf(hdr->prefix, sizeof(hdr->prefix), "%s", s->m->prefix);
+
+    for (i = 0; i < s->m->num; i++)
+    {
+        metric = &s->m->list[i];
+        if (metric->type == METRIC_HISTOGRAM)
+        {
+            set_column(&cols[c++], metric->name, "_count", METRIC_COUNTER);
+            set_column(&cols[c++], metric->name, "_p50", METRIC_GAUGE);
+            set_column(&cols[c++], metric->name, "_p99", METRIC_GAUGE);
+        }
+        else
+        {
+            set_column(&cols[c++], metric->name, "", metric->type);
+        }
+    }
+}
+
+/* Parse <path>[,interval=<msec>][,records=<num>]; returns the path */
+static char    *parse_spec(struct metrics_series *s, const char *spec,
+                           uint32_t * records)
+{
+    char           *str = strdup(spec);
+    char           *opt;
+
+    strtok(str, ",");
+    while ((opt = strtok(NULL, ",")) != NULL)
+    {
+        if (strncmp(opt, "interval=", 9) == 0)
+            s->interval = atoi(opt + 9);
+        else if (strncmp(opt, "records=", 8) == 0)
+            *records = atoi(opt + 8);
+        else
+            fprintf(stderr, "Unknown metrics series option: %s\n", opt);
+    }
+
+    if (s->interval < 10)
+        s->interval = 10;
+    if (*records < 2)
+        *records = 2;
+
+    return str;
+}
+
+int metrics_series_open(struct metrics_series *s, const char *spec)
+{
+    struct mseries_header hdr;
+    struct mseries_column *cols;
+    struct stat     st;
+    uint32_t        records = MSERIES_RECORDS;
+    size_t          cols_size;
+    char           *path;
+    void           *map;
+    int             fd;
+    int             resume = 0;
+
+    path = parse_spec(s, spec, &records);
+    cols_size = count_columns(s->m) * sizeof(*cols);
+    cols = malloc(cols_size + 1);
+    s->prev = calloc(s->m->num, sizeof(uint32_t) * METRIC_HIST_BUCKETS);
+    if (cols == NULL || s->prev == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", __func__);
+        goto error;
+    }
+
+    make_header(s, records, &hdr, cols);
+    s->map_size = hdr.header_size + (size_t) records * hdr.record_size;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error opening %s: %d: %s\n", path, errno,
+                strerror(errno));
+        goto error;
+    }
+
+    /* Continue an existing series only if the layout is the same. The
+     * space is allocated up front so that writing a record never needs to
+     * allocate blocks or fails on a full disk. */
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size == s->map_size)
+        resume = 1;
+    else if (ftruncate(fd, 0) == -1 || ftruncate(fd, s->map_size) == -1 ||
+             posix_fallocate(fd, 0, s->map_size) != 0)
+    {
+        fprintf(stderr, "Error allocating %zu bytes for %s\n", s->map_size,
+                path);
+        close(fd);
+        goto error;
+    }
+
+    map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Error mapping %s: %d: %s\n", path, errno,
+                strerror(errno));
+        goto error;
+    }
+    s->hdr = map;
+
+    if (resume)
+    {
+        hdr.head = s->hdr->head;
+        resume = memcmp(s->hdr, &hdr, sizeof(hdr)) == 0 &&
+            memcmp(s->hdr + 1, cols, cols_size) == 0;
+    }
+
+    if (!resume)
+    {
+        /* the magic is written last so that a reader never sees a
+         * partial header */
+        memset(s->hdr->magic, 0, sizeof(hdr.magic));
+        memcpy((char *)s->hdr + sizeof(hdr), cols, cols_size);
+        memcpy((char *)s->hdr + sizeof(hdr.magic),
+               (char *)&hdr + sizeof(hdr.magic),
+               sizeof(hdr) - sizeof(hdr.magic));
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(s->hdr->magic, hdr.magic, sizeof(hdr.magic));
+    }
+
+    fprintf(stderr, "Metrics series: %u columns every %u ms in %s (%s at "
+            "record %llu)\n", hdr.columns, s->interval, path,
+            resume ? "continued" : "new",
+            (unsigned long long)s->hdr->head);
+
+    free(cols);
+    free(path);
+
+    return 0;
+
+  error:
+    free(cols);
+    free(path);
+    free(s->prev);
+    s->prev = NULL;
+    s->hdr = NULL;
+
+    return -1;
+}
+
+/**
+ * Get the percentiles of the values added to a histogram since the
+ * previous sample.
+ *
+ * The difference of two histograms is a histogram of the values added in
+ * between, except that min and max are for all values. They only limit
+ * the interpolation, so the percentiles are still good estimates.
+ */
+static void hist_interval(const struct metric_hist *h, uint32_t * prev,
+                          uint64_t * p50, uint64_t * p99)
+{
+    struct metric_hist diff;
+    uint32_t        num;
+    int             i;
+
+    diff.count = 0;
+    diff.min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    diff.max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    diff.sum = 0;
+    for (i = 0; i < METRIC_HIST_BUCKETS; i++)
+    {
+        num = __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+
+        /* the histogram has been cleared */
+        if (num < prev[i])
+            prev[i] = 0;
+
+        diff.bucket[i] = num - prev[i];
+        diff.count += diff.bucket[i];
+        prev[i] = num;
+    }
+
+    *p50 = metric_hist_percentile(&diff, 50);
+    *p99 = metric_hist_percentile(&diff, 99);
+}
+
+void metrics_series_process(struct metrics_series *s, uint64_t now)
+{
+    struct mseries_record *rec;
+    const struct metric *metric;
+    const struct metric_hist *h;
+    uint64_t        head;
+    uint32_t        c = 0;
+    int             i;
+
+    if (s->hdr == NULL || now < s->next)
+        return;
+
+    /* don't try to catch up after a stall; the gap shows in the times */
+    s->next += s->interval;
+    if (s->next <= now)
+        s->next = now - now % s->interval + s->interval;
+
+    if (s->m->update)
+        s->m->update(s->m->update_arg);
+
+    head = s->hdr->head;
+    rec = (struct mseries_record *)((uint8_t *) s->hdr +
+                                    s->hdr->header_size +
+                                    (size_t) (head % s->hdr->records) *
+                                    s->hdr->record_size);
+    rec->time = time_wall_ms();
+    for (i = 0; i < s->m->num; i++)
+    {
+        metric = &s->m->list[i];
+        if (metric->type == METRIC_HISTOGRAM)
+        {
+            h = metric->value;
+            rec->value[c++] = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+            hist_interval(h, &s->prev[i * METRIC_HIST_BUCKETS],
+                          &rec->value[c], &rec->value[c + 1]);
+            c += 2;
+        }
+        else
+        {
+            rec->value[c++] = metric_value(metric);
+        }
+    }
+
+    __atomic_store_n(&s->hdr->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void metrics_series_close(struct metrics_series *s)
+{
+    if (s->hdr)
+        munmap(s->hdr, s->map_size);
+
+    free(s->prev);
+    s->hdr = NULL;
+    s->prev = NULL;
+}
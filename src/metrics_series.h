@@ -0,0 +1,148 @@
+/*
+ * Metrics time series in a memory-mapped file.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __METRICS_SERIES_H__
+#define __METRICS_SERIES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+/**
+ * @file
+ * Periodic snapshots of a metrics registry in a circular file.
+ *
+ * Scraping the metrics endpoint misses short spikes and logging to stderr
+ * every second wears the SD card. Instead, every registered metric is
+ * sampled at a fixed interval and the record is stored in a preallocated
+ * file that is mapped into memory. Writing a record is a few stores to
+ * memory; the kernel writes the dirty pages back in the background.
+ *
+ * The file is reused if the daemon is restarted with the same metrics, so
+ * the history survives restarts. metrics_series_print prints or exports
+ * the series and can follow a live file.
+ *
+ * Counters and gauges take one column each. A histogram takes three: the
+ * number of values (a counter) and the 50th and 99th percentiles of the
+ * values added during the interval.
+ */
+
+#define MSERIES_MAGIC           "METSER"
+#define MSERIES_VERSION         1
+#define MSERIES_NAME_LEN        56
+#define MSERIES_INTERVAL_MS     1000
+#define MSERIES_RECORDS         21600   /* six hours at the default interval */
+
+/**
+ * File header, followed by the column descriptions. The records start at
+ * header_size.
+ *
+ * @magic        MSERIES_MAGIC.
+ * @version      MSERIES_VERSION.
+ * @header_size  Offset of the first record; a multiple of the page size.
+ * @columns      Number of columns in a record.
+ * @record_size  Size of a record; 8 bytes per column plus the time.
+ * @records      Number of records in the file.
+ * @interval     Sampling interval in msec.
+ * @head         Number of records written since the file was created;
+ *               record i is at slot i % records. Updated after the record
+ *               has been written.
+ * @prefix       The metrics prefix, i.e. the daemon name.
+ *
+ * All numbers are in host byte order.
+ */
+struct mseries_header {
+    char            magic[6];
+    uint8_t         version;
+    uint8_t         reserved1;
+    uint32_t        header_size;
+    uint32_t        columns;
+    uint32_t        record_size;
+    uint32_t        records;
+    uint32_t        interval;
+    uint32_t        reserved2;
+    uint64_t        head;
+    char            prefix[32];
+};
+
+/**
+ * Column description.
+ *
+ * @name  Metric name, with _count, _p50 or _p99 appended for histograms.
+ * @type  METRIC_COUNTER or METRIC_GAUGE.
+ */
+struct mseries_column {
+    char            name[MSERIES_NAME_LEN];
+    uint8_t         type;
+    uint8_t         reserved[7];
+};
+
+/**
+ * Record; the values are in the order of the columns.
+ *
+ * @time   Wall clock time in msec since the epoch.
+ * @value  The metric values.
+ */
+struct mseries_record {
+    uint64_t        time;
+    uint64_t        value[];
+};
+
+/**
+ * Time series writer.
+ *
+ * @m         The metrics registry that is sampled.
+ * @hdr       The mapped file; NULL if disabled.
+ * @map_size  Size of the mapping.
+ * @interval  Sampling interval in msec.
+ * @next      Time of the next sample (msec).
+ * @prev      Histogram buckets at the previous sample, to compute the
+ *            percentiles over the interval.
+ */
+struct metrics_series {
+    struct metrics *m;
+    struct mseries_header *hdr;
+    size_t          map_size;
+    uint32_t        interval;
+    uint64_t        next;
+    uint32_t       *prev;
+};
+
+/** Initialize the writer; it is disabled until metrics_series_open(). */
+void            metrics_series_init(struct metrics_series *s,
+                                    struct metrics *m);
+
+/**
+ * Open or create the series file.
+ *
+ * @param s     The writer.
+ * @param spec  <path>[,interval=<msec>][,records=<num>]
+ * @return 0 if OK, -1 if an error occurred.
+ *
+ * Call after all metrics have been registered. An existing file is
+ * continued if it has the same metrics, interval and size; otherwise it
+ * is recreated.
+ */
+int             metrics_series_open(struct metrics_series *s,
+                                    const char *spec);
+
+/**
+ * Write a record if the interval has elapsed.
+ *
+ * @param s    The writer.
+ * @param now  Current time in msec, see time_ms().
+ *
+ * Call at least as often as the interval from the main loop. Does nothing
+ * if the writer is disabled.
+ */
+void            metrics_series_process(struct metrics_series *s,
+                                       uint64_t now);
+
+/** Unmap the file. */
+void            metrics_series_close(struct metrics_series *s);
+
+#endif
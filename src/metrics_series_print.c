@@ -0,0 +1,360 @@
+/*
+ * Print or export a metrics time series.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>           // PRIu64
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics_series.h"
+
+static int      keep_running = 1;
+
+static void signal_handler(int signo)
+{
+    (void)signo;
+    keep_running = 0;
+}
+
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: metrics_series_print [options] <series file>\n"
+        "\n Possible options are:\n"
+        "\n"
+        "  -l    List the columns.\n"
+        "  -c    Comma separated columns to print; a column is printed if\n"
+        "        its name contains one of them (default all).\n"
+        "  -r    Print counters as rates per second.\n"
+        "  -n    Print only the last n records.\n"
+        "  -C    Print CSV with the time in msec since the epoch.\n"
+        "  -f    Follow; print new records as they are written.\n"
+        "  -h    This help message.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+/* Series file and the selection of columns to print */
+struct series {
+    int             fd;
+    struct mseries_header hdr;
+    struct mseries_column *cols;
+    uint8_t        *selected;
+    int             rates;
+    int             csv;
+    int             have_prev;
+};
+
+static int read_header(struct series *s)
+{
+    if (pread(s->fd, &s->hdr, sizeof(s->hdr), 0) != sizeof(s->hdr))
+        return -1;
+
+    /* the head is only advanced after the record is complete */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return 0;
+}
+
+static int read_record(struct series *s, uint64_t i,
+                       struct mseries_record *rec)
+{
+    off_t           offs = s->hdr.header_size +
+        (off_t) (i % s->hdr.records) * s->hdr.record_size;
+
+    return pread(s->fd, rec, s->hdr.record_size, offs) ==
+        s->hdr.record_size ? 0 : -1;
+}
+
+static void select_columns(struct series *s, const char *spec)
+{
+    char           *str, *name;
+    uint32_t        c;
+
+    memset(s->selected, spec == NULL, s->hdr.columns);
+    if (spec == NULL)
+        return;
+
+    str = strdup(spec);
+    for (name = strtok(str, ","); name; name = strtok(NULL, ","))
+        for (c = 0; c < s->hdr.columns; c++)
+            if (strstr(s->cols[c].name, name))
+                s->selected[c] = 1;
+
+    free(str);
+}
+
+/* Text columns are as wide as the name, but at least 12 characters */
+static int column_width(const struct series *s, uint32_t c)
+{
+    int             len = strlen(s->cols[c].name);
+
+    return len > 12 ? len : 12;
+}
+
+static void print_heading(const struct series *s)
+{
+    uint32_t        c;
+
+    printf(s->csv ? "time" : "%-12s", "# time");
+    for (c = 0; c < s->hdr.columns; c++)
+    {
+        if (!s->selected[c])
+            continue;
+
+        if (s->csv)
+            printf(",%s", s->cols[c].name);
+        else
+            printf(" %*s", column_width(s, c), s->cols[c].name);
+    }
+    printf("\n");
+}
+
+/**
+ * Print a record.
+ *
+ * @param s     The series.
+ * @param rec   The record.
+ * @param prev  The previous record for rates; NULL if there is none.
+ */
+static void print_record(const struct series *s,
+                         const struct mseries_record *rec,
+                         const struct mseries_record *prev)
+{
+    struct tm       tm;
+    time_t          secs = rec->time / 1000;
+    uint64_t        dt;
+    uint32_t        c;
+    int             width;
+    char            clock[16];
+
+    if (s->csv)
+    {
+        printf("%" PRIu64, rec->time);
+    }
+    else
+    {
+        localtime_r(&secs, &tm);
+        strftime(clock, sizeof(clock), "%H:%M:%S", &tm);
+        printf("%s.%03u", clock, (unsigned)(rec->time % 1000));
+    }
+
+    for (c = 0; c < s->hdr.columns; c++)
+    {
+        if (!s->selected[c])
+            continue;
+
+        /* CSV fields have no padding */
+        width = s->csv ? 0 : column_width(s, c);
+        printf(s->csv ? "," : " ");
+
+        if (s->rates && s->cols[c].type == METRIC_COUNTER)
+        {
+            /* counters restart from 0 when the daemon is restarted */
+            dt = prev ? rec->time - prev->time : 0;
+            if (dt == 0 || rec->value[c] < prev->value[c])
+                printf("%*s", width, s->csv ? "" : "-");
+            else
+                printf("%*.3f", width,
+                       1.e3 * (rec->value[c] - prev->value[c]) / dt);
+        }
+        else
+        {
+            printf("%*" PRIu64, width, rec->value[c]);
+        }
+    }
+    printf("\n");
+}
+
+/**
+ * Print records up to the current head.
+ *
+ * @param s      The series.
+ * @param next   The first record to print; updated to the record after
+ *               the last one printed.
+ * @param rec    Buffer for a record.
+ * @param prev   The previous record, for rates.
+ */
+static void print_records(struct series *s, uint64_t * next,
+                          struct mseries_record **rec,
+                          struct mseries_record **prev)
+{
+    struct mseries_record *tmp;
+    uint64_t        first;
+
+    if (read_header(s))
+        return;
+
+    /* the oldest record may be being overwritten */
+    first = s->hdr.head > s->hdr.records - 1 ?
+        s->hdr.head - s->hdr.records + 1 : 0;
+    if (*next < first)
+        *next = first;
+
+    /* the record before the first one printed is needed for rates */
+    if (s->rates && !s->have_prev && *next < s->hdr.head)
+        s->have_prev = read_record(s, (*next)++, *prev) == 0;
+
+    for (; *next < s->hdr.head; (*next)++)
+    {
+        if (read_record(s, *next, *rec))
+            break;
+
+        print_record(s, *rec, s->have_prev ? *prev : NULL);
+        s->have_prev = 1;
+
+        tmp = *prev;
+        *prev = *rec;
+        *rec = tmp;
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    struct series   s;
+    struct mseries_record *rec = NULL;
+    struct mseries_record *prev = NULL;
+    const char     *spec = NULL;
+    uint64_t        last = 0;
+    uint64_t        next = 0;
+    uint32_t        c;
+    int             list = 0;
+    int             follow = 0;
+    int             option;
+    int             exit_code = EXIT_FAILURE;
+
+    memset(&s, 0, sizeof(s));
+    while ((option = getopt(argc, argv, "lc:rn:Cfh")) != -1)
+    {
+        switch (option)
+        {
+        case 'l':
+            list = 1;
+            break;
+
+        case 'c':
+            spec = optarg;
+            break;
+
+        case 'r':
+            s.rates = 1;
+            break;
+
+        case 'n':
+            last = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'C':
+            s.csv = 1;
+            break;
+
+        case 'f':
+            follow = 1;
+            break;
+
+        case 'h':
+        default:
+            help();
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        help();
+        return EXIT_FAILURE;
+    }
+
+    s.fd = open(argv[optind], O_RDONLY);
+    if (s.fd == -1)
+    {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if (read_header(&s) ||
+        memcmp(s.hdr.magic, MSERIES_MAGIC, sizeof(s.hdr.magic)) != 0)
+    {
+        fprintf(stderr, "%s is not a metrics series\n", argv[optind]);
+        goto cleanup;
+    }
+
+    if (s.hdr.version != MSERIES_VERSION || s.hdr.records < 2 ||
+        s.hdr.record_size != sizeof(uint64_t) * (s.hdr.columns + 1))
+    {
+        fprintf(stderr, "Unsupported series version %u\n", s.hdr.version);
+        goto cleanup;
+    }
+
+    s.cols = malloc(s.hdr.columns * sizeof(*s.cols) + 1);
+    s.selected = malloc(s.hdr.columns + 1);
+    rec = malloc(s.hdr.record_size);
+    prev = malloc(s.hdr.record_size);
+    if (s.cols == NULL || s.selected == NULL || rec == NULL || prev == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        goto cleanup;
+    }
+
+    if (pread(s.fd, s.cols, s.hdr.columns * sizeof(*s.cols),
+              sizeof(s.hdr)) != (ssize_t) (s.hdr.columns * sizeof(*s.cols)))
+    {
+        fprintf(stderr, "Error reading columns from %s\n", argv[optind]);
+        goto cleanup;
+    }
+
+    s.hdr.prefix[sizeof(s.hdr.prefix) - 1] = '\0';
+    for (c = 0; c < s.hdr.columns; c++)
+        s.cols[c].name[MSERIES_NAME_LEN - 1] = '\0';
+
+    if (list)
+    {
+        printf("# %s, %" PRIu64 " records every %u ms, room for %u\n",
+               s.hdr.prefix, s.hdr.head, s.hdr.interval, s.hdr.records);
+        for (c = 0; c < s.hdr.columns; c++)
+            printf("%-*s %s\n", MSERIES_NAME_LEN, s.cols[c].name,
+                   s.cols[c].type == METRIC_COUNTER ? "counter" : "gauge");
+
+        exit_code = EXIT_SUCCESS;
+        goto cleanup;
+    }
+
+    select_columns(&s, spec);
+    print_heading(&s);
+
+    /* with rates, one more record is read as the previous record */
+    if (last && s.hdr.head > last + s.rates)
+        next = s.hdr.head - last - s.rates;
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    print_records(&s, &next, &rec, &prev);
+    while (follow && keep_running)
+    {
+        usleep(1000 * s.hdr.interval / 2);
+        print_records(&s, &next, &rec, &prev);
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+  cleanup:
+    free(s.cols);
+    free(s.selected);
+    free(rec);
+    free(prev);
+    close(s.fd);
+
+    return exit_code;
+}
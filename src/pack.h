@@ -0,0 +1,65 @@
+/*
+ * Little endian fields and WAV headers.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __PACK_H__
+#define __PACK_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @file
+ * Packing of the little endian fields used in audio packets, capture files
+ * and WAV files. The byte order of the host does not matter.
+ */
+
+/** Store the len (1 to 8) least significant bytes of val, LSB first. */
+static inline void put_le(uint8_t * buf, uint64_t val, int len)
+{
+    int             i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = (val >> (8 * i)) & 0xFF;
+}
+
+/** Get a little endian value of len (1 to 8) bytes. */
+static inline uint64_t get_le(const uint8_t * buf, int len)
+{
+    uint64_t        val = 0;
+
+    while (len--)
+        val = (val << 8) | buf[len];
+
+    return val;
+}
+
+#define WAV_HDR_LEN     44
+
+/**
+ * Create the header of a 16 bit mono PCM WAV file.
+ *
+ * @param hdr         Buffer for WAV_HDR_LEN bytes.
+ * @param sample_rate The sample rate.
+ * @param data_len    Length of the samples following the header (bytes).
+ */
+static inline void wav_header_pack(uint8_t * hdr, uint32_t sample_rate,
+                                   uint32_t data_len)
+{
+    memcpy(hdr, "RIFF", 4);
+    put_le(&hdr[4], 36 + data_len, 4);
+    memcpy(&hdr[8], "WAVEfmt ", 8);
+    put_le(&hdr[16], 16, 4);
+    put_le(&hdr[20], 1, 2);     /* PCM */
+    put_le(&hdr[22], 1, 2);     /* mono */
+    put_le(&hdr[24], sample_rate, 4);
+    put_le(&hdr[28], sample_rate * 2, 4);
+    put_le(&hdr[32], 2, 2);
+    put_le(&hdr[34], 16, 2);
+    memcpy(&hdr[36], "data", 4);
+    put_le(&hdr[40], data_len, 4);
+}
+
+#endif
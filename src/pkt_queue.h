@@ -0,0 +1,275 @@
+/*
+ * Simple packet queue.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __PKT_QUEUE_H__
+#define __PKT_QUEUE_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file
+ * Bounded FIFO queue of packets.
+ *
+ * The queue holds a fixed number of slots, each large enough for the largest
+ * packet that will be queued. It is used to queue outgoing packets for
+ * non-blocking sockets: the packet at the front of the queue is written
+ * until it has been sent completely, using @ref pkt_queue_t.offset to keep
+ * track of partial writes.
+ *
+ * The queue does not drop anything by itself; the owner decides what to do
+ * when the queue is full, see pkt_queue_drop_oldest(). Packets can be
+ * queued with a time stamp, which allows the owner to drop packets that
+ * have been waiting too long, see pkt_queue_drop_older().
+ */
+
+/**
+ * The packet queue structure.
+ *
+ * @data       Packet data, slots * slot_size bytes.
+ * @len        Length of the packet in each slot.
+ * @stamp      Time stamp of the packet in each slot.
+ * @slots      Number of slots.
+ * @slot_size  Size of each slot.
+ * @head       Index of the oldest packet.
+ * @count      Number of packets in the queue.
+ * @offset     Number of bytes of the oldest packet that have been sent.
+ */
+typedef struct {
+    uint8_t        *data;
+    uint16_t       *len;
+    uint64_t       *stamp;
+    uint_fast16_t   slots;
+    uint_fast16_t   slot_size;
+    uint_fast16_t   head;
+    uint_fast16_t   count;
+    uint_fast16_t   offset;
+} pkt_queue_t;
+
+/**
+ * Initialize the packet queue.
+ *
+ * @param q          Pointer to a newly allocated pkt_queue_t structure.
+ * @param slots      The maximum number of packets in the queue.
+ * @param slot_size  The maximum size of a packet.
+ * @return 0 if OK, -1 if the memory could not be allocated.
+ */
+static inline int pkt_queue_init(pkt_queue_t * q, uint_fast16_t slots,
+                                 uint_fast16_t slot_size)
+{
+    q->slots = slots;
+    q->slot_size = slot_size;
+    q->head = 0;
+    q->count = 0;
+    q->offset = 0;
+    q->data = (uint8_t *) malloc(slots * slot_size);
+    q->len = (uint16_t *) malloc(slots * sizeof(uint16_t));
+    q->stamp = (uint64_t *) malloc(slots * sizeof(uint64_t));
+
+    return (q->data && q->len && q->stamp) ? 0 : -1;
+}
+
+static inline void pkt_queue_free(pkt_queue_t * q)
+{
+    free(q->data);
+    free(q->len);
+    free(q->stamp);
+    q->data = NULL;
+    q->len = NULL;
+    q->stamp = NULL;
+}
+
+/** Remove all packets from the queue. */
+static inline void pkt_queue_clear(pkt_queue_t * q)
+{
+    q->head = 0;
+    q->count = 0;
+    q->offset = 0;
+}
+
+/** Get number of packets in the queue. */
+static inline uint_fast16_t pkt_queue_count(pkt_queue_t * q)
+{
+    return q->count;
+}
+
+/** Check whether the queue is full. */
+static inline int pkt_queue_is_full(pkt_queue_t * q)
+{
+    return (q->count == q->slots);
+}
+
+/**
+ * Add time stamped packet to the end of the queue.
+ *
+ * @param q     The packet queue.
+ * @param pkt   The packet data.
+ * @param len   The packet length; must be less than or equal to the slot
+ *              size.
+ * @param stamp The time stamp, e.g. the time when the packet was queued.
+ * @return 0 if the packet was queued, -1 if the queue is full.
+ */
+static inline int pkt_queue_push_stamped(pkt_queue_t * q, const uint8_t * pkt,
+                                         uint16_t len, uint64_t stamp)
+{
+    uint_fast16_t   idx;
+
+    if (q->count == q->slots)
+        return -1;
+
+    idx = (q->head + q->count) % q->slots;
+    memcpy(&q->data[idx * q->slot_size], pkt, len);
+    q->len[idx] = len;
+    q->stamp[idx] = stamp;
+    q->count++;
+
+    return 0;
+}
+
+/** Add packet to the end of the queue; see pkt_queue_push_stamped(). */
+static inline int pkt_queue_push(pkt_queue_t * q, const uint8_t * pkt,
+                                 uint16_t len)
+{
+    return pkt_queue_push_stamped(q, pkt, len, 0);
+}
+
+/**
+ * Get the unsent part of the packet at the front of the queue.
+ *
+ * @param q    The packet queue.
+ * @param len  Set to the number of bytes left to send.
+ * @return Pointer to the first unsent byte or NULL if the queue is empty.
+ */
+static inline uint8_t *pkt_queue_front(pkt_queue_t * q, uint16_t * len)
+{
+    if (!q->count)
+        return NULL;
+
+    *len = q->len[q->head] - q->offset;
+
+    return &q->data[q->head * q->slot_size + q->offset];
+}
+
+/** Get the time stamp of the packet at the front of the queue. */
+static inline uint64_t pkt_queue_front_stamp(pkt_queue_t * q)
+{
+    return q->count ? q->stamp[q->head] : 0;
+}
+
+/**
+ * Get a packet in the queue without removing it.
+ *
+ * @param q    The packet queue.
+ * @param i    The index of the packet; 0 is the oldest packet.
+ * @param len  Set to the length of the packet.
+ * @return Pointer to the packet or NULL if there is no such packet.
+ */
+static inline uint8_t *pkt_queue_peek(pkt_queue_t * q, uint_fast16_t i,
+                                      uint16_t * len)
+{
+    uint_fast16_t   idx;
+
+    if (i >= q->count)
+        return NULL;
+
+    idx = (q->head + i) % q->slots;
+    *len = q->len[idx];
+
+    return &q->data[idx * q->slot_size];
+}
+
+/**
+ * Mark bytes of the front packet as sent.
+ *
+ * @param q    The packet queue.
+ * @param num  The number of bytes sent.
+ * @return 1 if the front packet has been sent completely and removed from
+ *         the queue, otherwise 0.
+ */
+static inline int pkt_queue_consume(pkt_queue_t * q, uint_fast16_t num)
+{
+    q->offset += num;
+    if (q->offset < q->len[q->head])
+        return 0;
+
+    q->head = (q->head + 1) % q->slots;
+    q->count--;
+    q->offset = 0;
+
+    return 1;
+}
+
+/**
+ * Drop the oldest packet that has not been partially sent.
+ *
+ * @param q The packet queue.
+ * @return 1 if a packet was dropped, 0 if there was nothing to drop.
+ *
+ * A packet that has been partially sent can not be dropped without breaking
+ * the framing of the stream, so in that case the second packet is dropped
+ * instead.
+ */
+static inline int pkt_queue_drop_oldest(pkt_queue_t * q)
+{
+    uint_fast16_t   src, dst;
+
+    if (q->offset == 0)
+    {
+        if (!q->count)
+            return 0;
+
+        q->head = (q->head + 1) % q->slots;
+        q->count--;
+        return 1;
+    }
+
+    if (q->count < 2)
+        return 0;
+
+    /* keep the partially sent packet by moving it one slot forward */
+    src = q->head;
+    dst = (q->head + 1) % q->slots;
+    memcpy(&q->data[dst * q->slot_size], &q->data[src * q->slot_size],
+           q->len[src]);
+    q->len[dst] = q->len[src];
+    q->stamp[dst] = q->stamp[src];
+    q->head = dst;
+    q->count--;
+
+    return 1;
+}
+
+/**
+ * Drop packets with a time stamp older than the limit.
+ *
+ * @param q     The packet queue.
+ * @param limit Packets with a time stamp less than this are dropped.
+ * @return The number of packets dropped.
+ *
+ * Packets are queued in time order, so dropping stops at the first packet
+ * that is new enough. A partially sent packet is never dropped.
+ */
+static inline int pkt_queue_drop_older(pkt_queue_t * q, uint64_t limit)
+{
+    uint_fast16_t   idx;
+    int             dropped = 0;
+
+    while (q->count > (q->offset ? 1u : 0u))
+    {
+        /* the oldest packet that can be dropped */
+        idx = q->offset ? (q->head + 1) % q->slots : q->head;
+        if (q->stamp[idx] >= limit)
+            break;
+
+        pkt_queue_drop_oldest(q);
+        dropped++;
+    }
+
+    return dropped;
+}
+
+#endif // __PKT_QUEUE_H__
@@ -0,0 +1,293 @@
+/*
+ * Per-stage CPU profiler.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>           /* PRIu64 */
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "prof.h"
+#include "timebase.h"
+
+/**
+ * Totals of a stage.
+ *
+ * @calls   Number of times the stage has run.
+ * @ns      Time spent in the stage (nsec).
+ * @count   Perf event counts, see struct prof_sample.
+ * @counted Number of calls included in each count. Calls in threads
+ *          without counters, e.g. the PortAudio callback, are only timed.
+ */
+struct prof_totals {
+    uint64_t        calls;
+    uint64_t        ns;
+    uint64_t        count[PROF_COUNTERS];
+    uint64_t        counted[PROF_COUNTERS];
+};
+
+int             prof_enabled = 0;
+
+static const char *stage_names[PROF_STAGES] = {
+    "read", "write", "framing", "opus_encode", "opus_decode", "ring_copy",
+    "ring_copy_cb"
+};
+
+static struct prof_totals totals[PROF_STAGES];
+static struct prof_totals printed[PROF_STAGES];
+
+static uint32_t interval_ms;
+static uint64_t next_print;
+static uint64_t last_print_ns;
+
+/* Counters of this thread, see prof_thread_init(); the group leader is
+ * perf_fds[0] */
+static __thread int perf_fds[PROF_COUNTERS];
+static __thread int perf_num;
+
+static int      perf_user_only;         /* kernel time is not counted */
+static int      perf_multiplexed;       /* counts have been scaled */
+
+/* Open a counter group for the calling thread; returns the number of
+ * counters */
+static int open_counters(int *fds)
+{
+    static const uint64_t config[PROF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+    };
+    struct perf_event_attr attr;
+    int             leader = -1;
+    int             fd;
+    int             i;
+
+    for (i = 0; i < PROF_COUNTERS; i++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config[i];
+        attr.read_format = PERF_FORMAT_GROUP |
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_hv = 1;
+        attr.exclude_kernel = perf_user_only;
+
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+
+        /* system calls can only be counted with perf_event_paranoid < 2 */
+        if (fd == -1 && leader == -1 && !perf_user_only &&
+            (errno == EACCES || errno == EPERM))
+        {
+            perf_user_only = 1;
+            attr.exclude_kernel = 1;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        }
+
+        /* the values are read in the order the counters were added, so
+         * stop at the first one that is not supported */
+        if (fd == -1)
+            break;
+
+        if (leader == -1)
+            leader = fd;
+        fds[i] = fd;
+    }
+
+    return i;
+}
+
+void prof_thread_init(void)
+{
+    if (prof_enabled && perf_num == 0)
+        perf_num = open_counters(perf_fds);
+}
+
+void prof_thread_close(void)
+{
+    while (perf_num > 0)
+        close(perf_fds[--perf_num]);
+}
+
+void prof_read(struct prof_sample *s)
+{
+    struct {
+        uint64_t        nr;
+        uint64_t        time_enabled;
+        uint64_t        time_running;
+        uint64_t        value[PROF_COUNTERS];
+    } data;
+    int             i;
+
+    memset(s->count, 0, sizeof(s->count));
+    s->num = 0;
+    if (perf_num && read(perf_fds[0], &data, sizeof(data)) > 0 &&
+        data.time_running)
+    {
+        /* The group was not always on the PMU, e.g. because another
+         * process uses the counters; estimate the full count */
+        if (data.time_running < data.time_enabled)
+        {
+            for (i = 0; i < perf_num; i++)
+                data.value[i] = (double)data.value[i] *
+                    data.time_enabled / data.time_running;
+            __atomic_store_n(&perf_multiplexed, 1, __ATOMIC_RELAXED);
+        }
+
+        for (i = 0; i < perf_num; i++)
+            s->count[i] = data.value[i];
+        s->num = perf_num;
+    }
+
+    s->ns = time_trace_ns();
+}
+
+void prof_add(int stage, const struct prof_sample *begin)
+{
+    struct prof_totals *t = &totals[stage];
+    struct prof_sample end;
+    int             num;
+    int             i;
+
+    prof_read(&end);
+    num = begin->num < end.num ? begin->num : end.num;
+
+    /* stages may run in more than one thread */
+    __atomic_fetch_add(&t->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->ns, end.ns - begin->ns, __ATOMIC_RELAXED);
+    for (i = 0; i < num; i++)
+    {
+        __atomic_fetch_add(&t->count[i], end.count[i] - begin->count[i],
+                           __ATOMIC_RELAXED);
+        __atomic_fetch_add(&t->counted[i], 1, __ATOMIC_RELAXED);
+    }
+}
+
+void prof_init(int interval)
+{
+    static const char *names[PROF_COUNTERS] = {
+        "cycles", "instructions", "cache misses"
+    };
+    int             i;
+
+    if (time_trace_init() == 0)
+        fprintf(stderr, "Profiler: timing with the CPU cycle counter\n");
+
+    interval_ms = interval > 0 ? 1000 * interval : 10000;
+    next_print = 0;
+    last_print_ns = time_trace_ns();
+
+    prof_enabled = 1;
+    prof_thread_init();
+    if (perf_num == 0)
+    {
+        fprintf(stderr, "Profiler: perf events not available (%s); only "
+                "measuring time\n", strerror(errno));
+    }
+    else
+    {
+        fprintf(stderr, "Profiler: counting");
+        for (i = 0; i < perf_num; i++)
+            fprintf(stderr, "%s%s", i ? ", " : " ", names[i]);
+        fprintf(stderr, "%s\n", perf_user_only ?
+                " in user space only (perf_event_paranoid)" : "");
+    }
+}
+
+/* Print the count per call, or "-" if no call was counted, e.g. because
+ * the PMU lacks the counter or the stage runs in the PortAudio callback */
+static void print_per_call(uint64_t count, uint64_t calls)
+{
+    if (calls)
+        fprintf(stderr, " %12.0f", (double)count / calls);
+    else
+        fprintf(stderr, " %12s", "-");
+}
+
+void prof_print(void)
+{
+    struct prof_totals now, *p;
+    uint64_t        ns = time_trace_ns();
+    uint64_t        elapsed = ns - last_print_ns;
+    int             i, j;
+
+    if (!prof_enabled)
+        return;
+
+    fprintf(stderr, "Profile of the last %.1f s:\n"
+            "  %-12s %10s %10s %7s %12s %12s %6s %12s\n", 1.e-9 * elapsed,
+            "stage", "calls", "us/call", "time%", "cycles/call",
+            "instr/call", "IPC", "misses/call");
+
+    for (i = 0; i < PROF_STAGES; i++)
+    {
+        now.calls = __atomic_load_n(&totals[i].calls, __ATOMIC_RELAXED);
+        now.ns = __atomic_load_n(&totals[i].ns, __ATOMIC_RELAXED);
+        for (j = 0; j < PROF_COUNTERS; j++)
+        {
+            now.count[j] = __atomic_load_n(&totals[i].count[j],
+                                           __ATOMIC_RELAXED);
+            now.counted[j] = __atomic_load_n(&totals[i].counted[j],
+                                             __ATOMIC_RELAXED);
+        }
+
+        /* print the difference to the previous table */
+        p = &printed[i];
+        p->calls = now.calls - p->calls;
+        p->ns = now.ns - p->ns;
+        for (j = 0; j < PROF_COUNTERS; j++)
+        {
+            p->count[j] = now.count[j] - p->count[j];
+            p->counted[j] = now.counted[j] - p->counted[j];
+        }
+
+        if (p->calls)
+        {
+            fprintf(stderr, "  %-12s %10" PRIu64 " %10.2f %7.2f",
+                    stage_names[i], p->calls, 1.e-3 * p->ns / p->calls,
+                    100. * p->ns / elapsed);
+            print_per_call(p->count[PROF_CYCLES], p->counted[PROF_CYCLES]);
+            print_per_call(p->count[PROF_INSTRUCTIONS],
+                           p->counted[PROF_INSTRUCTIONS]);
+            if (p->counted[PROF_INSTRUCTIONS] && p->count[PROF_CYCLES])
+                fprintf(stderr, " %6.2f",
+                        (double)p->count[PROF_INSTRUCTIONS] /
+                        p->count[PROF_CYCLES]);
+            else
+                fprintf(stderr, " %6s", "-");
+            print_per_call(p->count[PROF_CACHE_MISSES],
+                           p->counted[PROF_CACHE_MISSES]);
+            fprintf(stderr, "\n");
+        }
+
+        *p = now;
+    }
+
+    if (__atomic_exchange_n(&perf_multiplexed, 0, __ATOMIC_RELAXED))
+        fprintf(stderr, "  Counters were multiplexed; counts are scaled "
+                "estimates\n");
+
+    last_print_ns = ns;
+}
+
+void prof_process(uint64_t now)
+{
+    if (!prof_enabled)
+        return;
+
+    if (next_print == 0)
+        next_print = now + interval_ms;
+
+    if (now < next_print)
+        return;
+
+    prof_print();
+    next_print = now + interval_ms;
+}
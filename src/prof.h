@@ -0,0 +1,119 @@
+/*
+ * Per-stage CPU profiler.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __PROF_H__
+#define __PROF_H__
+
+#include <stdint.h>
+
+/**
+ * @file
+ * Optional profiler that counts where the CPU goes in the daemons.
+ *
+ * Code that belongs to a processing stage is wrapped in prof_begin() and
+ * prof_end(). For each stage the profiler counts the calls, the time and,
+ * if perf_event_open() is available, the CPU cycles, instructions and
+ * cache misses. A table is printed to stderr periodically and at exit.
+ *
+ * The counters are per thread and are opened by prof_thread_init() when a
+ * thread starts. Threads without counters only measure the time using
+ * time_trace_ns(). This includes the PortAudio callback thread, which is
+ * created by PortAudio: opening or reading the counters there would be a
+ * system call in the real-time path. The same applies to all threads when
+ * there are no perf events, e.g. when kernel.perf_event_paranoid forbids
+ * them.
+ *
+ * If the kernel has to multiplex the counters with other users, the counts
+ * are scaled by the time the counters were running. The next table then
+ * notes that the counts are estimates.
+ *
+ * A disabled profiler costs one test per prof_begin() and prof_end().
+ * When enabled, reading the counters is a system call; stages that take
+ * less than a few microseconds are dominated by that overhead, so compare
+ * cycles between builds rather than taking them as absolute numbers.
+ */
+
+#define PROF_READ           0   /* read() and recv() */
+#define PROF_WRITE          1   /* write() and send() */
+#define PROF_FRAMING        2   /* CI-V and audio packet framing */
+#define PROF_ENCODE         3   /* opus_encode() */
+#define PROF_DECODE         4   /* opus_decode() */
+#define PROF_RING           5   /* ring buffer copies in the main loop */
+#define PROF_CALLBACK       6   /* ring buffer copies in the audio callback */
+#define PROF_STAGES         7
+
+#define PROF_CYCLES         0
+#define PROF_INSTRUCTIONS   1
+#define PROF_CACHE_MISSES   2
+#define PROF_COUNTERS       3
+
+/**
+ * Counter values at the beginning of a stage.
+ *
+ * @ns     Trace clock time (nsec), see time_trace_ns().
+ * @count  The perf event counters, PROF_CYCLES etc.; 0 if not available.
+ * @num    Number of counters read; 0 in threads without counters.
+ */
+struct prof_sample {
+    uint64_t        ns;
+    uint64_t        count[PROF_COUNTERS];
+    int             num;
+};
+
+/** Non-zero if the profiler is enabled; set by prof_init(). */
+extern int      prof_enabled;
+
+/**
+ * Open the counters of the calling thread.
+ *
+ * Call at the start of a thread that runs stages, outside of any real-time
+ * path; prof_init() does this for the calling thread. Does nothing if the
+ * profiler is disabled.
+ */
+void            prof_thread_init(void);
+
+/** Close the counters of the calling thread; call before it exits. */
+void            prof_thread_close(void);
+
+/** Read the counters of the calling thread. */
+void            prof_read(struct prof_sample *s);
+
+/** Add the counts since begin to a stage. */
+void            prof_add(int stage, const struct prof_sample *begin);
+
+static inline void prof_begin(struct prof_sample *s)
+{
+    if (prof_enabled)
+        prof_read(s);
+}
+
+static inline void prof_end(int stage, const struct prof_sample *begin)
+{
+    if (prof_enabled)
+        prof_add(stage, begin);
+}
+
+/**
+ * Enable the profiler.
+ *
+ * @param interval  Seconds between tables.
+ *
+ * Call from the main thread before other threads are started. The
+ * counters of the main thread are opened here.
+ */
+void            prof_init(int interval);
+
+/**
+ * Print the table if the interval has elapsed.
+ *
+ * @param now  Current time in msec, see time_ms().
+ */
+void            prof_process(uint64_t now);
+
+/** Print the table for the time since the previous table. */
+void            prof_print(void);
+
+#endif
@@ -18,10 +18,21 @@
 #include <unistd.h>
 #include <sys/select.h>
 
+#include "civ_capture.h"
 #include "common.h"
+#include "flightrec.h"
 
 
 static int      keep_running = 1;       /* set to 0 to exit infinite loop */
+static struct civ_capture capture;      /* frames are recorded if open */
+static uint64_t capture_offset; /* wall clock minus monotonic time (usec) */
+
+/* Capture times are since the epoch but must not jump with the clock */
+static uint64_t capture_time(void)
+{
+    return time_us() + capture_offset;
+}
+
 void signal_handler(int signo)
 {
     if (signo == SIGINT)
@@ -34,35 +45,58 @@ void signal_handler(int signo)
     keep_running = 0;
 }
 
-int transfer_data_local(int ifd, int ofd, struct xfr_buf *buffer)
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: serial_gateway [options]\n"
+        "\n Possible options are:\n"
+        "\n"
+        "  -r    Radio port (default is /dev/ttyUSB0).\n"
+        "  -p    Panel port (default is /dev/ttyUSB1).\n"
+        "  -w    Record all frames with time stamps to a capture file,\n"
+        "        which can be played back using civ_replay.\n"
+        "  -h    This help message.\n"
+        "\n SIGUSR1 dumps the flight recorder, see flightrec.h.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+int transfer_data_local(int ifd, int ofd, int dir, struct xfr_buf *buffer)
 {
     int             pkt_type;
 
-    pkt_type = read_data(ifd, buffer);
-    switch (pkt_type)
+    do
     {
-    case PKT_TYPE_INCOMPLETE:
-        break;
+        pkt_type = read_data(ifd, buffer);
+        switch (pkt_type)
+        {
+        case PKT_TYPE_INCOMPLETE:
+        case PKT_TYPE_EOF:
+            break;
 
-    case PKT_TYPE_INVALID:
-        buffer->invalid_pkts++;
-        buffer->wridx = 0;
-        break;
+        case PKT_TYPE_INVALID:
+            buffer->invalid_pkts++;
+            break;
 
-    default:
-        /* we also "send" on EOF packet because buffer may not be empty */
+        default:
 #if DEBUG
-        print_buffer(ifd, ofd, buffer->data, buffer->wridx);
+            print_buffer(ifd, ofd, buffer->data, buffer->pktlen);
 #endif
-        write(ofd, buffer->data, buffer->wridx);
-        buffer->wridx = 0;
-        buffer->valid_pkts++;
+            write(ofd, buffer->data, buffer->pktlen);
+            if (civ_capture_write(&capture, dir, buffer->data,
+                                  buffer->pktlen, capture_time()))
+            {
+                fprintf(stderr, "Error writing capture file; stopped\n");
+                civ_capture_close(&capture);
+            }
+            buffer->valid_pkts++;
+        }
     }
+    while (packet_pending(buffer));
 
     return pkt_type;
 }
 
-
 int main(int argc, char **argv)
 {
     struct xfr_buf  radio_buf, panel_buf;
@@ -74,6 +108,40 @@ int main(int argc, char **argv)
     int             panel_fd;
     char           *radio_port = "/dev/ttyUSB0";
     char           *panel_port = "/dev/ttyUSB1";
+    char           *capture_file = NULL;
+    uint64_t        last_flush = 0;
+    int             option;
+
+    while ((option = getopt(argc, argv, "r:p:w:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'r':
+            radio_port = optarg;
+            break;
+
+        case 'p':
+            panel_port = optarg;
+            break;
+
+        case 'w':
+            capture_file = optarg;
+            break;
+
+        case 'h':
+            help();
+            exit(EXIT_SUCCESS);
+
+        default:
+            help();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    capture_offset = time_wall_us() - time_us();
+    if (capture_file &&
+        civ_capture_create(&capture, capture_file, capture_time()) == -1)
+        return 1;
 
 
     /* setup signal handler */
@@ -82,6 +150,8 @@ int main(int argc, char **argv)
     if (signal(SIGTERM, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGTERM\n");
 
+    flightrec_init("serial_gateway", SIGUSR1);
+
     /* control panel */
     panel_fd = open(panel_port, O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (panel_fd < 0)
@@ -110,9 +180,11 @@ int main(int argc, char **argv)
     maxfd = (radio_fd > panel_fd ? radio_fd : panel_fd) + 1;
 
     radio_buf.wridx = 0;
+    radio_buf.pktlen = 0;
     radio_buf.valid_pkts = 0;
     radio_buf.invalid_pkts = 0;
     panel_buf.wridx = 0;
+    panel_buf.pktlen = 0;
     panel_buf.valid_pkts = 0;
     panel_buf.invalid_pkts = 0;
 
@@ -130,10 +202,19 @@ int main(int argc, char **argv)
         if (res > 0)
         {
             if (FD_ISSET(panel_fd, &readfs))
-                transfer_data_local(panel_fd, radio_fd, &panel_buf);
+                transfer_data_local(panel_fd, radio_fd, CIV_DIR_PANEL,
+                                    &panel_buf);
 
             if (FD_ISSET(radio_fd, &readfs))
-                transfer_data_local(radio_fd, panel_fd, &radio_buf);
+                transfer_data_local(radio_fd, panel_fd, CIV_DIR_RADIO,
+                                    &radio_buf);
+        }
+
+        /* limit what is lost if we are killed */
+        if (time_ms() - last_flush > 1000)
+        {
+            civ_capture_flush(&capture);
+            last_flush = time_ms();
         }
 
         usleep(LOOP_DELAY_US);
@@ -143,6 +224,7 @@ int main(int argc, char **argv)
   closefds:
     close(panel_fd);
     close(radio_fd);
+    civ_capture_close(&capture);
 
     fprintf(stderr,
             "  Valid packets radio / panel: %" PRIu64 " / %" PRIu64 "\n",
@@ -150,6 +232,9 @@ int main(int argc, char **argv)
     fprintf(stderr,
             "Invalid packets radio / panel: %" PRIu64 " / %" PRIu64 "\n",
             radio_buf.invalid_pkts, panel_buf.invalid_pkts);
+    if (capture_file)
+        fprintf(stderr, "  Frames / bytes captured: %" PRIu64 " / %" PRIu64
+                "\n", capture.frames, capture.bytes);
 
     return 0;
 }
@@ -0,0 +1,117 @@
+/*
+ * Helpers shared by the test and load generator programs.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#define _XOPEN_SOURCE 600       /* posix_openpt() */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "test_util.h"
+
+pid_t test_start_daemon(const char *dir, const char *name, char **args,
+                        int quiet)
+{
+    char            path[256];
+    pid_t           pid;
+    int             fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    pid = fork();
+    if (pid == 0)
+    {
+        if (quiet && (fd = open("/dev/null", O_WRONLY)) != -1)
+        {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        args[0] = path;
+        execv(path, args);
+        fprintf(stderr, "Error starting %s: %d: %s\n", path, errno,
+                strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    else if (pid == -1)
+    {
+        fprintf(stderr, "fork() error: %d: %s\n", errno, strerror(errno));
+    }
+
+    return pid;
+}
+
+void test_stop_daemon(pid_t pid)
+{
+    if (pid <= 0)
+        return;
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+}
+
+int test_open_pty(char *path, int size, int *slave_fd)
+{
+    struct termios  tio;
+    char           *name;
+    int             fd;
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd == -1 || grantpt(fd) || unlockpt(fd) ||
+        (name = ptsname(fd)) == NULL)
+    {
+        fprintf(stderr, "Error creating pty: %d: %s\n", errno,
+                strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    snprintf(path, size, "%s", name);
+
+    /* The slave is raw from the start, so nothing is echoed before the
+     * daemon has configured it */
+    *slave_fd = open(path, O_RDWR | O_NOCTTY);
+    if (*slave_fd == -1 || tcgetattr(*slave_fd, &tio))
+    {
+        fprintf(stderr, "Error opening %s: %d: %s\n", path, errno,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(*slave_fd, TCSANOW, &tio);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
+void test_frame_make(uint8_t * frame, uint8_t type, uint32_t seq, int len)
+{
+    seq &= TEST_SEQ_MASK;
+
+    frame[0] = 0xFE;
+    frame[1] = type;
+    frame[2] = seq & 0x7F;
+    frame[3] = (seq >> 7) & 0x7F;
+    frame[4] = (seq >> 14) & 0x7F;
+    memset(&frame[5], 0x20, len - TEST_FRAME_MIN_LEN);
+    frame[len - 1] = 0xFD;
+}
+
+uint32_t test_frame_seq(const uint8_t * frame, uint32_t next)
+{
+    uint32_t        seq;
+
+    seq = frame[2] | (frame[3] << 7) | (frame[4] << 14);
+
+    return next - ((next - seq) & TEST_SEQ_MASK);
+}
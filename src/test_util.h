@@ -0,0 +1,78 @@
+/*
+ * Helpers shared by the test and load generator programs.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __TEST_UTIL_H__
+#define __TEST_UTIL_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * @file
+ * Starting the daemons under test, pseudo-terminals standing in for the
+ * UARTs, and the test frames used by ic706_sim and ic706_stress.
+ *
+ * A test frame is
+ *
+ *   0xFE <type> <seq0> <seq1> <seq2> [0x20 padding] 0xFD
+ *
+ * at least TEST_FRAME_MIN_LEN bytes long. The sequence number is 21 bit,
+ * sent as three 7 bit bytes starting with the least significant, so the
+ * payload never contains 0xFD or 0xFE.
+ */
+
+#define TEST_SEQ_MASK       0x1FFFFF
+#define TEST_FRAME_MIN_LEN  6
+
+/**
+ * Start a daemon.
+ *
+ * @param dir    Directory with the executable.
+ * @param name   Name of the executable.
+ * @param args   Arguments; args[0] is set to the path and the list ends
+ *               with NULL.
+ * @param quiet  Discard the output of the daemon.
+ * @return The process id, or -1 if fork() failed.
+ */
+pid_t           test_start_daemon(const char *dir, const char *name,
+                                  char **args, int quiet);
+
+/** Stop a daemon with SIGINT and wait for it; a pid <= 0 is ignored. */
+void            test_stop_daemon(pid_t pid);
+
+/**
+ * Create a pseudo-terminal in raw mode.
+ *
+ * @param path      Buffer for the name of the slave.
+ * @param size      Size of path.
+ * @param slave_fd  The slave, which is kept open so that the master never
+ *                  gets EOF while the daemon reopens it.
+ * @return The non-blocking master, or -1 if an error occurred.
+ */
+int             test_open_pty(char *path, int size, int *slave_fd);
+
+/**
+ * Create a test frame.
+ *
+ * @param frame  Buffer for the frame, len bytes.
+ * @param type   Packet type.
+ * @param seq    Sequence number; only the lower 21 bits are sent.
+ * @param len    Frame length, at least TEST_FRAME_MIN_LEN.
+ */
+void            test_frame_make(uint8_t * frame, uint8_t type, uint32_t seq,
+                                int len);
+
+/**
+ * Get the sequence number of a received test frame.
+ *
+ * @param frame  The frame, at least TEST_FRAME_MIN_LEN bytes.
+ * @param next   The next sequence number to be sent.
+ * @return The full sequence number, restored from the 21 bits in the frame
+ *         assuming that the frame was sent less than 2^21 frames ago.
+ */
+uint32_t        test_frame_seq(const uint8_t * frame, uint32_t next);
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Monotonic timebase.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#define _DEFAULT_SOURCE
+
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "timebase.h"
+
+#define CALIBRATE_NS   20000000 /* TSC calibration time */
+
+struct time_trace time_trace;
+
+static int      trace_result = 1;       /* 1 until time_trace_init() */
+
+#if defined(__x86_64__)
+static uint64_t raw_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#ifdef TIME_HAVE_CYCLES
+/* Get nanoseconds per cycle shifted left by 32; 0 if not usable */
+static uint64_t cycles_mult(void)
+{
+#if defined(__x86_64__)
+    struct timespec req = { 0, CALIBRATE_NS };
+    unsigned int    eax, ebx, ecx, edx;
+    uint64_t        c0, c1, t0, t1;
+
+    /* without an invariant TSC the rate changes with the CPU frequency */
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+        !(edx & (1 << 8)))
+        return 0;
+
+    t0 = raw_ns();
+    c0 = time_cycles();
+    nanosleep(&req, NULL);
+    t1 = raw_ns();
+    c1 = time_cycles();
+
+    if (c1 <= c0 || t1 <= t0)
+        return 0;
+
+    return ((t1 - t0) << 32) / (c1 - c0);
+#else
+    uint64_t        freq;
+
+    /* the generic timer has a fixed frequency */
+    __asm__         __volatile__("mrs %0, cntfrq_el0":"=r"(freq));
+    if (freq == 0)
+        return 0;
+
+    return (1000000000ULL << 32) / freq;
+#endif
+}
+#endif
+
+int time_trace_init(void)
+{
+    if (trace_result != 1)
+        return trace_result;
+
+    trace_result = -1;
+
+#ifdef TIME_HAVE_CYCLES
+    time_trace.mult = cycles_mult();
+    if (time_trace.mult)
+    {
+        time_trace.base_ns = time_ns();
+        time_trace.base_cycles = time_cycles();
+        time_trace.enabled = 1;
+        trace_result = 0;
+    }
+#endif
+
+    return trace_result;
+}
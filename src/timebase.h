@@ -0,0 +1,152 @@
+/*
+ * Monotonic timebase.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ */
+#ifndef __TIMEBASE_H__
+#define __TIMEBASE_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @file
+ * Clocks for timers, latency measurements, statistics and tracing.
+ *
+ * time_ms(), time_us() and time_ns() read CLOCK_MONOTONIC, which does not
+ * jump when the wall clock is set or stepped by NTP. Use them for all
+ * timeouts, intervals and latencies. The conversion is integer only and
+ * the sub-second part is divided as 32 bits, so 32-bit ARM needs no 64-bit
+ * division either.
+ *
+ * time_wall_ms() and time_wall_us() read CLOCK_REALTIME. They are only for
+ * timestamps that are stored or shown, e.g. in capture files.
+ *
+ * time_trace_ns() is for the flight recorder and the profiler, which read
+ * the clock for every event. After time_trace_init() it reads the CPU
+ * cycle counter, i.e. the invariant TSC on x86-64 or the generic timer on
+ * AArch64, and converts it using a multiply and a shift calibrated against
+ * CLOCK_MONOTONIC_RAW. Otherwise, e.g. on the Cortex-A8 of the BeagleBone
+ * where the cycle counter is not accessible from user space, it is
+ * time_ns(). The trace clock is not corrected by NTP, so only compare
+ * trace times with each other.
+ */
+
+/** Get the monotonic time in nanoseconds. */
+static inline uint64_t time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Get the monotonic time in microseconds. */
+static inline uint64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + (uint32_t) ts.tv_nsec / 1000;
+}
+
+/** Get the monotonic time in milliseconds. */
+static inline uint64_t time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + (uint32_t) ts.tv_nsec / 1000000;
+}
+
+/** Get the wall clock time in microseconds since the epoch. */
+static inline uint64_t time_wall_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + (uint32_t) ts.tv_nsec / 1000;
+}
+
+/** Get the wall clock time in milliseconds since the epoch. */
+static inline uint64_t time_wall_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + (uint32_t) ts.tv_nsec / 1000000;
+}
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define TIME_HAVE_CYCLES 1
+#endif
+
+/**
+ * Conversion of the cycle counter to the trace clock:
+ * ns = base_ns + ((cycles - base_cycles) * mult) >> 32.
+ *
+ * @enabled      Non-zero if the cycle counter is used.
+ * @mult         Nanoseconds per cycle, shifted left by 32.
+ * @base_cycles  Cycle counter at calibration.
+ * @base_ns      CLOCK_MONOTONIC time at calibration.
+ */
+struct time_trace {
+    int             enabled;
+    uint64_t        mult;
+    uint64_t        base_cycles;
+    uint64_t        base_ns;
+};
+
+extern struct time_trace time_trace;
+
+#ifdef TIME_HAVE_CYCLES
+static inline uint64_t time_cycles(void)
+{
+#if defined(__x86_64__)
+    uint32_t        lo, hi;
+
+    __asm__         __volatile__("rdtsc":"=a"(lo), "=d"(hi));
+
+    return ((uint64_t) hi << 32) | lo;
+#else
+    uint64_t        val;
+
+    __asm__         __volatile__("mrs %0, cntvct_el0":"=r"(val));
+
+    return val;
+#endif
+}
+#endif
+
+/** Get the trace clock time in nanoseconds; see time_trace_init(). */
+static inline uint64_t time_trace_ns(void)
+{
+#ifdef TIME_HAVE_CYCLES
+    if (time_trace.enabled)
+        return time_trace.base_ns +
+            (uint64_t) (((unsigned __int128)
+                         (time_cycles() - time_trace.base_cycles) *
+                         time_trace.mult) >> 32);
+#endif
+
+    return time_ns();
+}
+
+/**
+ * Use the cycle counter for time_trace_ns() if it is usable.
+ *
+ * @retval  0  The cycle counter is used.
+ * @retval -1  time_trace_ns() uses time_ns().
+ *
+ * Calibrating the TSC takes 20 msec. Call from the main thread before
+ * other threads are started; later calls return the first result.
+ */
+int             time_trace_init(void);
+
+#endif